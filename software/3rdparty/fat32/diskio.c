@@ -12,6 +12,15 @@
 #if !defined(DISABLE_FILESYSTEM) && !defined(CAT_WINDOWS) && !defined(CAT_LINUX) && !defined(CAT_DARWIN)
 #include "sdcard.h"
 #endif
+#if !defined(DISABLE_FILESYSTEM) && defined(ROM_SECTOR_CACHE)
+// The boot ROM keeps a sector cache between FatFs and the card, other builds go straight to the card
+#include "sectorcache.h"
+#define DISK_READ(buff, count, sector) SectorCacheRead(buff, sector, count)
+#define DISK_WRITE(buff, count, sector) SectorCacheWrite(buff, sector, count)
+#else
+#define DISK_READ(buff, count, sector) SDReadMultipleBlocks(buff, count, sector)
+#define DISK_WRITE(buff, count, sector) SDWriteMultipleBlocks(buff, count, sector)
+#endif
 /* Definitions of physical drive number for each drive */
 #define DEV_RAM		0	/* Example: Map Ramdisk to physical drive 0 */
 #define DEV_MMC		1	/* Example: Map MMC/SD card to physical drive 1 */
@@ -85,7 +94,12 @@ DSTATUS disk_initialize (
 
 #if !defined(DISABLE_FILESYSTEM)
 		if (SDCardStartup() != -1)
+		{
+#if defined(ROM_SECTOR_CACHE)
+			SectorCacheInit();
+#endif
 			stat = 0x0;
+		}
 		else
 #endif
 			stat = STA_NOINIT;
@@ -132,7 +146,7 @@ DRESULT disk_read (
 		// translate the arguments here
 
 #if !defined(DISABLE_FILESYSTEM)
-		if (SDReadMultipleBlocks(buff, count, sector) != -1)
+		if (DISK_READ(buff, count, sector) != -1)
 			res = RES_OK;
 		else
 #endif
@@ -186,7 +200,7 @@ DRESULT disk_write (
 		case DEV_MMC :
 		{
 		#if !defined(DISABLE_FILESYSTEM)
-			if (SDWriteMultipleBlocks(buff, count, sector) != -1)
+			if (DISK_WRITE(buff, count, sector) != -1)
 				res = RES_OK;
 			else
 #endif
@@ -232,6 +246,11 @@ DRESULT disk_ioctl (
 
 	case DEV_MMC :
 		// Process of the command for the MMC/SD card
+#if !defined(DISABLE_FILESYSTEM) && defined(ROM_SECTOR_CACHE)
+		// Dirty sectors go out to the card on f_sync / f_close
+		if (cmd == CTRL_SYNC && SectorCacheFlush() == -1)
+			return RES_ERROR;
+#endif
 		if (SDIOControl(cmd, buff) != -1)
 			res = RES_OK;
 		else
@@ -3,6 +3,7 @@
 #include "task.h"
 #include "device.h"
 #include "commandline.h"
+#include "sectorcache.h"
 #include "rombase.h"
 #include "keyringbuffer.h"
 //#include "uart.h"
@@ -39,6 +40,10 @@ void CLIClearStatics()
 	s_cliCtx->startAddress = 0;
 	s_cliCtx->execName[0] = 0;
 	s_cliCtx->execParam0[0] = 0;
+	s_cliCtx->bgExecParamCount = 1;
+	s_cliCtx->bgStartAddress = 0;
+	s_cliCtx->bgExecName[0] = 0;
+	s_cliCtx->bgExecParam0[0] = 0;
 }
 
 // This task is a trampoline to the loaded executable
@@ -69,6 +74,63 @@ void __attribute__((aligned(64))) _runExecTask()
 	// execution pool.
 }
 
+// Same as above for the background program, runs on CPU#1 with its stack at the end of the background area
+void __attribute__((aligned(64))) _runBackgroundExecTask()
+{
+	asm volatile(
+		"addi sp, sp, -16;"
+		"sw %3, 0(sp);"		// Store argc
+		"sw %1, 4(sp);"		// Store argv[1] (path to exec)
+		"sw %2, 8(sp);"		// Store argv[2] (exec param0)
+		"sw zero, 12(sp);"	// Store argv[3] (have to end list with a nullptr)
+		".insn 0xFC000073;"	// Invalidate & Write Back D$ (CFLUSH.D.L1) - drop any stale lines this CPU holds for the loaded image
+		"fence.i;"			// Invalidate I$ - ensure loaded binary can be fetched as fresh instructions by the CPU
+		"lw t0, %0;"		// Set target branch address
+		"jalr t0;"			// Branch to the entry point
+		"addi sp, sp, 16;"
+		"bg_infinite_loop:"
+		"wfi;"
+		"j bg_infinite_loop;"
+		: "=m" (s_cliCtx->bgStartAddress)
+		: "r" (s_cliCtx->bgExecName), "r" (s_cliCtx->bgExecParam0), "r" (s_cliCtx->bgExecParamCount)
+		// Clobber list
+		: "t0"
+	);
+}
+
+// Look for the executable in the current directory first, then in 'sys/bin'
+static uint32_t FindAndLoadExecutable(const char *command, const uint32_t _heapID)
+{
+	char filename[64];
+	strcpy(filename, GetWorkDir());	// Current path already contains a trailing slash
+	strcat(filename, command);		// User supplied string
+	strcat(filename, ".elf");		// We don't expect command to contain the .elf extension
+
+	uint32_t startAddress = LoadExecutable(filename, _heapID, false);
+
+	if (startAddress == 0x0)
+	{
+		strcpy(filename, "sd:/sys/bin/");
+		strcat(filename, command);
+		strcat(filename, ".elf");
+		startAddress = LoadExecutable(filename, _heapID, false);
+	}
+
+	return startAddress;
+}
+
+// Stop tasks on a CPU, starting from _firstTask, either those of the background program or all the others
+static void StopProgramTasks(const uint32_t _hartid, const int _firstTask, const uint32_t _background)
+{
+	// NOTE: This has to be done in reverse order!
+	struct STaskContext *ctx = _task_get_context(_hartid);
+	for (int i=ctx->numTasks-1; i>=_firstTask; i--)
+	{
+		if ((ctx->tasks[i].heapID == 1) == (_background != 0))
+			_task_exit_task_with_id(ctx, i, 0);
+	}
+}
+
 void ShowVersion(struct EVideoContext *kernelgfx)
 {
 	uint32_t waterMark = read_csr(0xFF0);
@@ -97,11 +159,26 @@ void DumpTasks(const uint32_t _hartid)
 	}
 	else
 	{
+		// CPU share is over the time since the last 'proc', counting the running task's time so far
+		uint64_t now = E32ReadTime();
+		uint64_t permilleScale = (now - ctx->statsTime) / 1000;
+		kprintf("CPU%d : %s scheduling\n", _hartid, ctx->scheduling == TSCHED_DEADLINE ? "deadline" : "priority");
 		for (int i=0;i<ctx->numTasks;++i)
 		{
 			struct STask *task = &ctx->tasks[i];
-			kprintf("CPU%d : #%d : %s : PC=0x%08X : '%s'\n", _hartid, i, s_taskstates[task->state], task->regs[0], task->name);
+			uint64_t cpuTime = task->cpuTime + (i == ctx->currentTask ? now - ctx->switchTime : 0);
+			uint32_t share = permilleScale ? (uint32_t)(cpuTime / permilleScale) : 0;
+			share = share > 1000 ? 1000 : share;
+			kprintf("CPU%d : #%d : %s : PC=0x%08X : '%s'\n", _hartid, i, s_taskstates[task->state], TaskGetPC(ctx, i), task->name);
+			kprintf("  pri %d : cpu %d.%d%%", task->priority, share/10, share%10);
+			if (task->deadline)
+				kprintf(" : deadline %d us : missed %d", task->deadline/ONE_MICROSECOND_IN_TICKS, task->missedDeadlines);
+			if (task->waitFlags)
+				kprintf(" : blocked (0x%x)", task->waitFlags);
+			kprintf("\n");
 		}
+		// The HART running these tasks clears the counters when it next switches tasks
+		ctx->statsResetRequest = 1;
 	}
 }
 
@@ -115,7 +192,7 @@ uint32_t ExecuteCmd(char *_cmd, struct EVideoContext *kernelgfx)
 
 	if (!strcmp(command, "help"))
 	{
-		kprintf("Commands:\ndir, mount, unmount, cls, reboot, mem, proc, del, ren, pwd, cd,\nor name of ELF without extension\n");
+		kprintf("Commands:\ndir, mount, unmount, cls, reboot, mem, proc, del, ren, pwd, cd,\nbg, bgkill, or name of ELF without extension\n");
 	}
 	else if (!strcmp(command, "dir"))
 	{
@@ -154,13 +231,21 @@ uint32_t ExecuteCmd(char *_cmd, struct EVideoContext *kernelgfx)
 	}
 	else if (!strcmp(command, "mem"))
 	{
-		kprintf("Available memory:");
-		uint32_t inkbytes = core_memavail()/1024;
-		uint32_t inmbytes = inkbytes/1024;
-		if (inmbytes!=0)
-			kprintf("%d Mbytes\n", inmbytes);
-		else
-			kprintf("%d Kbytes\n", inkbytes);
+		for (uint32_t heapid=0; heapid<CORE_MAX_HEAPS; ++heapid)
+		{
+			kprintf(heapid == 0 ? "Available memory:" : "Available background memory:");
+			uint32_t inkbytes = core_memavail(heapid)/1024;
+			uint32_t inmbytes = inkbytes/1024;
+			if (inmbytes!=0)
+				kprintf("%d Mbytes\n", inmbytes);
+			else
+				kprintf("%d Kbytes\n", inkbytes);
+		}
+
+		struct SSectorCacheStats *stats = SectorCacheGetStats();
+		uint32_t lookups = stats->hits + stats->misses;
+		kprintf("Sector cache: %d Kbytes, %d hits, %d misses (%d%% hit rate)\n", (SECTORCACHE_SETS*SECTORCACHE_WAYS)/2, stats->hits, stats->misses, lookups ? (uint32_t)(((uint64_t)stats->hits*100)/lookups) : 0);
+		kprintf("Read ahead %d, bypassed %d, written back %d in %d runs\n", stats->readahead, stats->bypass, stats->writebacks, stats->writeruns);
 	}
 	else if (!strcmp(command, "proc"))
 	{
@@ -232,46 +317,66 @@ uint32_t ExecuteCmd(char *_cmd, struct EVideoContext *kernelgfx)
 				kprintf("Invalid: '%s'\n", s_cliCtx->pathtmp);
 		}
 	}
+	else if (!strcmp(command, "bg"))
+	{
+		const char *name = strtok(NULL, " ");
+		struct STaskContext *tctx1 = _task_get_context(1);
+		if (!name)
+			kprintf("usage: bg name [param]\n");
+		else if (tctx1->numTasks > 1)
+			kprintf("CPU1 is busy\n");
+		else
+		{
+			// Background programs have to be position independent (-fpie) to fit next to the foreground one
+			s_cliCtx->bgStartAddress = FindAndLoadExecutable(name, 1);
+			if (s_cliCtx->bgStartAddress != 0x0)
+			{
+				strncpy(s_cliCtx->bgExecName, name, 32);
+
+				const char *param = strtok(NULL, " ");
+				if (!param)
+					s_cliCtx->bgExecParamCount = 1;
+				else
+				{
+					strncpy(s_cliCtx->bgExecParam0, param, 32);
+					s_cliCtx->bgExecParamCount = 2;
+				}
+
+				// We loaded it from this CPU, make sure CPU1 finds it in memory
+				CFLUSH_D_L1;
+
+				_task_add(tctx1, name, _runBackgroundExecTask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, 1, 0 /*no gp*/, HEAP_END, 1);
+			}
+			else
+				kprintf("Executable '%s' not found\n", name);
+		}
+	}
+	else if (!strcmp(command, "bgkill"))
+	{
+		StopProgramTasks(0, 2, 1);
+		StopProgramTasks(1, 1, 1);
+	}
 	else // Anything else defers to being a command on storage
 		loadELF = 1;
 
 	if (loadELF)
 	{
-		// TODO: Add support to load user ELF files on HART#1/2
 		struct STaskContext* tctx[MAX_HARTS] = {_task_get_context(0), _task_get_context(1)};
 		int32_t taskcounts[MAX_HARTS] = {tctx[0]->numTasks, tctx[1]->numTasks};
 		int32_t maxcounts[MAX_HARTS] = {2, 1};
 
-		// Temporary measure to avoid loading another executable while the first one is running
-		// until we get a virtual memory device
+		// Only one foreground program at a time, a second one can run in the background on CPU1 (see 'bg')
 		if (taskcounts[0] > maxcounts[0]) // User programs always boot on main CPU
 		{
-			kprintf("Virtual memory / code relocator not implemented.\n");
+			kprintf("A program is already running, use 'bg' to start one on CPU1\n");
 		}
 		else
 		{
-			char filename[64];
-			strcpy(filename, GetWorkDir());	// Current path already contains a trailing slash
-			strcat(filename, command);		// User supplied string
-			strcat(filename, ".elf");		// We don't expect command to contain the .elf extension
-
 			// First parameter is excutable name
-			s_cliCtx->startAddress = LoadExecutable(filename, 0, false);
+			s_cliCtx->startAddress = FindAndLoadExecutable(command, 0);
 			// TODO: Scan and push all argv and the correct argc onto stack
 
-			// If we could not find the executable where we are, look into the 'sys/bin' directory
-			if (s_cliCtx->startAddress == 0x0)
-			{
-				strcpy(filename, "sd:/sys/bin/");
-				strcat(filename, command);
-				strcat(filename, ".elf");
-				s_cliCtx->startAddress = LoadExecutable(filename, 0, false);
-			}
-
 			// If we succeeded in loading the executable, the trampoline task can branch into it.
-			// NOTE: Without code relocation or virtual memory, two executables will ovelap when loaded
-			// even though each gets a new task slot assigned.
-			// This will cause corruption of the runtime environment.
 			if (s_cliCtx->startAddress != 0x0)
 			{
 				strncpy(s_cliCtx->execName, command, 32);
@@ -340,19 +445,14 @@ int HandleCommandLine(struct STaskContext *taskctx)
 				s_cliCtx->cmdString[0] = 0;
 				++s_cliCtx->refreshConsoleOut;
 
-				// NOTE: This has to be done in reverse order!
 				// NOTE: Sig:0, terminate process if no debugger is attached
+				// The background program keeps running, 'bgkill' stops it
 
 				// Stop task on main CPU except IDLE and CLI
-				for (int i=taskctx->numTasks-1; i>=2; i--)
-					_task_exit_task_with_id(taskctx, i, 0);
+				StopProgramTasks(0, 2, 0);
 
 				// Stop all other tasks on helper CPUs
-				{
-					struct STaskContext* tctx1 = _task_get_context(1);
-					for (int i=tctx1->numTasks-1; i>=1; i--)
-						_task_exit_task_with_id(tctx1, i, 0);
-				}
+				StopProgramTasks(1, 1, 0);
 			}
 			break;
 
@@ -504,8 +604,7 @@ void _CLITask()
 			}
 		}
 
-		clear_csr(mie, MIP_MTIP);
-		_task_yield();
-		set_csr(mie, MIP_MTIP);
+		// Sleep until a key comes in or the cursor has to blink
+		_task_block(taskctx, TASK_WAIT_KEYS | TASK_WAIT_TIME, (uint32_t)cursorTime + HALF_SECOND_IN_TICKS + ONE_MILLISECOND_IN_TICKS);
 	}
 }
@@ -13,6 +13,11 @@ struct SCommandLineContext
 	uint32_t startAddress;
 	char execName[36];
 	char execParam0[33];
+	// Background program on CPU#1
+	uint32_t bgExecParamCount;
+	uint32_t bgStartAddress;
+	char bgExecName[36];
+	char bgExecParam0[33];
 };
 
 struct SCommandLineContext* CLIGetContext();
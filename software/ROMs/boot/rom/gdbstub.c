@@ -374,7 +374,7 @@ void GDBReadRegisters()
 	// Registers for 'currentGProcess'
 
 	struct STaskContext *ctx = _task_get_context(0); // CPU0
-	struct STask *task = &ctx->tasks[s_gdbcontext->currentGProcess];
+	uint32_t taskid = s_gdbcontext->currentGProcess;
 
 	// Since we're stashing PC here, we'll just return 0 for zero register instead
 	mini_snprintf(responseData, 1023, "%s00000000", responseData);
@@ -382,7 +382,7 @@ void GDBReadRegisters()
 	// General purpose registers - float registers are aliased to these in our arhitecture
 	for (int i=1; i<32; ++i)
 	{
-		uint32_t reg = task->regs[i];
+		uint32_t reg = TaskGetRegister(ctx, taskid, i);
 		mini_snprintf(responseData + strlen(responseData), 1023 - strlen(responseData), "%02x%02x%02x%02x",
 					(reg >> 0) & 0xFF,
 					(reg >> 8) & 0xFF,
@@ -391,7 +391,7 @@ void GDBReadRegisters()
 	}
 
 	// PC comes last
-	uint32_t pc = task->regs[0];
+	uint32_t pc = TaskGetPC(ctx, taskid);
 	mini_snprintf(responseData + strlen(responseData), 1023 - strlen(responseData), "%02x%02x%02x%02x",
 				(pc >> 0) & 0xFF,
 				(pc >> 8) & 0xFF,
@@ -407,18 +407,18 @@ void GDBWriteRegisters()
 
 	// Parse registers
 	struct STaskContext *ctx = _task_get_context(0); // CPU0
-	struct STask *task = &ctx->tasks[s_gdbcontext->currentGProcess];
+	uint32_t taskid = s_gdbcontext->currentGProcess;
 
 	for (int i=1; i<32; ++i)
 	{
 		uint32_t reg = GDBHexToUint(packetData);
-		task->regs[i] = reg;
+		TaskSetRegister(ctx, taskid, i, reg);
 		packetData += 8;
 	}
 
 	// PC comes last
 	uint32_t pc = GDBHexToUint(packetData);
-	task->regs[0] = pc;
+	TaskSetRegister(ctx, taskid, 0, pc);
 
 	strcpy(responseData, "OK");
 	s_gdbcontext->haveResponse = 1;
@@ -490,7 +490,7 @@ void GDBBreak()
 	else
 	{
 		// Add a software breakpoint at the current PC to stop the process
-		GDBAddBreakpoint(s_gdbcontext->currentGCPU, s_gdbcontext->currentGProcess, _task_get_context(s_gdbcontext->currentGCPU)->tasks[s_gdbcontext->currentGProcess].regs[0]);
+		GDBAddBreakpoint(s_gdbcontext->currentGCPU, s_gdbcontext->currentGProcess, TaskGetPC(_task_get_context(s_gdbcontext->currentGCPU), s_gdbcontext->currentGProcess));
 
 		// Stopped due to CTRL+C
 		strcpy(responseData, "T02");
@@ -171,18 +171,15 @@ void __attribute__((aligned(64), noinline)) UserMain()
 	_task_init_context(self);
 
 	struct STaskContext *taskctx = _task_get_context(self);
-	_task_add(taskctx, "CPUIdle", _stubTask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, self, 0 /*no gp*/, TASK_STACK_POINTER(self, 0, TASK_STACK_SIZE));
+	_task_add(taskctx, "CPUIdle", _stubTask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, self, 0 /*no gp*/, TASK_STACK_POINTER(self, 0, TASK_STACK_SIZE), 0);
 
 	InstallISR(self, false, true);
 
 	while(1)
 	{
-		asm volatile("wfi;");
-
-		// Yield time back to any tasks running on this core after handling an interrupt
-		clear_csr(mie, MIP_MTIP);
-		/*uint64_t currentTime =*/ _task_yield();
-		set_csr(mie, MIP_MTIP);
+		// Nothing to do here besides running tasks, so stay out of their way
+		// and sleep in WFI whenever none of them are ready
+		_task_block(taskctx, TASK_WAIT_TIME, (uint32_t)E32ReadTime() + TASK_TICKLESS_SLICE);
 	}
 }
 
@@ -235,7 +232,7 @@ void HandleCPUError(struct STaskContext *ctx, const uint32_t cpu)
 		kfillline(' ');
 		for (uint32_t i=0; i<32; ++i)
 		{
-			kprintf("%s=0x%08X ", s_regnames[i], task->regs[i]);
+			kprintf("%s=0x%08X ", s_regnames[i], TaskGetRegister(ctx, taskid, i));
 			if ((i+1)%4==0)
 				kfillline(' ');
 		}
@@ -306,8 +303,8 @@ void __attribute__((aligned(64), noinline)) KernelMain()
 	struct STaskContext *taskctx[2];
 	taskctx[0] = _task_get_context(self);
 	taskctx[1] = _task_get_context(1);
-	_task_add(taskctx[0], "CPUIdle", _stubTask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, self, 0 /*no gp*/, TASK_STACK_POINTER(self, 0, TASK_STACK_SIZE));
-	_task_add(taskctx[0], "CLI", _CLITask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, self, 0 /*no gp*/, TASK_STACK_POINTER(self, 1, TASK_STACK_SIZE));
+	_task_add(taskctx[0], "CPUIdle", _stubTask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, self, 0 /*no gp*/, TASK_STACK_POINTER(self, 0, TASK_STACK_SIZE), 0);
+	_task_add(taskctx[0], "CLI", _CLITask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, self, 0 /*no gp*/, TASK_STACK_POINTER(self, 1, TASK_STACK_SIZE), 0);
 
 	LEDSetState((0x7<<2)|0x1);														// xOOO--
 	InstallISR(self, true, true);
@@ -343,11 +340,6 @@ void __attribute__((aligned(64), noinline)) KernelMain()
 		if (kernelgfx->m_consoleUpdated)
 			VPUConsoleResolve(kernelgfx);
 
-		// Yield time as soon as we're done here (disables/enables interrupts)
-		clear_csr(mie, MIP_MTIP);
-		/*uint64_t currentTime =*/ _task_yield();
-		set_csr(mie, MIP_MTIP);
-
 		// ----------------------------------------------------------------
 		// H/W related tasks which should't cause IRQs or be interrupted
 		// ----------------------------------------------------------------
@@ -365,6 +357,10 @@ void __attribute__((aligned(64), noinline)) KernelMain()
 		// Allow serial input to be processed if it's not turned off
 		if(devicecontrol[0] == 0)
 			HandleSerialInput();
+
+		// Sleep until the next poll, or until serial input arrives if it's ours to handle.
+		// The CPU sits in WFI while no other task is ready.
+		_task_block(taskctx[0], TASK_WAIT_TIME | (devicecontrol[0] == 0 ? TASK_WAIT_UART : 0), (uint32_t)E32ReadTime() + KERNEL_POLL_INTERVAL);
 	}
 }
 
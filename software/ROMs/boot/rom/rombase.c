@@ -3,7 +3,10 @@
 #include "uart.h"
 #include "mini-printf.h"
 #include "serialinringbuffer.h"
+#include "keyringbuffer.h"
+#include "apu.h"
 #include "gdbstub.h"
+#include "sectorcache.h"
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
@@ -85,130 +88,186 @@ void ksetcursor(const int _x, const int _y)
 	VPUConsoleSetCursor(kernelgfx, _x, _y);
 }
 
+// Index of the lowest set bit, multiplying the isolated bit by a de Bruijn sequence puts a unique pattern in the top 5 bits
+static const uint8_t s_debruijnBitIndex[32] = {
+	0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+	31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9 };
+
+static inline uint32_t _task_lowest_bit(const uint32_t _mask)
+{
+	return s_debruijnBitIndex[((_mask & -_mask) * 0x077CB531U) >> 27];
+}
+
 uint32_t _task_switch_to_task(struct STaskContext *_ctx, const uint32_t _taskID)
 {
-	// Load current process ID from TP register
-	int32_t currentTask = _ctx->currentTask;
+	// Each task's registers live in the register bank matching its index.
+	// The ISR already saved the current task's registers into its bank through the shadow window,
+	// so selecting the next task's bank is all it takes for the ISR to restore that task instead.
+	_ctx->currentTask = _taskID;
+	write_csr(0x8C0, _taskID);	// CSR_REGISTERBANK
 
-	// Get current task's register stash
-	uint32_t *regs = _ctx->tasks[currentTask].regs;
-
-	// Store register back-ups in current task's structure
-	regs[0] = read_csr(0x8A0);	// PC of halted task
-	regs[1] = read_csr(0x8A1);	// ra
-	regs[2] = read_csr(0x8A2);	// sp
-	regs[3] = read_csr(0x8A3);	// gp
-	regs[4] = read_csr(0x8A4);	// tp
-	regs[5] = read_csr(0x8A5);	// t0
-	regs[6] = read_csr(0x8A6);	// t1
-	regs[7] = read_csr(0x8A7);	// t2
-	regs[8] = read_csr(0x8A8);	// s0
-	regs[9] = read_csr(0x8A9);	// s1
-	regs[10] = read_csr(0x8AA);	// a0
-	regs[11] = read_csr(0x8AB);	// a1
-	regs[12] = read_csr(0x8AC);	// a2
-	regs[13] = read_csr(0x8AD);	// a3
-	regs[14] = read_csr(0x8AE);	// a4
-	regs[15] = read_csr(0x8AF);	// a5
-	regs[16] = read_csr(0x8B0);	// a6
-	regs[17] = read_csr(0x8B1);	// a7
-	regs[18] = read_csr(0x8B2);	// s2
-	regs[19] = read_csr(0x8B3);	// s3
-	regs[20] = read_csr(0x8B4);	// s4
-	regs[21] = read_csr(0x8B5);	// s5
-	regs[22] = read_csr(0x8B6);	// s6
-	regs[23] = read_csr(0x8B7);	// s7
-	regs[24] = read_csr(0x8B8);	// s8
-	regs[25] = read_csr(0x8B9);	// s9
-	regs[26] = read_csr(0x8BA);	// s10
-	regs[27] = read_csr(0x8BB);	// s11
-	regs[28] = read_csr(0x8BC);	// t3
-	regs[29] = read_csr(0x8BD);	// t4
-	regs[30] = read_csr(0x8BE);	// t5
-	regs[31] = read_csr(0x8BF);	// t6
+	return _ctx->tasks[_taskID].runLength;
+}
 
-	_ctx->currentTask = _taskID;
+// Whether task _a should run before task _b, ties go to _b which comes first in turn order
+static int _task_runs_before(struct STaskContext *_ctx, const uint32_t _a, const uint32_t _b)
+{
+	struct STask *a = &_ctx->tasks[_a];
+	struct STask *b = &_ctx->tasks[_b];
 
-	regs = _ctx->tasks[_taskID].regs;
-
-	// Load next tasks's registers into CSR file
-	write_csr(0x8A0, regs[0]);	// PC of next task
-	write_csr(0x8A1, regs[1]);	// ra
-	write_csr(0x8A2, regs[2]);	// sp
-	write_csr(0x8A3, regs[3]);	// gp
-	write_csr(0x8A4, regs[4]);	// tp
-	write_csr(0x8A5, regs[5]);	// t0
-	write_csr(0x8A6, regs[6]);	// t1
-	write_csr(0x8A7, regs[7]);	// t2
-	write_csr(0x8A8, regs[8]);	// s0
-	write_csr(0x8A9, regs[9]);	// s1
-	write_csr(0x8AA, regs[10]);	// a0
-	write_csr(0x8AB, regs[11]);	// a1
-	write_csr(0x8AC, regs[12]);	// a2
-	write_csr(0x8AD, regs[13]);	// a3
-	write_csr(0x8AE, regs[14]);	// a4
-	write_csr(0x8AF, regs[15]);	// a5
-	write_csr(0x8B0, regs[16]);	// a6
-	write_csr(0x8B1, regs[17]);	// a7
-	write_csr(0x8B2, regs[18]);	// s2
-	write_csr(0x8B3, regs[19]);	// s3
-	write_csr(0x8B4, regs[20]);	// s4
-	write_csr(0x8B5, regs[21]);	// s5
-	write_csr(0x8B6, regs[22]);	// s6
-	write_csr(0x8B7, regs[23]);	// s7
-	write_csr(0x8B8, regs[24]);	// s8
-	write_csr(0x8B9, regs[25]);	// s9
-	write_csr(0x8BA, regs[26]);	// s10
-	write_csr(0x8BB, regs[27]);	// s11
-	write_csr(0x8BC, regs[28]);	// t3
-	write_csr(0x8BD, regs[29]);	// t4
-	write_csr(0x8BE, regs[30]);	// t5
-	write_csr(0x8BF, regs[31]);	// t6
+	if (_ctx->scheduling == TSCHED_DEADLINE && (a->deadline || b->deadline))
+	{
+		// Tasks with a deadline go before those without, then the earliest deadline wins
+		if (!b->deadline)
+			return 1;
+		if (!a->deadline)
+			return 0;
+		int32_t diff = (int32_t)((a->release + a->deadline) - (b->release + b->deadline));
+		if (diff != 0)
+			return diff < 0;
+	}
 
-	return _ctx->tasks[_taskID].runLength;
+	return a->priority > b->priority;
+}
+
+// Count periods that ended before their task yielded, the task carries on with its current period
+static void _task_update_deadlines(struct STaskContext *_ctx, const uint32_t _now)
+{
+	for (int32_t i=0; i<_ctx->numTasks; ++i)
+	{
+		struct STask *task = &_ctx->tasks[i];
+		// Tasks waiting for their next period to start have nothing due
+		if (!task->deadline || (int32_t)(_now - task->release) < 0)
+			continue;
+
+		uint32_t late = (_now - task->release) / task->deadline;
+		task->missedDeadlines += late;
+		task->release += late * task->deadline;
+	}
+}
+
+static int _task_wait_over(struct STask *_task, const uint32_t _now)
+{
+	uint32_t flags = _task->waitFlags;
+	// Wake times close to each other get handled by the same timer interrupt
+	if ((flags & TASK_WAIT_TIME) && (int32_t)(_now + TASK_TIMER_SLACK - _task->waitUntil) >= 0)
+		return 1;
+	if ((flags & TASK_WAIT_VSYNC) && VPUReadVBlankCounter() != _task->waitVSync)
+		return 1;
+	if ((flags & TASK_WAIT_APU) && *IO_AUDIOOUT != _task->waitAPU)
+		return 1;
+	if ((flags & TASK_WAIT_UART) && SerialInRingBufferCount())
+		return 1;
+	if ((flags & TASK_WAIT_KEYS) && KeyRingBufferCount())
+		return 1;
+	return 0;
+}
+
+// Blocked tasks whose wait is over go back into the ready set
+static void _task_update_waits(struct STaskContext *_ctx, const uint32_t _now)
+{
+	for (int32_t i=0; i<_ctx->numTasks; ++i)
+	{
+		struct STask *task = &_ctx->tasks[i];
+		if (!task->waitFlags || !_task_wait_over(task, _now))
+			continue;
+
+		task->waitFlags = 0;
+		if (task->state == TS_RUNNING)
+			_ctx->readyMask |= (1U << i);
+	}
+}
+
+// Time until something could make a different task run, at most _slice
+static uint32_t _task_next_event(struct STaskContext *_ctx, const uint32_t _now, uint32_t _slice)
+{
+	// Devices without an interrupt get polled. Serial input interrupts only reach CPU#0,
+	// which reschedules right away, other cores have to poll for it too.
+	uint32_t polled = TASK_WAIT_VSYNC | TASK_WAIT_APU | (_ctx->hartID != 0 ? (TASK_WAIT_UART | TASK_WAIT_KEYS) : 0);
+
+	for (int32_t i=0; i<_ctx->numTasks; ++i)
+	{
+		struct STask *task = &_ctx->tasks[i];
+
+		// Next period of a task with a deadline, so it can preempt the current one
+		if (task->deadline && (_ctx->readyMask & (1U << i)))
+		{
+			int32_t until = (int32_t)(task->release - _now);
+			if (until > 0 && (uint32_t)until < _slice)
+				_slice = until;
+		}
+
+		if (task->waitFlags & TASK_WAIT_TIME)
+		{
+			int32_t until = (int32_t)(task->waitUntil - _now);
+			if (until > 0 && (uint32_t)until < _slice)
+				_slice = until;
+		}
+
+		if ((task->waitFlags & polled) && TASK_DEVICE_POLL_INTERVAL < _slice)
+			_slice = TASK_DEVICE_POLL_INTERVAL;
+	}
+
+	return _slice;
+}
+
+static uint32_t _task_pick_next(struct STaskContext *_ctx, const uint32_t _now)
+{
+	uint32_t ready = _ctx->readyMask;
+
+	// Tasks waiting for their next period can't run yet
+	uint32_t bits = ready;
+	while (bits)
+	{
+		uint32_t i = _task_lowest_bit(bits);
+		bits &= bits - 1;
+		struct STask *task = &_ctx->tasks[i];
+		if (task->deadline && (int32_t)(_now - task->release) < 0)
+			ready &= ~(1U << i);
+	}
+
+	// The OS idle task runs when nothing else can, whether it's ready or not
+	if (!ready)
+		return 0;
+
+	// Visit tasks after the current one first, wrapping around to the start of the list,
+	// so tasks that tie take turns
+	uint32_t after = ready & ~((2U << _ctx->currentTask) - 1);
+	uint32_t turns[2] = { after, ready & ~after };
+	uint32_t best = _task_lowest_bit(after ? after : ready);
+	for (uint32_t t=0; t<2; ++t)
+	{
+		bits = turns[t];
+		while (bits)
+		{
+			uint32_t i = _task_lowest_bit(bits);
+			bits &= bits - 1;
+			if (_task_runs_before(_ctx, i, best))
+				best = i;
+		}
+	}
+
+	return best;
 }
 
 uint32_t _task_switch_to_next(struct STaskContext *_ctx)
 {
-	// Load current process ID from TP register
 	int32_t currentTask = _ctx->currentTask;
 
-	// Get current task's register stash
-	uint32_t *regs = _ctx->tasks[currentTask].regs;
-
-	// Store register back-ups in current task's structure
-	regs[0] = read_csr(0x8A0);	// PC of halted task
-	regs[1] = read_csr(0x8A1);	// ra
-	regs[2] = read_csr(0x8A2);	// sp
-	regs[3] = read_csr(0x8A3);	// gp
-	regs[4] = read_csr(0x8A4);	// tp
-	regs[5] = read_csr(0x8A5);	// t0
-	regs[6] = read_csr(0x8A6);	// t1
-	regs[7] = read_csr(0x8A7);	// t2
-	regs[8] = read_csr(0x8A8);	// s0
-	regs[9] = read_csr(0x8A9);	// s1
-	regs[10] = read_csr(0x8AA);	// a0
-	regs[11] = read_csr(0x8AB);	// a1
-	regs[12] = read_csr(0x8AC);	// a2
-	regs[13] = read_csr(0x8AD);	// a3
-	regs[14] = read_csr(0x8AE);	// a4
-	regs[15] = read_csr(0x8AF);	// a5
-	regs[16] = read_csr(0x8B0);	// a6
-	regs[17] = read_csr(0x8B1);	// a7
-	regs[18] = read_csr(0x8B2);	// s2
-	regs[19] = read_csr(0x8B3);	// s3
-	regs[20] = read_csr(0x8B4);	// s4
-	regs[21] = read_csr(0x8B5);	// s5
-	regs[22] = read_csr(0x8B6);	// s6
-	regs[23] = read_csr(0x8B7);	// s7
-	regs[24] = read_csr(0x8B8);	// s8
-	regs[25] = read_csr(0x8B9);	// s9
-	regs[26] = read_csr(0x8BA);	// s10
-	regs[27] = read_csr(0x8BB);	// s11
-	regs[28] = read_csr(0x8BC);	// t3
-	regs[29] = read_csr(0x8BD);	// t4
-	regs[30] = read_csr(0x8BE);	// t5
-	regs[31] = read_csr(0x8BF);	// t6
+	// Bill the outgoing task for its time
+	uint64_t time = E32ReadTime();
+	uint32_t now = (uint32_t)time;
+	_ctx->tasks[currentTask].cpuTime += time - _ctx->switchTime;
+	_ctx->switchTime = time;
+
+	// Only this HART touches its own counters, others ask for a reset instead
+	if (_ctx->statsResetRequest)
+	{
+		for (int32_t i=0; i<_ctx->numTasks; ++i)
+			_ctx->tasks[i].cpuTime = 0;
+		_ctx->statsTime = time;
+		_ctx->statsResetRequest = 0;
+	}
 
 	// Terminate task and visit OS task
 	// NOTE: Task #0 cannot be terminated
@@ -222,9 +281,18 @@ uint32_t _task_switch_to_next(struct STaskContext *_ctx)
 
 			// Mark as 'terminated'
 			_ctx->tasks[currentTask].state = TS_TERMINATED;
+			_ctx->readyMask &= ~(1U << currentTask);
+
 			// Replace with task at end of list, if we're not the end of list
-			if (currentTask != _ctx->numTasks-1)
-				__builtin_memcpy(&_ctx->tasks[currentTask], &_ctx->tasks[_ctx->numTasks-1], sizeof(struct STask));
+			int32_t lastTask = _ctx->numTasks-1;
+			if (currentTask != lastTask)
+			{
+				__builtin_memcpy(&_ctx->tasks[currentTask], &_ctx->tasks[lastTask], sizeof(struct STask));
+				for (uint32_t i=0; i<32; ++i)
+					TaskSetRegister(_ctx, currentTask, i, TaskGetRegister(_ctx, lastTask, i));
+				if (_ctx->readyMask & (1U << lastTask))
+					_ctx->readyMask = (_ctx->readyMask & ~(1U << lastTask)) | (1U << currentTask);
+			}
 			// One less task to run
 			--_ctx->numTasks;
 			// Rewind back to OS Idle task (always guaranteed to be alive)
@@ -238,53 +306,76 @@ uint32_t _task_switch_to_next(struct STaskContext *_ctx)
 	}
 	else
 	{
-		// Switch to next task
-		// TODO: Next task state should not be `TS_PAUSED`
-		currentTask = (_ctx->numTasks <= 1) ? 0 : ((currentTask+1) % _ctx->numTasks);
+		_task_update_deadlines(_ctx, now);
+		_task_update_waits(_ctx, now);
+		currentTask = _task_pick_next(_ctx, now);
 	}
 
-	_ctx->currentTask = currentTask;
-
-	regs = _ctx->tasks[currentTask].regs;
-
-	// Load next tasks's registers into CSR file
-	write_csr(0x8A0, regs[0]);	// PC of next task
-	write_csr(0x8A1, regs[1]);	// ra
-	write_csr(0x8A2, regs[2]);	// sp
-	write_csr(0x8A3, regs[3]);	// gp
-	write_csr(0x8A4, regs[4]);	// tp
-	write_csr(0x8A5, regs[5]);	// t0
-	write_csr(0x8A6, regs[6]);	// t1
-	write_csr(0x8A7, regs[7]);	// t2
-	write_csr(0x8A8, regs[8]);	// s0
-	write_csr(0x8A9, regs[9]);	// s1
-	write_csr(0x8AA, regs[10]);	// a0
-	write_csr(0x8AB, regs[11]);	// a1
-	write_csr(0x8AC, regs[12]);	// a2
-	write_csr(0x8AD, regs[13]);	// a3
-	write_csr(0x8AE, regs[14]);	// a4
-	write_csr(0x8AF, regs[15]);	// a5
-	write_csr(0x8B0, regs[16]);	// a6
-	write_csr(0x8B1, regs[17]);	// a7
-	write_csr(0x8B2, regs[18]);	// s2
-	write_csr(0x8B3, regs[19]);	// s3
-	write_csr(0x8B4, regs[20]);	// s4
-	write_csr(0x8B5, regs[21]);	// s5
-	write_csr(0x8B6, regs[22]);	// s6
-	write_csr(0x8B7, regs[23]);	// s7
-	write_csr(0x8B8, regs[24]);	// s8
-	write_csr(0x8B9, regs[25]);	// s9
-	write_csr(0x8BA, regs[26]);	// s10
-	write_csr(0x8BB, regs[27]);	// s11
-	write_csr(0x8BC, regs[28]);	// t3
-	write_csr(0x8BD, regs[29]);	// t4
-	write_csr(0x8BE, regs[30]);	// t5
-	write_csr(0x8BF, regs[31]);	// t6
-
-	return _ctx->tasks[currentTask].runLength;
+	uint32_t runLength = _task_switch_to_task(_ctx, currentTask);
+
+	// With nobody else to take turns with, there's no need for a timer interrupt
+	// until a blocked or waiting task might have to run
+	if (!(_ctx->readyMask & ~(1U << currentTask)))
+		runLength = TASK_TICKLESS_SLICE;
+
+	return _task_next_event(_ctx, now, runLength);
+}
+
+int _task_set_priority(struct STaskContext *_ctx, const uint32_t _taskid, const uint32_t _priority, const uint32_t _deadline)
+{
+	if (_taskid >= (uint32_t)_ctx->numTasks)
+		return -1;
+
+	struct STask *task = &_ctx->tasks[_taskid];
+	task->priority = _priority;
+	task->deadline = _deadline;
+	// First period starts right away
+	task->release = (uint32_t)E32ReadTime();
+	task->missedDeadlines = 0;
+
+	return 0;
 }
 
-int _task_add(struct STaskContext *_ctx, const char *_name, taskfunc _task, enum ETaskState _initialState, const uint32_t _runLength, const uint32_t _hartid, const uint32_t _gp, const uint32_t _parentStackPointer)
+void _task_wait(struct STaskContext *_ctx, const uint32_t _flags, const uint32_t _until, const uint32_t _vsync, const uint32_t _apuFrame)
+{
+	uint32_t taskid = _ctx->currentTask;
+	struct STask *task = &_ctx->tasks[taskid];
+	task->waitUntil = _until;
+	task->waitVSync = _vsync;
+	task->waitAPU = _apuFrame;
+	task->waitFlags = _flags;
+
+	// Leave the ready set unless there's nothing to wait for
+	if (_flags && !_task_wait_over(task, (uint32_t)E32ReadTime()))
+		_ctx->readyMask &= ~(1U << taskid);
+	else
+		task->waitFlags = 0;
+}
+
+void _task_block(struct STaskContext *_ctx, const uint32_t _flags, const uint32_t _until)
+{
+	// Kernel tasks block here, user tasks go through the task_wait syscall instead
+	clear_csr(mie, MIP_MTIP);
+	_task_wait(_ctx, _flags, _until, 0, 0);
+	_task_yield();
+	set_csr(mie, MIP_MTIP);
+
+	// The OS idle task comes back here when nothing else is ready, doze until
+	// an interrupt while its own wait isn't over
+	volatile uint32_t *waitFlags = &_ctx->tasks[_ctx->currentTask].waitFlags;
+	while (*waitFlags)
+		asm volatile("wfi;");
+}
+
+void _task_end_period(struct STaskContext *_ctx)
+{
+	// Task is done with this period's work and waits for the next one
+	struct STask *task = &_ctx->tasks[_ctx->currentTask];
+	if (task->deadline)
+		task->release += task->deadline;
+}
+
+int _task_add(struct STaskContext *_ctx, const char *_name, taskfunc _task, enum ETaskState _initialState, const uint32_t _runLength, const uint32_t _hartid, const uint32_t _gp, const uint32_t _parentStackPointer, const uint32_t _heapID)
 {
 	int32_t prevcount = _ctx->numTasks;
 	if (prevcount >= TASK_MAX)
@@ -292,11 +383,22 @@ int _task_add(struct STaskContext *_ctx, const char *_name, taskfunc _task, enum
 
 	// Insert the task before we increment task count
 	struct STask *task = &(_ctx->tasks[prevcount]);
-	task->regs[0] = (uint32_t)_task;		// Initial PC
-	task->regs[2] = _parentStackPointer;	// Stack pointer
-	task->regs[3] = _gp;					// Global pointer
-	task->regs[8] = _parentStackPointer;	// Frame pointer
 	task->runLength = _runLength;			// Time slice dedicated to this task
+	task->heapID = _heapID;					// Heap brk() works on
+	task->priority = TASK_PRIORITY_NORMAL;
+	task->deadline = 0;						// No deadline until _task_set_priority() gives it one
+	task->release = 0;
+	task->cpuTime = 0;
+	task->missedDeadlines = 0;
+	task->waitFlags = 0;					// Not blocked on anything
+
+	// Initial register set goes into the task's register bank
+	for (uint32_t i=0; i<32; ++i)
+		TaskSetRegister(_ctx, prevcount, i, 0);
+	TaskSetRegister(_ctx, prevcount, 0, (uint32_t)_task);			// Initial PC
+	TaskSetRegister(_ctx, prevcount, 2, _parentStackPointer);		// Stack pointer
+	TaskSetRegister(_ctx, prevcount, 3, _gp);						// Global pointer
+	TaskSetRegister(_ctx, prevcount, 8, _parentStackPointer);		// Frame pointer
 
 	char *np = (char*)_name;
 	int idx = 0;
@@ -312,6 +414,10 @@ int _task_add(struct STaskContext *_ctx, const char *_name, taskfunc _task, enum
 
 	++_ctx->numTasks;
 
+	// Scheduler can pick it up from here on
+	if (_initialState == TS_RUNNING)
+		_ctx->readyMask |= (1U << prevcount);
+
 	return prevcount;
 }
 
@@ -323,6 +429,8 @@ void _task_exit_task_with_id(struct STaskContext *_ctx, uint32_t _taskid, uint32
 	struct STask *task = &_ctx->tasks[_taskid];
 	task->state = TS_TERMINATING;
 	task->exitCode = _signal;
+	// Paused tasks have to run once more to be cleaned up
+	_ctx->readyMask |= (1U << _taskid);
 }
 
 void _task_exit_current_task(struct STaskContext *_ctx)
@@ -385,6 +493,10 @@ void _task_init_context(uint32_t _hartid)
 	struct STaskContext *ctx = _task_get_context(_hartid);
 	memset(ctx, 0x0, sizeof(struct STaskContext));
 	ctx->hartID = _hartid;
+	ctx->switchTime = E32ReadTime();
+	ctx->statsTime = ctx->switchTime;
+	// Task #0 registers live in bank #0
+	E32WriteMemMappedCSR(_hartid, CSR_REGISTERBANK, 0);
 }
 
 uint32_t MountDrive()
@@ -511,6 +623,8 @@ char *krealpath(const char *path, char resolved[PATH_MAX])
 
 void UnmountDrive()
 {
+	// Write back what's still in the sector cache, the next mount starts with an empty one
+	SectorCacheFlush();
 	f_mount(NULL, "sd:", 1);
 }
 
@@ -575,7 +689,75 @@ void ListFiles(const char *path)
 	ksetcolor(CONSOLEDEFAULTFG, CONSOLEDEFAULTBG);
 }
 
-uint32_t ParseELFHeaderAndLoadSections(FIL *fp, struct SElfFileHeader32 *fheader, uint32_t* jumptarget, int _relocOffset)
+// Enough for any of our executables, which usually come with four or five
+#define ELF_MAX_PROGRAM_HEADERS 16
+// Cluster map entries for fast seek, a contiguous file needs 4 of these
+#define ELF_CLUSTER_MAP_SIZE 64
+
+// Zero a memory range, using whole cache lines of word stores for the bulk of it
+static void ZeroCacheLines(uint8_t *_dest, uint32_t _size)
+{
+	uint8_t *end = _dest + _size;
+
+	while (_dest < end && ((uint32_t)_dest & 63))
+		*_dest++ = 0;
+
+	uint32_t *line = (uint32_t*)_dest;
+	while ((uint8_t*)(line + 16) <= end)
+	{
+		line[0] = 0; line[1] = 0; line[2] = 0; line[3] = 0;
+		line[4] = 0; line[5] = 0; line[6] = 0; line[7] = 0;
+		line[8] = 0; line[9] = 0; line[10] = 0; line[11] = 0;
+		line[12] = 0; line[13] = 0; line[14] = 0; line[15] = 0;
+		line += 16;
+	}
+
+	_dest = (uint8_t*)line;
+	while (_dest < end)
+		*_dest++ = 0;
+}
+
+// Patch a position independent executable loaded at _base, using the relocations its dynamic section lists
+static uint32_t ApplyELFRelocations(const uint32_t _dynamicAddr, const uint32_t _base)
+{
+	uint32_t rela = 0, relasz = 0, relaent = sizeof(struct SElfRela32), symtab = 0;
+	for (struct SElfDynamic32 *dyn = (struct SElfDynamic32 *)_dynamicAddr; dyn->m_Tag != DT_NULL; ++dyn)
+	{
+		switch (dyn->m_Tag)
+		{
+			case DT_RELA: rela = dyn->m_Val + _base; break;
+			case DT_RELASZ: relasz = dyn->m_Val; break;
+			case DT_RELAENT: relaent = dyn->m_Val; break;
+			case DT_SYMTAB: symtab = dyn->m_Val + _base; break;
+		}
+	}
+
+	for (uint32_t i=0; i<relasz; i+=relaent)
+	{
+		struct SElfRela32 *reloc = (struct SElfRela32 *)(rela + i);
+		uint32_t *target = (uint32_t *)(reloc->m_Offset + _base);
+		uint32_t type = reloc->m_Info & 0xFF;
+
+		if (type == R_RISCV_RELATIVE)
+			*target = _base + reloc->m_Addend;
+		else if (type == R_RISCV_32 && symtab)
+		{
+			struct SElfSymbol32 *sym = (struct SElfSymbol32 *)symtab + (reloc->m_Info >> 8);
+			// Undefined (weak) symbols resolve to zero, absolute ones don't move with the executable
+			uint32_t value = sym->m_Shndx == 0 ? 0 : (sym->m_Shndx == 0xFFF1 ? sym->m_Value : sym->m_Value + _base);
+			*target = value + reloc->m_Addend;
+		}
+		else if (type != R_RISCV_NONE)
+		{
+			kprintf("ELF relocation type %d not supported\n", type);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+uint32_t ParseELFHeaderAndLoadSections(FIL *fp, struct SElfFileHeader32 *fheader, uint32_t* jumptarget, int _relocOffset, const uint32_t _memStart, const uint32_t _memEnd)
 {
 	uint32_t heap_start = 0;
 	if (fheader->m_Magic != 0x464C457F)
@@ -584,69 +766,129 @@ uint32_t ParseELFHeaderAndLoadSections(FIL *fp, struct SElfFileHeader32 *fheader
 		return heap_start;
 	}
 
+	if (fheader->m_PHNum > ELF_MAX_PROGRAM_HEADERS || fheader->m_PHEntSize != sizeof(struct SElfProgramHeader32))
+	{
+		kprintf("ELF program header error\n");
+		return heap_start;
+	}
+
 	*jumptarget = fheader->m_Entry + _relocOffset;
 	UINT bytesread = 0;
 
-	// Read program headers
+	// Read all program headers in one go
+	struct SElfProgramHeader32 pheaders[ELF_MAX_PROGRAM_HEADERS];
+	uint32_t phsize = fheader->m_PHNum * sizeof(struct SElfProgramHeader32);
+	f_lseek(fp, fheader->m_PHOff);
+	if (f_read(fp, pheaders, phsize, &bytesread) != FR_OK || bytesread != phsize)
+	{
+		kprintf("ELF program header error\n");
+		return heap_start;
+	}
+
+	// Visit segments in file order so the reads walk forward through the file
+	uint8_t order[ELF_MAX_PROGRAM_HEADERS];
+	for (uint32_t i=0; i<fheader->m_PHNum; ++i)
+	{
+		uint32_t at = i;
+		while (at > 0 && pheaders[order[at-1]].m_Offset > pheaders[i].m_Offset)
+		{
+			order[at] = order[at-1];
+			--at;
+		}
+		order[at] = i;
+	}
+
+	uint32_t dynamicAddr = 0;
 	for (uint32_t i=0; i<fheader->m_PHNum; ++i)
 	{
-		struct SElfProgramHeader32 pheader;
-		f_lseek(fp, fheader->m_PHOff + fheader->m_PHEntSize*i);
-		f_read(fp, &pheader, sizeof(struct SElfProgramHeader32), &bytesread);
+		struct SElfProgramHeader32 *pheader = &pheaders[order[i]];
 
-		// Something here
-		if (pheader.m_MemSz != 0)
+		// Relocations are applied once everything is in place
+		if (pheader->m_Type == PT_DYNAMIC)
+			dynamicAddr = pheader->m_VAddr + _relocOffset;
+
+		// Something to load here
+		if (pheader->m_Type == PT_LOAD && pheader->m_MemSz != 0)
 		{
-			uint8_t *memaddr = (uint8_t *)(pheader.m_PAddr + _relocOffset);
+			uint8_t *memaddr = (uint8_t *)(pheader->m_PAddr + _relocOffset);
 			// Check illegal range
-			if ((uint32_t)memaddr>=HEAP_END || ((uint32_t)memaddr)+pheader.m_MemSz>=HEAP_END)
+			if ((uint32_t)memaddr<_memStart || ((uint32_t)memaddr)+pheader->m_MemSz>_memEnd)
 			{
 				kprintf("ELF section in illegal memory region\n");
 				return 0;
 			}
 			else
 			{
-				// Initialize the memory range at target physical address
-				// This can be larger than the loaded size
-				memset(memaddr, 0x0, pheader.m_MemSz);
-
-				// Load the binary section depending on 'load' flag
-				if (pheader.m_Type == PT_LOAD)
+				// Segments start sector aligned in the file, so a single read lets
+				// FatFs move whole clusters from the card straight into place
+				uint32_t loadsize = pheader->m_FileSz < pheader->m_MemSz ? pheader->m_FileSz : pheader->m_MemSz;
+				f_lseek(fp, pheader->m_Offset);
+				if (f_read(fp, memaddr, loadsize, &bytesread) != FR_OK || bytesread != loadsize)
 				{
-					f_lseek(fp, pheader.m_Offset);
-					f_read(fp, memaddr, pheader.m_FileSz, &bytesread);
+					kprintf("ELF section read error\n");
+					return 0;
 				}
 
-				uint32_t blockEnd = (uint32_t)memaddr + pheader.m_MemSz;
+				// Only the part not loaded from the file needs clearing (BSS)
+				ZeroCacheLines(memaddr + loadsize, pheader->m_MemSz - loadsize);
+
+				uint32_t blockEnd = (uint32_t)memaddr + pheader->m_MemSz;
 				heap_start = heap_start < blockEnd ? blockEnd : heap_start;
 			}
 		}
 	}
 
+	// Position independent executables (-fpie) carry their own relocations
+	if (fheader->m_Type == ET_DYN && dynamicAddr != 0)
+	{
+		if (!ApplyELFRelocations(dynamicAddr, _relocOffset))
+			return 0;
+	}
+
 	return E32AlignUp(heap_start, 1024);
 }
 
-uint32_t LoadExecutable(const char *filename, int _relocOffset, const bool reportError)
+uint32_t LoadExecutable(const char *filename, const uint32_t _heapID, const bool reportError)
 {
 	FIL fp;
 	FRESULT fr = f_open(&fp, filename, FA_READ);
 
 	if (fr == FR_OK)
 	{
+		uint64_t starttime = E32ReadTime();
+
+		// Map the file's clusters up front so seeks don't have to walk the FAT
+		DWORD clustermap[ELF_CLUSTER_MAP_SIZE];
+		clustermap[0] = ELF_CLUSTER_MAP_SIZE;
+		fp.cltbl = clustermap;
+		if (f_lseek(&fp, CREATE_LINKMAP) != FR_OK)
+			fp.cltbl = 0; // Too fragmented, fall back to regular seeks
+
+		// Foreground programs get the application space below the background area,
+		// the background program gets that area minus room for its stack
+		uint32_t memStart = _heapID == 0 ? HEAP_START : BACKGROUND_APP_START;
+		uint32_t memEnd = _heapID == 0 ? BACKGROUND_APP_START : HEAP_END - BACKGROUND_APP_STACK_SIZE;
+
 		// Something was there, load and parse it
 		struct SElfFileHeader32 fheader;
 		UINT readsize;
 		f_read(&fp, &fheader, sizeof(fheader), &readsize);
+		// Position independent executables go to the start of their area, the rest where they were linked
+		int relocOffset = fheader.m_Type == ET_DYN ? (int)memStart : 0;
 		uint32_t branchaddress;
-		uint32_t heap_start = ParseELFHeaderAndLoadSections(&fp, &fheader, &branchaddress, _relocOffset);
+		uint32_t heap_start = ParseELFHeaderAndLoadSections(&fp, &fheader, &branchaddress, relocOffset, memStart, memEnd);
+		uint32_t filesize = (uint32_t)f_size(&fp);
 		f_close(&fp);
 
 		// Success?
 		if (heap_start != 0)
 		{
-			// Set brk() to end of executable's BSS
+			uint64_t loadtime = E32ReadTime() - starttime;
+			kprintf("Loaded %d Kb in %d ticks (%d ms)\n", filesize/1024, (uint32_t)loadtime, ClockToMs(loadtime));
+
+			// Set brk() range to end of executable's BSS up to the end of its area
 			// TODO: MMU should handle address space mapping and we should not have to do this manually
-			set_elf_heap(heap_start);
+			set_elf_heap(_heapID, heap_start, memEnd);
 
 			return branchaddress;
 		}
@@ -745,16 +987,37 @@ uint32_t IsFileHandleAllocated(const uint32_t _bitIndex, const uint32_t  _input)
 	return (_input & mask) ? 1 : 0;
 }
 
+static void SerialInWriteBatch(const uint8_t *data, uint32_t count)
+{
+	// Keep as much as fits if the ring can't take the whole batch
+	if (!SerialInRingBufferWrite(data, count))
+		for (uint32_t i = 0; i < count; ++i)
+			SerialInRingBufferWrite(&data[i], 1);
+}
+
 void HandleUART()
 {
 	uint32_t currLED = LEDGetState();
 	LEDSetState(currLED | 0x8);
+
+	// Move the FIFO into the ring buffer in batches, uploads keep it busy
+	uint8_t rcvData[64];
+	uint32_t count = 0;
 	while (UARTGetStatus() & UARTSTA_RXFIFO_VALID)
 	{
-		uint8_t rcvData = (uint8_t)(UARTReceiveData() & 0x000000FF);
-		SerialInRingBufferWrite(&rcvData, 1);
+		rcvData[count++] = (uint8_t)(UARTReceiveData() & 0x000000FF);
+		if (count == sizeof(rcvData))
+		{
+			SerialInWriteBatch(rcvData, count);
+			count = 0;
+		}
 	}
+	if (count)
+		SerialInWriteBatch(rcvData, count);
 	LEDSetState(currLED);
+
+	// Reschedule right after this interrupt so tasks blocked on serial input wake up
+	_task_yield();
 }
 
 //void __attribute__((aligned(16))) __attribute__((interrupt("machine"))) interrupt_service_routine() // Auto-saves registers
@@ -832,8 +1095,7 @@ void __attribute__((aligned(16))) __attribute__((naked)) interrupt_service_routi
 				// Machine Timer Interrupt (timer)
 				// Task scheduler runs here
 
-				// Switch between running tasks
-				// TODO: Return time slice request of current task
+				// Switch between running tasks, the time slice might be cut short for a task with a deadline
 				uint32_t runLength = _task_switch_to_next(taskctx);
 
 				// Update task breakpoints if we're in debug mode
@@ -842,7 +1104,6 @@ void __attribute__((aligned(16))) __attribute__((naked)) interrupt_service_routi
 
 				// Task scheduler will re-visit after we've filled run length of this task
 				uint64_t now = E32ReadTime();
-				// TODO: Use time slice request returned from _task_switch_to_next()
 				uint64_t future = now + runLength;
 				E32SetTimeCompare(future);
 			}
@@ -1211,7 +1472,7 @@ void __attribute__((aligned(16))) __attribute__((naked)) interrupt_service_routi
 				else if (value==214) // brk()
 				{
 					uint32_t addrs = read_csr(0x8AA); // A0
-					uint32_t retval = core_brk(addrs);
+					uint32_t retval = core_brk(taskctx->tasks[taskctx->currentTask].heapID, addrs);
 					write_csr(0x8AA, retval);
 				}
 				else if (value==403) // gettimeofday()
@@ -1358,8 +1619,10 @@ void __attribute__((aligned(16))) __attribute__((naked)) interrupt_service_routi
 					const uint32_t stackPointer = read_csr(0x8AF); // A5
 					const uint32_t gp = read_csr(0x8A3); // GP
 					uint32_t parentSP = (stackPointer != 0x0) ? stackPointer : read_csr(0x8A2); // SP
+					// New task shares the heap of the program adding it
+					const uint32_t heapID = taskctx->tasks[taskctx->currentTask].heapID;
 					// Using parent's stack pointer as the new task's stack pointer
-					int retVal = _task_add(context, name, task, initialState, runLength, hartid, gp, parentSP);
+					int retVal = _task_add(context, name, task, initialState, runLength, hartid, gp, parentSP, heapID);
 					write_csr(0x8AA, retVal);
 				}
 				else if (value==16385) // task_switch_to_next
@@ -1384,6 +1647,7 @@ void __attribute__((aligned(16))) __attribute__((naked)) interrupt_service_routi
 				}
 				else if (value==16388) // _task_yield
 				{
+					_task_end_period(taskctx);
 					// Ignore return value, only OS has access to it
 					_task_yield();
 					write_csr(0x8AA, 0);
@@ -1399,6 +1663,29 @@ void __attribute__((aligned(16))) __attribute__((naked)) interrupt_service_routi
 					void* sharedmem = _task_get_shared_memory();
 					write_csr(0x8AA, (uint32_t)sharedmem);
 				}
+				else if (value==16391) // _task_set_priority
+				{
+					struct STaskContext *context = (struct STaskContext *)read_csr(0x8AA); // A0
+					uint32_t taskid = read_csr(0x8AB); // A1
+					uint32_t priority = read_csr(0x8AC); // A2
+					uint32_t deadline = read_csr(0x8AD); // A3
+					int retVal = _task_set_priority(context, taskid, priority, deadline);
+					// Pick again right away in case another task should run now
+					if (context == taskctx)
+						_task_yield();
+					write_csr(0x8AA, retVal);
+				}
+				else if (value==16392) // _task_wait
+				{
+					uint32_t flags = read_csr(0x8AA); // A0
+					uint32_t until = read_csr(0x8AB); // A1
+					uint32_t vsync = read_csr(0x8AC); // A2
+					uint32_t apuFrame = read_csr(0x8AD); // A3
+					_task_wait(taskctx, flags, until, vsync, apuFrame);
+					// Switch away right after the syscall returns
+					_task_yield();
+					write_csr(0x8AA, 0);
+				}
 				else // Unimplemented syscalls drop here
 				{
 					kprintf("unimplemented ECALL: %d\b", value);
@@ -21,7 +21,7 @@ const char* GetWorkDir();
 uint32_t MountDrive();
 void UnmountDrive();
 void ListFiles(const char *path);
-uint32_t LoadExecutable(const char *filename, int _relocOffset, const bool reportError);
+uint32_t LoadExecutable(const char *filename, const uint32_t _heapID, const bool reportError);
 
 // Kernel print
 void ksetcolor(int8_t fg, int8_t bg);
@@ -38,14 +38,28 @@ char *krealpath(const char *path, char resolved[PATH_MAX]);
 // Task - internals
 struct STaskContext *_task_get_context(uint32_t _hartid);
 void _task_init_context(uint32_t _hartid);
-int _task_add(struct STaskContext *_ctx, const char *_name, taskfunc _task, enum ETaskState _initialState, const uint32_t _runLength, const uint32_t _hartid, const uint32_t _gp, const uint32_t _parentStackPointer);
+int _task_add(struct STaskContext *_ctx, const char *_name, taskfunc _task, enum ETaskState _initialState, const uint32_t _runLength, const uint32_t _hartid, const uint32_t _gp, const uint32_t _parentStackPointer, const uint32_t _heapID);
 uint32_t _task_switch_to_next(struct STaskContext *_ctx);
 void _task_exit_task_with_id(struct STaskContext *_ctx, uint32_t _taskid, uint32_t _signal);
 void _task_exit_current_task(struct STaskContext *_ctx);
+int _task_set_priority(struct STaskContext *_ctx, const uint32_t _taskid, const uint32_t _priority, const uint32_t _deadline);
+void _task_end_period(struct STaskContext *_ctx);
+void _task_wait(struct STaskContext *_ctx, const uint32_t _flags, const uint32_t _until, const uint32_t _vsync, const uint32_t _apuFrame);
+// Blocks the calling kernel task, the OS idle task sits in WFI until its wait is over
+void _task_block(struct STaskContext *_ctx, const uint32_t _flags, const uint32_t _until);
 uint64_t _task_yield();
 
 // Debug helpers
 uint32_t _task_replace_instruction(uint32_t _newInstruction, uint32_t _address);
 
+// Longest time slice when there's only one task to run, so the timer stays quiet when idle
+#define TASK_TICKLESS_SLICE ONE_SECOND_IN_TICKS
+// Tasks waiting on devices that can't interrupt the CPU get checked this often
+#define TASK_DEVICE_POLL_INTERVAL QUARTER_MILLISECOND_IN_TICKS
+// Wake times this close together are served by one timer interrupt
+#define TASK_TIMER_SLACK (100*ONE_MICROSECOND_IN_TICKS)
+// How often the OS idle task on CPU#0 wakes up for console and crash reports when nothing else happens
+#define KERNEL_POLL_INTERVAL TEN_MILLISECONDS_IN_TICKS
+
 #define TASK_STACK_SIZE 1024
 #define TASK_STACK_POINTER(_hartid, _taskIndex, _stacksize) (TASKMEM_END_STACK_END - ((_hartid*TASK_MAX+_taskIndex)*_stacksize))
\ No newline at end of file
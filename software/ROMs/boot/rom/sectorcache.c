@@ -0,0 +1,227 @@
+#include "basesystem.h"
+#include "sdcard.h"
+#include "sectorcache.h"
+
+#define SECTORCACHE_ENTRIES (SECTORCACHE_SETS*SECTORCACHE_WAYS)
+
+struct SSectorCacheEntry
+{
+	uint32_t sector;
+	uint32_t lastuse;
+	uint8_t valid;
+	uint8_t dirty;
+};
+
+// KERNEL_SECTORCACHE layout: 8 Kbytes of tags and the flush order list, then the write staging area, then the sectors
+static struct SSectorCacheEntry *s_entries = (struct SSectorCacheEntry*)KERNEL_SECTORCACHE;
+static uint16_t *s_order = (uint16_t*)(KERNEL_SECTORCACHE + SECTORCACHE_ENTRIES*sizeof(struct SSectorCacheEntry));
+static uint8_t *s_staging = (uint8_t*)(KERNEL_SECTORCACHE + 0x2000);
+static uint8_t *s_sectors = (uint8_t*)(KERNEL_SECTORCACHE + 0x2000 + SECTORCACHE_STAGING*512);
+
+static struct SSectorCacheStats s_stats;
+static uint32_t s_usecounter = 0;
+// Sector after the last miss, a miss on this one means someone's reading sequentially
+static uint32_t s_nextsequential = 0xFFFFFFFF;
+
+static inline uint8_t *SectorData(const uint32_t _index)
+{
+	return s_sectors + (_index<<9);
+}
+
+static int FindSector(const uint32_t _sector)
+{
+	uint32_t base = (_sector % SECTORCACHE_SETS) * SECTORCACHE_WAYS;
+	for (uint32_t i=base; i<base+SECTORCACHE_WAYS; ++i)
+		if (s_entries[i].valid && s_entries[i].sector == _sector)
+			return i;
+	return -1;
+}
+
+// Least recently used way of the set, or a free one, writing it back first if dirty
+static int AllocateSector(const uint32_t _sector)
+{
+	uint32_t base = (_sector % SECTORCACHE_SETS) * SECTORCACHE_WAYS;
+	uint32_t victim = base;
+	for (uint32_t i=base; i<base+SECTORCACHE_WAYS; ++i)
+	{
+		if (!s_entries[i].valid)
+		{
+			victim = i;
+			break;
+		}
+		if (s_entries[i].lastuse < s_entries[victim].lastuse)
+			victim = i;
+	}
+
+	struct SSectorCacheEntry *entry = &s_entries[victim];
+	if (entry->valid && entry->dirty)
+	{
+		if (SDWriteMultipleBlocks(SectorData(victim), 1, entry->sector) == -1)
+			return -1;
+		s_stats.writebacks++;
+		s_stats.writeruns++;
+	}
+
+	entry->sector = _sector;
+	entry->valid = 1;
+	entry->dirty = 0;
+	return victim;
+}
+
+void SectorCacheInit()
+{
+	// The card might have been swapped, start over
+	__builtin_memset(s_entries, 0, SECTORCACHE_ENTRIES*sizeof(struct SSectorCacheEntry));
+	s_usecounter = 0;
+	s_nextsequential = 0xFFFFFFFF;
+}
+
+int SectorCacheRead(uint8_t *buffer, uint32_t sector, uint32_t count)
+{
+	if (count >= SECTORCACHE_BYPASS)
+	{
+		// Large reads such as executables and file contents would only evict the FAT and directories
+		if (SDReadMultipleBlocks(buffer, count, sector) == -1)
+			return -1;
+		s_stats.bypass += count;
+
+		// Cached sectors that haven't been written back yet are newer than the card
+		for (uint32_t i=0; i<count; ++i)
+		{
+			int index = FindSector(sector+i);
+			if (index != -1 && s_entries[index].dirty)
+				__builtin_memcpy(buffer + (i<<9), SectorData(index), 512);
+		}
+		return 0;
+	}
+
+	for (uint32_t i=0; i<count; ++i, ++sector, buffer += 512)
+	{
+		int index = FindSector(sector);
+		if (index != -1)
+		{
+			s_stats.hits++;
+		}
+		else
+		{
+			s_stats.misses++;
+
+			// Read a few sectors ahead when this continues where the last miss left off
+			uint32_t runlength = (sector == s_nextsequential) ? SECTORCACHE_READAHEAD : 1;
+			if (SDReadMultipleBlocks(s_staging, runlength, sector) == -1)
+			{
+				// Read ahead might run past the end of the card
+				runlength = 1;
+				if (SDReadMultipleBlocks(s_staging, 1, sector) == -1)
+					return -1;
+			}
+
+			for (uint32_t r=0; r<runlength; ++r)
+			{
+				// Don't replace anything already cached, it might be dirty
+				if (r != 0 && FindSector(sector+r) != -1)
+					continue;
+				int slot = AllocateSector(sector+r);
+				if (slot == -1)
+					return -1;
+				__builtin_memcpy(SectorData(slot), s_staging + (r<<9), 512);
+				// Read ahead sectors are the oldest in their set until they're used
+				s_entries[slot].lastuse = r == 0 ? s_usecounter : 0;
+				if (r != 0)
+					s_stats.readahead++;
+			}
+
+			s_nextsequential = sector + runlength;
+			index = FindSector(sector);
+		}
+
+		s_entries[index].lastuse = ++s_usecounter;
+		__builtin_memcpy(buffer, SectorData(index), 512);
+	}
+
+	return 0;
+}
+
+int SectorCacheWrite(const uint8_t *buffer, uint32_t sector, uint32_t count)
+{
+	if (count >= SECTORCACHE_BYPASS)
+	{
+		// Same as reads, large writes go straight through and replace what's cached
+		for (uint32_t i=0; i<count; ++i)
+		{
+			int index = FindSector(sector+i);
+			if (index != -1)
+				s_entries[index].valid = 0;
+		}
+		s_stats.bypass += count;
+		return SDWriteMultipleBlocks(buffer, count, sector) == -1 ? -1 : 0;
+	}
+
+	for (uint32_t i=0; i<count; ++i, ++sector, buffer += 512)
+	{
+		int index = FindSector(sector);
+		if (index == -1)
+			index = AllocateSector(sector);
+		if (index == -1)
+			return -1;
+
+		__builtin_memcpy(SectorData(index), buffer, 512);
+		s_entries[index].dirty = 1;
+		s_entries[index].lastuse = ++s_usecounter;
+	}
+
+	return 0;
+}
+
+int SectorCacheFlush()
+{
+	// Collect dirty sectors in ascending order so neighbours can go out together
+	uint16_t *order = s_order;
+	uint32_t dirtycount = 0;
+	for (uint32_t i=0; i<SECTORCACHE_ENTRIES; ++i)
+	{
+		if (!s_entries[i].valid || !s_entries[i].dirty)
+			continue;
+
+		uint32_t at = dirtycount++;
+		while (at > 0 && s_entries[order[at-1]].sector > s_entries[i].sector)
+		{
+			order[at] = order[at-1];
+			--at;
+		}
+		order[at] = i;
+	}
+
+	int result = 0;
+	uint32_t d = 0;
+	while (d < dirtycount)
+	{
+		// Consecutive sectors up to the size of the staging area make one run
+		uint32_t first = s_entries[order[d]].sector;
+		uint32_t runlength = 0;
+		while (d+runlength < dirtycount && runlength < SECTORCACHE_STAGING && s_entries[order[d+runlength]].sector == first+runlength)
+		{
+			__builtin_memcpy(s_staging + (runlength<<9), SectorData(order[d+runlength]), 512);
+			++runlength;
+		}
+
+		if (SDWriteMultipleBlocks(s_staging, runlength, first) == -1)
+			result = -1;
+		else
+		{
+			for (uint32_t r=0; r<runlength; ++r)
+				s_entries[order[d+r]].dirty = 0;
+			s_stats.writebacks += runlength;
+			s_stats.writeruns++;
+		}
+
+		d += runlength;
+	}
+
+	return result;
+}
+
+struct SSectorCacheStats *SectorCacheGetStats()
+{
+	return &s_stats;
+}
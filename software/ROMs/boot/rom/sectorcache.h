@@ -0,0 +1,31 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Set associative cache of SD card sectors under the FatFs disk layer,
+// kept in the KERNEL_SECTORCACHE region (see basesystem.h)
+#define SECTORCACHE_SETS		64
+#define SECTORCACHE_WAYS		8
+// Sectors read in one go once a sequential read is detected
+#define SECTORCACHE_READAHEAD	8
+// Requests this long go straight to the card instead of through the cache
+#define SECTORCACHE_BYPASS		8
+// Longest run of dirty sectors written back with one command
+#define SECTORCACHE_STAGING		16
+
+struct SSectorCacheStats
+{
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t readahead;		// Sectors brought in ahead of use
+	uint32_t bypass;		// Sectors of large requests that skipped the cache
+	uint32_t writebacks;	// Dirty sectors written to the card
+	uint32_t writeruns;		// Write commands used for the above
+};
+
+void SectorCacheInit();
+int SectorCacheRead(uint8_t *buffer, uint32_t sector, uint32_t count);
+int SectorCacheWrite(const uint8_t *buffer, uint32_t sector, uint32_t count);
+// Writes all dirty sectors back, FatFs calls this through CTRL_SYNC on f_sync/f_close
+int SectorCacheFlush();
+struct SSectorCacheStats *SectorCacheGetStats();
@@ -10,6 +10,7 @@
 #include "basesystem.h"
 #include "apu.h"
 #include "core.h"
+#include "task.h"
 #include <stdlib.h>
 
 volatile uint32_t *IO_AUDIOOUT = (volatile uint32_t* ) DEVICE_APUC;
@@ -70,3 +71,20 @@ void APUSetSampleRate(enum EAPUSampleRate sampleRate)
     *IO_AUDIOOUT = APUCMD_SETRATE;
     *IO_AUDIOOUT = (uint32_t)sampleRate;
 }
+
+/**
+ * @brief Waits for the APU to move on to the next buffer.
+ *
+ * Blocks the calling task until APUFrame() differs from the given frame, which happens
+ * once the APU is done playing the current buffer. Other tasks run in the meantime.
+ *
+ * @param prevFrame The frame returned by APUFrame() when the current buffer was queued.
+ * @return The new frame.
+ */
+uint32_t APUWaitFrame(uint32_t prevFrame)
+{
+    uint32_t currFrame;
+    while ((currFrame = APUFrame()) == prevFrame)
+        TaskWait(TASK_WAIT_APU, 0, 0, prevFrame);
+    return currFrame;
+}
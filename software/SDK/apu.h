@@ -26,3 +26,4 @@ void APUStartDMA(uint32_t audioBufferAddress16byteAligned);
 void APUSetSampleRate(enum EAPUSampleRate sampleRate);
 
 inline uint32_t APUFrame() { return *IO_AUDIOOUT; }
+uint32_t APUWaitFrame(uint32_t prevFrame);
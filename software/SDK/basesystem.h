@@ -20,12 +20,22 @@
 #define CSR_CPURESET					0xFEE
 #define CSR_WATERMARK					0xFF0
 #define CSR_PROGRAMCOUNTER				0xFFC
+// The ISR saves registers into the shadow window (PC in place of register zero),
+// which shows the register bank selected by CSR_REGISTERBANK. Banks are stored at CSR_REGISTERBANKS, 32 words each.
+#define CSR_REGISTERSHADOW				0x8A0
+#define CSR_REGISTERBANK				0x8C0
+#define CSR_REGISTERBANKS				0x400
+#define REGISTER_BANK_COUNT				32
 
 // Physical address map for no-MMU raw mode at boot time
 #define APPMEM_START					0x00000000 // Top of RAM
 #define HEAP_START						0x00001000 // Application heap starts here
 // 240 MBytes of application space
 #define HEAP_END						0x0F000000 // Executable heap space above this, we try not to cross this boundary into task stack space
+// Top 16 MBytes of application space is where position independent executables started on HART#1 live,
+// with their stack at the very end of it
+#define BACKGROUND_APP_START			0x0E000000
+#define BACKGROUND_APP_STACK_SIZE		0x00040000
 
 // Console buffers
 #define CONSOLE_FRAMEBUFFER_START		0x0F100000 // Console framebuffer == 0x4B000 bytes max at 640*480 resolution, has to be 64K aligned
@@ -43,7 +53,8 @@
 #define KERNEL_GFX_CONTEXT				0x0F160000 // Kernel terminal graphics context (4096 bytes with free space for future use)
 #define KERNEL_INPUTBUFFER				0x0F161000 // Input data buffer for keyboard and joystick (4096 bytes)
 #define KERNEL_DEVICECONTROL			0x0F162000 // Device control blocks (4096 bytes)
-#define KERNEL_NOMANSLAND				0x0F163000 // Kernel reserved space (~16 MBytes)
+#define KERNEL_SECTORCACHE				0x0F163000 // SD card sector cache, tags, write staging and 256 Kbytes of sectors (278528 bytes)
+#define KERNEL_NOMANSLAND				0x0F1A7000 // Kernel reserved space (~16 MBytes)
 // Task stack space
 #define TASKMEM_END_STACK_END			0x0FFD0000 // Tasks stack space above this (832 KBytes)
 //  Kernel stacks for all cores, 256 bytes each
@@ -61,7 +72,7 @@
 #define DEVICE_BASE 0x80000000
 
 // Each device has 64 Kbytes of uncached memory space mapped to it
-// - Mailbox device only implements 16 Kbytes of memory (lower half of address space)
+// - Mailbox device only implements 16 Kbytes of memory (lower half of address space) and 64 atomic slots at +0x8000
 // - CSR devices only implement 4 Kbytes of memory and is not byte addressable
 // - UART and most devices with a FIFO only implement about 16 bytes of physical memory for data and status registers
 // - Scratchpad device implements a 16 Kbytes region of memory (lower half of address space)
@@ -16,23 +16,36 @@
 
 #if defined(BUILDING_ROM)
 
-// TODO: __heap_start should be set to __bss_end and __heap_end to __heap_start+__heap_size for loaded executables
-// This also means we have to get rid of any addresses between bss and heap as they might get overwritten
-static uint8_t* __heap_start = (uint8_t*)HEAP_START;
-static uint8_t* __heap_end = (uint8_t*)HEAP_END;
-static uint8_t* __breakpos = (uint8_t*)HEAP_START;
+// Each loaded executable has its own heap, tasks it starts share it with brk()
+// Heap 0 belongs to the foreground program, heap 1 to the one started on HART#1
+struct SCoreHeap
+{
+	uint8_t* start;
+	uint8_t* end;
+	uint8_t* breakpos;
+};
+
+static struct SCoreHeap s_heaps[CORE_MAX_HEAPS] = {
+	{ (uint8_t*)HEAP_START, (uint8_t*)BACKGROUND_APP_START, (uint8_t*)HEAP_START },
+	{ (uint8_t*)BACKGROUND_APP_START, (uint8_t*)BACKGROUND_APP_START, (uint8_t*)BACKGROUND_APP_START } };
 
 /**
- * @brief Sets the ELF heap to the provided address.
+ * @brief Sets the ELF heap range for a given heap.
  *
- * This function sets the start of the heap to the provided address.
+ * This function sets the start and end of the heap, and resets its break position to the start.
  *
- * @param heaptop The top address of the heap.
+ * @param heapid The heap to set up.
+ * @param heaptop The top address of the heap, usually the end of the executable's BSS.
+ * @param heapend The address the heap can grow up to.
  */
-void set_elf_heap(uint32_t heaptop)
+void set_elf_heap(uint32_t heapid, uint32_t heaptop, uint32_t heapend)
 {
-	__breakpos = (uint8_t*)heaptop;
-	__heap_start = (uint8_t*)heaptop;
+	if (heapid >= CORE_MAX_HEAPS)
+		return;
+
+	s_heaps[heapid].breakpos = (uint8_t*)heaptop;
+	s_heaps[heapid].start = (uint8_t*)heaptop;
+	s_heaps[heapid].end = (uint8_t*)heapend;
 }
 
 /**
@@ -40,11 +53,16 @@ void set_elf_heap(uint32_t heaptop)
  *
  * This function returns the amount of available memory by subtracting the current break position from the end of the heap.
  *
+ * @param heapid The heap to query.
+ * 
  * @return The amount of available memory.
  */
-uint32_t core_memavail()
+uint32_t core_memavail(uint32_t heapid)
 {
-	return (uint32_t)(__heap_end - __breakpos);
+	if (heapid >= CORE_MAX_HEAPS)
+		return 0;
+
+	return (uint32_t)(s_heaps[heapid].end - s_heaps[heapid].breakpos);
 }
 
 /**
@@ -54,28 +72,37 @@ uint32_t core_memavail()
  * The break position is aligned to the next multiple of 4 bytes.
  * If the provided address is out of bounds, the function sets errno to ENOMEM and returns -1.
  *
+ * @param heapid The heap of the calling task.
  * @param brkptr The new memory break position.
  * 
  * @return 0 on success, -1 on failure.
  */
-uint32_t core_brk(uint32_t brkptr)
+uint32_t core_brk(uint32_t heapid, uint32_t brkptr)
 {
+	if (heapid >= CORE_MAX_HEAPS)
+	{
+		errno = ENOMEM;
+		return 0xFFFFFFFF;
+	}
+
+	struct SCoreHeap *heap = &s_heaps[heapid];
+
 	// Address set to zero will query current break position
 	if (brkptr == 0)
-		return (uint32_t)__breakpos;
+		return (uint32_t)heap->breakpos;
 
 	// NOTE: The break address is aligned to the next multiple of 4 bytes
 	uint32_t alignedbrk = E32AlignUp(brkptr, 4);
 
 	// Out of bounds will return all ones (-1)
-	if (alignedbrk<(uint32_t)__heap_start || alignedbrk>(uint32_t)__heap_end)
+	if (alignedbrk<(uint32_t)heap->start || alignedbrk>(uint32_t)heap->end)
 	{
 		errno = ENOMEM;
 		return 0xFFFFFFFF;
 	}
 
 	// Set new break position and return 0 (success) in all other cases
-	__breakpos = (uint8_t*)alignedbrk;
+	heap->breakpos = (uint8_t*)alignedbrk;
 	return 0;
 }
 
@@ -155,7 +182,7 @@ int chdir(const char *path)
  */
 int _brk(void *addr)
 {
-	return core_brk((uint32_t)addr);
+	return core_brk(0, (uint32_t)addr);
 }
 #else
 /** @brief Set the break position of the heap.
@@ -7,10 +7,13 @@
 
 #if defined(BUILDING_ROM)
 
+// Foreground program and background program on HART#1
+#define CORE_MAX_HEAPS 2
+
 // syscall handlers for ROM
-uint32_t core_brk(uint32_t brkptr);
-uint32_t core_memavail();
-void set_elf_heap(uint32_t heaptop);
+uint32_t core_brk(uint32_t heapid, uint32_t brkptr);
+uint32_t core_memavail(uint32_t heapid);
+void set_elf_heap(uint32_t heapid, uint32_t heaptop, uint32_t heapend);
 
 #else // Non-ROM
 
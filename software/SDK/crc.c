@@ -0,0 +1,201 @@
+/**
+ * @file crc.c
+ *
+ * @brief Checksums for the SD card traffic, with bitwise, bytewise and table driven variants
+ */
+
+#include "crc.h"
+
+static uint16_t s_defaultTables[8*256 + 128];
+static uint16_t *s_crc16Table = 0;
+static uint8_t *s_crc7Table = 0;
+static uint32_t s_crc32Table[256];
+static uint32_t s_crc32TableReady = 0;
+
+/**
+ * @brief Build the CRC lookup tables
+ *
+ * Table k of the CRC16 tables holds the CRC contribution of a byte followed by k zero bytes,
+ * table 0 being the plain bytewise table. The CRC7 table follows the CRC16 tables.
+ *
+ * @param location Where to store the tables, CRC_TABLE_SIZE bytes aligned to 4 bytes, or 0 for regular memory
+ */
+void CRCInitTables(void *location)
+{
+	uint16_t *crc16Table = location ? (uint16_t*)location : s_defaultTables;
+	uint8_t *crc7Table = (uint8_t*)(crc16Table + 8*256);
+
+	for (uint32_t i=0; i<256; ++i)
+	{
+		uint16_t crc = i << 8;
+		for (uint32_t j=0; j<8; ++j)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		crc16Table[i] = crc;
+	}
+
+	for (uint32_t k=1; k<8; ++k)
+	{
+		for (uint32_t i=0; i<256; ++i)
+		{
+			uint16_t prev = crc16Table[(k-1)*256 + i];
+			crc16Table[k*256 + i] = (prev << 8) ^ crc16Table[prev >> 8];
+		}
+	}
+
+	// CRC7 is kept in the upper 7 bits so each step is a single lookup
+	for (uint32_t i=0; i<256; ++i)
+	{
+		uint8_t crc = i;
+		for (uint32_t j=0; j<8; ++j)
+			crc = (crc & 0x80) ? (crc << 1) ^ (0x09 << 1) : (crc << 1);
+		crc7Table[i] = crc;
+	}
+
+	s_crc7Table = crc7Table;
+	s_crc16Table = crc16Table;
+}
+
+/**
+ * @brief Calculate the CRC16 checksum one bit at a time
+ *
+ * @param data Data buffer
+ * @param len Length of the data buffer
+ * @return CRC16 checksum
+ */
+uint16_t CRC16Bitwise(const uint8_t *data, uint32_t len)
+{
+	uint16_t crc = 0;
+	while (len--)
+	{
+		crc ^= (*data++) << 8;
+		for (uint32_t j=0; j<8; ++j)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return crc;
+}
+
+/**
+ * @brief Calculate the CRC16 checksum one byte at a time with shifts and XORs
+ *
+ * @param data Data buffer
+ * @param len Length of the data buffer
+ * @return CRC16 checksum
+ */
+uint16_t CRC16Bytewise(const uint8_t *data, uint32_t len)
+{
+	uint16_t crc = 0;
+	while (len--)
+	{
+		crc  = (uint8_t)(crc >> 8)|(crc << 8);
+		crc ^= *data++;
+		crc ^= (uint8_t)(crc & 0xff) >> 4;
+		crc ^= (crc << 8) << 4;
+		crc ^= ((crc & 0xff) << 4) << 1;
+	}
+	return crc;
+}
+
+/**
+ * @brief Calculate the CRC16 checksum with one table lookup per byte
+ *
+ * @param data Data buffer
+ * @param len Length of the data buffer
+ * @return CRC16 checksum
+ */
+uint16_t CRC16Table(const uint8_t *data, uint32_t len)
+{
+	if (!s_crc16Table)
+		CRCInitTables(0);
+
+	const uint16_t *table = s_crc16Table;
+	uint16_t crc = 0;
+	while (len--)
+		crc = (crc << 8) ^ table[(crc >> 8) ^ *data++];
+	return crc;
+}
+
+/**
+ * @brief Calculate the CRC16 checksum eight bytes at a time
+ *
+ * The eight lookups of a step don't depend on each other, only the XOR
+ * that combines them does, which keeps the pipeline busy.
+ *
+ * @param data Data buffer
+ * @param len Length of the data buffer
+ * @return CRC16 checksum
+ */
+uint16_t CRC16Slice8(const uint8_t *data, uint32_t len)
+{
+	if (!s_crc16Table)
+		CRCInitTables(0);
+
+	const uint16_t *table = s_crc16Table;
+	uint16_t crc = 0;
+	while (len >= 8)
+	{
+		crc = table[7*256 + (data[0] ^ (crc >> 8))] ^
+			table[6*256 + (data[1] ^ (crc & 0xff))] ^
+			table[5*256 + data[2]] ^
+			table[4*256 + data[3]] ^
+			table[3*256 + data[4]] ^
+			table[2*256 + data[5]] ^
+			table[1*256 + data[6]] ^
+			table[data[7]];
+		data += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = (crc << 8) ^ table[(crc >> 8) ^ *data++];
+	return crc;
+}
+
+/**
+ * @brief Calculate the CRC7 checksum for a given data buffer
+ *
+ * @param data Data buffer
+ * @param len Length of the data buffer
+ * @return CRC7 checksum in the upper 7 bits, with the end bit set
+ */
+uint8_t CRC7(const uint8_t *data, uint32_t len)
+{
+	if (!s_crc7Table)
+		CRCInitTables(0);
+
+	const uint8_t *table = s_crc7Table;
+	uint8_t crc = 0;
+	while (len--)
+		crc = table[crc ^ *data++];
+	return crc | 1;
+}
+
+/**
+ * @brief Calculate the CRC32 checksum with one table lookup per byte
+ *
+ * Uses the reflected 0xEDB88320 polynomial with inverted initial and final values, so results
+ * match zlib's crc32() and the host tools.
+ *
+ * @param crc Result of the previous call when continuing a checksum, 0 for new data
+ * @param data Data buffer
+ * @param len Length of the data buffer
+ * @return CRC32 checksum
+ */
+uint32_t CRC32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	if (!s_crc32TableReady)
+	{
+		for (uint32_t i=0; i<256; ++i)
+		{
+			uint32_t c = i;
+			for (uint32_t j=0; j<8; ++j)
+				c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : (c >> 1);
+			s_crc32Table[i] = c;
+		}
+		s_crc32TableReady = 1;
+	}
+
+	crc = ~crc;
+	while (len--)
+		crc = (crc >> 8) ^ s_crc32Table[(crc ^ *data++) & 0xff];
+	return ~crc;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CRC16-CCITT (polynomial 0x1021, zero initial value) as used for SD data blocks,
+// and CRC7 as used for SD commands. All CRC16 variants produce the same result.
+
+// Reference versions, no tables
+uint16_t CRC16Bitwise(const uint8_t *data, uint32_t len);
+uint16_t CRC16Bytewise(const uint8_t *data, uint32_t len);
+
+// One lookup per byte from a 512 byte table
+uint16_t CRC16Table(const uint8_t *data, uint32_t len);
+// Eight bytes per step from eight tables, 4 Kbytes in total
+uint16_t CRC16Slice8(const uint8_t *data, uint32_t len);
+
+// Returns the 7 bit CRC shifted up by one with the end bit set, ready to send as the last command byte
+uint8_t CRC7(const uint8_t *data, uint32_t len);
+
+// CRC-32 (IEEE 802.3, same as zlib), pass 0 to start and the previous result to continue over more data.
+// Keeps its own 1 Kbyte table in regular memory, built on first use.
+uint32_t CRC32(uint32_t crc, const uint8_t *data, uint32_t len);
+
+// Size of the memory CRCInitTables needs
+#define CRC_TABLE_SIZE (8*256*sizeof(uint16_t) + 256)
+
+// Builds the lookup tables at the given location, which needs CRC_TABLE_SIZE bytes aligned to 4 bytes.
+// Pass (void*)E32GetScratchpad() or an offset into it to keep the tables in scratchpad memory.
+// When not called, the tables get built in regular memory on first use.
+void CRCInitTables(void *location);
+
+#ifdef __cplusplus
+}
+#endif
@@ -13,6 +13,19 @@
 #define PT_LOPROC	0x70000000	/* Processor-specific */
 #define PT_HIPROC	0x7FFFFFFF	/* Processor-specific */
 
+#define ET_EXEC		2		/* Executable file */
+#define ET_DYN		3		/* Shared object or position independent executable */
+
+#define DT_NULL		0		/* Marks end of dynamic section */
+#define DT_SYMTAB	6		/* Address of symbol table */
+#define DT_RELA		7		/* Address of Rela relocs */
+#define DT_RELASZ	8		/* Total size of Rela relocs */
+#define DT_RELAENT	9		/* Size of one Rela reloc */
+
+#define R_RISCV_NONE		0	/* No relocation */
+#define R_RISCV_32			1	/* Symbol value plus addend */
+#define R_RISCV_RELATIVE	3	/* Load base plus addend */
+
 #pragma pack(push,1)
 struct SElfFileHeader32
 {
@@ -61,4 +74,24 @@ struct SElfSectionHeader32
     unsigned int m_AddrAlign;
     unsigned int m_EntSize;
 };
+struct SElfDynamic32
+{
+    int m_Tag;
+    unsigned int m_Val;
+};
+struct SElfRela32
+{
+    unsigned int m_Offset;      // Location to patch, relative to load base
+    unsigned int m_Info;        // Symbol index in upper 24 bits, relocation type in lower 8 bits
+    int m_Addend;
+};
+struct SElfSymbol32
+{
+    unsigned int m_Name;
+    unsigned int m_Value;
+    unsigned int m_Size;
+    unsigned char m_Info;
+    unsigned char m_Other;
+    unsigned short m_Shndx;     // Zero for undefined symbols
+};
 #pragma pack(pop)
@@ -109,3 +109,13 @@ uint32_t __attribute__ ((noinline)) KeyRingBufferWrite( const void* pvSrc, const
 
     return 1;
 }
+
+/**
+ * @brief Number of bytes waiting in the ring buffer
+ * 
+ * @return Number of bytes that can be read
+ */
+uint32_t __attribute__ ((noinline)) KeyRingBufferCount()
+{
+    return *m_writeOffset - *m_readOffset;
+}
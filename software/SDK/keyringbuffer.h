@@ -4,3 +4,4 @@
 void KeyRingBufferReset();
 uint32_t KeyRingBufferRead(void* pvDest, const uint32_t cbDest);
 uint32_t KeyRingBufferWrite(const void* pvSrc, const uint32_t cbSrc);
+uint32_t KeyRingBufferCount();
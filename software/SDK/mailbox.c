@@ -0,0 +1,138 @@
+/**
+ * @file mailbox.c
+ *
+ * @brief Atomic register block of the mailbox device and spin locks built on it
+ *
+ * The cores have no A extension, so these are the only read-modify-write operations that
+ * can't be torn apart by the other HART. The operation is selected by the address used to
+ * access a slot, see axi4mail.sv.
+ */
+
+#include "mailbox.h"
+
+#define ATOMIC_OP_LOAD			0
+#define ATOMIC_OP_TESTANDSET	1
+#define ATOMIC_OP_FETCHINC		2
+#define ATOMIC_OP_FETCHDEC		3
+#define ATOMIC_OP_FETCHADD		4
+
+static inline volatile uint32_t *AtomicAddress(const uint32_t _op, const uint32_t _slot)
+{
+	return (volatile uint32_t *)(MAILBOX_ATOMICS + (_op << 8) + ((_slot & (ATOMIC_SLOT_COUNT - 1)) << 2));
+}
+
+/**
+ * @brief Read the value of an atomic slot
+ *
+ * @param _slot Slot index, 0..ATOMIC_SLOT_COUNT-1
+ * @return Current value
+ */
+uint32_t AtomicLoad(const uint32_t _slot)
+{
+	return *AtomicAddress(ATOMIC_OP_LOAD, _slot);
+}
+
+/**
+ * @brief Overwrite the value of an atomic slot
+ *
+ * @param _slot Slot index, 0..ATOMIC_SLOT_COUNT-1
+ * @param _value New value
+ */
+void AtomicStore(const uint32_t _slot, const uint32_t _value)
+{
+	*AtomicAddress(ATOMIC_OP_LOAD, _slot) = _value;
+}
+
+/**
+ * @brief Set an atomic slot to 1 and return what it held before
+ *
+ * @param _slot Slot index, 0..ATOMIC_SLOT_COUNT-1
+ * @return Previous value, zero means the caller was the one to set it
+ */
+uint32_t AtomicTestAndSet(const uint32_t _slot)
+{
+	return *AtomicAddress(ATOMIC_OP_TESTANDSET, _slot);
+}
+
+/**
+ * @brief Increment an atomic slot and return what it held before
+ *
+ * @param _slot Slot index, 0..ATOMIC_SLOT_COUNT-1
+ * @return Previous value
+ */
+uint32_t AtomicFetchIncrement(const uint32_t _slot)
+{
+	return *AtomicAddress(ATOMIC_OP_FETCHINC, _slot);
+}
+
+/**
+ * @brief Decrement an atomic slot and return what it held before
+ *
+ * @param _slot Slot index, 0..ATOMIC_SLOT_COUNT-1
+ * @return Previous value
+ */
+uint32_t AtomicFetchDecrement(const uint32_t _slot)
+{
+	return *AtomicAddress(ATOMIC_OP_FETCHDEC, _slot);
+}
+
+/**
+ * @brief Add a value to an atomic slot
+ *
+ * The previous value isn't returned, use AtomicFetchIncrement / AtomicFetchDecrement for counters that need it.
+ *
+ * @param _slot Slot index, 0..ATOMIC_SLOT_COUNT-1
+ * @param _value Value to add, wraps around
+ */
+void AtomicAdd(const uint32_t _slot, const uint32_t _value)
+{
+	*AtomicAddress(ATOMIC_OP_FETCHADD, _slot) = _value;
+}
+
+/**
+ * @brief Put a spin lock into unlocked state
+ *
+ * @param _slot Atomic slot the lock lives in
+ */
+void SpinLockInit(const uint32_t _slot)
+{
+	AtomicStore(_slot, 0);
+}
+
+/**
+ * @brief Acquire a spin lock, waiting as long as it takes
+ *
+ * Waiting is done with plain loads so the test-and-set only goes out once the lock looks free.
+ * The timer interrupt stays enabled, keep the locked section short or wrap it in
+ * E32BeginCriticalSection / E32EndCriticalSection if the holder must not be switched out.
+ *
+ * @param _slot Atomic slot the lock lives in
+ */
+void SpinLock(const uint32_t _slot)
+{
+	while (AtomicTestAndSet(_slot))
+	{
+		while (AtomicLoad(_slot)) { }
+	}
+}
+
+/**
+ * @brief Try to acquire a spin lock once
+ *
+ * @param _slot Atomic slot the lock lives in
+ * @return 1 if the lock was acquired, 0 if someone else holds it
+ */
+int SpinTryLock(const uint32_t _slot)
+{
+	return AtomicTestAndSet(_slot) == 0 ? 1 : 0;
+}
+
+/**
+ * @brief Release a spin lock
+ *
+ * @param _slot Atomic slot the lock lives in
+ */
+void SpinUnlock(const uint32_t _slot)
+{
+	AtomicStore(_slot, 0);
+}
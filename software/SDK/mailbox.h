@@ -0,0 +1,31 @@
+#pragma once
+
+#include <inttypes.h>
+#include "basesystem.h"
+
+// Mailbox device layout (uncached, shared by all HARTs):
+// DEVICE_MAIL+0x0000 task contexts, then the key and serial input ring buffers
+// DEVICE_MAIL+0x2000 8 Kbytes free for HART to HART message queues
+// DEVICE_MAIL+0x8000 atomic register block
+#define MAILBOX_USER_MEMORY (DEVICE_MAIL + 0x2000)
+#define MAILBOX_USER_MEMORY_SIZE 0x2000
+#define MAILBOX_ATOMICS (DEVICE_MAIL + 0x8000)
+
+// The atomic register block has 64 word sized slots, each access to a slot is a single
+// indivisible bus transaction, which is what makes them usable across HARTs.
+// Slots below ATOMIC_SLOT_USER_FIRST are reserved for the OS.
+#define ATOMIC_SLOT_COUNT 64
+#define ATOMIC_SLOT_USER_FIRST 8
+
+uint32_t AtomicLoad(const uint32_t _slot);
+void AtomicStore(const uint32_t _slot, const uint32_t _value);
+uint32_t AtomicTestAndSet(const uint32_t _slot);
+uint32_t AtomicFetchIncrement(const uint32_t _slot);
+uint32_t AtomicFetchDecrement(const uint32_t _slot);
+void AtomicAdd(const uint32_t _slot, const uint32_t _value);
+
+// Spin locks on top of test-and-set, zero is unlocked
+void SpinLockInit(const uint32_t _slot);
+void SpinLock(const uint32_t _slot);
+int SpinTryLock(const uint32_t _slot);
+void SpinUnlock(const uint32_t _slot);
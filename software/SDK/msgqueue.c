@@ -0,0 +1,191 @@
+/**
+ * @file msgqueue.c
+ *
+ * @brief Bounded message queues for HART to HART communication
+ *
+ * MQ_SPSC is a plain ring buffer, each index has a single writer and uncached stores from one
+ * HART reach the mailbox in program order, so the message is always in place before the index moves.
+ *
+ * MQ_MPMC hands out push and pop tickets from the atomic register block. Every message word has a
+ * sequence word next to it that tells whose turn it is: ticket t may push when the sequence equals t,
+ * and may pop when it equals t+1. Without compare-and-swap a ticket can't be handed back, so taking one
+ * commits the caller to wait for its turn and only the blocking calls are available for this type.
+ */
+
+#include "msgqueue.h"
+
+struct SMessageCell
+{
+	uint32_t sequence;
+	uint32_t message;
+};
+
+static inline volatile uint32_t *SPSCMessages(struct SMessageQueue *_queue)
+{
+	return (volatile uint32_t *)(_queue + 1);
+}
+
+static inline volatile struct SMessageCell *MPMCCells(struct SMessageQueue *_queue)
+{
+	return (volatile struct SMessageCell *)(_queue + 1);
+}
+
+/**
+ * @brief Memory needed for a message queue
+ *
+ * @param _type Queue type
+ * @param _capacity Number of messages the queue can hold
+ * @return Size in bytes, including the queue header
+ */
+uint32_t MQMemorySize(const enum EMessageQueueType _type, const uint32_t _capacity)
+{
+	uint32_t cellSize = _type == MQ_MPMC ? sizeof(struct SMessageCell) : sizeof(uint32_t);
+	return sizeof(struct SMessageQueue) + _capacity * cellSize;
+}
+
+/**
+ * @brief Set up an empty message queue
+ *
+ * The memory has to be uncached and visible to all users of the queue, such as MAILBOX_USER_MEMORY
+ * or the scratchpad, and at least MQMemorySize() bytes long. Only one HART should call this,
+ * before anyone starts using the queue.
+ *
+ * @param _memory Where to place the queue
+ * @param _type Queue type
+ * @param _capacity Number of messages the queue can hold, has to be a power of two
+ * @param _ticketSlot First of the two atomic slots an MQ_MPMC queue uses, ignored for MQ_SPSC
+ * @return The queue, or 0 if the capacity isn't a power of two
+ */
+struct SMessageQueue *MQCreate(void *_memory, const enum EMessageQueueType _type, const uint32_t _capacity, const uint32_t _ticketSlot)
+{
+	if (_capacity == 0 || (_capacity & (_capacity - 1)) != 0)
+		return 0;
+
+	volatile struct SMessageQueue *queue = (volatile struct SMessageQueue *)_memory;
+	queue->type = _type;
+	queue->capacity = _capacity;
+	queue->mask = _capacity - 1;
+	queue->head = 0;
+	queue->tail = 0;
+	queue->ticketSlot = _ticketSlot;
+
+	if (_type == MQ_MPMC)
+	{
+		volatile struct SMessageCell *cells = MPMCCells((struct SMessageQueue *)_memory);
+		for (uint32_t i = 0; i < _capacity; ++i)
+		{
+			cells[i].sequence = i;
+			cells[i].message = 0;
+		}
+		AtomicStore(_ticketSlot, 0);
+		AtomicStore(_ticketSlot + 1, 0);
+	}
+
+	return (struct SMessageQueue *)_memory;
+}
+
+/**
+ * @brief Push a message unless the queue is full
+ *
+ * @param _queue An MQ_SPSC queue, only ever pushed to by one task
+ * @param _message Message to push
+ * @return 1 if the message was pushed, 0 if the queue was full or isn't an MQ_SPSC queue
+ */
+int MQTryPush(struct SMessageQueue *_queue, const uint32_t _message)
+{
+	volatile struct SMessageQueue *queue = _queue;
+	if (queue->type != MQ_SPSC)
+		return 0;
+
+	uint32_t head = queue->head;
+	if (head - queue->tail == queue->capacity)
+		return 0;
+
+	SPSCMessages(_queue)[head & queue->mask] = _message;
+	queue->head = head + 1;
+	return 1;
+}
+
+/**
+ * @brief Pop a message if there is one
+ *
+ * @param _queue An MQ_SPSC queue, only ever popped from by one task
+ * @param _message Receives the message
+ * @return 1 if a message was popped, 0 if the queue was empty or isn't an MQ_SPSC queue
+ */
+int MQTryPop(struct SMessageQueue *_queue, uint32_t *_message)
+{
+	volatile struct SMessageQueue *queue = _queue;
+	if (queue->type != MQ_SPSC)
+		return 0;
+
+	uint32_t tail = queue->tail;
+	if (tail == queue->head)
+		return 0;
+
+	*_message = SPSCMessages(_queue)[tail & queue->mask];
+	queue->tail = tail + 1;
+	return 1;
+}
+
+/**
+ * @brief Push a message, spinning while the queue is full
+ *
+ * @param _queue Queue to push to
+ * @param _message Message to push
+ */
+void MQPush(struct SMessageQueue *_queue, const uint32_t _message)
+{
+	if (_queue->type == MQ_SPSC)
+	{
+		while (!MQTryPush(_queue, _message)) { }
+		return;
+	}
+
+	uint32_t ticket = AtomicFetchIncrement(_queue->ticketSlot);
+	volatile struct SMessageCell *cell = &MPMCCells(_queue)[ticket & _queue->mask];
+	while (cell->sequence != ticket) { }
+	cell->message = _message;
+	cell->sequence = ticket + 1;
+}
+
+/**
+ * @brief Pop a message, spinning while the queue is empty
+ *
+ * @param _queue Queue to pop from
+ * @return The message
+ */
+uint32_t MQPop(struct SMessageQueue *_queue)
+{
+	uint32_t message;
+	if (_queue->type == MQ_SPSC)
+	{
+		while (!MQTryPop(_queue, &message)) { }
+		return message;
+	}
+
+	uint32_t ticket = AtomicFetchIncrement(_queue->ticketSlot + 1);
+	volatile struct SMessageCell *cell = &MPMCCells(_queue)[ticket & _queue->mask];
+	while (cell->sequence != ticket + 1) { }
+	message = cell->message;
+	// Hand the cell to the push ticket one lap ahead
+	cell->sequence = ticket + _queue->capacity;
+	return message;
+}
+
+/**
+ * @brief Number of messages in the queue
+ *
+ * @param _queue Queue to look at
+ * @return Messages pushed but not popped yet, zero while consumers are waiting on an empty queue
+ */
+uint32_t MQCount(struct SMessageQueue *_queue)
+{
+	volatile struct SMessageQueue *queue = _queue;
+	int32_t count;
+	if (queue->type == MQ_SPSC)
+		count = (int32_t)(queue->head - queue->tail);
+	else
+		count = (int32_t)(AtomicLoad(queue->ticketSlot) - AtomicLoad(queue->ticketSlot + 1));
+	return count < 0 ? 0 : (uint32_t)count;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <inttypes.h>
+#include "mailbox.h"
+
+// Bounded queues of 32 bit messages for HART to HART communication.
+// Queues have to live in uncached memory (MAILBOX_USER_MEMORY or the scratchpad) so both HARTs see the same contents.
+enum EMessageQueueType
+{
+	MQ_SPSC,	// One producer and one consumer, needs no atomic slots
+	MQ_MPMC,	// Any number of producers and consumers, takes two atomic slots for its tickets
+};
+
+struct SMessageQueue
+{
+	uint32_t type;			// EMessageQueueType
+	uint32_t capacity;		// Message count, power of two
+	uint32_t mask;			// capacity-1
+	uint32_t head;			// MQ_SPSC: messages pushed so far, only written by the producer
+	uint32_t tail;			// MQ_SPSC: messages popped so far, only written by the consumer
+	uint32_t ticketSlot;	// MQ_MPMC: atomic slot of the push ticket, the pop ticket is the next slot
+	// Message storage follows, one word per message for MQ_SPSC, sequence and message words for MQ_MPMC
+};
+
+// Bytes needed for a queue of the given type and capacity, including the header
+uint32_t MQMemorySize(const enum EMessageQueueType _type, const uint32_t _capacity);
+// Sets up a queue at _memory, _capacity has to be a power of two, _ticketSlot is ignored for MQ_SPSC
+struct SMessageQueue *MQCreate(void *_memory, const enum EMessageQueueType _type, const uint32_t _capacity, const uint32_t _ticketSlot);
+
+// Non blocking, return 1 on success and 0 if the queue was full / empty. MQ_SPSC only.
+int MQTryPush(struct SMessageQueue *_queue, const uint32_t _message);
+int MQTryPop(struct SMessageQueue *_queue, uint32_t *_message);
+
+// Spin until there's room / a message
+void MQPush(struct SMessageQueue *_queue, const uint32_t _message);
+uint32_t MQPop(struct SMessageQueue *_queue);
+
+// Messages waiting, only a snapshot while others are pushing or popping
+uint32_t MQCount(struct SMessageQueue *_queue);
@@ -7,12 +7,15 @@
 #include "basesystem.h"
 #include "sdcard.h"
 #include "leds.h"
+#include "crc.h"
 #include <stdio.h>
 
 #define MAX_SDCARD_WRITE_ATTEMPTS 512
 
 volatile uint8_t *IO_SPIRXTX = (volatile uint8_t* ) DEVICE_SPIC; // SPI read/write port
 volatile uint8_t *IO_CARDDETECT = (volatile uint8_t* ) (DEVICE_SPIC+4); // SDCard insert/remove detect
+volatile uint32_t *IO_SPIBURSTLEN = (volatile uint32_t* ) (DEVICE_SPIC+8); // Number of idle bytes to clock for a burst read
+volatile uint32_t *IO_SPIBURSTDATA = (volatile uint32_t* ) (DEVICE_SPIC+12); // Four bytes of burst data per access
 
 typedef enum {
     CMD_NOT_SUPPORTED = -1,             /**< Command not supported error */
@@ -56,67 +59,81 @@ typedef enum {
 
 #define G_SPI_TIMEOUT 65536
 
+// Off by default, the checksum costs time on every block read
+static int s_readCRCCheck = 0;
+
 /**
- * @brief Calculate the CRC7 checksum for a given data buffer
+ * @brief Perform a SPI transaction
  * 
- * @param data Data buffer
- * @param n Length of the data buffer
- * @return CRC7 checksum
+ * This function performs a SPI transaction by writing a byte to the SPI slave and reading a byte from the SPI slave.
+ * 
+ * @param outbyte Byte to write
+ * @return Byte read from the SPI slave
  */
-static uint8_t CRC7(const uint8_t* data, uint8_t n) {
-  uint8_t crc = 0;
-  for (uint8_t i = 0; i < n; i++) {
-    uint8_t d = data[i];
-    for (uint8_t j = 0; j < 8; j++) {
-      crc <<= 1;
-      if ((d & 0x80) ^ (crc & 0x80)) {
-        crc ^= 0x09;
-      }
-      d <<= 1;
-    }
-  }
-  return (crc << 1) | 1;
-}
-
-uint16_t CRC16_one(uint16_t crcIn, uint8_t data)
+uint8_t __attribute__ ((noinline)) SPITxRx(const uint8_t outbyte)
 {
-	crcIn  = (uint8_t)(crcIn >> 8)|(crcIn << 8);
-	crcIn ^=  data;
-	crcIn ^= (uint8_t)(crcIn & 0xff) >> 4;
-	crcIn ^= (crcIn << 8) << 4;
-	crcIn ^= ((crcIn & 0xff) << 4) << 1;
-
-	return crcIn;
+   *IO_SPIRXTX = outbyte;
+   return *IO_SPIRXTX;
 }
 
 /**
- * @brief Calculate the CRC16 checksum for a given data buffer
+ * @brief Read a run of bytes in one SPI burst
  * 
- * @param pData Data buffer
- * @param len Length of the data buffer
- * @return CRC16 checksum
+ * The controller clocks out len idle bytes by itself, and the received bytes are
+ * collected four at a time instead of one uncached write/read pair per byte.
+ * 
+ * @param buffer Pointer to store the data, does not need to be word aligned
+ * @param len Number of bytes to read, a multiple of 4 up to SPI_BURST_MAX
  */
-static uint16_t CRC16(const uint8_t *pData, uint16_t len)
+void __attribute__ ((noinline)) SPIBurstRead(uint8_t *buffer, const uint32_t len)
 {
-	uint16_t crc = 0;
-
-	while (len--) crc = CRC16_one(crc,*pData++);
+   *IO_SPIBURSTLEN = len;
 
-	return crc;
+   uint32_t count = len>>2;
+   if (((uint32_t)buffer & 3) == 0)
+   {
+      uint32_t *target = (uint32_t*)buffer;
+      for (uint32_t i=0; i<count; ++i)
+         target[i] = *IO_SPIBURSTDATA;
+   }
+   else
+   {
+      for (uint32_t i=0; i<count; ++i)
+      {
+         uint32_t word = *IO_SPIBURSTDATA;
+         *buffer++ = word;
+         *buffer++ = word >> 8;
+         *buffer++ = word >> 16;
+         *buffer++ = word >> 24;
+      }
+   }
 }
 
 /**
- * @brief Perform a SPI transaction
+ * @brief Write a run of bytes in one SPI burst
  * 
- * This function performs a SPI transaction by writing a byte to the SPI slave and reading a byte from the SPI slave.
+ * Sends four bytes per uncached write, the controller drops the bytes received meanwhile.
  * 
- * @param outbyte Byte to write
- * @return Byte read from the SPI slave
+ * @param buffer Pointer to the data, does not need to be word aligned
+ * @param len Number of bytes to write, a multiple of 4
  */
-uint8_t __attribute__ ((noinline)) SPITxRx(const uint8_t outbyte)
+void __attribute__ ((noinline)) SPIBurstWrite(const uint8_t *buffer, const uint32_t len)
 {
-   *IO_SPIRXTX = outbyte;
-   return *IO_SPIRXTX;
+   uint32_t count = len>>2;
+   if (((uint32_t)buffer & 3) == 0)
+   {
+      const uint32_t *source = (const uint32_t*)buffer;
+      for (uint32_t i=0; i<count; ++i)
+         *IO_SPIBURSTDATA = source[i];
+   }
+   else
+   {
+      for (uint32_t i=0; i<count; ++i)
+      {
+         *IO_SPIBURSTDATA = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (buffer[3] << 24);
+         buffer += 4;
+      }
+   }
 }
 
 /**
@@ -297,11 +314,24 @@ uint8_t __attribute__ ((noinline)) SDSetBlockSize512()
    return response;
 }
 
+/**
+ * @brief Turn data checksum verification on reads on or off
+ * 
+ * With the check on, block reads whose data doesn't match the CRC16 sent by the card fail.
+ * SDReadSingleBlock returns SD_CRC_ERROR for these, SDReadMultipleBlocks returns -1.
+ * 
+ * @param enable Non-zero to check
+ */
+void SDSetReadCRCCheck(const int enable)
+{
+   s_readCRCCheck = enable;
+}
+
 /**
  * @brief Read a single block from the SD card
  * 
  * This function reads a single block from the SD card at given sector.
- * It will read but ignore any checksum errors for now.
+ * Checksum errors are ignored unless enabled with SDSetReadCRCCheck.
  * 
  * @param sector Sector to read
  * @param datablock Pointer to store the data block
@@ -326,14 +356,14 @@ uint8_t __attribute__ ((noinline)) SDReadSingleBlock(uint32_t sector, uint8_t *d
       {
          // Data burst follows
          // 512 bytes of data followed by 16 bit CRC, total of 514 bytes
-         int x=0;
-         do {
-            datablock[x++] = SPITxRx(0xFF);
-         } while(x<512);
+         SPIBurstRead(datablock, 512);
 
          // Checksum
          checksum[0] = SPITxRx(0xFF);
          checksum[1] = SPITxRx(0xFF);
+
+         if (s_readCRCCheck && CRC16Slice8(datablock, 512) != ((checksum[0] << 8) | checksum[1]))
+            response = SD_CRC_ERROR;
       }
    }
 
@@ -346,8 +376,9 @@ uint8_t __attribute__ ((noinline)) SDReadSingleBlock(uint32_t sector, uint8_t *d
  * @brief Read multiple blocks from the SD card
  * 
  * This function reads multiple blocks from the SD card starting at the given block address.
- * However, it will use repeated calls to SDReadSingleBlock to read the blocks, so it is less efficient.
- * Ideally, if the SD card supports CMD18_READ_MULTIPLE_BLOCK command, this function should be modified to use it.
+ * A single block is read with CMD17_READ_SINGLE_BLOCK, longer runs use one CMD18_READ_MULTIPLE_BLOCK
+ * command, which sends the blocks back to back until it's stopped with CMD12_STOP_TRANSMISSION.
+ * This saves the command and response overhead for every block after the first one.
  * 
  * @param datablock Pointer to store the data blocks
  * @param numblocks Number of blocks to read
@@ -359,20 +390,60 @@ int __attribute__ ((noinline)) SDReadMultipleBlocks(uint8_t *datablock, uint32_t
 	if (numblocks == 0)
 		return -1;
 
-	uint32_t cursor = 0;
-
 	uint8_t checksum[2];
 
-	for(uint32_t b=0; b<numblocks; ++b)
+	if (numblocks == 1)
+		return SDReadSingleBlock(blockaddress, datablock, checksum) == SD_START_TOKEN ? 0 : -1;
+
+	uint32_t oldstate = LEDGetState();
+	LEDSetState(oldstate|0x2); // GREEN
+
+	SDCmd(CMD18_READ_MULTIPLE_BLOCK, blockaddress);
+	uint8_t response = SDResponse1(); // R1: expect 0x00
+
+	int failed = 0;
+	if (response == SD_READY)
 	{
-		uint8_t* target = (uint8_t*)(datablock+cursor);
-		uint8_t response = SDReadSingleBlock(b+blockaddress, target, checksum);
-		if (response != SD_START_TOKEN)
-			return -1;
-		cursor += 512;
+		for(uint32_t b=0; b<numblocks; ++b)
+		{
+			// Each block comes with its own start token and checksum
+			response = SDResponse1();
+			if (response != SD_START_TOKEN)
+			{
+				failed = 1;
+				break;
+			}
+
+			SPIBurstRead(datablock + (b<<9), 512);
+
+			checksum[0] = SPITxRx(0xFF);
+			checksum[1] = SPITxRx(0xFF);
+
+			if (s_readCRCCheck && CRC16Slice8(datablock + (b<<9), 512) != ((checksum[0] << 8) | checksum[1]))
+			{
+				failed = 1;
+				break;
+			}
+		}
+
+		// Stop the transfer, the byte following the command is a stuff byte
+		// The card can keep streaming the next block until it decodes CMD12, so skip
+		// anything that isn't an R1 (top bit clear) instead of taking the first non-0xFF byte
+		SDCmd(CMD12_STOP_TRANSMISSION, 0);
+		SPITxRx(0xFF);
+		response = 0xFF;
+		for (uint32_t i=0; i<G_SPI_TIMEOUT && (response & 0x80); ++i)
+			response = SPITxRx(0xFF);
+		if (response != SD_READY) // R1b: expect 0x00
+			failed = 1;
+		SDWaitNotBusy();
 	}
+	else
+		failed = 1;
+
+	LEDSetState(oldstate);
 
-	return 0;
+	return failed ? -1 : 0;
 }
 
 /**
@@ -391,7 +462,7 @@ uint8_t __attribute__ ((noinline)) SDWriteSingleBlock(uint32_t sector, uint8_t *
 	uint32_t oldstate = LEDGetState();
 	LEDSetState(oldstate|0x1); // RED
 
-	uint16_t crc = CRC16(datablock, 512);
+	uint16_t crc = CRC16Slice8(datablock, 512);
 
 	SDCmd(CMD24_WRITE_BLOCK, sector);
 	uint8_t response = SDResponse1(); // R1: expect 0x00
@@ -402,10 +473,7 @@ uint8_t __attribute__ ((noinline)) SDWriteSingleBlock(uint32_t sector, uint8_t *
 		// Send start token - single block (0xFD->multiblock)
 		response = SPITxRx(SD_START_TOKEN);
 
-		int x=0;
-		do {
-			response = SPITxRx(datablock[x++]);
-		} while(x<512);
+		SPIBurstWrite(datablock, 512);
 
 		// This seems to be unused in most samples, we'll emit 0xFFFF
 		SPITxRx(crc >> 8);
@@ -455,8 +523,9 @@ uint8_t __attribute__ ((noinline)) SDWriteSingleBlock(uint32_t sector, uint8_t *
  * @brief Write multiple blocks to the SD card
  * 
  * This function writes multiple blocks to the SD card starting at the given block address.
- * It will use repeated calls to SDWriteSingleBlock to write the blocks, so it is less efficient.
- * Ideally, if the SD card supports CMD25_WRITE_MULTIPLE_BLOCK command, this function should be modified to use it.
+ * A single block is written with CMD24_WRITE_BLOCK, longer runs use one CMD25_WRITE_MULTIPLE_BLOCK
+ * command where each block starts with the multiple block start token, and the transfer ends
+ * with the stop token.
  * 
  * @param datablock Pointer to the data blocks
  * @param numblocks Number of blocks to write
@@ -468,18 +537,53 @@ int __attribute__ ((noinline)) SDWriteMultipleBlocks(const uint8_t *datablock, u
 	if (numblocks == 0)
 		return -1;
 
-	uint32_t cursor = 0;
+	if (numblocks == 1)
+		return SDWriteSingleBlock(blockaddress, (uint8_t*)datablock) == SD_READY ? 0 : -1;
 
-	for(uint32_t b=0; b<numblocks; ++b)
+	uint32_t oldstate = LEDGetState();
+	LEDSetState(oldstate|0x1); // RED
+
+	SDCmd(CMD25_WRITE_MULTIPLE_BLOCK, blockaddress);
+	uint8_t response = SDResponse1(); // R1: expect 0x00
+
+	int failed = 0;
+	if (response == SD_READY)
 	{
-		uint8_t* source = (uint8_t*)(datablock+cursor);
-		uint8_t response = SDWriteSingleBlock(b+blockaddress, source);
-		if (response != SD_READY)
-			return -1;
-		cursor += 512;
+		for(uint32_t b=0; b<numblocks; ++b)
+		{
+			const uint8_t* source = datablock + (b<<9);
+			uint16_t crc = CRC16Slice8(source, 512);
+
+			// One byte gap before the token
+			SPITxRx(0xFF);
+			SPITxRx(SD_MULTIBLOCK_START_TOKEN);
+
+			SPIBurstWrite(source, 512);
+
+			SPITxRx(crc >> 8);
+			SPITxRx(crc & 0xff);
+
+			// Expected status&x1F==0x05, wait for the block to be programmed before sending the next one
+			uint8_t writeAcceptState = SDResponse1() & 0x1F;
+			if (writeAcceptState != 0x05)
+			{
+				failed = 1;
+				break;
+			}
+			SDWaitNotBusy();
+		}
+
+		// The stop token ends the transfer, even after a rejected block
+		SPITxRx(SD_MULTIBLOCK_STOP_TOKEN);
+		SPITxRx(0xFF);
+		SDWaitNotBusy();
 	}
+	else
+		failed = 1;
+
+	LEDSetState(oldstate);
 
-	return 0;
+	return failed ? -1 : 0;
 }
 
 /**
@@ -4,11 +4,27 @@
 
 extern volatile uint8_t *IO_SPIRXTX;
 extern volatile uint8_t *IO_CARDDETECT;
+extern volatile uint32_t *IO_SPIBURSTLEN;
+extern volatile uint32_t *IO_SPIBURSTDATA;
 
 #define SD_READY 0x00
 #define SD_START_TOKEN 0xFE
+#define SD_MULTIBLOCK_START_TOKEN 0xFC
+#define SD_MULTIBLOCK_STOP_TOKEN 0xFD
+#define SD_CRC_ERROR 0x0B
+
+// Longest burst the SPI controller takes in one go
+#define SPI_BURST_MAX 2044
+
+void SPIBurstRead(uint8_t *buffer, const uint32_t len);
+void SPIBurstWrite(const uint8_t *buffer, const uint32_t len);
 
 int SDCardStartup();
+void SDSetReadCRCCheck(const int enable);
 int SDIOControl(const uint8_t cmd, void *buffer);
 int SDReadMultipleBlocks(uint8_t *datablock, uint32_t numblocks, uint32_t blockaddress);
-int SDWriteMultipleBlocks(const uint8_t *datablock, uint32_t numblocks, uint32_t blockaddress);
\ No newline at end of file
+int SDWriteMultipleBlocks(const uint8_t *datablock, uint32_t numblocks, uint32_t blockaddress);
+
+// One block per command, SDRead/WriteMultipleBlocks use these for single blocks
+uint8_t SDReadSingleBlock(uint32_t sector, uint8_t *datablock, uint8_t checksum[2]);
+uint8_t SDWriteSingleBlock(uint32_t sector, uint8_t *datablock);
@@ -62,7 +62,9 @@ uint32_t __attribute__ ((noinline)) SerialInRingBufferRead(void* pvDest, const u
     __builtin_memcpy( pbDest, ringbuffer + actualReadOffset, cbTailBytes );
     bytesLeft -= cbTailBytes;
 
-    //EAssert(bytesLeft == 0, "Item not an exact multiple of ring buffer, this will cause multiple memcpy() calls during Read()");
+    // Wrapped around the end of the ring, the rest is at the start
+    if( bytesLeft )
+        __builtin_memcpy( pbDest + cbTailBytes, ringbuffer, bytesLeft );
 
     readOffset += cbDest;
     *m_si_readOffset = readOffset;
@@ -99,7 +101,9 @@ uint32_t __attribute__ ((noinline)) SerialInRingBufferWrite( const void* pvSrc,
     __builtin_memcpy(ringbuffer + actualWriteOffset, pbSrc, cbTailBytes);
     bytesLeft -= cbTailBytes;
 
-    //EAssert(bytesLeft == 0, "Item not an exact multiple of ring buffer, this will cause multiple memcpy() calls during Write()");
+    // Wrapped around the end of the ring, the rest goes to the start
+    if( bytesLeft )
+        __builtin_memcpy(ringbuffer, pbSrc + cbTailBytes, bytesLeft);
 
     //EReadWriteBarrier(0);
     asm volatile ("" : : : "memory"); // Stop compiler reordering
@@ -109,3 +113,13 @@ uint32_t __attribute__ ((noinline)) SerialInRingBufferWrite( const void* pvSrc,
 
     return 1;
 }
+
+/**
+ * @brief Number of bytes waiting in the ring buffer
+ * 
+ * @return Number of bytes that can be read
+ */
+uint32_t __attribute__ ((noinline)) SerialInRingBufferCount()
+{
+    return *m_si_writeOffset - *m_si_readOffset;
+}
@@ -8,6 +8,7 @@
 #include "basesystem.h"
 #include "task.h"
 #include "leds.h"
+#include "serialinringbuffer.h"
 
 #include <stdlib.h>
 
@@ -78,6 +79,12 @@ void *TaskGetSharedMemory()
 void TaskSetState(struct STaskContext *_ctx, const uint32_t _taskid, enum ETaskState _state)
 {
 	_ctx->tasks[_taskid].state = _state;
+
+	// Paused tasks drop out of the scheduler's ready set, terminating ones stay in it until they're cleaned up
+	if (_state == TS_PAUSED)
+		_ctx->readyMask &= ~(1u << _taskid);
+	else if (_state == TS_RUNNING || _state == TS_TERMINATING)
+		_ctx->readyMask |= (1u << _taskid);
 }
 
 /**
@@ -106,7 +113,37 @@ enum ETaskState TaskGetState(struct STaskContext *_ctx, const uint32_t _taskid)
 */
 uint32_t TaskGetPC(struct STaskContext *_ctx, const uint32_t _taskid)
 {
-	return _ctx->tasks[_taskid].regs[0];
+	return TaskGetRegister(_ctx, _taskid, 0);
+}
+
+/**
+ * @brief Get a saved register of a task
+ * 
+ * Registers of each task live in the CSR register bank with the same index as the task.
+ * 
+ * @param _ctx Task context
+ * @param _taskid Task ID
+ * @param _reg Register index, zero returns the program counter
+ * @return Register value
+ */
+uint32_t TaskGetRegister(struct STaskContext *_ctx, const uint32_t _taskid, const uint32_t _reg)
+{
+	return E32ReadMemMappedCSR(_ctx->hartID, CSR_REGISTERBANKS + (_taskid<<5) + (_reg&0x1F));
+}
+
+/**
+ * @brief Set a saved register of a task
+ * 
+ * The task picks up the new value the next time it's switched in.
+ * 
+ * @param _ctx Task context
+ * @param _taskid Task ID
+ * @param _reg Register index, zero sets the program counter
+ * @param _value New register value
+ */
+void TaskSetRegister(struct STaskContext *_ctx, const uint32_t _taskid, const uint32_t _reg, const uint32_t _value)
+{
+	E32WriteMemMappedCSR(_ctx->hartID, CSR_REGISTERBANKS + (_taskid<<5) + (_reg&0x1F), _value);
 }
 
 /**
@@ -229,7 +266,7 @@ void TaskYield()
  * 
  * Switch to the next task in the task pool and return time slice of the next task.
  * This function is called by the scheduler to switch between tasks.
- * The current task's registers are stored in the task structure before switching.
+ * The current task's registers stay in its register bank, the next task's bank gets selected.
  * 
  * @note Please call TaskYield() from user code to yield leftover time back to the next task instead.
  * 
@@ -257,3 +294,128 @@ uint32_t TaskSwitchToNext(struct STaskContext *_ctx)
 
 	return retval;
 }
+
+/**
+ * @brief Set the priority and deadline of a task
+ * 
+ * Ready tasks with a higher priority always run before lower priority ones, tasks of equal
+ * priority take turns. A task with a deadline runs periodically: each period starts 'deadline'
+ * ticks after the previous one, and the task should call TaskYield() once its work for the
+ * period is done. It then waits for the next period, which will preempt lower priority tasks.
+ * Periods that end before the task yields are counted as missed deadlines.
+ * 
+ * @param _ctx Task context
+ * @param _taskid Task ID
+ * @param _priority New priority, see TASK_PRIORITY_*
+ * @param _deadline Period and deadline in clock ticks, or zero for none
+ * @return Zero on success, -1 if there is no such task
+ * @see TaskSetScheduling
+ */
+int TaskSetPriority(struct STaskContext *_ctx, const uint32_t _taskid, const uint32_t _priority, const uint32_t _deadline)
+{
+	uint32_t context = (uint32_t)_ctx;
+	int retval = 0;
+
+	asm (
+		"li a7, 16391;" // _task_set_priority custom syscall
+		"mv a0, %1;"
+		"mv a1, %2;"
+		"mv a2, %3;"
+		"mv a3, %4;"
+		"ecall;"
+		"mv %0, a0;" :
+		// Return values
+		"=r" (retval) :
+		// Input parameters
+		"r" (context), "r" (_taskid), "r" (_priority), "r" (_deadline) :
+		// Clobber list
+		"a0", "a1", "a2", "a3", "a7"
+	);
+
+	return retval;
+}
+
+/**
+ * @brief Set how the scheduler picks the next task
+ * 
+ * With TSCHED_PRIORITY the highest priority ready task runs next.
+ * With TSCHED_DEADLINE the task whose deadline comes first runs next, tasks without a deadline
+ * only run when no task with a deadline is ready, in priority order.
+ * 
+ * @param _ctx Task context
+ * @param _scheduling Scheduling mode
+ * @see TaskSetPriority
+ */
+void TaskSetScheduling(struct STaskContext *_ctx, enum ETaskScheduling _scheduling)
+{
+	_ctx->scheduling = _scheduling;
+}
+
+/**
+ * @brief Block the current task until a condition holds
+ * 
+ * The task leaves the scheduler's ready set until one of the given conditions holds.
+ * When no task is ready the CPU waits for interrupts, and the timer is only set up
+ * for the next thing that could wake a task instead of every time slice.
+ * 
+ * @param _flags Combination of TASK_WAIT_* conditions
+ * @param _wakeTime Low 32 bits of the wall clock to wake up at, for TASK_WAIT_TIME
+ * @param _vsync Wake up once VPUReadVBlankCounter() differs from this, for TASK_WAIT_VSYNC
+ * @param _apuFrame Wake up once APUFrame() differs from this, for TASK_WAIT_APU
+ * @see TaskSleep
+ * @see TaskWaitUART
+ */
+void TaskWait(const uint32_t _flags, const uint32_t _wakeTime, const uint32_t _vsync, const uint32_t _apuFrame)
+{
+	asm (
+		"li a7, 16392;" // _task_wait custom syscall
+		"mv a0, %0;"
+		"mv a1, %1;"
+		"mv a2, %2;"
+		"mv a3, %3;"
+		"ecall;" :
+		// Return values
+		:
+		// Input parameters
+		"r" (_flags), "r" (_wakeTime), "r" (_vsync), "r" (_apuFrame) :
+		// Clobber list
+		"a0", "a1", "a2", "a3", "a7"
+	);
+}
+
+/**
+ * @brief Sleep until a given time
+ * 
+ * @param _wakeTime Wall clock time to wake up at, as returned by E32ReadTime()
+ * @see TaskWait
+ */
+void TaskSleepUntil(const uint64_t _wakeTime)
+{
+	// The task might get to run for a moment before the switch, so check the clock as well
+	while ((int32_t)((uint32_t)_wakeTime - (uint32_t)E32ReadTime()) > 0)
+		TaskWait(TASK_WAIT_TIME, (uint32_t)_wakeTime, 0, 0);
+}
+
+/**
+ * @brief Sleep for a number of clock ticks
+ * 
+ * Unlike E32Sleep() this lets other tasks run, or the CPU rest, in the meantime.
+ * 
+ * @param _ticks Time to sleep in clock ticks
+ * @see TaskWait
+ */
+void TaskSleep(const uint32_t _ticks)
+{
+	TaskSleepUntil(E32ReadTime() + _ticks);
+}
+
+/**
+ * @brief Block until serial input arrives
+ * 
+ * @see TaskWait
+ */
+void TaskWaitUART()
+{
+	while (SerialInRingBufferCount() == 0)
+		TaskWait(TASK_WAIT_UART, 0, 0, 0);
+}
@@ -2,10 +2,31 @@
 
 #include <inttypes.h>
 
-#define TASK_MAX 4
+// Tasks per HART, each one keeps its registers in the CSR register bank matching its index,
+// so this can't go past REGISTER_BANK_COUNT (32)
+#define TASK_MAX 32
 
 typedef void(*taskfunc)();
 
+// Task priorities, higher numbers run first. Tasks of equal priority take turns.
+#define TASK_PRIORITY_LOWEST	0
+#define TASK_PRIORITY_NORMAL	8
+#define TASK_PRIORITY_HIGHEST	15
+
+// Conditions a task can block on with TaskWait(), it wakes up as soon as any of the given ones holds
+#define TASK_WAIT_TIME			0x01	// Wall clock reaches the wake time
+#define TASK_WAIT_VSYNC			0x02	// Vblank counter differs from the given one
+#define TASK_WAIT_APU			0x04	// APU frame differs from the given one
+#define TASK_WAIT_UART			0x08	// Serial input ring buffer has data
+#define TASK_WAIT_KEYS			0x10	// Key ring buffer has data
+
+// How the scheduler picks the next task on a HART
+enum ETaskScheduling
+{
+	TSCHED_PRIORITY,	// Highest priority ready task first
+	TSCHED_DEADLINE		// Earliest deadline first among tasks with a deadline, then by priority
+};
+
 struct STaskBreakpoint
 {
 	uint32_t address;				// Address of replaced instruction / breakpoint
@@ -26,24 +47,48 @@ struct STask {
 	uint32_t runLength;		// Time slice dedicated to this task
 	enum ETaskState state;	// State of this task
 	uint32_t exitCode;		// Task termination exit code
-	uint32_t regs[32];		// Integer registers - NOTE: register zero here is actually the PC, 128 bytes
+	uint64_t cpuTime;		// Ticks spent running since the statistics were last reset
+	uint32_t heapID;		// Heap used by brk(), shared with the task that added this one
+	uint32_t priority;		// Scheduling priority, see TASK_PRIORITY_*
+	uint32_t deadline;		// Period and relative deadline in ticks, or zero for tasks without one
+	uint32_t release;		// Time (low 32 bits) the current period started, the task's work is due at release+deadline
+	uint32_t missedDeadlines;	// Periods the task didn't finish in time
+	uint32_t waitFlags;		// TASK_WAIT_* conditions the task is blocked on, zero when not blocked
+	uint32_t waitUntil;		// Wake time (low 32 bits) for TASK_WAIT_TIME
+	uint32_t waitVSync;		// Vblank counter value to wait past for TASK_WAIT_VSYNC
+	uint32_t waitAPU;		// APU frame to wait past for TASK_WAIT_APU
+	uint32_t reserved;		// Keeps cpuTime of the next task 8 byte aligned
 
 	// Debug support - this will probably move somewhere else
 	char name[16];			// Name of this task
 };
 
-// 672 bytes total for one core (1344 for two cores)
+// 2616 bytes total for one core (5232 for two cores)
 struct STaskContext {
-	// 160 x 4 bytes (640)
+	// 80 x 32 bytes (2560)
 	struct STask tasks[TASK_MAX];	// List of all the tasks
-	// 32 bytes total below
+	// 56 bytes total below
+	uint32_t readyMask;				// One bit per task that can run, the scheduler picks among these
+	uint32_t scheduling;			// Scheduling mode, see ETaskScheduling
+	uint64_t switchTime;			// Time the current task got switched in
+	uint64_t statsTime;				// Time the cpuTime counters were last reset
 	int32_t currentTask;			// Current task index
 	int32_t numTasks;				// Number of tasks
 	int32_t kernelError;			// Current kernel error
 	int32_t kernelErrorData[3];		// Data relevant to the crash
 	int32_t hartID;					// Id of the HART where this task context runs
+	uint32_t statsResetRequest;		// Set by other HARTs, the owning HART clears cpuTime counters on its next task switch
 };
 
+// emulator/taskcontext.h mirrors these for the host side tools, and the mailbox layout assumes this size
+#ifdef __cplusplus
+static_assert(sizeof(struct STask) == 80, "STask layout changed, update emulator/taskcontext.h");
+static_assert(sizeof(struct STaskContext) == 2616, "STaskContext layout changed, update emulator/taskcontext.h");
+#else
+_Static_assert(sizeof(struct STask) == 80, "STask layout changed, update emulator/taskcontext.h");
+_Static_assert(sizeof(struct STaskContext) == 2616, "STaskContext layout changed, update emulator/taskcontext.h");
+#endif
+
 // Get task context for given HART
 struct STaskContext *TaskGetContext(uint32_t _hartid);
 
@@ -68,3 +113,20 @@ void TaskYield();
 void TaskSetState(struct STaskContext *_ctx, const uint32_t _taskid, enum ETaskState _state);
 enum ETaskState TaskGetState(struct STaskContext *_ctx, const uint32_t _taskid);
 uint32_t TaskGetPC(struct STaskContext *_ctx, const uint32_t _taskid);
+
+// Set the priority and deadline of a task, deadline is in ticks and zero means none.
+// A task with a deadline is expected to call TaskYield() once its work for the period is done.
+int TaskSetPriority(struct STaskContext *_ctx, const uint32_t _taskid, const uint32_t _priority, const uint32_t _deadline);
+void TaskSetScheduling(struct STaskContext *_ctx, enum ETaskScheduling _scheduling);
+
+// Block the current task until one of the TASK_WAIT_* conditions holds, the CPU sleeps if no other task is ready.
+// Wake time is the low 32 bits of E32ReadTime(), so waits are limited to a few minutes.
+void TaskWait(const uint32_t _flags, const uint32_t _wakeTime, const uint32_t _vsync, const uint32_t _apuFrame);
+void TaskSleepUntil(const uint64_t _wakeTime);
+void TaskSleep(const uint32_t _ticks);
+// Block until there is serial input to read with SerialInRingBufferRead()
+void TaskWaitUART();
+
+// Saved registers of a task as of the last time it was switched out, register zero is the PC
+uint32_t TaskGetRegister(struct STaskContext *_ctx, const uint32_t _taskid, const uint32_t _reg);
+void TaskSetRegister(struct STaskContext *_ctx, const uint32_t _taskid, const uint32_t _reg, const uint32_t _value);
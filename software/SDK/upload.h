@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+// File upload protocol between the host tools (riscvtool -sendfile, tinyremote drag and drop) and recv.elf.
+// Everything is little endian, checksums are CRC32 (zlib compatible).
+//
+// 1. The host types "recv\n", recv.elf answers with '+' once it owns the UART.
+// 2. The host sends an SUploadHeader. The receiver answers UPLOAD_RESUME with the first packet it
+//    still needs, which is 0 unless an earlier upload of the same file was cut short,
+//    or UPLOAD_NAK with UPLOAD_HEADER_INDEX if the header didn't arrive intact.
+// 3. The payload goes out in numbered packets of UPLOAD_PACKET_SIZE bytes, the last one padded with zeros:
+//    UPLOAD_SYNC, packet index, payload, CRC32 of index and payload.
+//    At most UPLOAD_WINDOW packets are unacknowledged at any time. The receiver answers each packet with
+//    UPLOAD_ACK, or UPLOAD_NAK if it was damaged, and the host resends NAKed packets as well as the oldest one
+//    if it wasn't answered in time. Packets may be accepted out of order.
+// 4. The receiver writes each block out as soon as it's complete. Once the trailer arrives it checks the CRC32 of the
+//    payload and the file size, renames the file and answers UPLOAD_DONE with status 0, or UPLOAD_ERROR with one of
+//    the UPLOAD_STATUS codes.
+//
+// The payload is the file cut into blocks of UPLOAD_BLOCK_SIZE bytes (the last one may be shorter), each compressed
+// with the LZ4 streaming API so it can refer to the 64K before it, and stored as its 32 bit compressed size followed
+// by the compressed data. A zero size ends the payload, followed by the CRC32 of all payload bytes before it.
+// Neither side needs to know the payload size up front: the host compresses the next block only once the window
+// has room for it, and the receiver only ever holds one block and the 64K window, whatever the file size.
+//
+// Replies from the receiver are always one of the reply bytes followed by a 32 bit value.
+// The window is sized so that everything in flight fits the UART FIFO and the serial input ring
+// buffer (2K + 1K), so nothing is lost while the receiver is busy.
+
+#define UPLOAD_MAGIC			0x50555354	// 'TSUP'
+#define UPLOAD_VERSION			4
+#define UPLOAD_PACKET_SIZE		512
+#define UPLOAD_BLOCK_SIZE		16384
+#define UPLOAD_WINDOW			4
+#define UPLOAD_MAX_NAME			64
+
+#define UPLOAD_SYNC				'#'
+#define UPLOAD_ACK				'A'
+#define UPLOAD_NAK				'N'
+#define UPLOAD_RESUME			'R'
+#define UPLOAD_DONE				'D'
+#define UPLOAD_ERROR			'!'
+#define UPLOAD_REPLY_SIZE		5
+
+// Packet index of the header in NAK replies
+#define UPLOAD_HEADER_INDEX		0xFFFFFFFF
+
+// Status values of UPLOAD_ERROR
+#define UPLOAD_STATUS_BAD_HEADER	1	// Unknown version or name too long
+#define UPLOAD_STATUS_NO_MEMORY		2
+#define UPLOAD_STATUS_BAD_PAYLOAD	3	// Whole payload CRC32 mismatch
+#define UPLOAD_STATUS_UNPACK		4	// LZ4 decompression failed
+#define UPLOAD_STATUS_WRITE			5	// Could not write the file
+
+struct SUploadHeader
+{
+	uint32_t magic;					// UPLOAD_MAGIC
+	uint32_t version;				// UPLOAD_VERSION
+	uint32_t decodedLen;			// File size in bytes
+	uint32_t fileTime;				// Modification time of the file on the host in seconds, tells a resumed upload apart from a new one
+	uint32_t nameLen;				// File name length, less than UPLOAD_MAX_NAME
+	char name[UPLOAD_MAX_NAME];		// File name, zero padded
+	uint32_t headerCRC;				// CRC32 of all fields above
+};
@@ -8,6 +8,7 @@
 #include "basesystem.h"
 #include "vpu.h"
 #include "core.h"
+#include "task.h"
 //#include "uart.h"
 #include <stdlib.h>
 
@@ -777,7 +778,8 @@ void VPUSwapPages(struct EVideoContext* _vx, struct EVideoSwapContext *_sc)
 /** @brief Wait for vertical blanking interval
  * 
  * This is a convenience function that waits for the vertical blanking interval
- * by blocking the CPU until the vblank counter changes.
+ * by blocking the calling task until the vblank counter changes. Other tasks run
+ * in the meantime, or the CPU sleeps if there are none.
  * 
  * It utilizes VPUReadVBlankCounter() to read the current counter value.
  * 
@@ -791,6 +793,9 @@ void VPUWaitVSync()
 	uint32_t prevvsync = VPUReadVBlankCounter();
 	uint32_t currentvsync;
 	do {
+#if !defined(BUILDING_ROM)
+		TaskWait(TASK_WAIT_VSYNC, 0, prevvsync, 0);
+#endif
 		currentvsync = VPUReadVBlankCounter();
 	} while (currentvsync == prevvsync);
 }
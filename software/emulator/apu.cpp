@@ -3,6 +3,7 @@
 #include "apu.h"
 #include "bus.h"
 #include "bitutil.h"
+#include "snapshot.h"
 
 CAPU::CAPU()
 {
@@ -128,3 +129,17 @@ void CAPU::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 	// Command FIFO writes dirty the video output
 	m_fifo.push(word);
 }
+
+void CAPU::Serialize(CSnapshot& snap)
+{
+	snap.Value(m_rateselector);
+	snap.Value(m_apuwordcount);
+	snap.Value(m_cmd);
+	snap.Value(m_data);
+	snap.Value(m_state);
+	snap.Value(m_currentbuffer);
+	snap.Value(m_sourceAddress);
+	snap.Bytes(m_audioData[0], 0x1000 * sizeof(uint32_t));
+	snap.Bytes(m_audioData[1], 0x1000 * sizeof(uint32_t));
+	snap.Queue(m_fifo);
+}
@@ -27,6 +27,7 @@ public:
 
 	void* GetPlaybackData() { return m_audioData[m_currentbuffer]; }
 	void FlipBuffers() { m_currentbuffer ^= 1; }
+	void Serialize(CSnapshot& snap);
 
 	uint32_t m_rateselector{ 0 };
 	uint32_t m_apuwordcount{ 0 };
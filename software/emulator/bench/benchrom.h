@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdio.h>
+
+// ROM image the benchmarks boot when none is given on the command line. Looks for rom.bin
+// in the current folder first, then for the one that ships in ROMs/ when run from the
+// emulator folder (where the sdcard folder the benchmarks read from also lives)
+static const char* BenchDefaultROM()
+{
+	static const char* candidates[] = { "rom.bin", "ROMs/rom.bin" };
+	for (const char* candidate : candidates)
+	{
+		FILE* fp = fopen(candidate, "rb");
+		if (fp)
+		{
+			fclose(fp);
+			return candidate;
+		}
+	}
+	// Let the emulator report the missing file
+	return candidates[0];
+}
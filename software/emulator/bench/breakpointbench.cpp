@@ -0,0 +1,51 @@
+// Breakpoint lookup overhead benchmark
+// Boots the ROM with a virtual clock for a fixed number of steps with 0, 1 and 64
+// breakpoints set on both harts, and reports host MIPS for each run.
+// The breakpoints are placed where no code runs so they never hit and all runs retire
+// the same instructions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#include "emulator.h"
+#include "benchrom.h"
+
+// Virtual wallclock ticks per emulator step, keeps runs repeatable across hosts
+static const uint64_t s_ticksPerStep = 4;
+// Arbitrary spot in system memory that never gets executed
+static const uint32_t s_breakpointBase = 0x0A000000;
+
+static const uint32_t s_breakpointCounts[] = { 0, 1, 64 };
+
+int main(int argc, char** argv)
+{
+	const char* romFile = argc > 1 ? argv[1] : BenchDefaultROM();
+	uint64_t stepCount = argc > 2 ? strtoull(argv[2], nullptr, 10) : 50000000;
+
+	printf("%-12s %14s %10s %10s\n", "breakpoints", "retired", "host s", "host MIPS");
+	for (uint32_t breakpointCount : s_breakpointCounts)
+	{
+		CEmulator emulator;
+		if (!emulator.Reset(romFile, 0x0FFE0000))
+		{
+			fprintf(stderr, "Failed to load ROM\n");
+			return -1;
+		}
+
+		for (uint32_t cpu = 0; cpu < 2; ++cpu)
+			for (uint32_t i = 0; i < breakpointCount; ++i)
+				emulator.AddBreakpoint(0, cpu, s_breakpointBase + i * 4);
+
+		auto startTime = std::chrono::high_resolution_clock::now();
+		for (uint64_t step = 0; step < stepCount; ++step)
+			emulator.Step(step * s_ticksPerStep);
+		auto endTime = std::chrono::high_resolution_clock::now();
+
+		double seconds = std::chrono::duration<double>(endTime - startTime).count();
+		uint64_t retired = emulator.m_cpu[0]->m_retired + emulator.m_cpu[1]->m_retired;
+		printf("%-12u %14llu %10.3f %10.2f\n", breakpointCount, (unsigned long long)retired, seconds, double(retired) / seconds / 1000000.0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+// Headless coremark run used to compare the CPU execute backends
+// Boots the ROM with a virtual clock, types the coremark command into the CLI
+// and reports host MIPS for the time the coremark task was alive
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "emulator.h"
+#include "benchrom.h"
+#include "taskcontext.h"
+
+#if defined(THREADED_DISPATCH)
+static const char* s_backend = "threaded";
+#else
+static const char* s_backend = "switch";
+#endif
+
+// Virtual wallclock ticks per emulator step, keeps runs repeatable across hosts
+static const uint64_t s_ticksPerStep = 4;
+// Give up if coremark hasn't finished after this many steps
+static const uint64_t s_maxSteps = 2000000000;
+
+static uint64_t Retired(CEmulator& emulator)
+{
+	return emulator.m_cpu[0]->m_retired + emulator.m_cpu[1]->m_retired;
+}
+
+int main(int argc, char** argv)
+{
+	const char* romFile = argc > 1 ? argv[1] : BenchDefaultROM();
+	const char* command = argc > 2 ? argv[2] : "coremark";
+
+	// The CLI looks in the root and sys/bin folders of the sdcard
+	char elfName[256];
+	snprintf(elfName, 255, "sdcard/%s.elf", command);
+	FILE* fp = fopen(elfName, "rb");
+	if (!fp)
+	{
+		snprintf(elfName, 255, "sdcard/sys/bin/%s.elf", command);
+		fp = fopen(elfName, "rb");
+	}
+	if (!fp)
+	{
+		fprintf(stderr, "%s.elf not found, build samples/coremark and copy it into the sdcard folder\n", command);
+		return -1;
+	}
+	fclose(fp);
+
+	CEmulator emulator;
+	if (!emulator.Reset(romFile, 0x0FFE0000))
+	{
+		fprintf(stderr, "Failed to load ROM\n");
+		return -1;
+	}
+
+	STaskContext* kernelctx = (STaskContext*)emulator.m_bus->GetHostAddress(DEVICE_MAIL);
+
+	// 0: booting, 1: command sent, 2: coremark running
+	int phase = 0;
+	int baseTaskCount = 0;
+	uint64_t steps = 0;
+	uint64_t startRetired = 0;
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	while (steps < s_maxSteps)
+	{
+		emulator.Step(steps * s_ticksPerStep);
+		++steps;
+
+		// Poll task state every now and then
+		if (steps % 4096)
+			continue;
+
+		if (phase == 0)
+		{
+			// Wait for the CLI task to settle before typing into it
+			if (kernelctx->numTasks >= 2 && steps > 4000000)
+			{
+				baseTaskCount = kernelctx->numTasks;
+				emulator.QueueBytes((uint8_t*)command, (uint32_t)strlen(command));
+				emulator.QueueByte('\n');
+				phase = 1;
+			}
+		}
+		else if (phase == 1)
+		{
+			if (kernelctx->numTasks > baseTaskCount)
+			{
+				startRetired = Retired(emulator);
+				startTime = std::chrono::high_resolution_clock::now();
+				phase = 2;
+			}
+		}
+		else if (kernelctx->numTasks <= baseTaskCount)
+		{
+			break;
+		}
+	}
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	double seconds = std::chrono::duration<double>(endTime - startTime).count();
+	uint64_t retired = Retired(emulator) - startRetired;
+
+	if (phase != 2 || steps >= s_maxSteps)
+	{
+		fprintf(stderr, "%s did not complete\n", command);
+		return -1;
+	}
+
+	printf("backend: %s\n", s_backend);
+	printf("retired instructions: %llu\n", (unsigned long long)retired);
+	printf("host time: %.3f s\n", seconds);
+	printf("host MIPS: %.2f\n", double(retired) / seconds / 1000000.0);
+
+	return 0;
+}
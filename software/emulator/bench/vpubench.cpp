@@ -0,0 +1,94 @@
+// Scanout conversion benchmark for the emulated VPU
+// Converts full 525 scanline frames for each video mode and reports host ns/frame,
+// once with every row dirty and once with an unchanged framebuffer
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "bus.h"
+
+// Arbitrary spot in system memory for the test framebuffer
+static const uint32_t s_framebuffer = 0x0A000000;
+static const uint32_t s_frameCount = 2000;
+
+struct SVideoMode
+{
+	const char* name;
+	uint32_t vmode;
+	uint32_t bytes;
+};
+
+static const SVideoMode s_modes[] = {
+	{ "320x240 8bpp", 0x1, 320 * 240 },
+	{ "640x480 8bpp", 0x3, 640 * 480 },
+	{ "320x240 12bpp", 0x5, 320 * 240 * 2 },
+	{ "640x480 12bpp", 0x7, 640 * 480 * 2 },
+};
+
+static void VPUCommand(CBus* bus, uint32_t cmd, uint32_t data)
+{
+	bus->Write(DEVICE_VPUC, cmd, 0b1111);
+	bus->Write(DEVICE_VPUC, data, 0b1111);
+	// Idle -> dispatch -> execute
+	for (int i = 0; i < 3; ++i)
+		bus->Tick();
+}
+
+static double RunFrames(CBus* bus, uint32_t* pixels, bool invalidate)
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+	for (uint32_t frame = 0; frame < s_frameCount; ++frame)
+	{
+		if (invalidate)
+			bus->GetVPU()->InvalidateScanout(bus);
+		for (int scanline = 0; scanline < 525; ++scanline)
+			bus->UpdateVideoLink(pixels, 640 * 4, scanline);
+	}
+	auto endTime = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::nano>(endTime - startTime).count() / s_frameCount;
+}
+
+int main(int argc, char** argv)
+{
+	CBus* bus = new CBus(0x0FFE0000);
+	bus->Reset(nullptr, 0);
+
+	uint32_t* pixels = new uint32_t[640 * 488];
+
+	// Random palette and framebuffer contents
+	uint32_t seed = 0x12345678;
+	for (uint32_t i = 0; i < 256; ++i)
+	{
+		seed = seed * 1664525 + 1013904223;
+		VPUCommand(bus, 0x1, (i << 24) | (seed >> 20));
+	}
+	uint8_t* framebuffer = (uint8_t*)bus->GetHostAddress(s_framebuffer);
+	for (uint32_t i = 0; i < 640 * 480 * 2; ++i)
+	{
+		seed = seed * 1664525 + 1013904223;
+		framebuffer[i] = seed >> 24;
+	}
+
+	VPUCommand(bus, 0x0, s_framebuffer);
+
+	printf("%-16s %14s %14s %10s\n", "mode", "dirty ns/frame", "clean ns/frame", "checksum");
+	for (const SVideoMode& mode : s_modes)
+	{
+		VPUCommand(bus, 0x2, mode.vmode);
+
+		double dirty = RunFrames(bus, pixels, true);
+		double clean = RunFrames(bus, pixels, false);
+
+		// Lets scalar and SIMD builds be compared
+		uint32_t checksum = 0;
+		for (uint32_t i = 0; i < 640 * 480; ++i)
+			checksum = checksum * 31 + pixels[i];
+
+		printf("%-16s %14.0f %14.0f %08X\n", mode.name, dirty, clean, checksum);
+	}
+
+	delete[] pixels;
+	delete bus;
+	return 0;
+}
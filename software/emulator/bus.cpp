@@ -1,5 +1,11 @@
 #include <stdio.h>
 #include "bus.h"
+#include "snapshot.h"
+
+// Set per host thread when harts run on their own threads
+static thread_local int32_t s_threadHart = -1;
+static thread_local bool s_syncRequest = false;
+static thread_local uint32_t s_stallCycles = 0;
 
 CBus::CBus(uint32_t resetvector)
 {
@@ -85,6 +91,21 @@ bool CBus::Tick()
 	return true;
 }
 
+void CBus::Serialize(CSnapshot& snap)
+{
+	snap.Value(m_resetvector);
+	m_mem->Serialize(snap);
+	m_spad->Serialize(snap);
+	m_mail->Serialize(snap);
+	m_csr[0]->Serialize(snap);
+	m_csr[1]->Serialize(snap);
+	m_vpuc->Serialize(snap);
+	m_apu->Serialize(snap);
+	m_leds->Serialize(snap);
+	m_uart->Serialize(snap);
+	m_sdcc->Serialize(snap);
+}
+
 uint32_t* CBus::GetHostAddress(uint32_t address)
 {
 	// Convert to emulator host address from emulated device memory address
@@ -133,6 +154,38 @@ uint32_t* CBus::GetHostAddress(uint32_t address)
 		return m_mem->GetHostAddress(address);
 }
 
+void CBus::SetHartThreads(bool enable)
+{
+	m_hartThreads = enable;
+	// Cache line transfers of the two harts can now overlap
+	m_mem->SetLineLocks(enable);
+}
+
+void CBus::SetThreadHart(uint32_t hartid)
+{
+	s_threadHart = (int32_t)hartid;
+	s_syncRequest = false;
+}
+
+bool CBus::TakeSyncRequest()
+{
+	bool request = s_syncRequest;
+	s_syncRequest = false;
+	return request;
+}
+
+void CBus::StallWriter(uint32_t cycles)
+{
+	s_stallCycles += cycles;
+}
+
+uint32_t CBus::TakeStallCycles()
+{
+	uint32_t cycles = s_stallCycles;
+	s_stallCycles = 0;
+	return cycles;
+}
+
 void CBus::Read(uint32_t address, uint32_t& data)
 {
 	uint32_t dev = (address & 0x80000000) ? ((address & 0xF0000) >> 16) : 11;
@@ -142,11 +195,28 @@ void CBus::Read(uint32_t address, uint32_t& data)
 		data = 0;
 		return;
 	}
-	m_devices[dev]->Read(address, data);
+
+	if (m_hartThreads && dev != 11)
+	{
+		std::lock_guard<std::mutex> lock(m_devicelock);
+		m_devices[dev]->Read(address, data);
+		// A hart's own CSR file is private, anything else needs to see device ticks
+		s_syncRequest |= dev != uint32_t(9 + s_threadHart);
+	}
+	else
+		m_devices[dev]->Read(address, data);
 }
  
 void CBus::Write(uint32_t address, uint32_t data, uint32_t wstrobe)
 {
 	uint32_t dev = (address & 0x80000000) ? ((address & 0xF0000) >> 16) : 11;
-	m_devices[dev]->Write(address, data, wstrobe);
+
+	if (m_hartThreads && dev != 11)
+	{
+		std::lock_guard<std::mutex> lock(m_devicelock);
+		m_devices[dev]->Write(address, data, wstrobe);
+		s_syncRequest |= dev != uint32_t(9 + s_threadHart);
+	}
+	else
+		m_devices[dev]->Write(address, data, wstrobe);
 }
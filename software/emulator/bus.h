@@ -1,5 +1,6 @@
 #pragma once
 
+#include <mutex>
 #include "rv32.h"
 #include "sysmem.h"
 #include "csrmem.h"
@@ -53,6 +54,16 @@ public:
 	void UpdateVideoLink(uint32_t* pixels, int pitch, int scanline);
 	void QueueByte(uint8_t byte);
 
+	// Hart threading support, see CEmulator::SetHartThreads()
+	void SetHartThreads(bool enable);
+	static void SetThreadHart(uint32_t hartid);
+	static bool TakeSyncRequest();
+	// A device that holds up a write (paced UART with a full ring) charges the writing hart through these
+	static void StallWriter(uint32_t cycles);
+	static uint32_t TakeStallCycles();
+
+	void Serialize(CSnapshot& snap);
+
 	CSysMem* m_mem{ nullptr };
 
 private:
@@ -68,5 +79,9 @@ private:
 
 	MemMappedDevice* m_devices[12]{ nullptr };
 
+	// Serializes uncached device accesses when harts run on their own threads
+	std::mutex m_devicelock;
+	bool m_hartThreads{ false };
+
 	uint32_t m_resetvector{ 0 };
 };
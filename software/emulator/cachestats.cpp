@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "cachestats.h"
+
+bool ParseCacheTiming(const char* spec, SCacheTiming& timing)
+{
+	// Approximation of the hardware: 6 cycle instructions, AXI bursts and I$ misses on every block
+	if (strcmp(spec, "hw") == 0)
+	{
+		timing.instructionCycles = 6;
+		timing.dcacheHitCycles = 2;
+		timing.axiLatency = 20;
+		timing.axiBeatCycles = 2;
+		timing.axiBeats = 4;
+		timing.icacheModel = true;
+		return true;
+	}
+
+	if (strcmp(spec, "flat") == 0)
+	{
+		timing = SCacheTiming();
+		return true;
+	}
+
+	const char* cursor = spec;
+	while (*cursor)
+	{
+		const char* separator = strchr(cursor, '=');
+		if (!separator)
+			break;
+
+		size_t keyLength = separator - cursor;
+		char* end;
+		uint32_t value = (uint32_t)strtoul(separator + 1, &end, 10);
+
+		if (keyLength == 3 && strncmp(cursor, "cpi", 3) == 0)
+			timing.instructionCycles = value;
+		else if (keyLength == 3 && strncmp(cursor, "hit", 3) == 0)
+			timing.dcacheHitCycles = value;
+		else if (keyLength == 4 && strncmp(cursor, "miss", 4) == 0)
+			timing.dcacheMissCycles = value;
+		else if (keyLength == 5 && strncmp(cursor, "imiss", 5) == 0)
+			timing.icacheMissCycles = value;
+		else if (keyLength == 7 && strncmp(cursor, "latency", 7) == 0)
+			timing.axiLatency = value;
+		else if (keyLength == 4 && strncmp(cursor, "beat", 4) == 0)
+			timing.axiBeatCycles = value;
+		else if (keyLength == 5 && strncmp(cursor, "beats", 5) == 0)
+			timing.axiBeats = value;
+		else if (keyLength == 6 && strncmp(cursor, "icache", 6) == 0)
+			timing.icacheModel = value != 0;
+		else
+			break;
+
+		if (*end == 0)
+			return true;
+		if (*end != ',')
+			break;
+		cursor = end + 1;
+	}
+
+	fprintf(stderr, "Could not parse cache timing '%s'\n", spec);
+	return false;
+}
+
+void CCacheStats::Conflict(uint32_t line, uint32_t victim)
+{
+	m_conflicts[(uint64_t(line) << 32) | victim]++;
+}
+
+void CCacheStats::InstructionMiss(uint32_t pc, uint32_t victim, bool evicted)
+{
+	uint32_t line = pc & ~63u;
+
+	m_totals.imisses++;
+	m_byPC[pc].imisses++;
+	m_byLine[line].imisses++;
+
+	if (evicted)
+	{
+		m_totals.evictions++;
+		m_byPC[pc].evictions++;
+		m_byLine[line].evictions++;
+		Conflict(line, victim);
+	}
+}
+
+void CCacheStats::DataMiss(uint32_t pc, uint32_t address, uint32_t victim, bool evicted, bool writeback)
+{
+	uint32_t line = address & ~63u;
+	SCacheEvents& byPC = m_byPC[pc];
+	SCacheEvents& byLine = m_byLine[line];
+
+	m_totals.dmisses++;
+	byPC.dmisses++;
+	byLine.dmisses++;
+
+	if (evicted)
+	{
+		m_totals.evictions++;
+		byPC.evictions++;
+		byLine.evictions++;
+		Conflict(line, victim);
+	}
+
+	if (writeback)
+	{
+		m_totals.writebacks++;
+		byPC.writebacks++;
+		byLine.writebacks++;
+	}
+}
+
+static void ReportEvents(FILE* fp, const char* title, const std::unordered_map<uint32_t, SCacheEvents>& events, uint32_t topCount)
+{
+	std::vector<std::pair<uint32_t, SCacheEvents>> sorted(events.begin(), events.end());
+	std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.Total() != b.second.Total() ? a.second.Total() > b.second.Total() : a.first < b.first; });
+	if (sorted.size() > topCount)
+		sorted.resize(topCount);
+
+	fprintf(fp, "  %-10s %12s %12s %12s %12s\n", title, "I$ misses", "D$ misses", "evictions", "writebacks");
+	for (auto& entry : sorted)
+		fprintf(fp, "  0x%08X %12llu %12llu %12llu %12llu\n", entry.first,
+			(unsigned long long)entry.second.imisses, (unsigned long long)entry.second.dmisses,
+			(unsigned long long)entry.second.evictions, (unsigned long long)entry.second.writebacks);
+}
+
+void CCacheStats::Report(FILE* fp, uint32_t hartid, uint32_t topCount)
+{
+	fprintf(fp, "hart%d cache report\n", hartid);
+	fprintf(fp, "  I$ misses %llu, D$ misses %llu, evictions %llu, writebacks %llu\n",
+		(unsigned long long)m_totals.imisses, (unsigned long long)m_totals.dmisses,
+		(unsigned long long)m_totals.evictions, (unsigned long long)m_totals.writebacks);
+
+	fprintf(fp, "\n");
+	ReportEvents(fp, "PC", m_byPC, topCount);
+	fprintf(fp, "\n");
+	ReportEvents(fp, "line", m_byLine, topCount);
+
+	// Pairs that keep replacing each other in the same set of the direct mapped caches
+	std::vector<std::pair<uint64_t, uint64_t>> sorted(m_conflicts.begin(), m_conflicts.end());
+	std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second != b.second ? a.second > b.second : a.first < b.first; });
+	if (sorted.size() > topCount)
+		sorted.resize(topCount);
+
+	fprintf(fp, "\n  %-10s %-10s %12s\n", "line", "evicted", "count");
+	for (auto& entry : sorted)
+		fprintf(fp, "  0x%08X 0x%08X %12llu\n", uint32_t(entry.first >> 32), uint32_t(entry.first), (unsigned long long)entry.second);
+	fprintf(fp, "\n");
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unordered_map>
+
+// Cost model for instruction execution and the caches, defaults are the flat costs
+// the emulator has always used. Setting AXI latency or beat cycles switches misses
+// over to burst timing, where evicting a dirty line costs a burst write on top.
+struct SCacheTiming
+{
+	uint32_t instructionCycles{ 4 };	// Per instruction: cache read + read registers + dispatch
+	uint32_t dcacheHitCycles{ 4 };
+	uint32_t dcacheMissCycles{ 80 };	// Flat D$ miss cost without burst timing
+	uint32_t icacheMissCycles{ 0 };		// Flat I$ miss cost without burst timing
+	uint32_t axiLatency{ 0 };			// Cycles before the first beat of a burst
+	uint32_t axiBeatCycles{ 0 };		// Cycles per beat
+	uint32_t axiBeats{ 4 };				// 64 byte cache line over the 128 bit bus
+	bool icacheModel{ false };			// Also run code from the decoded block cache through the I$
+
+	bool BurstTiming() const { return axiLatency != 0 || axiBeatCycles != 0; }
+	uint32_t BurstCycles() const { return axiLatency + axiBeats * axiBeatCycles; }
+	uint32_t DataMissCycles(bool writeback) const { return BurstTiming() ? BurstCycles() * (writeback ? 2 : 1) : dcacheMissCycles; }
+	uint32_t InstructionMissCycles() const { return BurstTiming() ? BurstCycles() : icacheMissCycles; }
+};
+
+// Either a preset name or a comma separated list of key=value pairs, see README.md
+bool ParseCacheTiming(const char* spec, SCacheTiming& timing);
+
+struct SCacheEvents
+{
+	uint64_t imisses{ 0 };
+	uint64_t dmisses{ 0 };
+	uint64_t evictions{ 0 };	// Misses that replaced another valid line
+	uint64_t writebacks{ 0 };	// Misses that had to write a dirty line back first
+
+	uint64_t Total() const { return imisses + dmisses + evictions + writebacks; }
+};
+
+// Where one hart's cache misses happen, by guest PC, by 64 byte line address
+// and by which line evicted which (conflict thrash between the two)
+class CCacheStats
+{
+public:
+	void InstructionMiss(uint32_t pc, uint32_t victim, bool evicted);
+	void DataMiss(uint32_t pc, uint32_t address, uint32_t victim, bool evicted, bool writeback);
+
+	// Sorted by count, topCount entries per table
+	void Report(FILE* fp, uint32_t hartid, uint32_t topCount);
+
+private:
+	void Conflict(uint32_t line, uint32_t victim);
+
+	SCacheEvents m_totals;
+	std::unordered_map<uint32_t, SCacheEvents> m_byPC;
+	std::unordered_map<uint32_t, SCacheEvents> m_byLine;
+	// Incoming line in the upper 32 bits, the line it replaced in the lower
+	std::unordered_map<uint64_t, uint64_t> m_conflicts;
+};
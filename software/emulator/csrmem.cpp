@@ -3,6 +3,7 @@
 #include "csrmem.h"
 #include "bus.h"
 #include "uart.h"
+#include "snapshot.h"
 
 void CCSRMem::Reset()
 {
@@ -26,6 +27,7 @@ void CCSRMem::Reset()
 	m_mepcshadow = 0;
 	m_mieshadow = 0;
 	m_mtvecshadow = 0;
+	m_regbank = 0;
 
 	m_cycle = 0x0000000000000000;
 	m_wallclocktime = 0x0000000000000000;
@@ -68,9 +70,17 @@ void CCSRMem::Tick(CBus* bus)
 	m_irq = (timerInterrupt << 1) | (hwInterrupt);
 }
 
+// Register shadow window shows the selected bank
+static inline uint32_t BankedIndex(uint32_t csrindex, uint32_t regbank)
+{
+	if ((csrindex & ~0x1F) == CSR_REGISTERSHADOW)
+		return CSR_REGISTERBANKS + (regbank << 5) + (csrindex & 0x1F);
+	return csrindex;
+}
+
 void CCSRMem::Read(uint32_t address, uint32_t& data)
 {
-	uint32_t csrindex = (address >> 2) & 0xFFF;
+	uint32_t csrindex = BankedIndex((address >> 2) & 0xFFF, m_regbank);
 	//if (csrindex == CSR_MSCRATCH)
 	//	__debugbreak();
 
@@ -98,7 +108,7 @@ void CCSRMem::Read(uint32_t address, uint32_t& data)
 
 void CCSRMem::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 {
-	uint32_t csrindex = (address >> 2) & 0xFFF;
+	uint32_t csrindex = BankedIndex((address >> 2) & 0xFFF, m_regbank);
 	//if (csrindex == CSR_MSCRATCH)
 	//	__debugbreak();
 
@@ -119,4 +129,26 @@ void CCSRMem::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 		m_mstatusieshadow = SelectBitRange(word, 3, 3); // Only ie bit is shadowed
 	else if (csrindex == CSR_MTVEC)
 		m_mtvecshadow = word;
+	else if (csrindex == CSR_REGISTERBANK)
+		m_regbank = word & 0x1F;
+}
+
+void CCSRMem::Serialize(CSnapshot& snap)
+{
+	snap.Bytes(m_csrmem, 4096 * sizeof(uint32_t));
+	snap.Value(m_retired);
+	snap.Value(m_cycle);
+	snap.Value(m_wallclocktime);
+	snap.Value(m_pc);
+	snap.Value(m_timecmpshadow);
+	snap.Value(m_mepcshadow);
+	snap.Value(m_mieshadow);
+	snap.Value(m_mtvecshadow);
+	snap.Value(m_sie);
+	snap.Value(m_irq);
+	snap.Value(m_pendingCPUReset);
+	snap.Value(m_cpuresetreq);
+	snap.Value(m_mstatusieshadow);
+	snap.Value(m_irqstate);
+	snap.Value(m_regbank);
 }
@@ -27,6 +27,9 @@
 #define CSR_MIMPID			0xF13
 #define CSR_MHARTID			0xF14
 #define CSR_REGISTERSHADOW	0x8A0
+#define CSR_REGISTERBANK	0x8C0
+// Storage for the 32 register banks the shadow window can map to
+#define CSR_REGISTERBANKS	0x400
 
 // Custom CSRs
 #define CSR_CPURESET		0xFEE
@@ -50,6 +53,9 @@ public:
 	void SetRetiredInstructions(uint64_t retired) { m_retired = retired; }
 	void SetPC(uint32_t pc) { m_pc = pc; }
 	void RequestReset() { m_cpuresetreq = 1; }
+	// Wall clock time the timer interrupt fires at, ~0 while it can't fire
+	uint64_t NextTimerInterrupt() const { return ((m_mieshadow & 0x2) && m_mstatusieshadow) ? m_timecmpshadow : ~0ull; }
+	void Serialize(CSnapshot& snap);
 
 	uint64_t m_retired{ 0 };
 	uint64_t m_cycle{ 0 };
@@ -71,4 +77,5 @@ private:
 	uint32_t m_cpuresetreq{ 0 };
 	uint32_t m_mstatusieshadow{ 0 };
 	uint32_t m_irqstate{ 0 };
+	uint32_t m_regbank{ 0 };
 };
@@ -1,14 +1,20 @@
 #include <stdio.h>
+#include <string.h>
 #include "emulator.h"
+#include "snapshot.h"
 
 CEmulator::~CEmulator()
 {
+	StopHartThreads();
+
 	if (m_rombin)
 		delete[] m_rombin;
 	if (m_bus)
 		delete m_bus;
 	if (m_cpu[0]) delete m_cpu[0];
 	if (m_cpu[1]) delete m_cpu[1];
+	if (m_cachestats[0]) delete m_cachestats[0];
+	if (m_cachestats[1]) delete m_cachestats[1];
 }
 
 bool CEmulator::Reset(const char* romFile, uint32_t resetvector)
@@ -60,8 +66,225 @@ void CEmulator::Step(uint64_t wallclock)
 {
 	++m_steps;
 	m_bus->Tick();
-	m_cpu[0]->Tick(wallclock, m_bus);
-	m_cpu[1]->Tick(wallclock, m_bus);
+
+	if (m_quantum == 0)
+	{
+		m_cpu[0]->Tick(wallclock, m_bus);
+		m_cpu[1]->Tick(wallclock, m_bus);
+	}
+	else
+	{
+		// Devices and interrupt lines were updated above while both harts
+		// were parked, release them for one quantum and wait for them to return
+		m_quantumWallclock = wallclock;
+		m_quantumStart->arrive_and_wait();
+		m_quantumEnd->arrive_and_wait();
+	}
+
+	if (m_profiler)
+	{
+		m_profiler->Sample(m_bus, m_cpu[0]);
+		m_profiler->Sample(m_bus, m_cpu[1]);
+	}
+}
+
+void CEmulator::DebugStop()
+{
+	std::unique_lock<std::mutex> lock(m_debugLock);
+	++m_debugStop;
+	m_debugSignal.wait(lock, [this] { return m_debugParked; });
+}
+
+void CEmulator::DebugResume()
+{
+	std::lock_guard<std::mutex> lock(m_debugLock);
+	if (--m_debugStop == 0)
+		m_debugSignal.notify_all();
+}
+
+bool CEmulator::DebugPark()
+{
+	// Only the rare stop request pays for the lock
+	if (m_debugStop.load(std::memory_order_relaxed) == 0)
+		return false;
+
+	std::unique_lock<std::mutex> lock(m_debugLock);
+	if (m_debugStop == 0)
+		return false;
+	m_debugParked = true;
+	m_debugSignal.notify_all();
+	m_debugSignal.wait(lock, [this] { return m_debugStop == 0; });
+	m_debugParked = false;
+	return true;
+}
+
+uint64_t CEmulator::IdleUntil()
+{
+	uint64_t wake = ~0ull;
+	for (uint32_t i = 0; i < 2; ++i)
+	{
+		CCSRMem* csr = m_bus->GetCSR(i);
+		if (!m_cpu[i]->IsWaitingForInterrupt() || csr->m_irq)
+			return 0;
+		uint64_t timer = csr->NextTimerInterrupt();
+		wake = timer < wake ? timer : wake;
+	}
+	return wake;
+}
+
+void CEmulator::SetHartThreads(uint32_t quantum)
+{
+	StopHartThreads();
+
+	m_quantum = quantum;
+	if (m_quantum == 0)
+		return;
+
+	// Main thread plus one thread per hart
+	m_quantumStart = new std::barrier<>(3);
+	m_quantumEnd = new std::barrier<>(3);
+	m_bus->SetHartThreads(true);
+	m_hartsAlive = true;
+	m_hartThread[0] = std::thread(&CEmulator::HartThread, this, 0);
+	m_hartThread[1] = std::thread(&CEmulator::HartThread, this, 1);
+}
+
+void CEmulator::StopHartThreads()
+{
+	if (m_hartsAlive)
+	{
+		// Release the harts from the start barrier so they can see the stop request
+		m_hartsAlive = false;
+		m_quantumStart->arrive_and_wait();
+		m_hartThread[0].join();
+		m_hartThread[1].join();
+	}
+
+	if (m_quantumStart)
+	{
+		delete m_quantumStart;
+		delete m_quantumEnd;
+		m_quantumStart = nullptr;
+		m_quantumEnd = nullptr;
+	}
+
+	if (m_bus)
+		m_bus->SetHartThreads(false);
+	m_quantum = 0;
+}
+
+void CEmulator::HartThread(uint32_t hartid)
+{
+	CRV32* cpu = m_cpu[hartid];
+	CBus::SetThreadHart(hartid);
+
+	while (true)
+	{
+		m_quantumStart->arrive_and_wait();
+		if (!m_hartsAlive)
+			break;
+
+		// Blocks that retire nothing (WFI, waiting on a branch, breakpoints) still count
+		// as one instruction so an idle hart reaches the barrier in bounded time
+		uint32_t executed = 0;
+		while (executed < m_quantum)
+		{
+			uint64_t retired = cpu->m_retired;
+			cpu->Tick(m_quantumWallclock, m_bus);
+			uint64_t count = cpu->m_retired - retired;
+			executed += count ? (uint32_t)count : 1;
+
+			// Device access outside of this hart's CSRs, end the quantum early so
+			// the device gets ticked before this hart sees its response
+			if (CBus::TakeSyncRequest())
+				break;
+		}
+
+		m_quantumEnd->arrive_and_wait();
+	}
+}
+
+void CEmulator::SetCacheModel(const SCacheTiming& timing, bool collectStats)
+{
+	SCacheTiming model = timing;
+	for (uint32_t i = 0; i < 2; ++i)
+	{
+		if (collectStats && !m_cachestats[i])
+			m_cachestats[i] = new CCacheStats();
+
+		// Code runs from decoded blocks most of the time, which only shows up in the stats through the I$ model
+		if (collectStats)
+			model.icacheModel = true;
+
+		m_cpu[i]->SetCacheModel(model, m_cachestats[i]);
+	}
+}
+
+void CEmulator::SetProfiler(CProfiler* profiler)
+{
+	m_profiler = profiler;
+	m_cpu[0]->m_profiler = profiler;
+	m_cpu[1]->m_profiler = profiler;
+}
+
+bool CEmulator::WriteCacheReport(const char* filename)
+{
+	if (!m_cachestats[0])
+		return false;
+
+	FILE* fp = strcmp(filename, "-") == 0 ? stderr : fopen(filename, "w");
+	if (!fp)
+	{
+		fprintf(stderr, "Could not open '%s' for the cache report\n", filename);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < 2; ++i)
+		m_cachestats[i]->Report(fp, i, 32);
+
+	if (fp != stderr)
+		fclose(fp);
+	return true;
+}
+
+bool CEmulator::SaveSnapshot(const char* filename)
+{
+	CSnapshot snap(true);
+	m_bus->Serialize(snap);
+	m_cpu[0]->Serialize(snap);
+	m_cpu[1]->Serialize(snap);
+	snap.Value(m_steps);
+	snap.Value(m_virtualCycles);
+	return snap.Save(filename);
+}
+
+bool CEmulator::LoadSnapshot(const char* filename)
+{
+	CSnapshot snap(false);
+	if (!snap.Load(filename))
+		return false;
+
+	// Restoring into a fresh emulator skips the ROM load and sdcard image build
+	if (!m_bus)
+	{
+		m_bus = new CBus(0);
+		m_cpu[0] = new CRV32(0, 0);
+		m_cpu[1] = new CRV32(1, 0);
+	}
+
+	m_bus->Serialize(snap);
+	m_cpu[0]->Serialize(snap);
+	m_cpu[1]->Serialize(snap);
+	snap.Value(m_steps);
+	snap.Value(m_virtualCycles);
+
+	if (!snap.IsValid())
+	{
+		fprintf(stderr, "Snapshot '%s' is incomplete, machine state is undefined\n", filename);
+		return false;
+	}
+
+	return true;
 }
 
 void CEmulator::UpdateVideoLink(uint32_t *pixels, int scanline, int pitch)
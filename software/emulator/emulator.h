@@ -1,7 +1,13 @@
 #pragma once
 
+#include <thread>
+#include <barrier>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "bus.h"
 #include "rv32.h"
+#include "profiler.h"
 
 class CEmulator
 {
@@ -11,6 +17,23 @@ public:
 
 	bool Reset(const char* romFile, uint32_t resetvector);
 	void Step(uint64_t wallclock);
+	void SetHartThreads(uint32_t quantum);
+	// Wall clock time of the next timer interrupt while both harts sit in WFI with nothing pending,
+	// zero while any of them has work to do, ~0 if nothing is ever going to wake them
+	uint64_t IdleUntil();
+
+	// Cost model for both harts, optionally keeping track of where misses happen for WriteCacheReport()
+	void SetCacheModel(const SCacheTiming& timing, bool collectStats);
+	// Pass nullptr to stop profiling, the profiler stays owned by the caller
+	void SetProfiler(CProfiler* profiler);
+	// Sorted miss attribution of both harts, '-' writes to stderr
+	bool WriteCacheReport(const char* filename);
+
+	// Whole machine state, a restore can also stand in for Reset()
+	bool SaveSnapshot(const char* filename);
+	bool LoadSnapshot(const char* filename);
+	// Emulated wall clock as of the last step, a restored snapshot carries on from its saved time
+	uint64_t GetWallclock() { return m_bus->GetCSR(0)->m_wallclocktime; }
 	void UpdateVideoLink(uint32_t* pixels, int pitch, int scanline);
 	void QueueBytes(uint8_t *bytes, uint32_t count);
 	void QueueByte(uint8_t byte);
@@ -23,13 +46,41 @@ public:
 
 	int m_audioDevice {0};
 
-	int m_debugStop{ 0 };
-	int m_debugAck{ 0 };
+	// The debugger and snapshots park the emulator thread between steps.
+	// DebugStop() returns once the thread is parked, stops nest and each needs a DebugResume().
+	void DebugStop();
+	void DebugResume();
+	// Called by the emulator thread before each step, returns true after sitting out a stop
+	bool DebugPark();
 
 	CBus* m_bus{ nullptr };
 	CRV32* m_cpu[2]{ nullptr, nullptr };
+	CCacheStats* m_cachestats[2]{ nullptr, nullptr };
 
 	uint8_t* m_rombin{ nullptr };
 	uint32_t m_romsize{ 0 };
 	uint32_t m_steps{ 0 };
+	// Modeled cycles behind the wall clock of headless runs, kept in snapshots
+	uint64_t m_virtualCycles{ 0 };
+
+	// Samples both harts after every instruction and step while set, see SetProfiler()
+	CProfiler* m_profiler{ nullptr };
+
+private:
+	void HartThread(uint32_t hartid);
+
+	std::atomic<int> m_debugStop{ 0 };
+	bool m_debugParked{ false };
+	std::mutex m_debugLock;
+	std::condition_variable m_debugSignal;
+	void StopHartThreads();
+
+	// Zero runs both harts in lock-step on the caller's thread (deterministic)
+	// Otherwise each hart runs this many instructions on its own thread between barriers
+	uint32_t m_quantum{ 0 };
+	uint64_t m_quantumWallclock{ 0 };
+	std::atomic<bool> m_hartsAlive{ false };
+	std::barrier<>* m_quantumStart{ nullptr };
+	std::barrier<>* m_quantumEnd{ nullptr };
+	std::thread m_hartThread[2];
 };
@@ -1,231 +1,327 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
 
 #include "gdbstub.h"
+#include "taskcontext.h"
 
 static int s_currentCPU = 0;
 static int s_currentTask = 0;
 
-// These are from task.h in the SDK folder
-
-#define TASK_MAX 4
-
-enum ETaskState
-{
-	TS_UNKNOWN,
-	TS_PAUSED,
-	TS_RUNNING,
-	TS_TERMINATING,
-	TS_TERMINATED
-};
-
-struct STask {
-	uint32_t HART;			// HART affinity mask (for migration)
-	uint32_t runLength;		// Time slice dedicated to this task
-	enum ETaskState state;	// State of this task
-	uint32_t exitCode;		// Task termination exit code
-	uint32_t regs[32];		// Integer registers - NOTE: register zero here is actually the PC, 128 bytes
-
-	// Debug support - this will probably move somewhere else
-	char name[16];			// Name of this task
-};
-
-// 672 bytes total for one core (1344 for two cores)
-struct STaskContext {
-	// 160 x 4 bytes (640)
-	struct STask tasks[TASK_MAX];	// List of all the tasks
-	// 32 bytes total below
-	int32_t currentTask;			// Current task index
-	int32_t numTasks;				// Number of tasks
-	int32_t kernelError;			// Current kernel error
-	int32_t kernelErrorData[3];		// Data relevant to the crash
-	int32_t hartID;					// Id of the HART where this task context runs
-};
+// Replies to a whole batch of incoming packets pile up here and leave with one send
+static std::string s_outgoing;
+
+static const char s_hexdigits[] = "0123456789abcdef";
+
+// Device memory the debugger may touch, anything else on the device bus has side effects
+// on read (UART and SD card FIFOs, atomics) and is left alone. Matches the memory map below.
+#define GDB_SPAD_SIZE 0x4000
+#define GDB_MAIL_SIZE 0x4000
 
 // ------------------------------------------------------------
 
 void StopEmulatorThread(CEmulator* emulator)
 {
-	emulator->m_debugStop = 1;
-	do {} while (!emulator->m_debugAck);
+	emulator->DebugStop();
 }
 
 void ResumeEmulatorThread(CEmulator* emulator)
 {
-	emulator->m_debugStop = 0;
-}
-
-uint8_t gdbchecksum(const char *data)
-{
-	uint8_t sum = 0;
-	while (*data)
-	{
-		sum += (uint8_t)*data++;
-	}
-	return sum;
+	emulator->DebugResume();
 }
 
-void gdbplainpacket(socket_t gdbsocket, const char* buffer)
+bool gdbvalidsocket(socket_t gdbsocket)
 {
-	char response[16384];
-	snprintf(response, 16384, "$%s#%02x", buffer, gdbchecksum(buffer));
 #ifdef CAT_WINDOWS
-	send(gdbsocket, response, (int)strlen(response), 0);
+	return gdbsocket != INVALID_SOCKET;
 #else
-	write(gdbsocket, response, strlen(response));
-#endif
-
-#ifdef GDB_COMM_DEBUG
-	fprintf(stderr, "< %s\n", response);
+	return gdbsocket >= 0;
 #endif
 }
 
-void gdbresponsepacket(socket_t gdbsocket, const char* buffer)
+void gdbsetnonblocking(socket_t gdbsocket)
 {
-	char response[16384];
-	snprintf(response, 16384, "+$%s#%02x", buffer, gdbchecksum(buffer));
 #ifdef CAT_WINDOWS
-	send(gdbsocket, response, (int)strlen(response), 0);
+	u_long nonBlocking = 1;
+	if (ioctlsocket(gdbsocket, FIONBIO, &nonBlocking) == SOCKET_ERROR)
+		fprintf(stderr, "ERROR: Socket can't be set to nonblocking mode\n");
 #else
-	write(gdbsocket, response, strlen(response));
-#endif
-#ifdef GDB_COMM_DEBUG
-	fprintf(stderr, "< %s\n", response);
+	int flags = fcntl(gdbsocket, F_GETFL, 0);
+	if (flags == -1 || fcntl(gdbsocket, F_SETFL, flags | O_NONBLOCK) == -1)
+		fprintf(stderr, "ERROR: Socket can't be set to nonblocking mode\n");
 #endif
 }
 
-void gdbresponseack(socket_t gdbsocket)
+bool gdbwouldblock()
 {
-	char response[4];
-	snprintf(response, 4, "+");
 #ifdef CAT_WINDOWS
-	send(gdbsocket, response, (int)strlen(response), 0);
+	return WSAGetLastError() == WSAEWOULDBLOCK;
 #else
-	write(gdbsocket, response, strlen(response));
-#endif
-#ifdef GDB_COMM_DEBUG
-	fprintf(stderr, "< %s\n", response);
+	return errno == EAGAIN || errno == EWOULDBLOCK;
 #endif
 }
 
-void gdbresponsenack(socket_t gdbsocket)
+void gdbclosesocket(socket_t gdbsocket)
 {
-	char response[4];
-	snprintf(response, 4, "-");
 #ifdef CAT_WINDOWS
-	send(gdbsocket, response, (int)strlen(response), 0);
+	closesocket(gdbsocket);
 #else
-	write(gdbsocket, response, strlen(response));
+	close(gdbsocket);
 #endif
+}
+
+uint8_t gdbchecksum(const char *data, size_t len)
+{
+	uint8_t sum = 0;
+	for (size_t i = 0; i < len; ++i)
+		sum += (uint8_t)data[i];
+	return sum;
+}
+
+void gdbresponsepacket(const char* buffer, size_t len)
+{
+	uint8_t sum = gdbchecksum(buffer, len);
+	s_outgoing += '$';
+	s_outgoing.append(buffer, len);
+	s_outgoing += '#';
+	s_outgoing += s_hexdigits[sum >> 4];
+	s_outgoing += s_hexdigits[sum & 0xF];
 #ifdef GDB_COMM_DEBUG
-	fprintf(stderr, "< %s\n", response);
+	fprintf(stderr, "< %.*s\n", (int)len, buffer);
 #endif
 }
 
-void gdbreadthreads(socket_t gdbsocket, CEmulator* emulator, const char* buffer)
+void gdbresponsepacket(const char* buffer)
+{
+	gdbresponsepacket(buffer, strlen(buffer));
+}
+
+void gdbresponsepacket(const std::string& buffer)
+{
+	gdbresponsepacket(buffer.data(), buffer.size());
+}
+
+void gdbappendhex(std::string& out, const uint8_t* data, size_t len)
+{
+	size_t at = out.size();
+	out.resize(at + len * 2);
+	for (size_t i = 0; i < len; ++i)
+	{
+		out[at++] = s_hexdigits[data[i] >> 4];
+		out[at++] = s_hexdigits[data[i] & 0xF];
+	}
+}
+
+// Binary replies escape the characters that have a meaning in the packet framing
+void gdbappendbinary(std::string& out, const char* data, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+	{
+		char c = data[i];
+		if (c == '$' || c == '#' || c == '}' || c == '*')
+		{
+			out += '}';
+			out += (char)(c ^ 0x20);
+		}
+		else
+			out += c;
+	}
+}
+
+// Undoes the escaping of binary packet data, returns the number of bytes decoded
+uint32_t gdbdecodebinary(const char* buffer, size_t available, uint8_t* data, uint32_t len)
+{
+	uint32_t i = 0;
+	size_t at = 0;
+	while (i < len && at < available)
+	{
+		if (buffer[at] == '}' && at + 1 < available) // Escape sequence
+		{
+			data[i++] = buffer[at + 1] ^ 0x20;
+			at += 2;
+		}
+		else // Normal character
+			data[i++] = buffer[at++];
+	}
+	return i;
+}
+
+bool gdbflush(socket_t gdbsocket)
+{
+	size_t sent = 0;
+	while (sent < s_outgoing.size())
+	{
+		int n = (int)send(gdbsocket, s_outgoing.data() + sent, (int)(s_outgoing.size() - sent), 0);
+		if (n > 0)
+		{
+			sent += n;
+			continue;
+		}
+
+		if (n == 0 || !gdbwouldblock())
+		{
+			s_outgoing.clear();
+			return false;
+		}
+
+		// Socket buffer is full, wait until gdb reads some of it
+		struct pollfd fds;
+		fds.fd = gdbsocket;
+		fds.events = POLLOUT;
+		fds.revents = 0;
+		gdbpoll(&fds, 1, 100);
+	}
+
+	s_outgoing.clear();
+	return true;
+}
+
+// Answers a qXfer read of the given document, the request ends in :offset,length
+void gdbxferreply(const std::string& document, const char* buffer)
 {
-	char response[16384];
-	snprintf(response, 16384, "l<?xml version=\"1.0\"?>\n<threads>\n");
+	const char* range = strrchr(buffer, ':');
+	uint32_t offset = 0, length = 0;
+	if (!range || sscanf(range + 1, "%x,%x", &offset, &length) != 2)
+	{
+		gdbresponsepacket("E00");
+		return;
+	}
+
+	if (offset >= document.size())
+	{
+		gdbresponsepacket("l");
+		return;
+	}
+
+	size_t count = document.size() - offset;
+	if (count > length)
+		count = length;
+
+	// 'm' tells gdb there's more to come, 'l' marks the last piece
+	std::string reply = offset + count < document.size() ? "m" : "l";
+	gdbappendbinary(reply, document.data() + offset, count);
+	gdbresponsepacket(reply);
+}
+
+void gdbreadthreads(CEmulator* emulator, const char* buffer)
+{
+	std::string document = "<?xml version=\"1.0\"?>\n<threads>\n";
 
 	StopEmulatorThread(emulator);
 
+	// Access the task contexts of the CPUs
+	struct STaskContext* contextpool = (struct STaskContext *)emulator->m_bus->GetHostAddress(DEVICE_MAIL);
 	for (int cpu = 0; cpu < 2; ++cpu)
 	{
-		CRV32 *core = emulator->m_cpu[cpu];
-
-		// Access the task context of the CPU
-		struct STaskContext* contextpool = (struct STaskContext *)emulator->m_bus->GetHostAddress(DEVICE_MAIL);
 		struct STaskContext& ctx = contextpool[cpu];
-
-		for (int j = 0; j < ctx.numTasks; ++j)
+		// The guest can leave anything in here, don't walk past the task array
+		int numTasks = ctx.numTasks < 0 ? 0 : (ctx.numTasks > TASK_MAX ? TASK_MAX : ctx.numTasks);
+		for (int j = 0; j < numTasks; ++j)
 		{
 			struct STask* task = &ctx.tasks[j];
 			// Apparently GDB expects thread IDs across CPUs to be unique
-			snprintf(response, 1024, "%s\t<thread id=\"%d\" core=\"%d\" name=\"%s:%d\" handle=\"%x\"> </thread>\n", response, (cpu*TASK_MAX+j)+1, cpu, task->name, cpu, cpu*TASK_MAX+j);
+			char line[128];
+			snprintf(line, 128, "\t<thread id=\"%d\" core=\"%d\" name=\"%.*s:%d\" handle=\"%x\"> </thread>\n", (cpu*TASK_MAX+j)+1, cpu, (int)sizeof(task->name), task->name, cpu, cpu*TASK_MAX+j);
+			document += line;
 		}
 	}
 
 	ResumeEmulatorThread(emulator);
 
-	strcat(response, "</threads>\n");
-	gdbresponsepacket(gdbsocket, response);
+	document += "</threads>\n";
+	gdbxferreply(document, buffer);
+}
+
+void gdbreadmemorymap(const char* buffer)
+{
+	// System memory, then the memory backed devices that are safe to read (no FIFOs, no atomics)
+	static const std::string document =
+		"<?xml version=\"1.0\"?>\n"
+		"<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" \"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n"
+		"<memory-map>\n"
+		"\t<memory type=\"ram\" start=\"0x00000000\" length=\"0x10000000\"/>\n"
+		"\t<memory type=\"ram\" start=\"0x80000000\" length=\"0x4000\"/>\n"	// GDB_SPAD_SIZE
+		"\t<memory type=\"ram\" start=\"0x80070000\" length=\"0x4000\"/>\n"	// GDB_MAIL_SIZE
+		"</memory-map>\n";
+	gdbxferreply(document, buffer);
 }
 
-void gdbprocessquery(socket_t gdbsocket, CEmulator* emulator, const char* buffer)
+void gdbprocessquery(CEmulator* emulator, const char* buffer)
 {
 	// Check the query type
 	if (strstr(buffer, "qAttached") == buffer)
 	{
 		// Attached query : 0-new process, 1-attached
-		int pid = 0;
-		const char* pidstr = strchr(buffer, ':');
-		if (pidstr)
-			sscanf(buffer, ":%x", &pid);
-		fprintf(stderr, "Attached pid: %d\n", pid);
-		gdbresponsepacket(gdbsocket, "1");
+		gdbresponsepacket("1");
 	}
 	else if (strstr(buffer, "qOffsets") == buffer)
 	{
-		gdbresponsepacket(gdbsocket, "Text=0;Data=0;Bss=0");
+		gdbresponsepacket("Text=0;Data=0;Bss=0");
 	}
 	else if (strstr(buffer, "qXfer:threads:read:") == buffer)
 	{
 		// Read threads query
-		gdbreadthreads(gdbsocket, emulator, buffer);
+		gdbreadthreads(emulator, buffer);
+	}
+	else if (strstr(buffer, "qXfer:memory-map:read:") == buffer)
+	{
+		gdbreadmemorymap(buffer);
 	}
 	else if (strstr(buffer, "qTStatus") == buffer)
 	{
 		// Status query
-		gdbresponsepacket(gdbsocket, "");
+		gdbresponsepacket("");
 	}
 	else if (strstr(buffer, "qSupported") == buffer)
 	{
-		// Supported query (packetsize is hex therefore 0x1000==4096 bytes)
-		gdbresponsepacket(gdbsocket, "PacketSize=1000;qXfer:threads:read+;swbreak+;"); // QNonStop+
+		// Supported query (packetsize is hex)
+		char response[128];
+		snprintf(response, 128, "PacketSize=%x;qXfer:threads:read+;qXfer:memory-map:read+;swbreak+;", GDB_PACKET_SIZE); // QNonStop+
+		gdbresponsepacket(response);
 	}
 	else if (strstr(buffer, "qSymbol") == buffer)
 	{
 		// No symbol query support
-		gdbresponsepacket(gdbsocket, "");
-	}
-	else if (strstr(buffer, "qfThreadInfo") == buffer)
-	{
-		// Thread info query
-		fprintf(stderr, "Thread info\n");
+		gdbresponsepacket("");
 	}
 	else if (strstr(buffer, "qC") == buffer)
 	{
 		// we don't support this
-		gdbresponsepacket(gdbsocket, "");
+		gdbresponsepacket("");
 	}
 	/*else if (strstr(buffer, "QNonStop") == buffer)
 	{
 		// Enter/Exit non-stop mode
-		gdbresponsepacket(gdbsocket, "OK");
+		gdbresponsepacket("OK");
 	}*/
 	else
 	{
-		// Unknown query
+		// Unknown query, an empty reply tells gdb it's not supported
+#if defined(GDB_COMM_DEBUG)
 		fprintf(stderr, "Unknown query: %s\n", buffer);
+#endif
+		gdbresponsepacket("");
 	}
 }
 
-void gdbvcont(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbvcont(CEmulator* emulator, char* buffer)
 {
 	// Skip 'vCont'
 	buffer += 5;
 
 	//> $vCont;s:1;c#c1
 
-	// Parse commands
+	// Parse commands, continue and step only get a stop reply once the CPU halts again
 	char* command = strtok(buffer, ";");
-	int respond = 0;
 	while (command != NULL)
 	{
 		if (strstr(command, "?") == command)
 		{
 			// vCont query
-			gdbresponsepacket(gdbsocket, "vCont;s;S;c;C;");
+			gdbresponsepacket("vCont;s;S;c;C;");
 		}
 		else if (strstr(command, "c") == command)
 		{
@@ -239,7 +335,6 @@ void gdbvcont(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 			}
 
 			ResumeEmulatorThread(emulator);
-			respond = 1;
 		}
 		else if (strstr(command, "s") == command)
 		{
@@ -253,7 +348,6 @@ void gdbvcont(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 			}
 
 			ResumeEmulatorThread(emulator);
-			respond = 1;
 		}
 		else
 		{
@@ -264,12 +358,9 @@ void gdbvcont(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 		}
 		command = strtok(NULL, ";");
 	}
-
-	if (respond)
-		gdbresponseack(gdbsocket);
 }
 
-void gdbkillprocess(socket_t gdbsocket, uint32_t hartid, int proc, CEmulator* emulator, char* buffer)
+void gdbkillprocess(uint32_t hartid, int proc, CEmulator* emulator, char* buffer)
 {
 	StopEmulatorThread(emulator);
 
@@ -280,14 +371,13 @@ void gdbkillprocess(socket_t gdbsocket, uint32_t hartid, int proc, CEmulator* em
 	{
 		if (cpu == hartid || hartid == -1)
 		{
-			CRV32 *core = emulator->m_cpu[cpu];
-
 			// Access the task context of the CPU
 			struct STaskContext* contextpool = (struct STaskContext *)emulator->m_bus->GetHostAddress(DEVICE_MAIL);
 			struct STaskContext& ctx = contextpool[cpu];
 
 			// Set task state to terminating
-			for (int t = 0; t < ctx.numTasks; ++t)
+			int numTasks = ctx.numTasks < 0 ? 0 : (ctx.numTasks > TASK_MAX ? TASK_MAX : ctx.numTasks);
+			for (int t = 0; t < numTasks; ++t)
 			{
 				struct STask* task = &ctx.tasks[t];
 
@@ -302,122 +392,145 @@ void gdbkillprocess(socket_t gdbsocket, uint32_t hartid, int proc, CEmulator* em
 	}
 
 	ResumeEmulatorThread(emulator);
-	gdbresponsepacket(gdbsocket, "OK");
+	gdbresponsepacket("OK");
 }
 
-void gdbreadregisters(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbreadregisters(CEmulator* emulator, char* buffer)
 {
-	char response[1024];
-
-	// x0
-	snprintf(response, 1024, "00000000");
+	uint32_t regs[33];
 
 	StopEmulatorThread(emulator);
 
-	// x1-x31
+	// x0-x31, then PC
 	CRV32* core = emulator->m_cpu[0];
+	regs[0] = 0;
 	for (int i = 1; i < 32; ++i)
+		regs[i] = core->m_GPR[i];
+	regs[32] = core->m_execPC;
+
+	ResumeEmulatorThread(emulator);
+
+	// Little endian byte order, same as the host
+	std::string response;
+	gdbappendhex(response, (const uint8_t*)regs, sizeof(regs));
+	gdbresponsepacket(response);
+}
+
+// Host copy of the scratchpad or mailbox range given, null when it falls outside them
+uint8_t* gdbdevicememory(CEmulator* emulator, uint32_t address, uint32_t len)
+{
+	if (address >= DEVICE_SPAD && address - DEVICE_SPAD < GDB_SPAD_SIZE && len <= GDB_SPAD_SIZE - (address - DEVICE_SPAD))
+		return (uint8_t*)emulator->m_bus->GetHostAddress(DEVICE_SPAD) + (address - DEVICE_SPAD);
+	if (address >= DEVICE_MAIL && address - DEVICE_MAIL < GDB_MAIL_SIZE && len <= GDB_MAIL_SIZE - (address - DEVICE_MAIL))
+		return (uint8_t*)emulator->m_bus->GetHostAddress(DEVICE_MAIL) + (address - DEVICE_MAIL);
+	return nullptr;
+}
+
+// Guest memory access for the debugger. System memory goes straight through the host copy
+// with the selected CPU's data cache on top, so do the scratchpad and mailbox. Reads from
+// the rest of the device range come back as zeros and writes to it are refused.
+void gdbreadguest(CEmulator* emulator, uint32_t address, uint8_t* data, uint32_t len)
+{
+	if (address < SYSMEM_SIZE && len <= SYSMEM_SIZE - address)
 	{
-		uint32_t reg = core->m_GPR[i];
-		snprintf(response, 1024, "%s%02X%02X%02X%02X",
-			response,
-			(reg >> 0) & 0xFF,
-			(reg >> 8) & 0xFF,
-			(reg >> 16) & 0xFF,
-			(reg >> 24) & 0xFF);
+		memcpy(data, emulator->m_bus->m_mem->GetHostByteAddress(address), len);
+
+		// Dirty cache lines hold newer data than memory
+		CRV32* core = emulator->m_cpu[s_currentCPU == 1 ? 1 : 0];
+		for (uint32_t word = address & ~3u; word < address + len; word += 4)
+		{
+			uint32_t cached;
+			if (!core->m_dcache.Peek(word, cached))
+				continue;
+			for (uint32_t b = 0; b < 4; ++b)
+			{
+				uint32_t at = word + b;
+				if (at >= address && at < address + len)
+					data[at - address] = (uint8_t)(cached >> (b * 8));
+			}
+		}
+		return;
 	}
 
-	// PC
+	uint8_t* device = gdbdevicememory(emulator, address, len);
+	if (device)
+		memcpy(data, device, len);
+	else
+		memset(data, 0, len);
+}
+
+bool gdbwriteguest(CEmulator* emulator, uint32_t address, const uint8_t* data, uint32_t len)
+{
+	// Write dirty lines back and forget what both CPUs cached so they see the new data
+	for (int cpu = 0; cpu < 2; ++cpu)
 	{
-		uint32_t reg = core->m_execPC;
-		snprintf(response, 1024, "%s%02X%02X%02X%02X",
-			response,
-			(reg >> 0) & 0xFF,
-			(reg >> 8) & 0xFF,
-			(reg >> 16) & 0xFF,
-			(reg >> 24) & 0xFF);
+		emulator->m_cpu[cpu]->m_dcache.Flush(emulator->m_bus);
+		emulator->m_cpu[cpu]->m_dcache.Discard();
+		emulator->m_cpu[cpu]->m_icache.Discard();
 	}
 
-	ResumeEmulatorThread(emulator);
+	if (address < SYSMEM_SIZE && len <= SYSMEM_SIZE - address)
+	{
+		CSysMem* mem = emulator->m_bus->m_mem;
+		memcpy(mem->GetHostByteAddress(address), data, len);
+		// Same bookkeeping a bus write would do, decoded code and scanout can't miss the change
+		++mem->m_codeGeneration;
+		mem->MarkScanoutDirty();
+		return true;
+	}
 
-	//fprintf(stderr, "R:%s\n", response);
-	gdbresponsepacket(gdbsocket, response);
+	uint8_t* device = gdbdevicememory(emulator, address, len);
+	if (!device)
+		return false;
+	memcpy(device, data, len);
+	return true;
 }
 
-void gdbbinarypacket(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbbinarypacket(CEmulator* emulator, char* buffer, size_t packetlen)
 {
+	char* start = buffer;
+
 	// Skip 'X'
 	buffer++;
 
 	// Parse the address and length
-	uint32_t addrs;
-	uint32_t len;
-	uint32_t readoffset = sscanf(buffer, "%x,%x", &addrs, &len);
+	uint32_t addrs = 0;
+	uint32_t len = 0;
+	sscanf(buffer, "%x,%x", &addrs, &len);
 
 	// This is a support check if len is 0
 	if (len == 0)
 	{
 		// We support binary data
-		gdbresponsepacket(gdbsocket, "OK");
+		gdbresponsepacket("OK");
+		return;
 	}
-	else
-	{
-		// Skip the address and length
-		buffer = strchr(buffer, ':');
-		buffer++;
-
-		StopEmulatorThread(emulator);
 
-		// Decode the encoded binary data, paying attention to escape sequences and repeat counts
-		uint8_t* data = new uint8_t[len];
-		uint32_t i = 0;
-		uint8_t lastchar = 0;
-		while (i < len)
-		{
-			if (*buffer == '}') // Escape sequence
-			{
-				buffer++;
-				uint8_t original = *buffer ^ 0x20;
-				data[i++] = original;
-			}
-			else if (*buffer == '*') // Repeat last character as a sequence
-			{
-				buffer++;
-				uint8_t count = *buffer - 29;
-				for (uint8_t j = 0; j < count; ++j)
-					data[i++] = lastchar;
-			}
-			else // Normal character
-				data[i++] = *buffer;
-			lastchar = *buffer;
-			buffer++;
-		}
-
-		// Invalidate data and instruction caches of both CPUs and write incoming data to memory
-		emulator->m_cpu[0]->m_dcache.Flush(emulator->m_bus);
-		emulator->m_cpu[0]->m_dcache.Discard();
-		emulator->m_cpu[0]->m_icache.Discard();
-		emulator->m_cpu[1]->m_dcache.Flush(emulator->m_bus);
-		emulator->m_cpu[1]->m_dcache.Discard();
-		emulator->m_cpu[1]->m_icache.Discard();
-
-		// Write the binary data to memory as 4 byte words
-		for (uint32_t i = 0; i < len; i += 4)
-		{
-			uint32_t word = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (data[i + 3] << 24);
-			emulator->m_bus->Write(addrs + i, word, 0xF);
-		}
+	// Skip the address and length
+	buffer = (char*)memchr(buffer, ':', packetlen - 1);
+	if (!buffer)
+	{
+		gdbresponsepacket("E01");
+		return;
+	}
+	buffer++;
 
-		ResumeEmulatorThread(emulator);
+	std::vector<uint8_t> data(len);
+	if (gdbdecodebinary(buffer, packetlen - (buffer - start), data.data(), len) != len)
+	{
+		gdbresponsepacket("E01");
+		return;
+	}
 
-		delete[] data;
+	StopEmulatorThread(emulator);
+	bool written = gdbwriteguest(emulator, addrs, data.data(), len);
+	ResumeEmulatorThread(emulator);
 
-		// Respond with an ACK on successful memory write
-		gdbresponsepacket(gdbsocket, "OK");
-	}
+	// Respond with an ACK on successful memory write
+	gdbresponsepacket(written ? "OK" : "E01");
 }
 
-void gdbsetreg(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbsetreg(CEmulator* emulator, char* buffer)
 {
 	// Skip 'P'
 	buffer++;
@@ -444,10 +557,10 @@ void gdbsetreg(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 	fprintf(stderr, "Setting reg %d to %08X\n", reg, val);
 #endif
 
-	gdbresponsepacket(gdbsocket, "OK");
+	gdbresponsepacket("OK");
 }
 
-void gdbsetcurrentthread(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbsetcurrentthread(CEmulator* emulator, char* buffer)
 {
 	// Parse the thread id
 	int threadid;
@@ -458,152 +571,84 @@ void gdbsetcurrentthread(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 	s_currentCPU = threadid/TASK_MAX;
 	s_currentTask = threadid%TASK_MAX;
 
+#if defined(GDB_COMM_DEBUG)
 	fprintf(stderr, "Set current: CPU=%d Task=%d\n", s_currentCPU, s_currentTask);
+#endif
 
-	gdbresponsepacket(gdbsocket, "OK");
+	gdbresponsepacket("OK");
 }
 
-void gdbreadmemory(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbreadmemory(CEmulator* emulator, char* buffer)
 {
 	// Skip 'm'
 	buffer++;
 
 	// Parse the address and length
-	uint32_t addrs;
-	uint32_t len;
-	uint32_t readoffset = sscanf(buffer, "%x,%x", &addrs, &len);
+	uint32_t addrs = 0;
+	uint32_t len = 0;
+	sscanf(buffer, "%x,%x", &addrs, &len);
 
 #if defined(GDB_COMM_DEBUG)
 	fprintf(stderr, "READ @0x%08X %d\n", addrs, len);
 #endif
 
-	StopEmulatorThread(emulator);
-
-	// Read the memory
-	uint32_t maxlen = (len+1) * 2;
-	char* response = new char[maxlen];
-	response[0] = 0;
-
-	int wordcount = len>>2;
-	int leftover = len%4;
-
-	// Whole words
-	for (int i = 0; i < wordcount; i++)
-	{
-		uint32_t dataword;
-		emulator->m_bus->Read(addrs, dataword);
+	// Hex doubles the size, the reply has to fit the packet size we told gdb about
+	if (len > GDB_PACKET_SIZE/2)
+		len = GDB_PACKET_SIZE/2;
 
-		uint32_t b[4];
-		b[3] = SelectBitRange(dataword, 31, 24);
-		b[2] = SelectBitRange(dataword, 23, 16);
-		b[1] = SelectBitRange(dataword, 15, 8);
-		b[0] = SelectBitRange(dataword, 7, 0);
-
-		snprintf(response, maxlen, "%s%02X", response, b[0]);
-		snprintf(response, maxlen, "%s%02X", response, b[1]);
-		snprintf(response, maxlen, "%s%02X", response, b[2]);
-		snprintf(response, maxlen, "%s%02X", response, b[3]);
-
-		addrs += 4;
-	}
-
-	// Leftover bytes
-	if (leftover > 0)
-	{
-		uint32_t dataword;
-		emulator->m_bus->Read(addrs, dataword);
-
-		uint32_t b[4];
-		b[3] = SelectBitRange(dataword, 31, 24);
-		b[2] = SelectBitRange(dataword, 23, 16);
-		b[1] = SelectBitRange(dataword, 15, 8);
-		b[0] = SelectBitRange(dataword, 7, 0);
-
-		for (int i = 0; i < leftover; i++)
-			snprintf(response, maxlen, "%s%02X", response, b[i]);
-	}
+	std::vector<uint8_t> data(len);
 
+	StopEmulatorThread(emulator);
+	gdbreadguest(emulator, addrs, data.data(), len);
 	ResumeEmulatorThread(emulator);
 
-	gdbresponsepacket(gdbsocket, response);
-	delete[] response;
+	std::string response;
+	response.reserve(len * 2);
+	gdbappendhex(response, data.data(), len);
+	gdbresponsepacket(response);
 }
 
-void gdbwritememory(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbwritememory(CEmulator* emulator, char* buffer)
 {
 	// Skip 'M'
 	buffer++;
 
 	// Parse the address and length
-	uint32_t addrs;
-	uint32_t len;
-	uint32_t readoffset = sscanf(buffer, "%x,%x:", &addrs, &len);
+	uint32_t addrs = 0;
+	uint32_t len = 0;
+	sscanf(buffer, "%x,%x:", &addrs, &len);
 
 	// Skip the address and length
 	buffer = strchr(buffer, ':');
+	if (!buffer || strlen(buffer + 1) < len * 2)
+	{
+		gdbresponsepacket("E01");
+		return;
+	}
 	buffer++;
 
 #if defined(GDB_COMM_DEBUG)
 	fprintf(stderr, "WRITE @0x%08X %d\n", addrs, len);
 #endif
 
-	StopEmulatorThread(emulator);
-
-	// Decode the encoded binary data, paying attention to escape sequences and repeat counts
-	uint8_t* data = new uint8_t[len];
-	uint32_t i = 0;
-	uint8_t lastchar = 0;
-	while (i < len)
-	{
-		if (*buffer == '}') // Escape sequence
-		{
-			buffer++;
-			uint8_t original = *buffer ^ 0x20;
-			data[i++] = original;
-		}
-		else if (*buffer == '*') // Repeat last character as a sequence
-		{
-			buffer++;
-			uint8_t count = *buffer - 29;
-			for (uint8_t j = 0; j < count; ++j)
-				data[i++] = lastchar;
-		}
-		else // Normal character
-			data[i++] = *buffer;
-		lastchar = *buffer;
-		buffer++;
-	}
-
-	int wordcount = len>>2;
-	int leftover = len%4;
-
-	// Whole words
-	uint32_t* worddata = (uint32_t*)data;
-	for (int i = 0; i < wordcount; i++)
+	// Data arrives as hex pairs
+	std::vector<uint8_t> data(len);
+	for (uint32_t i = 0; i < len; ++i)
 	{
-		uint32_t word = worddata[i];
-		emulator->m_bus->Write(addrs & 0xFFFFFFF0, word, 0xF);
-		addrs+=4;
-	}
-
-	// Leftover bytes
-	if (leftover > 0)
-	{
-		uint32_t word = 0;
-		for (int i = 0; i < leftover; i++)
-			word |= (data[wordcount*4+i] << (i*8));
-		emulator->m_bus->Write(addrs & 0xFFFFFFF0, word, 0xF);
+		unsigned int byte = 0;
+		sscanf(buffer + i * 2, "%2x", &byte);
+		data[i] = (uint8_t)byte;
 	}
 
+	StopEmulatorThread(emulator);
+	bool written = gdbwriteguest(emulator, addrs, data.data(), len);
 	ResumeEmulatorThread(emulator);
 
-	delete[] data;
-
 	// Respond with an ACK on successful memory write
-	gdbresponsepacket(gdbsocket, "OK");
+	gdbresponsepacket(written ? "OK" : "E01");
 }
 
-void gdbstep(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbstep(CEmulator* emulator, char* buffer)
 {
 	StopEmulatorThread(emulator);
 
@@ -613,10 +658,10 @@ void gdbstep(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 	ResumeEmulatorThread(emulator);
 
 	// Respond with an ACK on successful step
-	gdbresponsepacket(gdbsocket, "OK");
+	gdbresponsepacket("OK");
 }
 
-void gdbaddbreakpoint(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbaddbreakpoint(CEmulator* emulator, char* buffer)
 {
 	// Skip 'Z'
 	buffer++;
@@ -628,17 +673,17 @@ void gdbaddbreakpoint(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 	// 3; read watchpoint
 	// 4; access watchpoint
 	uint32_t type, addrs, len;
-	uint32_t readoffset = sscanf(buffer, "%d,%x,%x", &type, &addrs, &len);
+	sscanf(buffer, "%d,%x,%x", &type, &addrs, &len);
 
-	// We can't do other breakpoint types than software
+	// We can't do other breakpoint types than software, an empty reply says so
 	if (type != 0)
 	{
-		gdbresponsenack(gdbsocket);
+		gdbresponsepacket("");
 		return;
 	}
 
 	// NOTE: We're ignoring the length for now since every instruction is 4 bytes long
-	
+
 	StopEmulatorThread(emulator);
 
 	// Add the breakpoint
@@ -651,17 +696,17 @@ void gdbaddbreakpoint(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 	ResumeEmulatorThread(emulator);
 
 	// Respond with an ACK on successful breakpoint addition
-	gdbresponsepacket(gdbsocket, "OK");
+	gdbresponsepacket("OK");
 }
 
-void gdbremovebreakpoint(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbremovebreakpoint(CEmulator* emulator, char* buffer)
 {
 	// Skip 'z'
 	buffer++;
 
 	// Parse the type, address and length
 	uint32_t type, addrs, len;
-	uint32_t readoffset = sscanf(buffer, "%d,%x,%x", &type, &addrs, &len);
+	sscanf(buffer, "%d,%x,%x", &type, &addrs, &len);
 
 	StopEmulatorThread(emulator);
 
@@ -674,7 +719,7 @@ void gdbremovebreakpoint(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 	ResumeEmulatorThread(emulator);
 
 	// Respond with an ACK on successful breakpoint removal
-	gdbresponsepacket(gdbsocket, "OK");
+	gdbresponsepacket("OK");
 }
 
 void gdbstopemulator(CEmulator* emulator)
@@ -690,22 +735,33 @@ void gdbstopemulator(CEmulator* emulator)
 	ResumeEmulatorThread(emulator);
 }
 
-void gdbsendstopreason(socket_t gdbsocket, int cpu, uint32_t stopaddres, CEmulator* emulator)
+void gdbsendstopreason(int cpu, uint32_t stopaddres, CEmulator* emulator)
 {
 	StopEmulatorThread(emulator);
 
-	CRV32 *core = emulator->m_cpu[cpu];
 	struct STaskContext* contextpool = (struct STaskContext *)emulator->m_bus->GetHostAddress(DEVICE_MAIL);
 	struct STaskContext& ctx = contextpool[cpu];
 
+	int currentTask = ctx.currentTask < 0 || ctx.currentTask >= TASK_MAX ? 0 : ctx.currentTask;
+
 	char response[128];
-	snprintf(response, 128, "T05;thread:%d;stopped;reason:breakpoint;pc:0x%08X;", cpu*TASK_MAX+ctx.currentTask+1, stopaddres);
-	gdbplainpacket(gdbsocket, response);
+	snprintf(response, 128, "T05;thread:%d;stopped;reason:breakpoint;pc:0x%08X;", cpu*TASK_MAX+currentTask+1, stopaddres);
 
 	ResumeEmulatorThread(emulator);
+
+	gdbresponsepacket(response);
+}
+
+void gdbdisconnect(CEmulator* emulator)
+{
+	StopEmulatorThread(emulator);
+	for (int i = 0; i < 2; ++i)
+		emulator->RemoveAllBreakpoints(i);
+	ResumeEmulatorThread(emulator);
+	s_outgoing.clear();
 }
 
-void gdbprocesscommand(socket_t gdbsocket, CEmulator* emulator, char* buffer)
+void gdbprocesscommand(CEmulator* emulator, char* buffer, size_t len)
 {
 	// Check the command type
 	switch (buffer[0])
@@ -715,16 +771,15 @@ void gdbprocesscommand(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 			gdbstopemulator(emulator);
 			break;
 		case '?':
-			gdbresponsepacket(gdbsocket, "T00");
-			//gdbresponseack(gdbsocket); // No stop reason at this time
+			gdbresponsepacket("T00");
 			break;
 		case 'X':
-			// Read binary data
-			gdbbinarypacket(gdbsocket, emulator, buffer);
+			// Write binary data
+			gdbbinarypacket(emulator, buffer, len);
 			break;
 		case 'P':
 			// Write single register
-			gdbsetreg(gdbsocket, emulator, buffer);
+			gdbsetreg(emulator, buffer);
 			break;
 		case 'D':
 			// Disconnect request
@@ -732,76 +787,129 @@ void gdbprocesscommand(socket_t gdbsocket, CEmulator* emulator, char* buffer)
 			for (int i = 0; i < 2; ++i)
 				emulator->RemoveAllBreakpoints(i);
 			ResumeEmulatorThread(emulator);
-			gdbresponsepacket(gdbsocket, "OK");
+			gdbresponsepacket("OK");
 			fprintf(stderr, "Detached from debugger\n");
 			break;
 		case 'T':
 			// Skip 'T'
 			buffer++;
-			gdbsetcurrentthread(gdbsocket, emulator, buffer);
+			gdbsetcurrentthread(emulator, buffer);
 			break;
 		case 'H':
 			// Set thread - Hc or Hg
 			if (buffer[1] == 'c')
 			{
 				//emulator->m_cpu[???]->SetCurrent('c');
-				gdbresponsepacket(gdbsocket, "OK");
+				gdbresponsepacket("OK");
 			}
 			else if (buffer[1] == 'g')
 			{
 				// Skip 'Hg'
 				buffer+=2;
-				gdbsetcurrentthread(gdbsocket, emulator, buffer);
+				gdbsetcurrentthread(emulator, buffer);
 			}
+			else
+				gdbresponsepacket("");
 			break;
 		case 'g':
-			gdbreadregisters(gdbsocket, emulator, buffer);
-			break;
-		case 'G':
-			// Read registers
+			gdbreadregisters(emulator, buffer);
 			break;
 		case 'm':
 			// Read memory
-			gdbreadmemory(gdbsocket, emulator, buffer);
+			gdbreadmemory(emulator, buffer);
 			break;
 		case 'M':
 			// Write memory
-			gdbwritememory(gdbsocket, emulator, buffer);
+			gdbwritememory(emulator, buffer);
 			break;
 		case 'c':
-			// Continue
+			// Continue, reply comes with the next stop
 			break;
 		case 's':
 			// Step
-			gdbstep(gdbsocket, emulator, buffer);
+			gdbstep(emulator, buffer);
 			break;
 		case 'Z':
 			// Insert breakpoint
-			gdbaddbreakpoint(gdbsocket, emulator, buffer);
+			gdbaddbreakpoint(emulator, buffer);
 			break;
 		case 'z':
 			// Remove breakpoint
-			gdbremovebreakpoint(gdbsocket, emulator, buffer);
+			gdbremovebreakpoint(emulator, buffer);
 			break;
 		case 'v':
 			// vCont
 			if (strstr(buffer, "vCont") == buffer)
-				gdbvcont(gdbsocket, emulator, buffer);
-			else if (strstr(buffer, "vMustReplyEmpty") == buffer)
-				gdbresponsepacket(gdbsocket, "");
+				gdbvcont(emulator, buffer);
 			else if (strstr(buffer, "vKill") == buffer)
-				gdbkillprocess(gdbsocket, s_currentCPU, s_currentTask, emulator, buffer);
-			else
-				fprintf(stderr, "Unknown v command: %s\n", buffer);
+				gdbkillprocess(s_currentCPU, s_currentTask, emulator, buffer);
+			else // Includes vMustReplyEmpty
+				gdbresponsepacket("");
 			break;
 		case 'Q':
 		case 'q':
 			// Query
-			gdbprocessquery(gdbsocket, emulator, buffer);
+			gdbprocessquery(emulator, buffer);
 			break;
 		default:
-			// Unknown command
+			// Unknown command, including 'G'
+#if defined(GDB_COMM_DEBUG)
 			fprintf(stderr, "Unknown sequence start: %s\n", buffer);
+#endif
+			gdbresponsepacket("");
 			break;
 	}
 }
+
+size_t gdbprocessinput(CEmulator* emulator, char* buffer, size_t len)
+{
+	size_t pos = 0;
+	while (pos < len)
+	{
+		char c = buffer[pos];
+
+		// Interrupt request arrives on its own, outside of any packet
+		if (c == 0x03)
+		{
+			char interrupt[2] = { 0x03, 0 };
+			gdbprocesscommand(emulator, interrupt, 1);
+			++pos;
+			continue;
+		}
+
+		// Acks, nacks and anything else between packets
+		if (c != '$')
+		{
+			++pos;
+			continue;
+		}
+
+		// '#' never shows up unescaped inside a packet, binary data sends it as '}' 0x03
+		char* end = (char*)memchr(buffer + pos + 1, '#', len - pos - 1);
+		if (!end || (size_t)(end - buffer) + 2 >= len)
+			break; // Rest of the packet hasn't arrived yet
+
+		char* payload = buffer + pos + 1;
+		size_t payloadlen = end - payload;
+		char sumtext[3] = { end[1], end[2], 0 };
+		unsigned int sum = strtoul(sumtext, nullptr, 16);
+		pos = (end - buffer) + 3;
+
+		if (sum != gdbchecksum(payload, payloadlen))
+		{
+			// Ask for it again
+			s_outgoing += '-';
+			continue;
+		}
+
+		s_outgoing += '+';
+#ifdef GDB_COMM_DEBUG
+		fprintf(stderr, "> %.*s\n", (int)payloadlen, payload);
+#endif
+		// Handlers parse text with the C library, the checksum character is no longer needed
+		*end = 0;
+		gdbprocesscommand(emulator, payload, payloadlen);
+	}
+
+	return pos;
+}
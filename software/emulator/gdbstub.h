@@ -1,16 +1,33 @@
 #ifdef CAT_WINDOWS
 #include <winsock2.h>
 #define socket_t SOCKET
+#define gdbpoll WSAPoll
 #else
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #define socket_t int
+#define gdbpoll poll
 #endif
 
 #include "emulator.h"
 
-void gdbprocesscommand(socket_t gdbsocket, CEmulator* emulator, char* buffer);
-void gdbsendstopreason(socket_t gdbsocket, int cpu, uint32_t stopaddres, CEmulator* emulator);
-void gdbresponseack(socket_t gdbsocket);
\ No newline at end of file
+// Largest packet we accept and advertise to gdb, which sizes its memory transfers by it
+#define GDB_PACKET_SIZE 0x10000
+
+// Socket helpers that hide the platform differences
+bool gdbvalidsocket(socket_t gdbsocket);
+void gdbsetnonblocking(socket_t gdbsocket);
+bool gdbwouldblock();
+void gdbclosesocket(socket_t gdbsocket);
+
+// Handles all complete packets at the start of the buffer and queues their replies,
+// returns how many bytes were used up (a partial packet at the end is left alone)
+size_t gdbprocessinput(CEmulator* emulator, char* buffer, size_t len);
+void gdbsendstopreason(int cpu, uint32_t stopaddres, CEmulator* emulator);
+// Sends everything queued so far in one go, returns false if the connection is gone
+bool gdbflush(socket_t gdbsocket);
+// Drops breakpoints and queued replies once gdb goes away
+void gdbdisconnect(CEmulator* emulator);
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "headless.h"
+#include "taskcontext.h"
+
+// CPU runs at 166.667MHz and the wall clock at 10MHz, 3 wall clock ticks every 50 cycles
+static const uint64_t s_wallclockMul = 3;
+static const uint64_t s_wallclockDiv = 50;
+
+#if defined(CPU_STATS)
+static double HitRate(uint64_t hits, uint64_t misses)
+{
+	return (hits + misses) ? 100.0 * double(hits) / double(hits + misses) : 0.0;
+}
+#endif
+
+// Runs without video, audio or timers on a virtual clock derived from modeled
+// cycles so that every run of the same ROM and sdcard contents is identical
+int headlessrun(CEmulator* emulator, const SHeadlessOptions& options)
+{
+	FILE* uartFile = nullptr;
+	if (options.uartFile)
+	{
+		uartFile = fopen(options.uartFile, "wb");
+		if (!uartFile)
+		{
+			fprintf(stderr, "Could not open '%s' for UART output\n", options.uartFile);
+			return -1;
+		}
+		emulator->m_bus->GetUART()->SetOutput(uartFile);
+	}
+
+	STaskContext* kernelctx = (STaskContext*)emulator->m_bus->GetHostAddress(DEVICE_MAIL);
+	CRV32* cpu0 = emulator->m_cpu[0];
+	CRV32* cpu1 = emulator->m_cpu[1];
+
+	// Carry on from the clock of a restored snapshot
+	uint64_t& cycles = emulator->m_virtualCycles;
+	const uint64_t startCycles = cycles;
+	const uint64_t startRetired[2] = { cpu0->m_retired, cpu1->m_retired };
+	uint32_t lastCycles[2] = { cpu0->m_cycles, cpu1->m_cycles };
+	uint32_t exitCalls[2] = { cpu0->m_exitcalls, cpu1->m_exitcalls };
+	uint64_t idleCycles = 0;
+	bool commandSent = options.command == nullptr;
+	int exitCode = -1;
+	const char* stopReason = "cycle limit reached";
+
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	while (options.maxCycles == 0 || cycles - startCycles < options.maxCycles)
+	{
+		emulator->Step(cycles * s_wallclockMul / s_wallclockDiv);
+
+		// Harts run side by side, time moves as fast as the busier one (but always moves)
+		uint32_t delta0 = cpu0->m_cycles - lastCycles[0];
+		uint32_t delta1 = cpu1->m_cycles - lastCycles[1];
+		lastCycles[0] = cpu0->m_cycles;
+		lastCycles[1] = cpu1->m_cycles;
+		uint32_t delta = delta0 > delta1 ? delta0 : delta1;
+		cycles += delta ? delta : 1;
+
+		// Both harts wait for the timer, skip straight to it instead of stepping through the wait.
+		// Cycle counters keep running as they would on hardware.
+		uint64_t wake = emulator->IdleUntil();
+		if (wake != 0 && wake != ~0ull)
+		{
+			uint64_t wakeCycles = (wake * s_wallclockDiv + s_wallclockMul - 1) / s_wallclockMul;
+			if (options.maxCycles != 0 && wakeCycles > startCycles + options.maxCycles)
+				wakeCycles = startCycles + options.maxCycles;
+			if (wakeCycles > cycles)
+			{
+				uint32_t skipped = (uint32_t)(wakeCycles - cycles);
+				cpu0->m_cycles += skipped;
+				cpu1->m_cycles += skipped;
+				lastCycles[0] = cpu0->m_cycles;
+				lastCycles[1] = cpu1->m_cycles;
+				idleCycles += wakeCycles - cycles;
+				cycles = wakeCycles;
+			}
+		}
+
+		// Wait for the command line task before typing into it
+		if (!commandSent && kernelctx->numTasks >= 2)
+		{
+			emulator->QueueBytes((uint8_t*)options.command, (uint32_t)strlen(options.command));
+			emulator->QueueByte('\n');
+			commandSent = true;
+		}
+
+		if (cpu0->m_exitcalls != exitCalls[0] || cpu1->m_exitcalls != exitCalls[1])
+		{
+			exitCode = int(cpu0->m_exitcalls != exitCalls[0] ? cpu0->m_exitcode : cpu1->m_exitcode);
+			stopReason = "exit()";
+			break;
+		}
+	}
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	double seconds = std::chrono::duration<double>(endTime - startTime).count();
+
+	// Flush anything the UART still holds
+	emulator->m_bus->GetUART()->Flush(true);
+	if (uartFile)
+	{
+		emulator->m_bus->GetUART()->SetOutput(nullptr);
+		fclose(uartFile);
+	}
+
+	if (options.saveSnapshot)
+		emulator->SaveSnapshot(options.saveSnapshot);
+
+	const uint64_t retired0 = cpu0->m_retired - startRetired[0];
+	const uint64_t retired1 = cpu1->m_retired - startRetired[1];
+	const uint64_t retired = retired0 + retired1;
+	const uint64_t runCycles = cycles - startCycles;
+	fprintf(stderr, "\nheadless run summary\n");
+	fprintf(stderr, "stop reason         : %s", stopReason);
+	if (exitCode != -1)
+		fprintf(stderr, " status %d", exitCode);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "instructions        : %llu (hart0 %llu, hart1 %llu)\n", (unsigned long long)retired, (unsigned long long)retired0, (unsigned long long)retired1);
+	fprintf(stderr, "modeled cycles      : %llu (%.3f s at 166.667MHz)\n", (unsigned long long)runCycles, double(runCycles) / 166666667.0);
+	fprintf(stderr, "idle cycles skipped : %llu\n", (unsigned long long)idleCycles);
+#if defined(CPU_STATS)
+	for (CRV32* cpu : { cpu0, cpu1 })
+	{
+		fprintf(stderr, "hart%d I$ hit rate   : %.2f%%\n", cpu->m_hartid, HitRate(cpu->m_icache.m_hits, cpu->m_icache.m_misses));
+		fprintf(stderr, "hart%d D$ read hits  : %.2f%%\n", cpu->m_hartid, HitRate(cpu->m_dcache.m_readhits, cpu->m_dcache.m_readmisses));
+		fprintf(stderr, "hart%d D$ write hits : %.2f%%\n", cpu->m_hartid, HitRate(cpu->m_dcache.m_writehits, cpu->m_dcache.m_writemisses));
+	}
+#else
+	fprintf(stderr, "cache hit rates     : build with CPU_STATS to collect\n");
+#endif
+	fprintf(stderr, "host time           : %.3f s\n", seconds);
+	fprintf(stderr, "host MIPS           : %.2f\n", double(retired) / seconds / 1000000.0);
+
+	// Use the program's exit status, anything else counts as a failure
+	return exitCode == -1 ? 1 : exitCode;
+}
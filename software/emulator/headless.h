@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include "emulator.h"
+
+struct SHeadlessOptions
+{
+	uint64_t maxCycles{ 0 };		// Stop after this many modeled CPU cycles, 0 for no limit
+	const char* uartFile{ nullptr };	// UART output goes here instead of stdout
+	const char* command{ nullptr };		// Typed into the command line once it's up
+	const char* saveSnapshot{ nullptr };	// Machine state is saved here when the run stops
+};
+
+int headlessrun(CEmulator* emulator, const SHeadlessOptions& options);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include "leds.h"
+#include "snapshot.h"
 
 void CLEDs::Reset()
 {
@@ -15,3 +16,8 @@ void CLEDs::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 	m_ledstate = word;
 	//printf("LEDs: %c%c%c%c%c%c (%d)\n", m_ledstate & 32 ? 'O' : '_', m_ledstate & 16 ? 'O' : '_', m_ledstate & 8 ? 'O' : '_', m_ledstate & 4 ? 'O' : '_', m_ledstate & 2 ? 'G' : '_', m_ledstate & 1 ? 'R' : '_', m_ledstate);
 }
+
+void CLEDs::Serialize(CSnapshot& snap)
+{
+	snap.Value(m_ledstate);
+}
@@ -14,4 +14,5 @@ public:
 	void Reset() override final;
 	void Read(uint32_t address, uint32_t& data) override final;
 	void Write(uint32_t address, uint32_t word, uint32_t wstrobe) override final;
+	void Serialize(CSnapshot& snap);
 };
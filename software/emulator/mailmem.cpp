@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "mailmem.h"
+#include "snapshot.h"
 
 static const uint32_t quadexpand[] = {
 	0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF,
@@ -24,16 +25,40 @@ void CMailMem::Reset()
 {
 	// Clear memory
 	memset(m_mailmem, 0, 4096 * sizeof(uint32_t));
+	memset(m_atomics, 0, sizeof(m_atomics));
 }
 
 void CMailMem::Read(uint32_t address, uint32_t& data)
 {
+	if (address & 0x8000)
+	{
+		// Read-modify-write in one access, CBus holds the device lock when harts run on their own threads
+		uint32_t& slot = m_atomics[(address >> 2) & (MAIL_ATOMIC_SLOTS - 1)];
+		data = slot;
+		switch ((address >> 8) & 0x7)
+		{
+			case MAIL_ATOMIC_TESTANDSET:	slot = 1; break;
+			case MAIL_ATOMIC_FETCHINC:		slot = data + 1; break;
+			case MAIL_ATOMIC_FETCHDEC:		slot = data - 1; break;
+			default:						break;
+		}
+		return;
+	}
+
 	uint32_t mailslot = (address >> 2) & 0xFFF;
 	data = m_mailmem[mailslot];
 }
 
 void CMailMem::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 {
+	if (address & 0x8000)
+	{
+		// Atomic slots are word sized, fetch-add adds the written value and everything else stores it
+		uint32_t& slot = m_atomics[(address >> 2) & (MAIL_ATOMIC_SLOTS - 1)];
+		slot = (((address >> 8) & 0x7) == MAIL_ATOMIC_FETCHADD) ? slot + word : word;
+		return;
+	}
+
 	uint32_t mailslot = (address >> 2) & 0xFFF;
 	uint32_t olddata = m_mailmem[mailslot];
 
@@ -45,3 +70,9 @@ void CMailMem::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 	uint32_t newword = (olddata & invfullmask) | (word & fullmask);
 	m_mailmem[mailslot] = newword;
 }
+
+void CMailMem::Serialize(CSnapshot& snap)
+{
+	snap.Bytes(m_mailmem, 4096 * sizeof(uint32_t));
+	snap.Bytes(m_atomics, sizeof(m_atomics));
+}
@@ -4,6 +4,15 @@
 #include <stdint.h>
 #include "memmappeddevice.h"
 
+// Upper half of the mailbox address space holds the atomic register block,
+// address bits [10:8] pick the operation and bits [7:2] the slot
+#define MAIL_ATOMIC_SLOTS 64
+#define MAIL_ATOMIC_LOAD 0
+#define MAIL_ATOMIC_TESTANDSET 1
+#define MAIL_ATOMIC_FETCHINC 2
+#define MAIL_ATOMIC_FETCHDEC 3
+#define MAIL_ATOMIC_FETCHADD 4
+
 class CMailMem : public MemMappedDevice
 {
 public:
@@ -11,8 +20,10 @@ public:
 	~CMailMem();
 
 	uint32_t* m_mailmem{ nullptr };
+	uint32_t m_atomics[MAIL_ATOMIC_SLOTS]{};
 
 	void Reset() override final;
 	void Read(uint32_t address, uint32_t& data) override final;
 	void Write(uint32_t address, uint32_t word, uint32_t wstrobe) override final;
+	void Serialize(CSnapshot& snap);
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 class CBus;
+class CSnapshot;
 class MemMappedDevice
 {
 public:
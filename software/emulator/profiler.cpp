@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "profiler.h"
+#include "bus.h"
+#include "rv32.h"
+
+// Stacks deeper than this are cut off
+static const uint32_t s_maxDepth = 64;
+// A frame pointer further than this away from sp is not taken to be one
+static const uint32_t s_maxStackSpan = 1024 * 1024;
+
+// Same layout as the headers in SDK/elf.h, plus the symbol table entry
+#pragma pack(push,1)
+struct SProfilerElfHeader
+{
+	uint32_t m_Magic;
+	uint8_t m_Class;
+	uint8_t m_Data;
+	uint8_t m_EI_Version;
+	uint8_t m_OSABI;
+	uint8_t m_ABIVersion;
+	uint8_t m_Pad[7];
+	uint16_t m_Type;
+	uint16_t m_Machine;
+	uint32_t m_Version;
+	uint32_t m_Entry;
+	uint32_t m_PHOff;
+	uint32_t m_SHOff;
+	uint32_t m_Flags;
+	uint16_t m_EHSize;
+	uint16_t m_PHEntSize;
+	uint16_t m_PHNum;
+	uint16_t m_SHEntSize;
+	uint16_t m_SHNum;
+	uint16_t m_SHStrndx;
+};
+struct SProfilerElfSection
+{
+	uint32_t m_NameOffset;
+	uint32_t m_Type;
+	uint32_t m_Flags;
+	uint32_t m_Addr;
+	uint32_t m_Offset;
+	uint32_t m_Size;
+	uint32_t m_Link;
+	uint32_t m_Info;
+	uint32_t m_AddrAlign;
+	uint32_t m_EntSize;
+};
+struct SProfilerElfSymbol
+{
+	uint32_t m_NameOffset;
+	uint32_t m_Value;
+	uint32_t m_Size;
+	uint8_t m_Info;
+	uint8_t m_Other;
+	uint16_t m_SectionIndex;
+};
+#pragma pack(pop)
+
+#define ELF_SHT_SYMTAB 2
+#define ELF_STT_NOTYPE 0
+#define ELF_STT_FUNC 2
+#define ELF_STB_GLOBAL 1
+
+bool CProfiler::LoadSymbols(const char* elfFile)
+{
+	FILE* fp = fopen(elfFile, "rb");
+	if (!fp)
+	{
+		fprintf(stderr, "Could not open '%s' for symbols\n", elfFile);
+		return false;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long filesize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	std::vector<uint8_t> elf(filesize > 0 ? filesize : 0);
+	size_t readsize = fread(elf.data(), 1, elf.size(), fp);
+	fclose(fp);
+
+	SProfilerElfHeader* header = (SProfilerElfHeader*)elf.data();
+	if (readsize < sizeof(SProfilerElfHeader) || header->m_Magic != 0x464C457F || header->m_Class != 1)
+	{
+		fprintf(stderr, "'%s' is not a 32 bit ELF file\n", elfFile);
+		return false;
+	}
+
+	if (header->m_SHEntSize != sizeof(SProfilerElfSection) || header->m_SHOff + header->m_SHNum * sizeof(SProfilerElfSection) > readsize)
+	{
+		fprintf(stderr, "'%s' has no usable section headers\n", elfFile);
+		return false;
+	}
+
+	size_t symbolCount = m_symbols.size();
+	SProfilerElfSection* sections = (SProfilerElfSection*)(elf.data() + header->m_SHOff);
+	for (uint32_t i = 0; i < header->m_SHNum; ++i)
+	{
+		const SProfilerElfSection& symtab = sections[i];
+		if (symtab.m_Type != ELF_SHT_SYMTAB || symtab.m_Link >= header->m_SHNum)
+			continue;
+
+		const SProfilerElfSection& strtab = sections[symtab.m_Link];
+		if (symtab.m_Offset + symtab.m_Size > readsize || strtab.m_Offset + strtab.m_Size > readsize)
+			continue;
+
+		const char* names = (const char*)(elf.data() + strtab.m_Offset);
+		SProfilerElfSymbol* symbols = (SProfilerElfSymbol*)(elf.data() + symtab.m_Offset);
+		uint32_t count = symtab.m_Size / sizeof(SProfilerElfSymbol);
+		for (uint32_t s = 0; s < count; ++s)
+		{
+			const SProfilerElfSymbol& sym = symbols[s];
+			uint32_t type = sym.m_Info & 0xF;
+			uint32_t bind = sym.m_Info >> 4;
+
+			// Functions, and global labels from assembly sources such as _start
+			bool isCode = type == ELF_STT_FUNC || (type == ELF_STT_NOTYPE && bind == ELF_STB_GLOBAL && sym.m_SectionIndex != 0);
+			if (!isCode || sym.m_NameOffset == 0 || sym.m_NameOffset >= strtab.m_Size)
+				continue;
+
+			SProfilerSymbol entry;
+			entry.address = sym.m_Value;
+			entry.size = sym.m_Size;
+			entry.name.assign(names + sym.m_NameOffset, strnlen(names + sym.m_NameOffset, strtab.m_Size - sym.m_NameOffset));
+			m_symbols.push_back(entry);
+		}
+	}
+
+	std::stable_sort(m_symbols.begin(), m_symbols.end(), [](const SProfilerSymbol& a, const SProfilerSymbol& b) { return a.address < b.address; });
+
+	fprintf(stderr, "Loaded %d symbols from '%s'\n", int(m_symbols.size() - symbolCount), elfFile);
+	return true;
+}
+
+const SProfilerSymbol* CProfiler::FindSymbol(uint32_t address) const
+{
+	auto next = std::upper_bound(m_symbols.begin(), m_symbols.end(), address, [](uint32_t addr, const SProfilerSymbol& sym) { return addr < sym.address; });
+	if (next == m_symbols.begin())
+		return nullptr;
+
+	// Symbols without a size run up to the next one
+	const SProfilerSymbol& sym = *(next - 1);
+	if (sym.size != 0 && address >= sym.address + sym.size)
+		return nullptr;
+	return &sym;
+}
+
+uint32_t CProfiler::FunctionStart(uint32_t address) const
+{
+	const SProfilerSymbol* sym = FindSymbol(address);
+	return sym ? sym->address : address;
+}
+
+bool CProfiler::PeekWord(CBus* bus, CRV32* cpu, uint32_t address, uint32_t& data)
+{
+	if (address & 0x80000003 || address >= SYSMEM_SIZE)
+		return false;
+
+	// The hart's own D$ might hold newer stack contents than memory
+	if (!cpu->m_dcache.Peek(address, data))
+		data = *bus->GetHostAddress(address);
+	return true;
+}
+
+void CProfiler::WalkStack(CBus* bus, CRV32* cpu, std::vector<uint32_t>& frames)
+{
+	frames.clear();
+
+	uint32_t pc = cpu->m_execPC;
+	uint32_t ra = cpu->m_GPR[1];
+	uint32_t sp = cpu->m_GPR[2];
+	uint32_t fp = cpu->m_GPR[8];
+	frames.push_back(pc);
+
+	// Leaf functions, and any function before its first call, still have their caller in ra
+	uint32_t callerRA = 0;
+	if (ra && FunctionStart(ra) != FunctionStart(pc))
+	{
+		frames.push_back(ra);
+		callerRA = ra;
+	}
+
+	// Follow s0 frames, which needs code built with -fno-omit-frame-pointer
+	// Each frame keeps its return address at fp-4 and the caller's fp at fp-8
+	while (frames.size() < s_maxDepth && fp > sp && fp - sp < s_maxStackSpan && fp >= 8)
+	{
+		uint32_t retaddr, prevfp;
+		if (!PeekWord(bus, cpu, fp - 4, retaddr) || !PeekWord(bus, cpu, fp - 8, prevfp))
+			break;
+
+		// Stop at anything that doesn't look like code, s0 might just be a saved register
+		if (retaddr == 0 || retaddr >= SYSMEM_SIZE || (!m_symbols.empty() && !FindSymbol(retaddr)))
+			break;
+
+		if (retaddr != callerRA)
+			frames.push_back(retaddr);
+		callerRA = 0;
+
+		// Stack grows down, callers always live above us
+		if (prevfp <= fp)
+			break;
+		fp = prevfp;
+	}
+}
+
+void CProfiler::Sample(CBus* bus, CRV32* cpu)
+{
+	uint32_t hart = cpu->m_hartid;
+	if (!m_started[hart])
+	{
+		m_lastCycles[hart] = cpu->m_cycles;
+		m_started[hart] = true;
+		return;
+	}
+
+	m_pendingCycles[hart] += cpu->m_cycles - m_lastCycles[hart];
+	m_lastCycles[hart] = cpu->m_cycles;
+	if (m_pendingCycles[hart] < m_interval)
+		return;
+
+	// A long step counts as more than one sample of where it ended up
+	uint32_t weight = m_pendingCycles[hart] / m_interval;
+	m_pendingCycles[hart] %= m_interval;
+
+	WalkStack(bus, cpu, m_frames[hart]);
+	m_stacks[hart][m_frames[hart]] += weight;
+	m_sampleCount[hart] += weight;
+}
+
+bool CProfiler::Save(const char* filename)
+{
+	// Different return addresses in the same functions fold into one line
+	std::map<std::string, uint64_t> folded;
+	std::string line;
+	for (uint32_t hart = 0; hart < 2; ++hart)
+	{
+		for (auto& stack : m_stacks[hart])
+		{
+			line = hart ? "hart1" : "hart0";
+			for (auto frame = stack.first.rbegin(); frame != stack.first.rend(); ++frame)
+			{
+				const SProfilerSymbol* sym = FindSymbol(*frame);
+				if (sym)
+					line += ";" + sym->name;
+				else
+				{
+					char addr[16];
+					snprintf(addr, 16, ";0x%08X", *frame);
+					line += addr;
+				}
+			}
+			folded[line] += stack.second;
+		}
+	}
+
+	FILE* fp = fopen(filename, "wb");
+	if (!fp)
+	{
+		fprintf(stderr, "Could not open '%s' for profiler output\n", filename);
+		return false;
+	}
+
+	for (auto& entry : folded)
+		fprintf(fp, "%s %llu\n", entry.first.c_str(), (unsigned long long)entry.second);
+	fclose(fp);
+
+	fprintf(stderr, "Profiler wrote %llu samples (%d stacks) to '%s'\n", (unsigned long long)(m_sampleCount[0] + m_sampleCount[1]), int(folded.size()), filename);
+	return true;
+}
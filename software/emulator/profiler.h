@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class CBus;
+class CRV32;
+
+struct SProfilerSymbol
+{
+	uint32_t address;
+	uint32_t size;
+	std::string name;
+};
+
+// Samples the PC and call stack of each hart every m_interval modeled cycles
+// and writes them out in the folded stack format that flamegraph tools take
+class CProfiler
+{
+public:
+	explicit CProfiler(uint32_t interval) : m_interval(interval ? interval : 1) {}
+
+	// Functions from the symbol table of an ELF file, can be called for more than one file
+	bool LoadSymbols(const char* elfFile);
+	// Call after each instruction or step, takes a sample once enough cycles went by on this hart
+	// Each hart only touches its own state, so both can sample from their own threads
+	void Sample(CBus* bus, CRV32* cpu);
+	bool Save(const char* filename);
+
+private:
+	const SProfilerSymbol* FindSymbol(uint32_t address) const;
+	uint32_t FunctionStart(uint32_t address) const;
+	bool PeekWord(CBus* bus, CRV32* cpu, uint32_t address, uint32_t& data);
+	void WalkStack(CBus* bus, CRV32* cpu, std::vector<uint32_t>& frames);
+
+	uint32_t m_interval{ 10000 };
+	uint32_t m_lastCycles[2]{};
+	uint32_t m_pendingCycles[2]{};
+	bool m_started[2]{};
+	uint64_t m_sampleCount[2]{};
+
+	// Sorted by address
+	std::vector<SProfilerSymbol> m_symbols;
+	// Raw stacks (innermost frame first) per hart, with their sample counts
+	std::map<std::vector<uint32_t>, uint64_t> m_stacks[2];
+	std::vector<uint32_t> m_frames[2];
+};
@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <math.h>
+#include <algorithm>
 #include "rv32.h"
 #include "bus.h"
+#include "profiler.h"
+#include "snapshot.h"
 
 const char *opnames[] = {
 	"illegal",
@@ -75,6 +78,24 @@ static const uint32_t s_quadexpand[] = {
 	0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF,
 };
 
+// Handler lookup for threaded dispatch, indexed by ALU/BLU op or f3
+static const uint32_t s_aluhandlers[] = {
+	EH_GENERIC, EH_ADD, EH_SUB, EH_SLL, EH_SLT, EH_SLTU, EH_XOR, EH_SRL, EH_SRA, EH_OR, EH_AND,
+	EH_GENERIC, EH_GENERIC, EH_GENERIC }; // mul/div/rem
+
+static const uint32_t s_aluimmhandlers[] = {
+	EH_GENERIC, EH_ADDI, EH_GENERIC, EH_SLLI, EH_SLTI, EH_SLTIU, EH_XORI, EH_SRLI, EH_SRAI, EH_ORI, EH_ANDI,
+	EH_GENERIC, EH_GENERIC, EH_GENERIC };
+
+static const uint32_t s_bluhandlers[] = {
+	EH_GENERIC, EH_BEQ, EH_BNE, EH_BLT, EH_BGE, EH_BLTU, EH_BGEU };
+
+static const uint32_t s_loadhandlers[] = {
+	EH_LB, EH_LH, EH_LW, EH_GENERIC, EH_LBU, EH_LHU, EH_GENERIC, EH_GENERIC };
+
+static const uint32_t s_storehandlers[] = {
+	EH_SB, EH_SH, EH_SW, EH_GENERIC, EH_GENERIC, EH_GENERIC, EH_GENERIC, EH_GENERIC };
+
 // Floating point classification
 #define RISCV_NEG_INF			0
 #define RISCV_NEG_NORMAL		1
@@ -115,7 +136,7 @@ void InstructionCache::Reset()
 		m_cachelinetags[i] = 0x00000000;
 }
 
-void InstructionCache::Fetch(CBus *bus, uint32_t pc, uint32_t& instr)
+uint32_t InstructionCache::Fetch(CBus *bus, uint32_t pc, uint32_t& instr)
 {
 	uint32_t tag = SelectBitRange(pc, 27,14);	// 14 bits
 	uint32_t line = SelectBitRange(pc, 13, 6);	// 8 bits
@@ -127,9 +148,16 @@ void InstructionCache::Fetch(CBus *bus, uint32_t pc, uint32_t& instr)
 #if defined(CPU_STATS)
 		m_hits++;
 #endif
+		return 0;
 	}
 	else
 	{
+		if (m_stats)
+		{
+			uint32_t victim = ((m_cachelinetags[line] & 0x3FFF) << 14) | (line << 6);
+			m_stats->InstructionMiss(pc, victim, (m_cachelinetags[line] & 0x4000) != 0);
+		}
+
 		// Base cache address
 		uint32_t addr = (tag << 14) | (line << 6);
 		for (uint32_t i = 0; i < 16; i++)
@@ -140,15 +168,28 @@ void InstructionCache::Fetch(CBus *bus, uint32_t pc, uint32_t& instr)
 #if defined(CPU_STATS)
 		m_misses++;
 #endif
+		return m_timing.InstructionMissCycles();
 	}
 }
 
+uint32_t InstructionCache::Touch(CBus *bus, uint32_t pc)
+{
+	uint32_t instr;
+	return Fetch(bus, pc, instr);
+}
+
 void InstructionCache::Discard()
 {
 	for (uint32_t i = 0; i < 256; i++)
 		m_cachelinetags[i] = 0x00000000;
 }
 
+void InstructionCache::Serialize(CSnapshot& snap)
+{
+	snap.Value(m_cache);
+	snap.Value(m_cachelinetags);
+}
+
 void DataCache::Reset()
 {
 	for (uint32_t i=0; i<512; i++)
@@ -198,7 +239,7 @@ void DataCache::LoadLine(CBus* bus, uint32_t tag, uint32_t line)
 	m_cachelinetags[line] = tag | 0x4000;
 }
 
-uint32_t DataCache::Read(CBus* bus, uint32_t address, uint32_t& data)
+uint32_t DataCache::Read(CBus* bus, uint32_t pc, uint32_t address, uint32_t& data)
 {
 	uint32_t tag = SelectBitRange(address, 27, 15);		// 13 bits
 	uint32_t line = SelectBitRange(address, 14, 6);		// 9 bits
@@ -207,19 +248,26 @@ uint32_t DataCache::Read(CBus* bus, uint32_t address, uint32_t& data)
 	uint32_t retVal = 0;
 	if ((tag | 0x4000) != m_cachelinetags[line])
 	{
+		bool writeback = m_cachelinewb[line] != 0;
+		if (m_stats)
+		{
+			uint32_t victim = ((m_cachelinetags[line] & 0x3FFF) << 15) | (line << 6);
+			m_stats->DataMiss(pc, address, victim, (m_cachelinetags[line] & 0x4000) != 0, writeback);
+		}
+
 		WriteLine(bus, line);
 		LoadLine(bus, tag, line);
 #if defined(CPU_STATS)
 		m_readmisses++;
 #endif
-		retVal = 80;
+		retVal = m_timing.DataMissCycles(writeback);
 	}
 	else
 	{
 #if defined(CPU_STATS)
 		m_readhits++;
 #endif
-		retVal = 4;
+		retVal = m_timing.dcacheHitCycles;
 	}
 
 	// Read from cache
@@ -227,7 +275,7 @@ uint32_t DataCache::Read(CBus* bus, uint32_t address, uint32_t& data)
 	return retVal;
 }
 
-uint32_t DataCache::Write(CBus* bus, uint32_t address, uint32_t data, uint32_t wstrobe)
+uint32_t DataCache::Write(CBus* bus, uint32_t pc, uint32_t address, uint32_t data, uint32_t wstrobe)
 {
 	uint32_t tag = SelectBitRange(address, 27, 15);		// 13 bits
 	uint32_t line = SelectBitRange(address, 14, 6);		// 9 bits
@@ -236,19 +284,26 @@ uint32_t DataCache::Write(CBus* bus, uint32_t address, uint32_t data, uint32_t w
 	uint32_t retVal = 0;
 	if ((tag | 0x4000) != m_cachelinetags[line])
 	{
+		bool writeback = m_cachelinewb[line] != 0;
+		if (m_stats)
+		{
+			uint32_t victim = ((m_cachelinetags[line] & 0x3FFF) << 15) | (line << 6);
+			m_stats->DataMiss(pc, address, victim, (m_cachelinetags[line] & 0x4000) != 0, writeback);
+		}
+
 		WriteLine(bus, line);
 		LoadLine(bus, tag, line);
 #if defined(CPU_STATS)
 		m_writemisses++;
 #endif
-		retVal = 80;
+		retVal = m_timing.DataMissCycles(writeback);
 	}
 	else
 	{
 #if defined(CPU_STATS)
 		m_writehits++;
 #endif
-		retVal = 4;
+		retVal = m_timing.dcacheHitCycles;
 	}
 
 	// Write to cache
@@ -271,6 +326,20 @@ uint32_t DataCache::Flush(CBus* bus)
 	return 128;
 }
 
+bool DataCache::Peek(uint32_t address, uint32_t& data) const
+{
+	uint32_t tag = SelectBitRange(address, 27, 15);
+	uint32_t line = SelectBitRange(address, 14, 6);
+	uint32_t offset = SelectBitRange(address, 5, 2);
+
+	// Only hits, misses leave the cache and its counters alone
+	if ((tag | 0x4000) != m_cachelinetags[line])
+		return false;
+
+	data = m_cache[(line << 4) + offset];
+	return true;
+}
+
 void DataCache::Discard()
 {
 	for (uint32_t i = 0; i < 512; i++)
@@ -280,6 +349,13 @@ void DataCache::Discard()
 	}
 }
 
+void DataCache::Serialize(CSnapshot& snap)
+{
+	snap.Value(m_cache);
+	snap.Value(m_cachelinetags);
+	snap.Value(m_cachelinewb);
+}
+
 void CRV32::Reset()
 {
 	m_fetchstate = EFetchInit;
@@ -306,10 +382,46 @@ void CRV32::SecondaryReset()
 		m_GPR[i] = 0x00000000;
 
 	m_instructions.clear();
-	m_decodedBlocks.clear();
+	m_execBlock = nullptr;
+	m_blockFlushPending = 0;
+	FlushDecodedBlocks();
 	m_fetchstate = EFetchRead;
 }
 
+CRV32::~CRV32()
+{
+	FlushDecodedBlocks();
+}
+
+void CRV32::FlushDecodedBlocks()
+{
+	for (auto &blk : m_decodedBlocks)
+		delete blk.second;
+	m_decodedBlocks.clear();
+
+	FlushBlockCache();
+}
+
+void CRV32::FlushBlockCache()
+{
+	for (auto &blk : m_blockCache)
+		delete blk.second;
+	m_blockCache.clear();
+}
+
+void CRV32::FinalizeBlock(CBus* bus, SDecodedBlock* blk, EBlockExit exitType, uint32_t nextPC, uint32_t lastPC)
+{
+	blk->m_exit = exitType;
+	blk->m_nextPC = nextPC;
+	blk->m_lastPC = lastPC;
+
+	// Any write to memory this block was decoded from will discard it
+	for (uint32_t page = blk->m_PC >> SYSMEM_PAGE_SHIFT; page <= (lastPC >> SYSMEM_PAGE_SHIFT); ++page)
+		bus->m_mem->MarkCodePage(page << SYSMEM_PAGE_SHIFT);
+
+	m_blockCache[blk->m_PC] = blk;
+}
+
 uint32_t CRV32::ALU(SDecodedInstruction& instr)
 {
 	uint32_t aluout = 0;
@@ -612,6 +724,20 @@ void CRV32::DecodeInstruction(uint32_t pc, uint32_t instr, SDecodedInstruction&
 	}
 
 	dec.m_selimm = (dec.m_opcode==OP_JALR) || (dec.m_opcode==OP_OP_IMM) || (dec.m_opcode==OP_LOAD) || (dec.m_opcode==OP_STORE);
+
+	switch (dec.m_opcode)
+	{
+		case OP_OP:		dec.m_handler = s_aluhandlers[dec.m_aluop]; break;
+		case OP_OP_IMM:	dec.m_handler = s_aluimmhandlers[dec.m_aluop]; break;
+		case OP_LUI:	dec.m_handler = EH_LUI; break;
+		case OP_AUIPC:	dec.m_handler = EH_AUIPC; break;
+		case OP_JAL:	dec.m_handler = EH_JAL; break;
+		case OP_JALR:	dec.m_handler = EH_JALR; break;
+		case OP_BRANCH:	dec.m_handler = s_bluhandlers[dec.m_bluop]; break;
+		case OP_LOAD:	dec.m_handler = s_loadhandlers[dec.m_f3]; break;
+		case OP_STORE:	dec.m_handler = s_storehandlers[dec.m_f3]; break;
+		default:		dec.m_handler = EH_GENERIC; break;
+	}
 }
 
 void CRV32::InjectISRHeader(std::vector<SDecodedInstruction> *code)
@@ -764,6 +890,13 @@ void CRV32::InjectISRFooter(std::vector<SDecodedInstruction>* code)
 
 void CRV32::GatherInstructions(CCSRMem* csr, CBus* bus)
 {
+	// A fence ran in the previous block, which may have been executing out of the cache
+	if (m_blockFlushPending)
+	{
+		FlushDecodedBlocks();
+		m_blockFlushPending = 0;
+	}
+
 	// IRQ handling sequence
 	bool branchtomtvecforinterrupt = csr->m_irq && (m_exceptionmode == EXC_NONE);
 
@@ -806,17 +939,104 @@ void CRV32::GatherInstructions(CCSRMem* csr, CBus* bus)
 		return;
 	}
 
-	// Regular instruction sequence
+	// Regular instruction sequence, served from decoded blocks where possible
+	// NOTE: Code running from device memory is never cached
+	SDecodedBlock *recording = nullptr;
+	if ((m_PC & 0x80000000) == 0)
+	{
+		// All of memory got replaced since last time
+		if (m_codeGeneration != bus->m_mem->m_codeGeneration)
+		{
+			FlushBlockCache();
+			m_codeGeneration = bus->m_mem->m_codeGeneration;
+		}
+
+		// Memory this block was decoded from has been written to since, decode it again
+		auto cached = m_blockCache.find(m_PC);
+		if (cached != m_blockCache.end() && bus->m_mem->CodeWrittenSince(cached->second->m_PC, cached->second->m_lastPC, cached->second->m_codeStamp))
+		{
+			delete cached->second;
+			m_blockCache.erase(cached);
+			cached = m_blockCache.end();
+		}
+
+		if (cached != m_blockCache.end())
+		{
+			SDecodedBlock *blk = cached->second;
+
+			// Cached blocks skip fetch, the timing model still wants their trips through the I$
+			if (m_timing.icacheModel && !blk->m_code.empty())
+			{
+				uint32_t lastLine = blk->m_code.back().m_pc & ~63u;
+				for (uint32_t linePC = blk->m_PC; ; linePC = (linePC & ~63u) + 64)
+				{
+					m_cycles += m_icache.Touch(bus, linePC);
+					if ((linePC & ~63u) >= lastLine)
+						break;
+				}
+			}
+
+			// Execute straight from the cache unless we need to append to it
+			if (m_instructions.empty() && blk->m_exit != EBlockExitTrap)
+				m_execBlock = blk;
+			else
+				m_instructions.insert(m_instructions.end(), blk->m_code.begin(), blk->m_code.end());
+#if defined(CPU_STATS)
+			m_blockhits++;
+#endif
+
+			switch (blk->m_exit)
+			{
+				case EBlockExitBranch:
+					m_fetchstate = EFetchWaitForBranch;
+					return;
+				case EBlockExitJump:
+					m_PC = blk->m_nextPC;
+					return;
+				case EBlockExitWFI:
+					m_fetchstate = EFetchWFI;
+					m_PC = blk->m_nextPC;
+					return;
+				default:
+					// Whether the next instruction traps depends on CPU state, fetch the rest as usual
+					m_PC = blk->m_nextPC;
+					break;
+			}
+		}
+		else
+		{
+			recording = new SDecodedBlock();
+			recording->m_PC = m_PC;
+			recording->m_codeStamp = bus->m_mem->CodeStamp();
+#if defined(CPU_STATS)
+			m_blockmisses++;
+#endif
+		}
+	}
+
 	bool doneFetching = false;
 	do{
 		uint32_t instruction;
-		m_icache.Fetch(bus, m_PC, instruction);
+		m_cycles += m_icache.Fetch(bus, m_PC, instruction);
 
 		// Decode is part of fetch unit in hardware
 		SDecodedInstruction decoded;
 		DecodeInstruction(m_PC, instruction, decoded);
 		decoded.m_cantBreak = 0; // non-ISR
 
+		// Record into the block cache up to anything that could trap
+		if (recording)
+		{
+			bool maytrap = (decoded.m_opcode == OP_SYSTEM && (decoded.m_f12 == F12_EBREAK || decoded.m_f12 == F12_ECALL)) || decoded.m_opindex == 0;
+			if (maytrap)
+			{
+				FinalizeBlock(bus, recording, EBlockExitTrap, decoded.m_pc, decoded.m_pc);
+				recording = nullptr;
+			}
+			else
+				recording->m_code.push_back(decoded);
+		}
+
 		bool ismret = decoded.m_opcode == OP_SYSTEM && decoded.m_f12 == F12_MRET;
 		bool iswfi = decoded.m_opcode == OP_SYSTEM && decoded.m_f12 == F12_WFI;
 		bool isfence = decoded.m_opcode == OP_FENCE;
@@ -829,6 +1049,13 @@ void CRV32::GatherInstructions(CCSRMem* csr, CBus* bus)
 		bool isillegal = csr->m_sie && decoded.m_opindex == 0;
 		bool branchtomtvecforinstr = (isebreak || isecall || isillegal) && (m_exceptionmode == EXC_NONE);
 
+		// Syscall arguments live in registers, let everything queued in front of the ECALL execute first
+		if (isecall && branchtomtvecforinstr && !m_instructions.empty())
+		{
+			m_PC = decoded.m_pc;
+			break;
+		}
+
 		// Exception handling is part of fetch unit in hardware
 		if (branchtomtvecforinstr)
 		{
@@ -838,6 +1065,11 @@ void CRV32::GatherInstructions(CCSRMem* csr, CBus* bus)
 			// Most of these prevent instruction execution so they have to come back to same PC
 			if (isecall) // ecall
 			{
+				if (m_GPR[17] == 93) // exit
+				{
+					++m_exitcalls;
+					m_exitcode = m_GPR[10];
+				}
 				m_exceptionmode = EXC_ECALL;
 				// ECALL assumes current instruction executed and will return to the next one
 				m_PC += 4;
@@ -886,11 +1118,15 @@ void CRV32::GatherInstructions(CCSRMem* csr, CBus* bus)
 			m_fetchstate = EFetchWFI;
 			m_PC = decoded.m_pc + 4;
 			doneFetching = true;
+			if (recording)
+				FinalizeBlock(bus, recording, EBlockExitWFI, m_PC, decoded.m_pc);
 		}
 		else if (isjal) // For JAL instructions, we can calculate the target immediately without having to execute
 		{
 			m_PC = decoded.m_pc + decoded.m_immed;
 			doneFetching = true;
+			if (recording)
+				FinalizeBlock(bus, recording, EBlockExitJump, m_PC, decoded.m_pc);
 		}
 		else if (isebreak) // EBREAK stays at the same PC until it's replaced by another instruction or SWI is disabled
 			m_PC = decoded.m_pc;
@@ -900,6 +1136,8 @@ void CRV32::GatherInstructions(CCSRMem* csr, CBus* bus)
 		{
 			m_fetchstate = EFetchWaitForBranch; // wait for branch target from exec
 			doneFetching = true;
+			if (recording)
+				FinalizeBlock(bus, recording, EBlockExitBranch, 0, decoded.m_pc);
 		}
 	} while (!doneFetching);
 }
@@ -981,475 +1219,724 @@ bool CRV32::FetchDecode(CBus* bus)
 	}
 }
 
-bool CRV32::Execute(CBus* bus)
+void CRV32::ExecuteInstruction(CBus* bus, CCSRMem* csr, SDecodedInstruction& instr)
 {
-	CCSRMem* csr = bus->GetCSR(m_hartid);
-	for (auto &instr : m_instructions)
+	// Get register contents
+	instr.m_rval1 = m_GPR[instr.m_rs1 & 0x1F];
+	instr.m_rval2 = m_GPR[instr.m_rs2 & 0x1F];
+	instr.m_rval3 = m_GPR[instr.m_rs3 & 0x1F];
+
+	// Calculate future PC and other offsets
+	uint32_t adjacentpc = instr.m_pc + 4;
+	uint32_t rwaddress = instr.m_rval1 + instr.m_immed;
+	uint32_t offsetpc = instr.m_pc + instr.m_immed;
+	uint32_t rdin = 0;
+	uint32_t rwen = 0;
+	uint32_t wdata = 0;
+	uint32_t wstrobe = 0;
+
+	// Execute
+	switch (instr.m_opcode)
 	{
-		m_execPC = instr.m_pc;
-		csr->SetPC(instr.m_pc);
+		case OP_OP:
+		case OP_OP_IMM:
+			rdin = ALU(instr);
+			rwen = 1;
+		break;
 
-		// Is this PC in the m_breakpoints?
-		auto found = std::find_if(m_breakpoints.begin(), m_breakpoints.end(), [&](const SBreakpoint& b) { return b.address == instr.m_pc && !instr.m_cantBreak; });
-		if (found != m_breakpoints.end())
+		case OP_AUIPC:
+			rdin = offsetpc;
+			rwen = 1;
+		break;
+
+		case OP_LUI:
+			rdin = instr.m_immed;
+			rwen = 1;
+		break;
+
+		case OP_JAL:
+			// fetch handles this
+			rdin = adjacentpc;
+			rwen = 1;
+#if defined(CPU_STATS)
+			m_ucbtaken++;
+#endif
+		break;
+
+		case OP_JALR:
+			m_branchresolved = 1;
+			m_branchtarget = rwaddress;
+			rdin = adjacentpc;
+			rwen = 1;
+#if defined(CPU_STATS)
+			m_ucbtaken++;
+#endif
+		break;
+
+		case OP_BRANCH:
 		{
-#if defined(GDB_COMM_DEBUG)
-			fprintf(stderr, "Break at 0x%08X (0x%08X)\n", instr.m_pc, instr.m_rawInstruction);
+			m_branchresolved = 1;
+			bool branchout = BLU(instr);
+#if defined(CPU_STATS)
+			m_btaken += branchout ? 1 : 0;
+			m_bntaken += branchout ? 0 : 1;
 #endif
-		
-			// Remove instructions we have already executed up to and excluding this one
+			m_branchtarget = branchout ? offsetpc : adjacentpc;
+		}
+		break;
 
-			while(m_instructions.size() > 1)
+		case OP_FENCE:
+			m_icache.Discard();
+			m_instructions.clear();
+			m_blockFlushPending = 1;
+			m_branchresolved = 1;
+			m_branchtarget = instr.m_pc + 4;
+		break;
+
+		case OP_SYSTEM:
+		{
+			m_cycles += 6; // SYSOP + WAIT
+
+			if (instr.m_f12 == F12_CDISCARD)
 			{
-				if (m_instructions[0].m_pc != instr.m_pc)
-					m_instructions.erase(m_instructions.begin());
-				else
-					break; // We're at the current instruction
+				// cacheop=0b01
+				// NOOP for now, D$ not implemented yet
+				//fprintf(stderr, "- cdiscard\n");
+				m_cycles += 50; // CACHE OP
+				m_dcache.Discard();
+			}
+			else if (instr.m_f12 == F12_CFLUSH)
+			{
+				// cacheop=0b11
+				m_cycles += m_dcache.Flush(bus);
+			}
+			else if (instr.m_f12 == F12_MRET)
+			{
+				m_cycles += 2; // MRET
+				m_wasmret = 1;
+				m_branchresolved = 1;
+				csr->Read((CSR_MEPC << 2), m_branchtarget);
+			}
+			else if (instr.m_f12 == F12_WFI)
+			{
+				// This is handled by fetch unit, same as hardware
+			}
+			else if (instr.m_f12 == F12_EBREAK)
+			{
+				// This is handled by fetch unit, same as hardware
+			}
+			else if (instr.m_f12 == F12_ECALL)
+			{
+				// This is handled by fetch unit, same as hardware
 			}
+			else // CSROP
+			{
+				m_cycles += 4; // READ + MODIFY + WRITE + WAIT
 
-			found->isHit = 1;
-			found->isCommunicated = 0;
-			return true;
-		}
+				// Read previous value
+				uint32_t csrprevval;
+				uint32_t csraddress = (instr.m_csroffset << 2);
+				csr->Read(csraddress, csrprevval);
 
-		// Get register contents
-		instr.m_rval1 = m_GPR[instr.m_rs1 & 0x1F];
-		instr.m_rval2 = m_GPR[instr.m_rs2 & 0x1F];
-		instr.m_rval3 = m_GPR[instr.m_rs3 & 0x1F];
+				// Keep it in a register
+				rwen = 1;
+				rdin = csrprevval;
+				const uint32_t csrbase = csrBaseTable[m_hartid];
+				rwaddress = csrbase + csraddress;
 
-		// Calculate future PC and other offsets
-		uint32_t adjacentpc = instr.m_pc + 4;
-		uint32_t rwaddress = instr.m_rval1 + instr.m_immed;
-		uint32_t offsetpc = instr.m_pc + instr.m_immed;
-		uint32_t rdin = 0;
-		uint32_t rwen = 0;
-		uint32_t wdata = 0;
-		uint32_t wstrobe = 0;
+				// Apply operation
+				wstrobe = 0b1111;
+				switch (instr.m_f3)
+				{
+					case 0b001: // csrrw
+						wdata = instr.m_rval1;
+						break;
+					case 0b101: // csrrwi
+						wdata = instr.m_immed;
+						break;
+					case 0b010: // csrrs / csrr (set bits using rval1 as mask)
+						wdata = csrprevval | instr.m_rval1;
+						break;
+					case 0b110: // csrrsi
+						wdata = csrprevval | instr.m_immed;
+						break;
+					case 0b011: // csrrc
+						wdata = csrprevval & (~instr.m_rval1);
+						break;
+					case 0b111: // csrrci
+						wdata = csrprevval & (~instr.m_immed);
+						break;
+					default: // unknown - keep previous value
+						wdata = csrprevval;
+						break;
+				}
+			}
+		}
+		break;
+
+		case OP_STORE:
+		{
+			m_cycles += 1; // + bus busy wait
 
-		m_cycles += 4; // cache read + read registers + dispatch
+			uint32_t byte = SelectBitRange(instr.m_rval2, 7, 0);
+			uint32_t half = SelectBitRange(instr.m_rval2, 15, 0);
+			switch (instr.m_f3)
+			{
+				case 0b000:	wdata = (byte << 24) | (byte << 16) | (byte << 8) | byte; break;
+				case 0b001:	wdata = (half << 16) | half; break;
+				default:	wdata = instr.m_rval2; break;
+			}
+			uint32_t ah = SelectBitRange(rwaddress, 1, 1);
+			uint32_t ab = SelectBitRange(rwaddress, 0, 0);
+			uint32_t himask = (ah << 3) | (ah << 2) | ((1 - ah) << 1) | (1 - ah);
+			uint32_t lomask = ((ab << 3) | ((1 - ab) << 2) | (ab << 1) | (1 - ab));
+			switch (instr.m_f3)
+			{
+				case 0b000:	wstrobe = himask & lomask; break;
+				case 0b001:	wstrobe = himask; break;
+				default:	wstrobe = 0b1111; break;
+			}
+		}
+		break;
 
-		// Execute
-		switch (instr.m_opcode)
+		case OP_LOAD:
 		{
-			case OP_OP:
-			case OP_OP_IMM:
-				rdin = ALU(instr);
-				rwen = 1;
-			break;
+			m_cycles += 1; // + bus busy wait
 
-			case OP_AUIPC:
-				rdin = offsetpc;
-				rwen = 1;
-			break;
+			uint32_t dataword;
+			if (rwaddress & 0x80000000)
+			{
+				m_cycles += 2; // uncached access
+				bus->Read(rwaddress, dataword);
+			}
+			else
+			{
+				// Read from cache or miss cache
+				m_cycles += m_dcache.Read(bus, instr.m_pc, rwaddress, dataword);
+			}
 
-			case OP_LUI:
-				rdin = instr.m_immed;
-				rwen = 1;
-			break;
+			uint32_t range1 = SelectBitRange(rwaddress, 1, 1);
+			uint32_t range2 = SelectBitRange(rwaddress, 1, 0);
 
-			case OP_JAL:
-				// fetch handles this
-				rdin = adjacentpc;
-				rwen = 1;
-#if defined(CPU_STATS)
-				m_ucbtaken++;
-#endif
-			break;
+			uint32_t b[4];
+			b[3] = SelectBitRange(dataword, 31, 24);
+			b[2] = SelectBitRange(dataword, 23, 16);
+			b[1] = SelectBitRange(dataword, 15, 8);
+			b[0] = SelectBitRange(dataword, 7, 0);
 
-			case OP_JALR:
-				m_branchresolved = 1;
-				m_branchtarget = rwaddress;
-				rdin = adjacentpc;
-				rwen = 1;
-#if defined(CPU_STATS)
-				m_ucbtaken++;
-#endif
-			break;
+			uint32_t h[2];
+			h[1] = SelectBitRange(dataword, 31, 16);
+			h[0] = SelectBitRange(dataword, 15, 0);
+
+			int32_t sign[4];
+			sign[3] = int32_t(dataword & 0x80000000);
+			sign[2] = int32_t((dataword << 8) & 0x80000000);
+			sign[1] = int32_t((dataword << 16) & 0x80000000);
+			sign[0] = int32_t((dataword << 24) & 0x80000000);
 
-			case OP_BRANCH:
+			switch (instr.m_f3)
 			{
-				m_branchresolved = 1;
-				bool branchout = BLU(instr);
-#if defined(CPU_STATS)
-				m_btaken += branchout ? 1 : 0;
-				m_bntaken += branchout ? 0 : 1;
-#endif
-				m_branchtarget = branchout ? offsetpc : adjacentpc;
+				case 0b000: // BYTE with sign extension
+					rdin = (sign[range2] >> 24) | b[range2];
+				break;
+				case 0b001: // HALF with sign extension
+					rdin = (sign[range1*2+1] >> 16) | h[range1];
+				break;
+				case 0b100: // BYTE with zero extension
+					rdin = b[range2];
+				break;
+				case 0b101: // HALF with zero extension
+					rdin = h[range1];
+				break;
+				default: // WORD - 0b010
+					rdin = dataword;
+				break;
 			}
-			break;
-
-			case OP_FENCE:
-				m_icache.Discard();
-				m_instructions.clear();
-				m_decodedBlocks.clear();
-				m_branchresolved = 1;
-				m_branchtarget = instr.m_pc + 4;
-			break;
+			rwen = 1;
+		}
+		break;
 
-			case OP_SYSTEM:
+		case OP_FLOAT_MADD:
+		case OP_FLOAT_MSUB:
+		case OP_FLOAT_NMSUB:
+		case OP_FLOAT_NMADD:
+		{
+			m_cycles += 19; // all of them take 19 cycles
+
+			// We use zfinx extension (floating point registers in integer registers) so we need to alias them
+			float A = *(float*)&instr.m_rval1;
+			float B = *(float*)&instr.m_rval2;
+			float C = *(float*)&instr.m_rval3;
+			float* D = (float*)&rdin;
+			rwen = 1;
+
+			if (instr.m_opcode == OP_FLOAT_MADD)
+				*D = A * B + C;
+			else if (instr.m_opcode == OP_FLOAT_MSUB)
+				*D = A * B - C;
+			else if (instr.m_opcode == OP_FLOAT_NMSUB)
+				*D = -(A * B - C);
+			else if (instr.m_opcode == OP_FLOAT_NMADD)
+				*D = -(A * B + C);
+			else
 			{
-				m_cycles += 6; // SYSOP + WAIT
+				fprintf(stderr, "- unknown floatop3\n");
+			}
+		}
+		break;
 
-				if (instr.m_f12 == F12_CDISCARD)
+		case OP_FLOAT_OP:
+		{
+			float A = *(float*)&instr.m_rval1;
+			float B = *(float*)&instr.m_rval2;
+			float* D = (float*)&rdin;
+			rwen = 1;
+
+			switch (instr.m_f7)
+			{
+				case 0b0010000: // fsgnj.s / fsgnjn.s / fsgnjx.s
 				{
-					// cacheop=0b01
-					// NOOP for now, D$ not implemented yet
-					//fprintf(stderr, "- cdiscard\n");
-					m_cycles += 50; // CACHE OP
-					m_dcache.Discard();
+					m_cycles += 1;
+					switch (instr.m_f3)
+					{
+						case 0b000: rdin = (instr.m_rval2 & 0x80000000) | (instr.m_rval1 & 0x7FFFFFFF); break;
+						case 0b001: rdin = ((instr.m_rval2 & 0x80000000) ^ 0x80000000) | (instr.m_rval1 & 0x7FFFFFFF); break;
+						default: rdin = ((instr.m_rval2 & 0x80000000) ^ (instr.m_rval1 & 0x80000000)) | (instr.m_rval1 & 0x7FFFFFFF); break;
+					}
 				}
-				else if (instr.m_f12 == F12_CFLUSH)
+				break;
+				case 0b1110000: // fclass
 				{
-					// cacheop=0b11
-					m_cycles += m_dcache.Flush(bus);
+					m_cycles += 1; // Not implemented
+					switch (instr.m_f3)
+					{
+						case 0b000: {
+							rdin = instr.m_rval1; // fmv.x.w
+						}
+						break;
+						case 0b001: { // fclass.s
+							rdin = RISCV_POS_NORMAL; // Not implementing this for now
+							/*if (instr.m_rval1 == 0x00000000) rdin = POS_ZERO;
+							else if (instr.m_rval1 == 0x80000000) rdin = NEG_ZERO;
+							else if (instr.m_rval1 == 0x7F800000) rdin = POS_INF;
+							else if (instr.m_rval1 == 0xFF800000) rdin = NEG_INF;
+							else if (instr.m_rval1 >= 0x7F800001 && instr.m_rval1 <= 0x7FBFFFFF) rdin = SNAN;
+							else if (instr.m_rval1 >= 0xFF800001 && instr.m_rval1 <= 0xFFBFFFFF) rdin = SNAN;
+							else if (instr.m_rval1 >= 0x7FC00000 && instr.m_rval1 <= 0x7FFFFFFF) rdin = QNAN;
+							else if (instr.m_rval1 >= 0xFFC00000 && instr.m_rval1 <= 0xFFFFFFFF) rdin = QNAN;
+							else if (instr.m_rval1 & 0x80000000) rdin = NEG_NORMAL;
+							else rdin = POS_NORMAL;*/
+						}
+						break;
+					}
 				}
-				else if (instr.m_f12 == F12_MRET)
+				break;
+				case 0b0010100: // fmin.s / fmax.s
 				{
-					m_cycles += 2; // MRET
-					m_wasmret = 1;
-					m_branchresolved = 1;
-					csr->Read((CSR_MEPC << 2), m_branchtarget);
+					m_cycles += 1;
+					switch (instr.m_f3)
+					{
+						case 0b000: *D = A < B ? A : B; break;
+						case 0b001: *D = A > B ? A : B; break;
+					}
 				}
-				else if (instr.m_f12 == F12_WFI)
+				break;
+				case 0b1010000: // feq.s / flt.s / fle.s
 				{
-					// This is handled by fetch unit, same as hardware
+					m_cycles += 2;
+					switch (instr.m_f3)
+					{
+						case 0b010: rdin = A == B ? 1 : 0; break;
+						case 0b001: rdin = A < B ? 1 : 0; break;
+						case 0b000: rdin = A <= B ? 1 : 0; break;
+					}
 				}
-				else if (instr.m_f12 == F12_EBREAK)
+				break;
+				case 0b1100000: // fcvtws / fcvtwus
 				{
-					// This is handled by fetch unit, same as hardware
+					m_cycles += 8; // fcvtws
+					//m_cycles += 5; // fcvtwus
+					if (instr.m_rs2 == 0b00000) // Signed
+						rdin = (int32_t)A;
+					else // Unsigned - 5'b00000
+						rdin = (uint32_t)A;
 				}
-				else if (instr.m_f12 == F12_ECALL)
+				break;
+				case 0b1101000: // fcvtsw / fcvtwus
 				{
-					// This is handled by fetch unit, same as hardware
+					m_cycles += 6;
+					if (instr.m_rs2 == 0b00000) // signed
+						*D = (float)(int32_t)instr.m_rval1;
+					else // unsigned - NOTE: doing the abs() trick the hardware does here
+						*D = (float)(instr.m_rval1&0x7FFFFFFF);
 				}
-				else // CSROP
+				break;
+				case 0b0000000: // fadd.s
 				{
-					m_cycles += 4; // READ + MODIFY + WRITE + WAIT
-
-					// Read previous value
-					uint32_t csrprevval;
-					uint32_t csraddress = (instr.m_csroffset << 2);
-					csr->Read(csraddress, csrprevval);
-
-					// Keep it in a register
-					rwen = 1;
-					rdin = csrprevval;
-					const uint32_t csrbase = csrBaseTable[m_hartid];
-					rwaddress = csrbase + csraddress;
-
-					// Apply operation
-					wstrobe = 0b1111;
-					switch (instr.m_f3)
-					{
-						case 0b001: // csrrw
-							wdata = instr.m_rval1;
-							break;
-						case 0b101: // csrrwi
-							wdata = instr.m_immed;
-							break;
-						case 0b010: // csrrs / csrr (set bits using rval1 as mask)
-							wdata = csrprevval | instr.m_rval1;
-							break;
-						case 0b110: // csrrsi
-							wdata = csrprevval | instr.m_immed;
-							break;
-						case 0b011: // csrrc
-							wdata = csrprevval & (~instr.m_rval1);
-							break;
-						case 0b111: // csrrci
-							wdata = csrprevval & (~instr.m_immed);
-							break;
-						default: // unknown - keep previous value
-							wdata = csrprevval;
-							break;
-					}
+					m_cycles += 11;
+					*D = A + B;
 				}
-			}
-			break;
-
-			case OP_STORE:
-			{
-				m_cycles += 1; // + bus busy wait
-
-				uint32_t byte = SelectBitRange(instr.m_rval2, 7, 0);
-				uint32_t half = SelectBitRange(instr.m_rval2, 15, 0);
-				switch (instr.m_f3)
+				break;
+				case 0b0000100: // fsub.s
 				{
-					case 0b000:	wdata = (byte << 24) | (byte << 16) | (byte << 8) | byte; break;
-					case 0b001:	wdata = (half << 16) | half; break;
-					default:	wdata = instr.m_rval2; break;
+					m_cycles += 11;
+					*D = A - B;
 				}
-				uint32_t ah = SelectBitRange(rwaddress, 1, 1);
-				uint32_t ab = SelectBitRange(rwaddress, 0, 0);
-				uint32_t himask = (ah << 3) | (ah << 2) | ((1 - ah) << 1) | (1 - ah);
-				uint32_t lomask = ((ab << 3) | ((1 - ab) << 2) | (ab << 1) | (1 - ab));
-				switch (instr.m_f3)
+				break;
+				case 0b0001000: // fmul.s
 				{
-					case 0b000:	wstrobe = himask & lomask; break;
-					case 0b001:	wstrobe = himask; break;
-					default:	wstrobe = 0b1111; break;
+					m_cycles += 8;
+					*D = A * B;
 				}
-			}
-			break;
-
-			case OP_LOAD:
-			{
-				m_cycles += 1; // + bus busy wait
-
-				uint32_t dataword;
-				if (rwaddress & 0x80000000)
+				break;
+				case 0b0001100: // fdiv.s
 				{
-					m_cycles += 2; // uncached access
-					bus->Read(rwaddress, dataword);
+					m_cycles += 31;
+					if (instr.m_rval2 == 0)
+						rdin = 0x7fc00000;
+					else
+						*D = A / B;
 				}
-				else
+				break;
+				case 0b0101100: // fsqrt.s
+				{
+					m_cycles += 31;
+					*D = sqrtf(abs(A)); // NOTE: hardware drops sign bit i.e. abs()
+				}
+				break;
+				case 0b1100001: // fcvtswu4sat.s
+				{
+					m_cycles += 5;
+					int sat = (int)(16.0f * A);
+					sat = sat > 15 ? 15 : sat;
+					sat = sat < 0 ? 0 : sat;
+					rdin = sat;
+				}
+				break;
+				default:
 				{
-					// Read from cache or miss cache
-					m_cycles += m_dcache.Read(bus, rwaddress, dataword);
+					rwen = 0;
+					fprintf(stderr, "- unknown floatop2\n");
 				}
+				break;
+			}
+		}
+		break;
 
-				uint32_t range1 = SelectBitRange(rwaddress, 1, 1);
-				uint32_t range2 = SelectBitRange(rwaddress, 1, 0);
+		default:
+		{
+			// Illegal instruction exception should catch this
+		}
+		break;
+	}
 
-				uint32_t b[4];
-				b[3] = SelectBitRange(dataword, 31, 24);
-				b[2] = SelectBitRange(dataword, 23, 16);
-				b[1] = SelectBitRange(dataword, 15, 8);
-				b[0] = SelectBitRange(dataword, 7, 0);
+	if (wstrobe)
+	{
+		m_cycles += 1;
+		//fprintf(stderr, "- W @%.8X val=%.8x mask=%.8x\n", rwaddress, wdata, wstrobe);
+		if (rwaddress & 0x80000000)
+		{
+			bus->Write(rwaddress, wdata, wstrobe);
+			m_cycles += CBus::TakeStallCycles();
+		}
+		else
+		{
+			m_cycles += m_dcache.Write(bus, instr.m_pc, rwaddress, wdata, wstrobe);
+		}
+	}
 
-				uint32_t h[2];
-				h[1] = SelectBitRange(dataword, 31, 16);
-				h[0] = SelectBitRange(dataword, 15, 0);
+	if (rwen && instr.m_rd != 0)
+	{
+		//fprintf(stderr, "- regw @%.8X val=%.8x\n", instr.m_rd, rdin);
+		m_GPR[instr.m_rd] = rdin;
+	}
+}
 
-				int32_t sign[4];
-				sign[3] = int32_t(dataword & 0x80000000);
-				sign[2] = int32_t((dataword << 8) & 0x80000000);
-				sign[1] = int32_t((dataword << 16) & 0x80000000);
-				sign[0] = int32_t((dataword << 24) & 0x80000000);
+bool CRV32::Execute(CBus* bus)
+{
+	CCSRMem* csr = bus->GetCSR(m_hartid);
 
-				switch (instr.m_f3)
-				{
-					case 0b000: // BYTE with sign extension
-						rdin = (sign[range2] >> 24) | b[range2];
-					break;
-					case 0b001: // HALF with sign extension
-						rdin = (sign[range1*2+1] >> 16) | h[range1];
-					break;
-					case 0b100: // BYTE with zero extension
-						rdin = b[range2];
-					break;
-					case 0b101: // HALF with zero extension
-						rdin = h[range1];
-					break;
-					default: // WORD - 0b010
-						rdin = dataword;
-					break;
-				}
-				rwen = 1;
-			}
-			break;
+	// Fetch might have handed us a cached block to run in place
+	std::vector<SDecodedInstruction>& code = m_execBlock ? m_execBlock->m_code : m_instructions;
 
-			case OP_FLOAT_MADD:
-			case OP_FLOAT_MSUB:
-			case OP_FLOAT_NMSUB:
-			case OP_FLOAT_NMADD:
-			{
-				m_cycles += 19; // all of them take 19 cycles
+	// Breakpoints need to be checked per instruction, only pay for that while any are set
+	if (m_debugArmed)
+		return ExecuteChecked(bus, csr, code);
 
-				// We use zfinx extension (floating point registers in integer registers) so we need to alias them
-				float A = *(float*)&instr.m_rval1;
-				float B = *(float*)&instr.m_rval2;
-				float C = *(float*)&instr.m_rval3;
-				float* D = (float*)&rdin;
-				rwen = 1;
+	if (m_profiler)
+		ExecuteProfiled(bus, csr, code);
+	else
+	{
+#if defined(THREADED_DISPATCH)
+		ExecuteThreaded(bus, csr, code);
+#else
+		ExecuteFast(bus, csr, code);
+#endif
+	}
 
-				if (instr.m_opcode == OP_FLOAT_MADD)
-					*D = A * B + C;
-				else if (instr.m_opcode == OP_FLOAT_MSUB)
-					*D = A * B - C;
-				else if (instr.m_opcode == OP_FLOAT_NMSUB)
-					*D = -(A * B - C);
-				else if (instr.m_opcode == OP_FLOAT_NMADD)
-					*D = -(A * B + C);
-				else
-				{
-					fprintf(stderr, "- unknown floatop3\n");
-				}
-			}
-			break;
+	m_execBlock = nullptr;
+	m_instructions.clear();
 
-			case OP_FLOAT_OP:
-			{
-				float A = *(float*)&instr.m_rval1;
-				float B = *(float*)&instr.m_rval2;
-				float* D = (float*)&rdin;
-				rwen = 1;
+	csr->SetRetiredInstructions(m_retired);
+	return false;
+}
 
-				switch (instr.m_f7)
-				{
-					case 0b0010000: // fsgnj.s / fsgnjn.s / fsgnjx.s
-					{
-						m_cycles += 1;
-						switch (instr.m_f3)
-						{
-							case 0b000: rdin = (instr.m_rval2 & 0x80000000) | (instr.m_rval1 & 0x7FFFFFFF); break;
-							case 0b001: rdin = ((instr.m_rval2 & 0x80000000) ^ 0x80000000) | (instr.m_rval1 & 0x7FFFFFFF); break;
-							default: rdin = ((instr.m_rval2 & 0x80000000) ^ (instr.m_rval1 & 0x80000000)) | (instr.m_rval1 & 0x7FFFFFFF); break;
-						}
-					}
-					break;
-					case 0b1110000: // fclass
-					{
-						m_cycles += 1; // Not implemented
-						switch (instr.m_f3)
-						{
-							case 0b000: {
-								rdin = instr.m_rval1; // fmv.x.w
-							}
-							break;
-							case 0b001: { // fclass.s
-								rdin = RISCV_POS_NORMAL; // Not implementing this for now
-								/*if (instr.m_rval1 == 0x00000000) rdin = POS_ZERO;
-								else if (instr.m_rval1 == 0x80000000) rdin = NEG_ZERO;
-								else if (instr.m_rval1 == 0x7F800000) rdin = POS_INF;
-								else if (instr.m_rval1 == 0xFF800000) rdin = NEG_INF;
-								else if (instr.m_rval1 >= 0x7F800001 && instr.m_rval1 <= 0x7FBFFFFF) rdin = SNAN;
-								else if (instr.m_rval1 >= 0xFF800001 && instr.m_rval1 <= 0xFFBFFFFF) rdin = SNAN;
-								else if (instr.m_rval1 >= 0x7FC00000 && instr.m_rval1 <= 0x7FFFFFFF) rdin = QNAN;
-								else if (instr.m_rval1 >= 0xFFC00000 && instr.m_rval1 <= 0xFFFFFFFF) rdin = QNAN;
-								else if (instr.m_rval1 & 0x80000000) rdin = NEG_NORMAL;
-								else rdin = POS_NORMAL;*/
-							}
-							break;
-						}
-					}
-					break;
-					case 0b0010100: // fmin.s / fmax.s
-					{
-						m_cycles += 1;
-						switch (instr.m_f3)
-						{
-							case 0b000: *D = A < B ? A : B; break;
-							case 0b001: *D = A > B ? A : B; break;
-						}
-					}
-					break;
-					case 0b1010000: // feq.s / flt.s / fle.s
-					{
-						m_cycles += 2;
-						switch (instr.m_f3)
-						{
-							case 0b010: rdin = A == B ? 1 : 0; break;
-							case 0b001: rdin = A < B ? 1 : 0; break;
-							case 0b000: rdin = A <= B ? 1 : 0; break;
-						}
-					}
-					break;
-					case 0b1100000: // fcvtws / fcvtwus
-					{
-						m_cycles += 8; // fcvtws
-						//m_cycles += 5; // fcvtwus
-						if (instr.m_rs2 == 0b00000) // Signed
-							rdin = (int32_t)A;
-						else // Unsigned - 5'b00000
-							rdin = (uint32_t)A;
-					}
-					break;
-					case 0b1101000: // fcvtsw / fcvtwus
-					{
-						m_cycles += 6;
-						if (instr.m_rs2 == 0b00000) // signed
-							*D = (float)(int32_t)instr.m_rval1;
-						else // unsigned - NOTE: doing the abs() trick the hardware does here
-							*D = (float)(instr.m_rval1&0x7FFFFFFF);
-					}
-					break;
-					case 0b0000000: // fadd.s
-					{
-						m_cycles += 11;
-						*D = A + B;
-					}
-					break;
-					case 0b0000100: // fsub.s
-					{
-						m_cycles += 11;
-						*D = A - B;
-					}
-					break;
-					case 0b0001000: // fmul.s
-					{
-						m_cycles += 8;
-						*D = A * B;
-					}
-					break;
-					case 0b0001100: // fdiv.s
-					{
-						m_cycles += 31;
-						if (instr.m_rval2 == 0)
-							rdin = 0x7fc00000;
-						else
-							*D = A / B;
-					}
-					break;
-					case 0b0101100: // fsqrt.s
-					{
-						m_cycles += 31;
-						*D = sqrtf(abs(A)); // NOTE: hardware drops sign bit i.e. abs()
-					}
-					break;
-					case 0b1100001: // fcvtswu4sat.s
-					{
-						m_cycles += 5;
-						int sat = (int)(16.0f * A);
-						sat = sat > 15 ? 15 : sat;
-						sat = sat < 0 ? 0 : sat;
-						rdin = sat;
-					}
-					break;
-					default:
-					{
-						rwen = 0;
-						fprintf(stderr, "- unknown floatop2\n");
-					}
-					break;
-				}
-			}
-			break;
+void CRV32::ExecuteFast(CBus* bus, CCSRMem* csr, std::vector<SDecodedInstruction>& code)
+{
+	// NOTE: A fence in this block clears m_instructions, iteration still covers the whole block
+	SDecodedInstruction* first = code.data();
+	SDecodedInstruction* last = first + code.size();
 
-			default:
+	// cache read + read registers + dispatch
+	m_cycles += m_timing.instructionCycles * uint32_t(last - first);
+
+	for (SDecodedInstruction* instr = first; instr != last; ++instr)
+	{
+		m_execPC = instr->m_pc;
+		csr->SetPC(instr->m_pc);
+		ExecuteInstruction(bus, csr, *instr);
+	}
+
+	m_retired += uint32_t(last - first);
+}
+
+void CRV32::ExecuteProfiled(CBus* bus, CCSRMem* csr, std::vector<SDecodedInstruction>& code)
+{
+	// Same as ExecuteFast, except cycles are charged one instruction at a time so each sample lands on the right PC
+	SDecodedInstruction* first = code.data();
+	SDecodedInstruction* last = first + code.size();
+
+	for (SDecodedInstruction* instr = first; instr != last; ++instr)
+	{
+		m_execPC = instr->m_pc;
+		csr->SetPC(instr->m_pc);
+		m_cycles += m_timing.instructionCycles; // cache read + read registers + dispatch
+		ExecuteInstruction(bus, csr, *instr);
+		++m_retired;
+		m_profiler->Sample(bus, this);
+	}
+}
+
+bool CRV32::ExecuteChecked(CBus* bus, CCSRMem* csr, std::vector<SDecodedInstruction>& code)
+{
+	for (auto &instr : code)
+	{
+		m_execPC = instr.m_pc;
+		csr->SetPC(instr.m_pc);
+
+		// Is this PC in the m_breakpoints?
+		if (!instr.m_cantBreak && m_breakpointPCs.count(instr.m_pc))
+		{
+#if defined(GDB_COMM_DEBUG)
+			fprintf(stderr, "Break at 0x%08X (0x%08X)\n", instr.m_pc, instr.m_rawInstruction);
+#endif
+
+			// Keep our own copy of the rest of a cached block to resume from
+			uint32_t breakpc = instr.m_pc;
+			if (m_execBlock)
 			{
-				// Illegal instruction exception should catch this
+				m_instructions.assign(m_execBlock->m_code.begin(), m_execBlock->m_code.end());
+				m_execBlock = nullptr;
 			}
-			break;
-		}
 
-		if (wstrobe)
-		{
-			m_cycles += 1;
-			//fprintf(stderr, "- W @%.8X val=%.8x mask=%.8x\n", rwaddress, wdata, wstrobe);
-			if (rwaddress & 0x80000000)
-				bus->Write(rwaddress, wdata, wstrobe);
-			else
+			// Remove instructions we have already executed up to and excluding this one
+
+			while(m_instructions.size() > 1)
 			{
-				m_cycles += m_dcache.Write(bus, rwaddress, wdata, wstrobe);
+				if (m_instructions[0].m_pc != breakpc)
+					m_instructions.erase(m_instructions.begin());
+				else
+					break; // We're at the current instruction
 			}
-		}
 
-		if (rwen && instr.m_rd != 0)
-		{
-			//fprintf(stderr, "- regw @%.8X val=%.8x\n", instr.m_rd, rdin);
-			m_GPR[instr.m_rd] = rdin;
+			auto found = std::find_if(m_breakpoints.begin(), m_breakpoints.end(), [&](const SBreakpoint& b) { return b.address == breakpc; });
+			found->isHit = 1;
+			found->isCommunicated = 0;
+			return true;
 		}
 
+		m_cycles += m_timing.instructionCycles; // cache read + read registers + dispatch
+		ExecuteInstruction(bus, csr, instr);
 		++m_retired;
 	}
 
+	m_execBlock = nullptr;
 	m_instructions.clear();
 
 	csr->SetRetiredInstructions(m_retired);
 	return false;
 }
 
+#if defined(THREADED_DISPATCH)
+
+// Each decoded instruction carries its handler index, so dispatch is a single
+// table jump at the end of every handler instead of nested opcode/ALU/BLU switches.
+// With GCC/clang this uses computed goto, other compilers get a flat switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_COMPUTED_GOTO
+#endif
+
+#if defined(THREADED_COMPUTED_GOTO)
+#define EXEC_HANDLER(_h_) L_##_h_:
+#define EXEC_NEXT() if (++instr == last) goto done; goto *s_dispatch[instr->m_handler]
+#else
+#define EXEC_HANDLER(_h_) case _h_:
+#define EXEC_NEXT() break
+#endif
+
+#define RS1 m_GPR[instr->m_rs1]
+#define RS2 m_GPR[instr->m_rs2]
+#define IMM instr->m_immed
+#define WRITE_RD(_val_) { m_GPR[instr->m_rd] = (_val_); m_GPR[0] = 0; }
+
+void CRV32::ExecuteThreaded(CBus* bus, CCSRMem* csr, std::vector<SDecodedInstruction>& code)
+{
+	if (code.empty())
+		return;
+
+	// NOTE: A fence in this block clears m_instructions, iteration still covers the whole block same as the regular path
+	SDecodedInstruction* first = code.data();
+	SDecodedInstruction* last = first + code.size();
+	SDecodedInstruction* instr = first;
+
+	// cache read + read registers + dispatch
+	m_cycles += m_timing.instructionCycles * uint32_t(last - first);
+
+#if defined(THREADED_COMPUTED_GOTO)
+	// Same order as EExecHandler
+	static const void* s_dispatch[EH_COUNT] = {
+		&&L_EH_GENERIC,
+		&&L_EH_ADD, &&L_EH_SUB, &&L_EH_SLL, &&L_EH_SLT, &&L_EH_SLTU, &&L_EH_XOR, &&L_EH_SRL, &&L_EH_SRA, &&L_EH_OR, &&L_EH_AND,
+		&&L_EH_ADDI, &&L_EH_SLLI, &&L_EH_SLTI, &&L_EH_SLTIU, &&L_EH_XORI, &&L_EH_SRLI, &&L_EH_SRAI, &&L_EH_ORI, &&L_EH_ANDI,
+		&&L_EH_LUI, &&L_EH_AUIPC, &&L_EH_JAL, &&L_EH_JALR,
+		&&L_EH_BEQ, &&L_EH_BNE, &&L_EH_BLT, &&L_EH_BGE, &&L_EH_BLTU, &&L_EH_BGEU,
+		&&L_EH_LB, &&L_EH_LH, &&L_EH_LW, &&L_EH_LBU, &&L_EH_LHU,
+		&&L_EH_SB, &&L_EH_SH, &&L_EH_SW };
+
+	goto *s_dispatch[instr->m_handler];
+#else
+	for (; instr != last; ++instr)
+	switch (instr->m_handler)
+#endif
+	{
+		EXEC_HANDLER(EH_GENERIC)
+			m_execPC = instr->m_pc;
+			csr->SetPC(instr->m_pc);
+			ExecuteInstruction(bus, csr, *instr);
+			EXEC_NEXT();
+
+		// Register-register ALU
+		EXEC_HANDLER(EH_ADD)	WRITE_RD(RS1 + RS2); EXEC_NEXT();
+		EXEC_HANDLER(EH_SUB)	WRITE_RD(RS1 - RS2); EXEC_NEXT();
+		EXEC_HANDLER(EH_SLL)	WRITE_RD(RS1 << (RS2 & 0x1F)); EXEC_NEXT();
+		EXEC_HANDLER(EH_SLT)	WRITE_RD((int32_t)RS1 < (int32_t)RS2 ? 1 : 0); EXEC_NEXT();
+		EXEC_HANDLER(EH_SLTU)	WRITE_RD(RS1 < RS2 ? 1 : 0); EXEC_NEXT();
+		EXEC_HANDLER(EH_XOR)	WRITE_RD(RS1 ^ RS2); EXEC_NEXT();
+		EXEC_HANDLER(EH_SRL)	WRITE_RD(RS1 >> (RS2 & 0x1F)); EXEC_NEXT();
+		EXEC_HANDLER(EH_SRA)	WRITE_RD((int32_t)RS1 >> (RS2 & 0x1F)); EXEC_NEXT();
+		EXEC_HANDLER(EH_OR)		WRITE_RD(RS1 | RS2); EXEC_NEXT();
+		EXEC_HANDLER(EH_AND)	WRITE_RD(RS1 & RS2); EXEC_NEXT();
+
+		// Register-immediate ALU
+		EXEC_HANDLER(EH_ADDI)	WRITE_RD(RS1 + IMM); EXEC_NEXT();
+		EXEC_HANDLER(EH_SLLI)	WRITE_RD(RS1 << (IMM & 0x1F)); EXEC_NEXT();
+		EXEC_HANDLER(EH_SLTI)	WRITE_RD((int32_t)RS1 < (int32_t)IMM ? 1 : 0); EXEC_NEXT();
+		EXEC_HANDLER(EH_SLTIU)	WRITE_RD(RS1 < IMM ? 1 : 0); EXEC_NEXT();
+		EXEC_HANDLER(EH_XORI)	WRITE_RD(RS1 ^ IMM); EXEC_NEXT();
+		EXEC_HANDLER(EH_SRLI)	WRITE_RD(RS1 >> (IMM & 0x1F)); EXEC_NEXT();
+		EXEC_HANDLER(EH_SRAI)	WRITE_RD((int32_t)RS1 >> (IMM & 0x1F)); EXEC_NEXT();
+		EXEC_HANDLER(EH_ORI)	WRITE_RD(RS1 | IMM); EXEC_NEXT();
+		EXEC_HANDLER(EH_ANDI)	WRITE_RD(RS1 & IMM); EXEC_NEXT();
+
+		EXEC_HANDLER(EH_LUI)	WRITE_RD(IMM); EXEC_NEXT();
+		EXEC_HANDLER(EH_AUIPC)	WRITE_RD(instr->m_pc + IMM); EXEC_NEXT();
+
+		// Jumps and branches, fetch already knows the jal target
+		EXEC_HANDLER(EH_JAL)
+		{
+#if defined(CPU_STATS)
+			m_ucbtaken++;
+#endif
+			WRITE_RD(instr->m_pc + 4);
+			EXEC_NEXT();
+		}
+		EXEC_HANDLER(EH_JALR)
+		{
+#if defined(CPU_STATS)
+			m_ucbtaken++;
+#endif
+			m_branchresolved = 1;
+			m_branchtarget = RS1 + IMM;
+			WRITE_RD(instr->m_pc + 4);
+			EXEC_NEXT();
+		}
+
+#if defined(CPU_STATS)
+#define EXEC_BRANCH(_cond_) { bool branchout = (_cond_); m_btaken += branchout ? 1 : 0; m_bntaken += branchout ? 0 : 1; m_branchresolved = 1; m_branchtarget = branchout ? instr->m_pc + IMM : instr->m_pc + 4; }
+#else
+#define EXEC_BRANCH(_cond_) { m_branchresolved = 1; m_branchtarget = (_cond_) ? instr->m_pc + IMM : instr->m_pc + 4; }
+#endif
+		EXEC_HANDLER(EH_BEQ)	EXEC_BRANCH(RS1 == RS2); EXEC_NEXT();
+		EXEC_HANDLER(EH_BNE)	EXEC_BRANCH(RS1 != RS2); EXEC_NEXT();
+		EXEC_HANDLER(EH_BLT)	EXEC_BRANCH((int32_t)RS1 < (int32_t)RS2); EXEC_NEXT();
+		EXEC_HANDLER(EH_BGE)	EXEC_BRANCH((int32_t)RS1 >= (int32_t)RS2); EXEC_NEXT();
+		EXEC_HANDLER(EH_BLTU)	EXEC_BRANCH(RS1 < RS2); EXEC_NEXT();
+		EXEC_HANDLER(EH_BGEU)	EXEC_BRANCH(RS1 >= RS2); EXEC_NEXT();
+#undef EXEC_BRANCH
+
+		// Loads, with the same bus / D$ timing as the regular path
+#define EXEC_LOAD(_dataword_, _rwaddress_) \
+		uint32_t _rwaddress_ = RS1 + IMM; \
+		uint32_t _dataword_; \
+		m_cycles += 1; \
+		if (_rwaddress_ & 0x80000000) { m_cycles += 2; bus->Read(_rwaddress_, _dataword_); } \
+		else m_cycles += m_dcache.Read(bus, instr->m_pc, _rwaddress_, _dataword_);
+
+		EXEC_HANDLER(EH_LB)		{ EXEC_LOAD(dataword, rwaddress); WRITE_RD((int32_t)(int8_t)(dataword >> ((rwaddress & 3) << 3))); EXEC_NEXT(); }
+		EXEC_HANDLER(EH_LH)		{ EXEC_LOAD(dataword, rwaddress); WRITE_RD((int32_t)(int16_t)(dataword >> ((rwaddress & 2) << 3))); EXEC_NEXT(); }
+		EXEC_HANDLER(EH_LW)		{ EXEC_LOAD(dataword, rwaddress); WRITE_RD(dataword); EXEC_NEXT(); }
+		EXEC_HANDLER(EH_LBU)	{ EXEC_LOAD(dataword, rwaddress); WRITE_RD((dataword >> ((rwaddress & 3) << 3)) & 0xFF); EXEC_NEXT(); }
+		EXEC_HANDLER(EH_LHU)	{ EXEC_LOAD(dataword, rwaddress); WRITE_RD((dataword >> ((rwaddress & 2) << 3)) & 0xFFFF); EXEC_NEXT(); }
+#undef EXEC_LOAD
+
+		// Stores, byte and half data is replicated across the word and masked by the write strobe
+#define EXEC_STORE(_wdata_, _wstrobe_) \
+		{ \
+			uint32_t rwaddress = RS1 + IMM; \
+			m_cycles += 2; \
+			if (rwaddress & 0x80000000) { bus->Write(rwaddress, _wdata_, _wstrobe_); m_cycles += CBus::TakeStallCycles(); } \
+			else m_cycles += m_dcache.Write(bus, instr->m_pc, rwaddress, _wdata_, _wstrobe_); \
+		}
+
+		EXEC_HANDLER(EH_SB)		EXEC_STORE((RS2 & 0xFF) * 0x01010101, 1 << ((RS1 + IMM) & 3)); EXEC_NEXT();
+		EXEC_HANDLER(EH_SH)		EXEC_STORE((RS2 & 0xFFFF) * 0x00010001, 3 << ((RS1 + IMM) & 2)); EXEC_NEXT();
+		EXEC_HANDLER(EH_SW)		EXEC_STORE(RS2, 0b1111); EXEC_NEXT();
+#undef EXEC_STORE
+
+#if !defined(THREADED_COMPUTED_GOTO)
+		default:
+			ExecuteInstruction(bus, csr, *instr);
+			break;
+#endif
+	}
+
+#if defined(THREADED_COMPUTED_GOTO)
+done:
+#endif
+	m_retired += uint32_t(last - first);
+	m_execPC = last[-1].m_pc;
+	csr->SetPC(m_execPC);
+}
+
+#undef RS1
+#undef RS2
+#undef IMM
+#undef WRITE_RD
+#undef EXEC_HANDLER
+#undef EXEC_NEXT
+
+#endif // THREADED_DISPATCH
+
 void CRV32::AddBreakpoint(uint32_t isVolatile, uint32_t address, CBus* bus)
 {
 	SBreakpoint brkpt;
@@ -1459,6 +1946,8 @@ void CRV32::AddBreakpoint(uint32_t isVolatile, uint32_t address, CBus* bus)
 	brkpt.isCommunicated = 0;
 	bus->Read(address, brkpt.originalInstruction);
 	m_breakpoints.push_back(brkpt);
+	m_breakpointPCs.insert(address);
+	m_debugArmed = true;
 
 #if defined(GDB_COMM_DEBUG)
 	fprintf(stderr, "Added %sbreakpoint at 0x%08X (insn:0x%08X)\n", isVolatile ? "volatile " : "", address, brkpt.originalInstruction);
@@ -1476,6 +1965,11 @@ void CRV32::RemoveBreakpoint(uint32_t address, CBus* bus)
 #endif
 		bus->Write(address, found->originalInstruction, 0b1111);
 		m_breakpoints.erase(found);
+
+		// The same address might have been added more than once
+		if (std::none_of(m_breakpoints.begin(), m_breakpoints.end(), [&](const SBreakpoint& b) { return b.address == address; }))
+			m_breakpointPCs.erase(address);
+		m_debugArmed = !m_breakpoints.empty();
 	}
 #if defined(GDB_COMM_DEBUG)
 	else
@@ -1491,6 +1985,8 @@ void CRV32::RemoveAllBreakpoints(CBus* bus)
 	}
 
 	m_breakpoints.clear();
+	m_breakpointPCs.clear();
+	m_debugArmed = false;
 
 #if defined(GDB_COMM_DEBUG)
 	fprintf(stderr, "Removed all breakpoints\n");
@@ -1523,13 +2019,58 @@ void CRV32::StepToNext(CBus* bus)
 	AddBreakpoint(1, nextpc, bus);
 }
 
+void CRV32::Serialize(CSnapshot& snap)
+{
+	snap.Value(m_PC);
+	snap.Value(m_execPC);
+	snap.Value(m_branchtarget);
+	snap.Value(m_fetchstate);
+	snap.Value(m_branchresolved);
+	snap.Value(m_wasmret);
+	snap.Value(m_GPR);
+	snap.Value(m_retired);
+	snap.Value(m_wficount);
+	snap.Value(m_exitcalls);
+	snap.Value(m_exitcode);
+	snap.Value(m_exceptionmode);
+	snap.Value(m_lasttrap);
+	snap.Value(m_resetvector);
+	snap.Value(m_cycles);
+
+	// Only non-empty when stopped at a breakpoint in the middle of a block
+	snap.Vector(m_instructions);
+
+	m_icache.Serialize(snap);
+	m_dcache.Serialize(snap);
+
+	// Decoded blocks are rebuilt from restored memory as they're needed
+	if (!snap.IsSaving())
+	{
+		m_execBlock = nullptr;
+		m_blockFlushPending = 0;
+		FlushDecodedBlocks();
+	}
+}
+
+void CRV32::SetCacheModel(const SCacheTiming& timing, CCacheStats* stats)
+{
+	m_timing = timing;
+	m_icache.m_timing = timing;
+	m_icache.m_stats = stats;
+	m_dcache.m_timing = timing;
+	m_dcache.m_stats = stats;
+}
+
 void CRV32::Tick(uint64_t wallclock, CBus* bus)
 {
-	int hitBreakpointCount = 0;
-	for (auto& breakpoint : m_breakpoints)
-		hitBreakpointCount += breakpoint.isHit;
-	if (hitBreakpointCount)
-		m_breakLatch = 1;
+	if (m_debugArmed)
+	{
+		int hitBreakpointCount = 0;
+		for (auto& breakpoint : m_breakpoints)
+			hitBreakpointCount += breakpoint.isHit;
+		if (hitBreakpointCount)
+			m_breakLatch = 1;
+	}
 
 	if (!m_breakLatch)
 	{
@@ -2,9 +2,12 @@
 
 #include <deque>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "bitutil.h"
+#include "cachestats.h"
 
 enum FetchState{
 	EFetchInit,
@@ -56,6 +59,20 @@ enum FetchState{
 #define BLU_LU			5
 #define BLU_GEU			6
 
+// Execution handlers, resolved once at decode time for threaded dispatch
+// Anything without a dedicated handler goes through the generic path
+enum EExecHandler
+{
+	EH_GENERIC,
+	EH_ADD, EH_SUB, EH_SLL, EH_SLT, EH_SLTU, EH_XOR, EH_SRL, EH_SRA, EH_OR, EH_AND,
+	EH_ADDI, EH_SLLI, EH_SLTI, EH_SLTIU, EH_XORI, EH_SRLI, EH_SRAI, EH_ORI, EH_ANDI,
+	EH_LUI, EH_AUIPC, EH_JAL, EH_JALR,
+	EH_BEQ, EH_BNE, EH_BLT, EH_BGE, EH_BLTU, EH_BGEU,
+	EH_LB, EH_LH, EH_LW, EH_LBU, EH_LHU,
+	EH_SB, EH_SH, EH_SW,
+	EH_COUNT
+};
+
 #define F12_CDISCARD   0xFC2
 #define F12_CFLUSH     0xFC0
 #define F12_MRET       0x302
@@ -84,11 +101,14 @@ struct SDecodedInstruction
 	uint32_t m_rval2;
 	uint32_t m_rval3;
 	uint32_t m_opindex;
+	uint32_t m_handler;
 	uint32_t m_cantBreak;
 };
 
 class CBus;
 class CCSRMem;
+class CSnapshot;
+class CProfiler;
 
 enum ERV32ExceptionMode
 {
@@ -112,13 +132,19 @@ public:
 	~InstructionCache() {}
 
 	void Reset();
-	void Fetch(CBus *bus, uint32_t pc, uint32_t& instr);
+	// These return the cycles spent on a miss
+	uint32_t Fetch(CBus *bus, uint32_t pc, uint32_t& instr);
+	uint32_t Touch(CBus *bus, uint32_t pc);
 	void Discard();
+	void Serialize(CSnapshot& snap);
 
 	// 256 entries, 16 words each
 	uint32_t m_cache[256*16] = {};
 	uint32_t m_cachelinetags[256] = {};
 
+	SCacheTiming m_timing;
+	CCacheStats* m_stats{ nullptr };
+
 #if defined(CPU_STATS)
 	uint32_t m_hits {0};
 	uint32_t m_misses {0};
@@ -134,16 +160,23 @@ public:
 	void Reset();
 	void WriteLine(CBus* bus, uint32_t line);
 	void LoadLine(CBus* bus, uint32_t tag, uint32_t line);
-	uint32_t Read(CBus* bus, uint32_t address, uint32_t& data);
-	uint32_t Write(CBus* bus, uint32_t address, uint32_t data, uint32_t wstrobe);
+	// These return the cycles spent, pc is the load/store for miss attribution
+	uint32_t Read(CBus* bus, uint32_t pc, uint32_t address, uint32_t& data);
+	uint32_t Write(CBus* bus, uint32_t pc, uint32_t address, uint32_t data, uint32_t wstrobe);
 	uint32_t Flush(CBus* bus);
+	// Cached copy of a word if there's one, for debug views of memory
+	bool Peek(uint32_t address, uint32_t& data) const;
 	void Discard();
+	void Serialize(CSnapshot& snap);
 
 	// 512 entries, 16 words each
 	uint32_t m_cache[512*16] = {};
 	uint32_t m_cachelinetags[512] = {};
 	uint32_t m_cachelinewb[512] = {};
 
+	SCacheTiming m_timing;
+	CCacheStats* m_stats{ nullptr };
+
 #if defined(CPU_STATS)
 	uint32_t m_readhits {0};
 	uint32_t m_readmisses {0};
@@ -152,9 +185,21 @@ public:
 #endif
 };
 
+enum EBlockExit
+{
+	EBlockExitBranch,	// Ends on branch / jalr / mret, fetch waits for branch target
+	EBlockExitJump,		// Ends on jal, fetch resumes at m_nextPC
+	EBlockExitWFI,		// Ends on wfi, fetch sleeps and resumes at m_nextPC
+	EBlockExitTrap		// Ends before a possible ecall / ebreak / illegal instruction at m_nextPC
+};
+
 struct SDecodedBlock
 {
 	uint32_t m_PC;
+	uint32_t m_lastPC{ 0 };
+	uint64_t m_codeStamp{ 0 };	// Code stamp of system memory when decoding started
+	uint32_t m_nextPC{ 0 };
+	EBlockExit m_exit{ EBlockExitBranch };
 	std::vector<SDecodedInstruction> m_code;
 };
 
@@ -171,7 +216,7 @@ class CRV32
 {
 public:
 	explicit CRV32(uint32_t hartid, uint32_t resetvector) : m_hartid(hartid), m_resetvector(resetvector) {}
-	~CRV32() {}
+	~CRV32();
 
 	// Right hand side
 	uint32_t m_PC{ 0 };
@@ -186,6 +231,10 @@ public:
 	uint64_t m_retired{ 0 };
 	uint32_t m_wficount{ 0 };
 
+	// ECALLs made with a7 = 93 (exit) and the a0 status of the last one
+	uint32_t m_exitcalls{ 0 };
+	uint32_t m_exitcode{ 0 };
+
 	// HART0 by default
 	uint32_t m_hartid{ 0 };
 
@@ -197,11 +246,18 @@ public:
 	std::vector<SDecodedInstruction> m_instructions;
 	std::map<uint32_t, SDecodedBlock*> m_decodedBlocks;
 
+	// Regular code blocks decoded by fetch, keyed by guest PC
+	std::unordered_map<uint32_t, SDecodedBlock*> m_blockCache;
+	SDecodedBlock* m_execBlock{ nullptr };
+	uint32_t m_codeGeneration{ 0 };
+	uint32_t m_blockFlushPending{ 0 };
+
 	uint32_t m_cycles{0};
 
 	void Reset();
 	void SecondaryReset();
 	void Tick(uint64_t wallclock, CBus* bus);
+	bool IsWaitingForInterrupt() const { return m_fetchstate == EFetchWFI; }
 	bool FetchDecode(CBus* bus);
 	bool Execute(CBus* bus);
 
@@ -211,23 +267,48 @@ public:
 	void Continue(CBus* bus);
 	void StepToNext(CBus* bus);	
 
+	void Serialize(CSnapshot& snap);
+
+	// Replaces the default flat cost model, stats (optional) collect where misses happen
+	void SetCacheModel(const SCacheTiming& timing, CCacheStats* stats);
+
 	std::vector<SBreakpoint> m_breakpoints;
 	uint32_t m_breakLatch{ 0 };
 
+	// Breakpoint addresses for the per instruction lookup, only consulted while armed (any breakpoints set)
+	std::unordered_set<uint32_t> m_breakpointPCs;
+	bool m_debugArmed{ false };
+
 	InstructionCache m_icache;
 	DataCache m_dcache;
+	SCacheTiming m_timing;
+
+	// Samples after every instruction while set, so the profiler sees each PC and not just block ends
+	CProfiler* m_profiler{ nullptr };
 
 #if defined(CPU_STATS)
 	uint32_t m_btaken{ 0 };
 	uint32_t m_bntaken{ 0 };
 	uint32_t m_ucbtaken{ 0 };
+	uint32_t m_blockhits{ 0 };
+	uint32_t m_blockmisses{ 0 };
 #endif
 
 private:
+	void FlushDecodedBlocks();
+	void FlushBlockCache();
+	void FinalizeBlock(CBus* bus, SDecodedBlock* blk, EBlockExit exitType, uint32_t nextPC, uint32_t lastPC);
 	void DecodeInstruction(const uint32_t pc, const uint32_t instr, SDecodedInstruction& dec);
 	void InjectISRHeader(std::vector<SDecodedInstruction> *code);
 	void InjectISRFooter(std::vector<SDecodedInstruction>* code);
 	void GatherInstructions(CCSRMem* csr, CBus* bus);
+	void ExecuteInstruction(CBus* bus, CCSRMem* csr, SDecodedInstruction& instr);
+	void ExecuteFast(CBus* bus, CCSRMem* csr, std::vector<SDecodedInstruction>& code);
+	bool ExecuteChecked(CBus* bus, CCSRMem* csr, std::vector<SDecodedInstruction>& code);
+	void ExecuteProfiled(CBus* bus, CCSRMem* csr, std::vector<SDecodedInstruction>& code);
+#if defined(THREADED_DISPATCH)
+	void ExecuteThreaded(CBus* bus, CCSRMem* csr, std::vector<SDecodedInstruction>& code);
+#endif
 	uint32_t ALU(SDecodedInstruction &instr);
 	uint32_t BLU(SDecodedInstruction& instr);
 };
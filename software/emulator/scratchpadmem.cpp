@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "scratchpadmem.h"
+#include "snapshot.h"
 
 static const uint32_t quadexpand[] = {
 	0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF,
@@ -45,3 +46,8 @@ void CScratchpadMem::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 	uint32_t newword = (olddata & invfullmask) | (word & fullmask);
 	m_scratchmem[memslot] = newword;
 }
+
+void CScratchpadMem::Serialize(CSnapshot& snap)
+{
+	snap.Bytes(m_scratchmem, 4096 * sizeof(uint32_t));
+}
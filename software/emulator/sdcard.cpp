@@ -3,25 +3,38 @@
 #include <filesystem>
 #include <algorithm>
 #include "sdcard.h"
+#include "snapshot.h"
 
 #define SD_CMD_LEN 0x6
 
 #define SD_CMD0 0
 #define SD_CMD8 8
+#define SD_CMD12 12
 #define SD_CMD13 13
 #define SD_CMD16 16
 #define SD_CMD17 17
+#define SD_CMD18 18
 #define SD_CMD24 24
+#define SD_CMD25 25
 #define SD_CMD55 55
 #define SD_CMD58 58
 #define SD_ACMD41 41
 #define DATA_START_BLOCK 0XFE
+#define DATA_START_MULTIBLOCK 0XFC
+#define DATA_STOP_MULTIBLOCK 0XFD
+#define DATA_ERROR_OUT_OF_RANGE 0X08
 #define DATA_RES_ACCEPTED 0X05
 #define SD_SECTOR_SIZE 512
 
+// Register offsets in the SPI controller
+#define SPI_BURST_LENGTH 0x8
+#define SPI_BURST_DATA 0xC
+
 extern "C" void SDInitBlockMem();
 extern "C" void SDFreeBlockMem();
 extern "C" void SDReportMemoryUsage();
+extern "C" uint32_t SDBlockMemSlotCount();
+extern "C" uint8_t* SDBlockMemSlot(uint32_t slot, int allocate);
 extern "C" int SDReadBlock(uint32_t blockaddress, uint8_t* datablock);
 extern "C" int SDWriteBlock(uint32_t blockaddress, const uint8_t* datablock);
 
@@ -144,20 +157,63 @@ uint32_t CSDCard::SPIRead(uint8_t *buffer, uint32_t len)
 	return numread;
 }
 
+// CRC16-CCITT of a data block, the same checksum a card sends along
+static uint16_t BlockCRC16(const uint8_t* data, uint32_t len)
+{
+	uint16_t crc = 0;
+	while (len--)
+	{
+		crc ^= (*data++) << 8;
+		for (int i = 0; i < 8; ++i)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return crc;
+}
+
+void CSDCard::PushReadBlock()
+{
+	// Return block from FAT32 image in memory
+	if (SDReadBlock(m_readblock, m_datablock) < 0)
+	{
+		m_spioutfifo.push(DATA_ERROR_OUT_OF_RANGE);	// data error token instead of a block
+		m_multiread = false;
+		return;
+	}
+
+	m_spioutfifo.push(DATA_START_BLOCK);	// return start token
+	for (int i = 0; i <SD_SECTOR_SIZE; ++i)
+		m_spioutfifo.push(m_datablock[i]);
+
+	uint16_t crc = BlockCRC16(m_datablock, SD_SECTOR_SIZE);
+	m_spioutfifo.push(crc >> 8);
+	m_spioutfifo.push(crc & 0xFF);
+}
+
 void CSDCard::Tick(CBus* bus)
 {
+	// Multiple block read streams the next block once the host has drained the previous one
+	if (m_multiread && m_spioutfifo.empty())
+	{
+		++m_readblock;
+		PushReadBlock();
+	}
+
 	// Run the SPI bus
 	if (!m_spiinfifo.empty())
 	{
 		if (m_spimode == 0) // cmd
 		{
-			int rd = SPIRead(&m_cmdbyte, 1);
-			// First two bits of transfer must be 0b01 to be a valid command
-			if (rd && ((m_cmdbyte & 0xC0) == 0x40))
+			// Skip idle bytes up to the next command, a burst read can leave a lot of them here
+			while (SPIRead(&m_cmdbyte, 1))
 			{
-				m_numdatabytes = 0;
-				// We need data now
-				m_spimode = 1;
+				// First two bits of transfer must be 0b01 to be a valid command
+				if ((m_cmdbyte & 0xC0) == 0x40)
+				{
+					m_numdatabytes = 0;
+					// We need data now
+					m_spimode = 1;
+					break;
+				}
 			}
 		}
 
@@ -212,17 +268,32 @@ void CSDCard::Tick(CBus* bus)
 						case SD_CMD17: // READ_BLOCK
 						{
 							m_spioutfifo.push(0x00);				// expect to return 0 for ack
-							m_spioutfifo.push(DATA_START_BLOCK);	// return start token
 
 							m_readblock = (m_databytes[0] << 24) | (m_databytes[1] << 16) | (m_databytes[2] << 8) | (m_databytes[3]);
+							PushReadBlock();
+						}
+						break;
+
+						case SD_CMD18: // READ_MULTIPLE_BLOCK
+						{
+							m_spioutfifo.push(0x00);				// expect to return 0 for ack
 
-							// Return block from FAT32 image in memory
-							SDReadBlock(m_readblock, m_datablock);
-							for (int i = 0; i <SD_SECTOR_SIZE; ++i)
-								m_spioutfifo.push(m_datablock[i]);
+							// Blocks keep coming until CMD12
+							m_readblock = (m_databytes[0] << 24) | (m_databytes[1] << 16) | (m_databytes[2] << 8) | (m_databytes[3]);
+							m_multiread = true;
+							PushReadBlock();
+						}
+						break;
 
+						case SD_CMD12: // STOP_TRANSMISSION
+						{
+							// Drop whatever is left of the block being streamed
+							m_multiread = false;
+							std::queue<uint8_t>().swap(m_spioutfifo);
+
+							// Stuff byte, then R1b response
 							m_spioutfifo.push(0xFF);
-							m_spioutfifo.push(0xFF); // CRC
+							m_spioutfifo.push(0x00);
 						}
 						break;
 
@@ -232,6 +303,22 @@ void CSDCard::Tick(CBus* bus)
 
 							m_numdatabytes = 0;
 							m_havestarttoken = 0;
+							m_multiwrite = false;
+							m_spimode = 2; // data write mode
+
+							// Accept data
+							m_spioutfifo.push(0x00);
+						}
+						break;
+
+						case SD_CMD25: // WRITE_MULTIPLE_BLOCK
+						{
+							m_writeblock = (m_databytes[0] << 24) | (m_databytes[1] << 16) | (m_databytes[2] << 8) | (m_databytes[3]);
+
+							// Blocks keep coming until the stop token
+							m_numdatabytes = 0;
+							m_havestarttoken = 0;
+							m_multiwrite = true;
 							m_spimode = 2; // data write mode
 
 							// Accept data
@@ -278,13 +365,20 @@ void CSDCard::Tick(CBus* bus)
 		if (m_spimode == 2)
 		{
 			// Wait for data start token or data
-			int rd = SPIRead(&m_cmdbyte, 1);
-			if (rd)
+			if (m_havestarttoken)
 			{
-				if (m_havestarttoken)
-					m_datablock[m_numdatabytes++] = m_cmdbyte;
-				else if (m_cmdbyte == DATA_START_BLOCK)
+				// Take everything that's there, burst writes send four bytes at a time
+				m_numdatabytes += SPIRead(&m_datablock[m_numdatabytes], SD_SECTOR_SIZE - m_numdatabytes);
+			}
+			else if (SPIRead(&m_cmdbyte, 1))
+			{
+				if (m_cmdbyte == (m_multiwrite ? DATA_START_MULTIBLOCK : DATA_START_BLOCK))
 					m_havestarttoken = 1;
+				else if (m_multiwrite && m_cmdbyte == DATA_STOP_MULTIBLOCK)
+				{
+					m_multiwrite = false;
+					m_spimode = 0;
+				}
 			}
 			if (m_numdatabytes == SD_SECTOR_SIZE)
 			{
@@ -303,9 +397,20 @@ void CSDCard::Tick(CBus* bus)
 				m_datablock[m_numdatabytes++] = m_cmdbyte;
 			if (m_numdatabytes == 2)
 			{
+				// Token follows the CRC by a byte, so the host doesn't clock it out with the CRC
+				m_spioutfifo.push(0xFF);
 				m_spioutfifo.push(0x05); // data accepted
-				m_spimode = 0;
 				m_numdatabytes = 0;
+
+				// Next block of a multiple block write, or back to commands
+				if (m_multiwrite)
+				{
+					++m_writeblock;
+					m_havestarttoken = 0;
+					m_spimode = 2;
+				}
+				else
+					m_spimode = 0;
 			}
 		}
 	}
@@ -313,6 +418,26 @@ void CSDCard::Tick(CBus* bus)
 
 void CSDCard::Read(uint32_t address, uint32_t& data)
 {
+	// Burst data, four bytes per read with the first one in the low 8 bits.
+	// Only bytes clocked in by a burst length write are there to read, the hardware
+	// would stall the read waiting for the rest so they come back as 0xFF here.
+	if ((address & 0xF) == SPI_BURST_DATA)
+	{
+		data = 0;
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			uint32_t byte = 0xFF;
+			if (m_burstclocked && !m_spioutfifo.empty())
+			{
+				byte = m_spioutfifo.front();
+				m_spioutfifo.pop();
+				--m_burstclocked;
+			}
+			data |= byte << (i * 8);
+		}
+		return;
+	}
+
 	if (!m_spioutfifo.empty())
 	{
 		data = m_spioutfifo.front();
@@ -325,7 +450,77 @@ void CSDCard::Read(uint32_t address, uint32_t& data)
 
 void CSDCard::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 {
-	// SPI bus write
-	m_spiinfifo.push(word&0xFF);
+	switch (address & 0xF)
+	{
+		case SPI_BURST_LENGTH:
+		{
+			// Clock out that many idle bytes, each one brings a byte back for the burst data reads
+			uint32_t count = word & 0x7FF;
+			for (uint32_t i = 0; i < count; ++i)
+				m_spiinfifo.push(0xFF);
+			m_burstclocked = count;
+		}
+		break;
+
+		case SPI_BURST_DATA:
+			// Four bytes in one write, the hardware drops what comes back for these
+			for (uint32_t i = 0; i < 4; ++i)
+				m_spiinfifo.push((word >> (i * 8)) & 0xFF);
+		break;
+
+		default:
+			// SPI bus write
+			m_spiinfifo.push(word&0xFF);
+
+			// The host only clocks idle bytes while a multiple block read runs, so a command byte here
+			// is CMD12 going out. Stop streaming now, or bytes of the next block would be read back in
+			// place of the stuff byte and R1b response, which only show up once the command is processed
+			if (m_multiread && (word&0xFF) == (0x40 | SD_CMD12))
+			{
+				m_multiread = false;
+				std::queue<uint8_t>().swap(m_spioutfifo);
+			}
+		break;
+	}
 	//printf("SDW:%.8X <- %.8X\n", address, word);
 }
+
+void CSDCard::Serialize(CSnapshot& snap)
+{
+	snap.Queue(m_spiinfifo);
+	snap.Queue(m_spioutfifo);
+	snap.Value(m_spimode);
+	snap.Value(m_havestarttoken);
+	snap.Value(m_numdatabytes);
+	snap.Value(m_databytes);
+	snap.Value(m_cmdbyte);
+	snap.Value(m_readblock);
+	snap.Value(m_writeblock);
+	snap.Value(m_datablock);
+	snap.Value(m_app_mode);
+	snap.Value(m_multiread);
+	snap.Value(m_multiwrite);
+	snap.Value(m_burstclocked);
+
+	// Disk image, in the 1Mbyte slots the block memory allocates on demand
+	const uint32_t slotCount = SDBlockMemSlotCount();
+	std::vector<uint8_t> usedslots(slotCount, 0);
+	if (snap.IsSaving())
+	{
+		for (uint32_t slot = 0; slot < slotCount; ++slot)
+			usedslots[slot] = SDBlockMemSlot(slot, 0) ? 1 : 0;
+	}
+	else
+	{
+		SDFreeBlockMem();
+		SDInitBlockMem();
+	}
+
+	snap.Vector(usedslots);
+	if (usedslots.size() != slotCount)
+		return;
+
+	for (uint32_t slot = 0; slot < slotCount; ++slot)
+		if (usedslots[slot])
+			snap.Bytes(SDBlockMemSlot(slot, snap.IsSaving() ? 0 : 1), 1024 * 1024);
+}
@@ -15,10 +15,12 @@ public:
 	void Read(uint32_t address, uint32_t& data) override final;
 	void Write(uint32_t address, uint32_t word, uint32_t wstrobe) override final;
 	void Tick(CBus* bus);
+	void Serialize(CSnapshot& snap);
 
 private:
 	void PopulateFileSystem();
 	uint32_t SPIRead(uint8_t* buffer, uint32_t len);
+	void PushReadBlock();
 	std::queue<uint8_t> m_spiinfifo;
 	std::queue<uint8_t> m_spioutfifo;
 	uint32_t m_spimode{ 0 };
@@ -30,6 +32,9 @@ private:
 	uint32_t m_writeblock{ 0 };
 	uint8_t m_datablock[512] = {};
 	bool m_app_mode{ false };
+	bool m_multiread{ false };
+	bool m_multiwrite{ false };
+	uint32_t m_burstclocked{ 0 };
 
 	FATFS* m_fs{ nullptr };
 	uint8_t* m_workbuf{ nullptr };
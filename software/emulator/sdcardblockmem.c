@@ -5,7 +5,7 @@
 #include <ff.h>
 #include <diskio.h>
 
-static intptr_t* s_alloctable;
+static intptr_t* s_alloctable = NULL;
 static uint32_t s_blockcount;
 
 // 1 GByte virtual disk
@@ -27,12 +27,32 @@ void SDReportMemoryUsage()
 
 void SDFreeBlockMem()
 {
+	if (!s_alloctable)
+		return;
+
 	for (int i = 0; i < 512; ++i)
 	{
 		if (s_alloctable[i])
 			free((void*)s_alloctable[i]);
 	}
 	free(s_alloctable);
+	s_alloctable = NULL;
+	s_blockcount = 0;
+}
+
+uint8_t* SDCardGetPhysicalBlock(uint32_t blockaddress);
+
+// Direct access to each 1Mbyte slot of the virtual disk for snapshots
+uint32_t SDBlockMemSlotCount()
+{
+	return 512;
+}
+
+uint8_t* SDBlockMemSlot(uint32_t slot, int allocate)
+{
+	if (allocate)
+		return SDCardGetPhysicalBlock(slot * 2048);
+	return (uint8_t*)s_alloctable[slot];
 }
 
 int SDCardStartup()
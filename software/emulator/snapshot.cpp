@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <algorithm>
+#include "snapshot.h"
+#include "lz4.h"
+
+// File layout: header, then chunks of [raw size][compressed size][LZ4 data]
+static const char s_snapshotMagic[8] = { 'T', 'S', 'Y', 'S', 'S', 'N', 'A', 'P' };
+// Bump whenever a Serialize() function changes what it stores
+static const uint32_t s_snapshotVersion = 6;
+static const uint32_t s_chunkSize = 4 * 1024 * 1024;
+
+struct SSnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t chunkCount;
+	uint64_t rawSize;
+};
+
+bool CSnapshot::Save(const char* filename)
+{
+	FILE* fp = fopen(filename, "wb");
+	if (!fp)
+	{
+		fprintf(stderr, "Could not open snapshot file '%s' for writing\n", filename);
+		return false;
+	}
+
+	SSnapshotHeader header;
+	memcpy(header.magic, s_snapshotMagic, 8);
+	header.version = s_snapshotVersion;
+	header.chunkCount = (uint32_t)((m_data.size() + s_chunkSize - 1) / s_chunkSize);
+	header.rawSize = m_data.size();
+	fwrite(&header, sizeof(header), 1, fp);
+
+	std::vector<char> compressed(LZ4_compressBound(s_chunkSize));
+	size_t totalSize = sizeof(header);
+	for (size_t offset = 0; offset < m_data.size(); offset += s_chunkSize)
+	{
+		uint32_t rawSize = (uint32_t)std::min<size_t>(s_chunkSize, m_data.size() - offset);
+		uint32_t compressedSize = (uint32_t)LZ4_compress_default((const char*)&m_data[offset], compressed.data(), (int)rawSize, (int)compressed.size());
+		fwrite(&rawSize, sizeof(uint32_t), 1, fp);
+		fwrite(&compressedSize, sizeof(uint32_t), 1, fp);
+		fwrite(compressed.data(), 1, compressedSize, fp);
+		totalSize += 2 * sizeof(uint32_t) + compressedSize;
+	}
+
+	fclose(fp);
+	fprintf(stderr, "Saved snapshot '%s' (%zu Kbytes, %zu Kbytes uncompressed)\n", filename, totalSize / 1024, m_data.size() / 1024);
+	return true;
+}
+
+bool CSnapshot::Load(const char* filename)
+{
+	FILE* fp = fopen(filename, "rb");
+	if (!fp)
+	{
+		fprintf(stderr, "Could not open snapshot file '%s'\n", filename);
+		return false;
+	}
+
+	SSnapshotHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, s_snapshotMagic, 8) != 0 || header.version != s_snapshotVersion)
+	{
+		fprintf(stderr, "'%s' is not a compatible snapshot file\n", filename);
+		fclose(fp);
+		return false;
+	}
+
+	m_data.resize(header.rawSize);
+	m_cursor = 0;
+	m_overrun = false;
+
+	std::vector<char> compressed(LZ4_compressBound(s_chunkSize));
+	size_t offset = 0;
+	bool success = true;
+	for (uint32_t i = 0; i < header.chunkCount && success; ++i)
+	{
+		uint32_t rawSize = 0, compressedSize = 0;
+		success = fread(&rawSize, sizeof(uint32_t), 1, fp) == 1 && fread(&compressedSize, sizeof(uint32_t), 1, fp) == 1;
+		success = success && rawSize <= s_chunkSize && offset + rawSize <= m_data.size() && compressedSize <= compressed.size();
+		success = success && fread(compressed.data(), 1, compressedSize, fp) == compressedSize;
+		success = success && LZ4_decompress_safe(compressed.data(), (char*)&m_data[offset], (int)compressedSize, (int)rawSize) == (int)rawSize;
+		offset += rawSize;
+	}
+	fclose(fp);
+
+	if (!success || offset != m_data.size())
+	{
+		fprintf(stderr, "Snapshot file '%s' is damaged\n", filename);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <type_traits>
+
+// Machine state archive, each device serializes itself through the same
+// Serialize() call for both directions, so field order always matches
+class CSnapshot
+{
+public:
+	explicit CSnapshot(bool saving) : m_saving(saving) {}
+
+	bool IsSaving() const { return m_saving; }
+	bool IsValid() const { return !m_overrun; }
+
+	// Compress and write out everything serialized so far
+	bool Save(const char* filename);
+	// Read and decompress a file to serialize from
+	bool Load(const char* filename);
+
+	void Bytes(void* data, size_t size)
+	{
+		if (m_saving)
+		{
+			const uint8_t* source = (const uint8_t*)data;
+			m_data.insert(m_data.end(), source, source + size);
+		}
+		else if (m_cursor + size <= m_data.size())
+		{
+			memcpy(data, &m_data[m_cursor], size);
+			m_cursor += size;
+		}
+		else
+		{
+			memset(data, 0, size);
+			m_overrun = true;
+		}
+	}
+
+	template<typename T> void Value(T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "snapshot values need to be trivially copyable");
+		Bytes(&value, sizeof(T));
+	}
+
+	template<typename T> void Vector(std::vector<T>& items)
+	{
+		uint32_t count = (uint32_t)items.size();
+		Value(count);
+		if (!m_saving)
+			items.resize(IsValid() ? count : 0);
+		if (!items.empty())
+			Bytes(items.data(), items.size() * sizeof(T));
+	}
+
+	template<typename T> void Deque(std::deque<T>& items)
+	{
+		uint32_t count = (uint32_t)items.size();
+		Value(count);
+		if (m_saving)
+		{
+			for (T& item : items)
+				Value(item);
+		}
+		else
+		{
+			items.clear();
+			for (uint32_t i = 0; i < count && IsValid(); ++i)
+			{
+				T item;
+				Value(item);
+				items.push_back(item);
+			}
+		}
+	}
+
+	template<typename T> void Queue(std::queue<T>& items)
+	{
+		// std::queue hides its container, go through a copy
+		std::deque<T> copy;
+		if (m_saving)
+		{
+			std::queue<T> source = items;
+			while (!source.empty())
+			{
+				copy.push_back(source.front());
+				source.pop();
+			}
+		}
+		Deque(copy);
+		if (!m_saving)
+			items = std::queue<T>(copy);
+	}
+
+private:
+	bool m_saving{ true };
+	bool m_overrun{ false };
+	size_t m_cursor{ 0 };
+	std::vector<uint8_t> m_data;
+};
@@ -1,10 +1,15 @@
 #include <stdio.h>
 #include <string.h>
+#include <vector>
 #include "sysmem.h"
 #include "memmappeddevice.h"
+#include "snapshot.h"
 
 #if defined(CAT_WINDOWS)
 #include <pmmintrin.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
 #endif
 
 static const uint32_t quadexpand[] = {
@@ -14,21 +19,114 @@ static const uint32_t quadexpand[] = {
 	0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF,
 };
 
+// System memory is reserved as one contiguous range so host addresses stay linear,
+// but the OS only backs pages with physical memory once they're touched
 CSysMem::CSysMem()
 {
-	// TODO: Allocate on demand
-	m_devicemem = malloc(256*1024*1024);
+#if defined(CAT_WINDOWS)
+	m_devicemem = VirtualAlloc(nullptr, SYSMEM_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	m_devicemem = mmap(nullptr, SYSMEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m_devicemem == MAP_FAILED)
+		m_devicemem = nullptr;
+#endif
+	if (!m_devicemem)
+		fprintf(stderr, "Failed to reserve %d Mbytes of system memory\n", SYSMEM_SIZE/(1024*1024));
 }
 
 CSysMem::~CSysMem()
 {
-	free(m_devicemem);
+#if defined(CAT_WINDOWS)
+	VirtualFree(m_devicemem, 0, MEM_RELEASE);
+#else
+	munmap(m_devicemem, SYSMEM_SIZE);
+#endif
 }
 
 void CSysMem::Reset()
 {
-	// TODO: Clear only allocated blocks
-	memset(m_devicemem, 0x00, 256*1024*1024);
+	// Drop all touched pages, they read back as zeros on next access
+#if defined(CAT_WINDOWS)
+	VirtualFree(m_devicemem, SYSMEM_SIZE, MEM_DECOMMIT);
+	VirtualAlloc(m_devicemem, SYSMEM_SIZE, MEM_COMMIT, PAGE_READWRITE);
+#elif defined(CAT_LINUX)
+	madvise(m_devicemem, SYSMEM_SIZE, MADV_DONTNEED);
+#else
+	// MADV_DONTNEED does not guarantee zero fill here, map fresh pages over the same range instead
+	mmap(m_devicemem, SYSMEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#endif
+
+	// Nothing decoded from old memory contents is valid anymore
+	for (uint32_t page = 0; page < SYSMEM_PAGE_COUNT; ++page)
+	{
+		m_codepages[page].store(0, std::memory_order_relaxed);
+		m_pagestamps[page].store(0, std::memory_order_relaxed);
+	}
+	m_codestamp.store(0, std::memory_order_relaxed);
+	++m_codeGeneration;
+	MarkScanoutDirty();
+}
+
+void CSysMem::Serialize(CSnapshot& snap)
+{
+	// Only pages holding non-zero data are stored, the rest reads back as zeros after a reset
+	const uint32_t pageSize = 1 << SYSMEM_PAGE_SHIFT;
+	uint8_t* mem = (uint8_t*)m_devicemem;
+	std::vector<uint8_t> usedpages(SYSMEM_PAGE_COUNT, 0);
+
+	if (snap.IsSaving())
+	{
+		for (uint32_t page = 0; page < SYSMEM_PAGE_COUNT; ++page)
+		{
+			const uint64_t* words = (const uint64_t*)(mem + page * pageSize);
+			for (uint32_t i = 0; i < pageSize / sizeof(uint64_t); ++i)
+			{
+				if (words[i])
+				{
+					usedpages[page] = 1;
+					break;
+				}
+			}
+		}
+	}
+	else
+		Reset();
+
+	snap.Vector(usedpages);
+	if (usedpages.size() != SYSMEM_PAGE_COUNT)
+		return;
+
+	for (uint32_t page = 0; page < SYSMEM_PAGE_COUNT; ++page)
+		if (usedpages[page])
+			snap.Bytes(mem + page * pageSize, pageSize);
+}
+
+void CSysMem::InvalidateCodePage(uint32_t address)
+{
+	// Only blocks decoded from this page go, the page is watched again once one gets decoded from it
+	uint32_t page = (address & 0x0FFFFFFF) >> SYSMEM_PAGE_SHIFT;
+	m_codepages[page].store(0, std::memory_order_relaxed);
+	m_pagestamps[page].store(m_codestamp.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void CSysMem::WatchScanout(uint32_t address, uint32_t rowbytes, uint32_t rowcount)
+{
+	if (rowcount > SYSMEM_MAX_SCANOUT_ROWS)
+		rowcount = SYSMEM_MAX_SCANOUT_ROWS;
+
+	// Stop tracking while the range changes
+	m_scanoutsize = 0;
+	m_scanoutbase = address;
+	m_scanoutrowbytes = rowbytes ? rowbytes : 1;
+	m_scanoutsize = m_scanoutrowbytes * rowcount;
+
+	MarkScanoutDirty();
+}
+
+void CSysMem::MarkScanoutDirty()
+{
+	for (uint32_t i = 0; i < SYSMEM_MAX_SCANOUT_ROWS; ++i)
+		m_dirtyrows[i].store(1, std::memory_order_relaxed);
 }
 
 uint32_t* CSysMem::GetHostAddress(uint32_t address)
@@ -51,32 +149,45 @@ void CSysMem::CopyROM(uint32_t resetvector, uint8_t *bin, uint32_t size)
 	uint32_t base = resetvector>>2;
 	for (uint32_t i=0; i<size/4; ++i)
 		wordmem[base+i] = rom[i];
+
+	++m_codeGeneration;
 }
 
 void CSysMem::Read(uint32_t address, uint32_t& data)
 {
 	// TODO: Return from D$ instead for consistency of simulation
 	uint32_t *wordmem = (uint32_t*)m_devicemem;
-	data = wordmem[address>>2];
+	data = std::atomic_ref<uint32_t>(wordmem[address>>2]).load(std::memory_order_relaxed);
 }
 
 void CSysMem::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 {
 	// TODO: Use D$ instead for consistency of simulation
-	uint32_t olddata;
 	uint32_t *wordmem = (uint32_t*)m_devicemem;
-	olddata = wordmem[address>>2];
+	std::atomic_ref<uint32_t> target(wordmem[address>>2]);
+
+	if (IsCodePage(address))
+		InvalidateCodePage(address);
+	MarkScanoutRow(address);
+
+	if (wstrobe == 0xF)
+	{
+		target.store(word, std::memory_order_relaxed);
+		return;
+	}
 
 	// Expand the wstrobe
 	uint32_t fullmask = quadexpand[wstrobe];
 	uint32_t invfullmask = ~fullmask;
 
-	// Mask and mix incoming and old data
-	wordmem[address>>2] = (olddata&invfullmask) | (word&fullmask);
+	// Mask and mix incoming and old data, the other hart may be merging bytes into the same word
+	uint32_t olddata = target.load(std::memory_order_relaxed);
+	while (!target.compare_exchange_weak(olddata, (olddata&invfullmask) | (word&fullmask), std::memory_order_relaxed)) {}
 }
 
 void CSysMem::Read128bits(uint32_t address, uint32_t* data)
 {
+	LockLine(address);
 #if defined(CAT_WINDOWS)
 	uint32_t *wordmem = (uint32_t*)m_devicemem;
 	__m128i *source = (__m128i *)&wordmem[address>>2];
@@ -89,10 +200,17 @@ void CSysMem::Read128bits(uint32_t address, uint32_t* data)
 	target[0] = source[0];
 	target[1] = source[1];
 #endif
+	UnlockLine(address);
 }
 
 void CSysMem::Write128bits(uint32_t address, uint32_t* data)
 {
+	if (IsCodePage(address))
+		InvalidateCodePage(address);
+	// Lines never straddle rows since all scanout pitches are multiples of 64 bytes
+	MarkScanoutRow(address);
+
+	LockLine(address);
 #if defined(CAT_WINDOWS)
 	uint32_t *wordmem = (uint32_t*)m_devicemem;
 	__m128i *target = (__m128i *)&wordmem[address>>2];
@@ -105,10 +223,12 @@ void CSysMem::Write128bits(uint32_t address, uint32_t* data)
 	target[0] = source[0];
 	target[1] = source[1];
 #endif
+	UnlockLine(address);
 }
 
 void CSysMem::Read512bits(uint32_t address, uint32_t* data)
 {
+	LockLine(address);
 #if defined(CAT_WINDOWS)
 	uint32_t *wordmem = (uint32_t*)m_devicemem;
 	__m128i *source = (__m128i *)&wordmem[address>>2];
@@ -122,10 +242,17 @@ void CSysMem::Read512bits(uint32_t address, uint32_t* data)
 	for (int i=0; i<8; ++i)
 		target[i] = source[i];
 #endif
+	UnlockLine(address);
 }
 
 void CSysMem::Write512bits(uint32_t address, uint32_t* data)
 {
+	if (IsCodePage(address))
+		InvalidateCodePage(address);
+	// Lines never straddle rows since all scanout pitches are multiples of 64 bytes
+	MarkScanoutRow(address);
+
+	LockLine(address);
 #if defined(CAT_WINDOWS)
 	uint32_t *wordmem = (uint32_t*)m_devicemem;
 	__m128i *target = (__m128i *)&wordmem[address>>2];
@@ -139,4 +266,5 @@ void CSysMem::Write512bits(uint32_t address, uint32_t* data)
 	for (int i=0; i<8; ++i)
 		target[i] = source[i];
 #endif
+	UnlockLine(address);
 }
@@ -2,8 +2,22 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <atomic>
 #include "memmappeddevice.h"
 
+// Size of emulated system memory
+#define SYSMEM_SIZE (256*1024*1024)
+
+// Tallest scanout buffer the VPU can display
+#define SYSMEM_MAX_SCANOUT_ROWS 480
+
+// 4Kbyte pages used to track memory holding decoded code blocks
+#define SYSMEM_PAGE_SHIFT 12
+#define SYSMEM_PAGE_COUNT (SYSMEM_SIZE >> SYSMEM_PAGE_SHIFT)
+
+// Cache line transfers lock one of these, picked by line address
+#define SYSMEM_LINE_LOCKS 1024
+
 class CSysMem : public MemMappedDevice
 {
 public:
@@ -20,8 +34,72 @@ public:
 	void Read512bits(uint32_t address, uint32_t* data);
 	void Write512bits(uint32_t address, uint32_t* word);
 
+	void Serialize(CSnapshot& snap);
+
 	void* m_devicemem;
 	void CopyROM(uint32_t resetvector, uint8_t *bin, uint32_t size);
 	uint32_t* GetHostAddress(uint32_t address);
 	uint8_t* GetHostByteAddress(uint32_t address);
+
+	// Decoded block caches mark the pages they were built from. A write to a marked
+	// page stamps it with a new code stamp, and blocks decoded before that stamp from
+	// any page they span get dropped. Changes to all of memory at once (reset, ROM load,
+	// debugger writes) bump the generation instead, which flushes every decoded block.
+	// (atomic since harts can run on their own host threads)
+	void MarkCodePage(uint32_t address) { m_codepages[(address & 0x0FFFFFFF) >> SYSMEM_PAGE_SHIFT].store(1, std::memory_order_relaxed); }
+	uint64_t CodeStamp() const { return m_codestamp.load(std::memory_order_relaxed); }
+	bool CodeWrittenSince(uint32_t firstaddress, uint32_t lastaddress, uint64_t stamp) const
+	{
+		for (uint32_t page = (firstaddress & 0x0FFFFFFF) >> SYSMEM_PAGE_SHIFT; page <= ((lastaddress & 0x0FFFFFFF) >> SYSMEM_PAGE_SHIFT); ++page)
+			if (m_pagestamps[page].load(std::memory_order_relaxed) > stamp)
+				return true;
+		return false;
+	}
+	std::atomic<uint32_t> m_codeGeneration{ 0 };
+
+	// The VPU watches its scanout buffer, writes into it mark
+	// the rows they touch so unchanged rows can skip conversion
+	void WatchScanout(uint32_t address, uint32_t rowbytes, uint32_t rowcount);
+	void MarkScanoutDirty();
+	bool TakeDirtyRow(uint32_t row) { return m_dirtyrows[row].exchange(0, std::memory_order_relaxed) != 0; }
+
+	// With harts on their own host threads, whole line reads and writes lock the line
+	// so neither hart sees half of a line the other one is writing back
+	void SetLineLocks(bool enable) { m_linelocksenabled = enable; }
+
+private:
+	void InvalidateCodePage(uint32_t address);
+	bool IsCodePage(uint32_t address) const { return m_codepages[(address & 0x0FFFFFFF) >> SYSMEM_PAGE_SHIFT].load(std::memory_order_relaxed) != 0; }
+	void LockLine(uint32_t address)
+	{
+		if (m_linelocksenabled)
+		{
+			std::atomic_flag& lock = m_linelocks[(address >> 6) & (SYSMEM_LINE_LOCKS - 1)];
+			while (lock.test_and_set(std::memory_order_acquire))
+				while (lock.test(std::memory_order_relaxed)) {}
+		}
+	}
+	void UnlockLine(uint32_t address)
+	{
+		if (m_linelocksenabled)
+			m_linelocks[(address >> 6) & (SYSMEM_LINE_LOCKS - 1)].clear(std::memory_order_release);
+	}
+	void MarkScanoutRow(uint32_t address)
+	{
+		uint32_t offset = address - m_scanoutbase;
+		if (offset < m_scanoutsize)
+			m_dirtyrows[offset / m_scanoutrowbytes].store(1, std::memory_order_relaxed);
+	}
+
+	std::atomic<uint8_t> m_codepages[SYSMEM_PAGE_COUNT] = {};
+	std::atomic<uint64_t> m_pagestamps[SYSMEM_PAGE_COUNT] = {};
+	std::atomic<uint64_t> m_codestamp{ 0 };
+
+	bool m_linelocksenabled{ false };
+	std::atomic_flag m_linelocks[SYSMEM_LINE_LOCKS] = {};
+
+	uint32_t m_scanoutbase{ 0 };
+	uint32_t m_scanoutsize{ 0 };
+	uint32_t m_scanoutrowbytes{ 1 };
+	std::atomic<uint8_t> m_dirtyrows[SYSMEM_MAX_SCANOUT_ROWS] = {};
 };
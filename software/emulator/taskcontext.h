@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+// Mirrors the task context in SDK/task.h, which the headless runner, coremark bench
+// and GDB stub read through DEVICE_MAIL. Keep the two in step field for field.
+
+#define TASK_MAX 32
+
+enum ETaskState
+{
+	TS_UNKNOWN,
+	TS_PAUSED,
+	TS_RUNNING,
+	TS_TERMINATING,
+	TS_TERMINATED
+};
+
+struct STask {
+	uint32_t HART;			// HART affinity mask (for migration)
+	uint32_t runLength;		// Time slice dedicated to this task
+	enum ETaskState state;	// State of this task
+	uint32_t exitCode;		// Task termination exit code
+	uint64_t cpuTime;		// Ticks spent running since the statistics were last reset
+	uint32_t heapID;		// Heap used by brk(), shared with the task that added this one
+	uint32_t priority;		// Scheduling priority, see TASK_PRIORITY_*
+	uint32_t deadline;		// Period and relative deadline in ticks, or zero for tasks without one
+	uint32_t release;		// Time (low 32 bits) the current period started, the task's work is due at release+deadline
+	uint32_t missedDeadlines;	// Periods the task didn't finish in time
+	uint32_t waitFlags;		// TASK_WAIT_* conditions the task is blocked on, zero when not blocked
+	uint32_t waitUntil;		// Wake time (low 32 bits) for TASK_WAIT_TIME
+	uint32_t waitVSync;		// Vblank counter value to wait past for TASK_WAIT_VSYNC
+	uint32_t waitAPU;		// APU frame to wait past for TASK_WAIT_APU
+	uint32_t reserved;		// Keeps cpuTime of the next task 8 byte aligned
+
+	// Debug support - this will probably move somewhere else
+	char name[16];			// Name of this task
+};
+
+// 2616 bytes total for one core (5232 for two cores)
+struct STaskContext {
+	// 80 x 32 bytes (2560)
+	struct STask tasks[TASK_MAX];	// List of all the tasks
+	// 56 bytes total below
+	uint32_t readyMask;				// One bit per task that can run, the scheduler picks among these
+	uint32_t scheduling;			// Scheduling mode, see ETaskScheduling
+	uint64_t switchTime;			// Time the current task got switched in
+	uint64_t statsTime;				// Time the cpuTime counters were last reset
+	int32_t currentTask;			// Current task index
+	int32_t numTasks;				// Number of tasks
+	int32_t kernelError;			// Current kernel error
+	int32_t kernelErrorData[3];		// Data relevant to the crash
+	int32_t hartID;					// Id of the HART where this task context runs
+	uint32_t statsResetRequest;		// Set by other HARTs, the owning HART clears cpuTime counters on its next task switch
+};
+
+// The ROM is built with the 32 bit RISC-V ABI, which 8 byte aligns the 64 bit fields the same way
+static_assert(sizeof(STask) == 80, "STask must match SDK/task.h");
+static_assert(sizeof(STaskContext) == 2616, "STaskContext must match SDK/task.h");
@@ -31,6 +31,7 @@ struct EmulatorContext
 
 static bool s_alive = true;
 static uint64_t s_wallclock = 0;
+static const char* s_snapshotFile = "tinysys.snapshot";
 
 int emulatorthread(void* data)
 {
@@ -39,15 +40,16 @@ int emulatorthread(void* data)
 	do
 	{
 		CEmulator *emulator = ctx->emulator;
-		if (emulator->m_debugStop)
+		// Sits here while the debugger or a snapshot holds the machine
+		if (!emulator->DebugPark())
 		{
-			// Stop for debugger
-			emulator->m_debugAck = 1;
-		}
-		else
-		{
-			emulator->m_debugAck = 0;
 			emulator->Step(s_wallclock);
+
+			// Both harts sleep in WFI until a timer interrupt that's at least a millisecond away,
+			// give the host CPU a break instead of spinning (input still gets picked up every millisecond)
+			uint64_t wake = emulator->IdleUntil();
+			if (wake != 0 && wake > s_wallclock + 10000)
+				SDL_Delay(1);
 		}
 	} while(s_alive);
 
@@ -254,6 +256,10 @@ uint32_t videoCallback(Uint32 interval, void* param)
 
 	uint32_t* pixels = (uint32_t*)ctx->compositesurface->pixels;
 
+	// The splash screen draws over the scanout area, convert all rows until it's gone
+	if (s_logotime <= 120)
+		ctx->emulator->m_bus->GetVPU()->InvalidateScanout(ctx->emulator->m_bus);
+
 	for (int scanline = 0; scanline < 525; ++scanline)
 		ctx->emulator->UpdateVideoLink(pixels, scanline, ctx->compositesurface->pitch);
 
@@ -313,18 +319,20 @@ uint32_t videoCallback(Uint32 interval, void* param)
 
 	++s_logotime;
 
+	// Update window surface
+	SDL_BlitSurface(ctx->compositesurface, nullptr, ctx->surface, nullptr);
+
 #if defined(CPU_STATS)
+	// Stats go on top of the window surface so the composite surface only holds scanout rows
 	if (s_statSurface)
 	{
 		SDL_Rect statRect = s_statSurface->clip_rect;
 		statRect.y = H-statRect.h;
 
-		SDL_BlitSurface(s_statSurface, nullptr, ctx->compositesurface, &statRect);
+		SDL_BlitSurface(s_statSurface, nullptr, ctx->surface, &statRect);
 	}
 #endif
 
-	// Update window surface
-	SDL_BlitSurface(ctx->compositesurface, nullptr, ctx->surface, nullptr);
 	SDL_UpdateWindowSurface(ctx->window);
 
 	return interval;
@@ -340,6 +348,7 @@ uint32_t statsCallback(Uint32 interval, void* param)
 	CRV32 *cpu0 = ctx->emulator->m_cpu[0];
 	snprintf(stats, 512, "CPU0 stats (over last second)\n");
 	snprintf(stats, 512, "%sI$  read hits / misses: %d / %d\n", stats, cpu0->m_icache.m_hits, cpu0->m_icache.m_misses);
+	snprintf(stats, 512, "%sIF decoded block hits / misses: %d / %d\n", stats, cpu0->m_blockhits, cpu0->m_blockmisses);
 	snprintf(stats, 512, "%sEX retired instructions: %lld\n", stats, cpu0->m_retired);
 	snprintf(stats, 512, "%sEX conditional branches taken / not taken: %d / %d\n", stats, cpu0->m_btaken, cpu0->m_bntaken);
 	snprintf(stats, 512, "%sEX unconditional branches taken: %d\n", stats, cpu0->m_ucbtaken);
@@ -350,6 +359,8 @@ uint32_t statsCallback(Uint32 interval, void* param)
 
 	cpu0->m_icache.m_hits = 0;
 	cpu0->m_icache.m_misses = 0;
+	cpu0->m_blockhits = 0;
+	cpu0->m_blockmisses = 0;
 	cpu0->m_dcache.m_readhits = 0;
 	cpu0->m_dcache.m_readmisses = 0;
 	cpu0->m_dcache.m_writehits = 0;
@@ -362,64 +373,27 @@ uint32_t statsCallback(Uint32 interval, void* param)
 }
 #endif
 
-void gdbstubprocess(socket_t gdbsocket, CEmulator* emulator, char* buffer, int n)
-{
-	// Check the first character of the buffer to determine the packet type
-	switch (buffer[0])
-	{
-		case '+':
-			// ACK packet
-			//gdbresponseack(gdbsocket);
-			break;
-		case '-':
-			// NACK packet
-			break;
-		case 0x03:
-			// Interrupt packet, do not shift buffer
-			gdbprocesscommand(gdbsocket, emulator, buffer);
-			break;
-		case '$':
-			// Command packet
-			buffer++;
-			gdbprocesscommand(gdbsocket, emulator, buffer);
-			break;
-		default:
-			// Unknown packet
-			break;
-	}
-}
-
 int gdbstubthread(void* data)
 {
 	EmulatorContext* ctx = (EmulatorContext*)data;
 
 #ifdef CAT_WINDOWS
 	WSADATA wsaData;
-	int wsaerr;
 	WORD wVersionRequested = MAKEWORD(2, 2);
-	wsaerr = WSAStartup(wVersionRequested, &wsaData);
+	WSAStartup(wVersionRequested, &wsaData);
 #endif
 
 	// Create a socket
 	socket_t sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sockfd < 0)
+	if (!gdbvalidsocket(sockfd))
 	{
 		fprintf(stderr, "Error opening socket\n");
 		return -1;
 	}
 
-#ifdef CAT_WINDOWS
-	//int timeout = 1000; // ms
-	//retval = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
-
-	u_long nonBlocking = 1;
-	if (ioctlsocket(sockfd, FIONBIO, &nonBlocking) == SOCKET_ERROR)
-		fprintf(stderr, "ERROR: Socket can't be set to nonblocking mode\n");
-#endif
-
 	// Bind the socket to the port
 	struct sockaddr_in serv_addr;
-	memset(&serv_addr, '0', sizeof(serv_addr));
+	memset(&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_addr.s_addr = INADDR_ANY;
 	serv_addr.sin_port = htons(1234);
@@ -434,125 +408,104 @@ int gdbstubthread(void* data)
 
 	fprintf(stderr, "GDB stub on //localhost:1234\n");
 
-#if defined(CAT_LINUX) || defined(CAT_DARWIN)
-	struct sockaddr_in cli_addr;
-	socklen_t clilen = sizeof(cli_addr);
-	newsockfd = accept(sockfd, (struct sockaddr*)&cli_addr, &clilen);
-	if (newsockfd < 0)
-	{
-		fprintf(stderr, "Error accepting connection\n");
-		return -1;
-	}
+	// Room for the largest packet gdb may send, binary data can be escaped to twice its size
+	std::vector<char> incoming(GDB_PACKET_SIZE * 2 + 64);
 
-	// Read from the socket
-	char buffer[4096];
-	int n;
-	do
+	while (s_alive)
 	{
-		// TODO: We need nonblocking mode for this
-		/*if (ctx->emulator->m_cpu[0]->m_breakpointHit)
-			gdbsendstopreason(newsockfd, 0, ctx->emulator);
-		if (ctx->emulator->m_cpu[1]->m_breakpointHit)
-			gdbsendstopreason(newsockfd, 1, ctx->emulator);*/
-
-		n = read(newsockfd, buffer, 4096);
-		if (n < 0)
-			fprintf(stderr, "Error reading from socket\n");
-		else
-		{
-			buffer[n] = 0;
-			fprintf(stderr, "> %s\n", buffer);
-			// Respond to gdb command packets here
-			gdbstubprocess(newsockfd, ctx->emulator, buffer, n);
-		}
-	} while (n > 0);
+		// Wait for gdb, looking up now and then to see if we're shutting down
+		struct pollfd listenfd;
+		listenfd.fd = sockfd;
+		listenfd.events = POLLIN;
+		listenfd.revents = 0;
+		if (gdbpoll(&listenfd, 1, 100) <= 0)
+			continue;
+
+		struct sockaddr_in cli_addr;
+#ifdef CAT_WINDOWS
+		int clilen = sizeof(cli_addr);
 #else
-	fd_set readfds;
-	bool accepted = false;
-	while(!accepted && s_alive)
-	{
-		FD_ZERO(&readfds);
-		FD_SET(sockfd, &readfds);
-
-		int result = select(0, &readfds, NULL, NULL, NULL);
-		if (result > 0)
+		socklen_t clilen = sizeof(cli_addr);
+#endif
+		newsockfd = accept(sockfd, (struct sockaddr*)&cli_addr, &clilen);
+		if (!gdbvalidsocket(newsockfd))
+			continue;
+		gdbsetnonblocking(newsockfd);
+
+		size_t pending = 0;
+		bool connected = true;
+		std::vector<uint32_t> volatileHits[2];
+		while (connected && s_alive)
 		{
-			if (FD_ISSET(sockfd, &readfds))
+			// Breakpoint hits go out as soon as they happen
+			for (uint32_t cpu = 0; cpu < 2; ++cpu)
 			{
-				struct sockaddr_in clientAddr;
-				int addrlen = sizeof(clientAddr);
-				newsockfd = accept(sockfd, (struct sockaddr*)&clientAddr, &addrlen);
-				if (newsockfd != INVALID_SOCKET)
-				{
-					// Handle client connection (may need error checking for WSAEWOULDBLOCK)
-					//fprintf(stderr, "Accepted connection from %s:%d\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
-					ioctlsocket(newsockfd, FIONBIO, &nonBlocking);
-					accepted = true;
-				}
-				else
+				volatileHits[cpu].clear();
+				for (auto& breakpoint : ctx->emulator->m_cpu[cpu]->m_breakpoints)
 				{
-					// Check for WSAEWOULDBLOCK error (non-blocking)
-					if (WSAGetLastError() == WSAEWOULDBLOCK)
+					if (breakpoint.isHit && !breakpoint.isCommunicated)
 					{
-						// No connection available, try again later
-					}
-					else
-					{
-						// Other error handling
+						breakpoint.isCommunicated = 1;
+						gdbsendstopreason(cpu, breakpoint.address, ctx->emulator);
+
+						// If the breakpoint is volatile, remove it once we're done walking the list
+						if (breakpoint.isVolatile)
+							volatileHits[cpu].push_back(breakpoint.address);
 					}
 				}
 			}
-		}
-	}
 
-	char buffer[4096];
-	int n;
-	//bool done = false;
-	do
-	{
-		for (uint32_t cpu = 0; cpu < 2; ++cpu)
-		{
-			for (auto& breakpoint : ctx->emulator->m_cpu[cpu]->m_breakpoints)
+			// Removal changes the breakpoint list and lookup set the CPU reads, so it has to be parked
+			if (!volatileHits[0].empty() || !volatileHits[1].empty())
 			{
-				if (breakpoint.isHit && !breakpoint.isCommunicated)
-				{
-					breakpoint.isCommunicated = 1;
-					gdbsendstopreason(newsockfd, cpu, breakpoint.address, ctx->emulator);
+				ctx->emulator->DebugStop();
+				for (uint32_t cpu = 0; cpu < 2; ++cpu)
+					for (uint32_t address : volatileHits[cpu])
+						ctx->emulator->RemoveBreakpoint(cpu, address);
+				ctx->emulator->DebugResume();
+			}
 
-					// If the breakpoint is volatile, remove it
-					if (breakpoint.isVolatile)
-						ctx->emulator->RemoveBreakpoint(cpu, breakpoint.address);
+			struct pollfd fds;
+			fds.fd = newsockfd;
+			fds.events = POLLIN;
+			fds.revents = 0;
+			if (gdbpoll(&fds, 1, 10) > 0 && fds.revents != 0)
+			{
+				// Drain everything that arrived so a burst of packets is handled as one batch
+				while (pending < incoming.size())
+				{
+					int n = (int)recv(newsockfd, incoming.data() + pending, (int)(incoming.size() - pending), 0);
+					if (n > 0)
+					{
+						pending += n;
+						continue;
+					}
+					if (n == 0 || !gdbwouldblock())
+						connected = false;
+					break;
 				}
+
+				size_t used = gdbprocessinput(ctx->emulator, incoming.data(), pending);
+				memmove(incoming.data(), incoming.data() + used, pending - used);
+				pending -= used;
+
+				// Nothing valid can be this long, drop it and let gdb retry
+				if (pending == incoming.size())
+					pending = 0;
 			}
-		}
 
-		n = recv(newsockfd, buffer, 4096, 0);
-		if (n > 0)
-		{
-			buffer[n] = 0;
-#ifdef GDB_COMM_DEBUG
-			fprintf(stderr, "> %s\n", buffer);
-#endif
-			// Respond to gdb command packets here
-			gdbstubprocess(newsockfd, ctx->emulator, buffer, n);
+			if (!gdbflush(newsockfd))
+				connected = false;
 		}
-		else
-			buffer[0] = 0;
 
-		/*if (n < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
-		{
-			fprintf(stderr, "Error reading from socket\n");
-			done = true;
-		}*/
-	} while (s_alive);
-
-#endif
+		// Emulator thread is gone during shutdown, don't wait on it
+		if (s_alive)
+			gdbdisconnect(ctx->emulator);
+		gdbclosesocket(newsockfd);
+		fprintf(stderr, "Debugger connection closed\n");
+	}
 
-#ifdef CAT_WINDOWS
-#else
-	close(newsockfd);
-	close(sockfd);
-#endif
+	gdbclosesocket(sockfd);
 
 	return 0;
 }
@@ -571,17 +524,122 @@ int SDL_main(int argc, char** argv)
 
 	const uint32_t resetvector = 0x0FFE0000;
 	char bootRom[256] = "rom.bin";
-	if (argc>1)
-		strncpy(bootRom, argv[1], strlen(argv[1]));
+	uint32_t hartQuantum = 0;
+	bool headless = false;
+	bool restoreSnapshot = false;
+	SHeadlessOptions headlessOptions;
+	const char* profileFile = nullptr;
+	uint32_t profileInterval = 10000;
+	std::vector<const char*> profileSymbols;
+	SCacheTiming cacheTiming;
+	bool customTiming = false;
+	const char* cacheReportFile = nullptr;
+	bool uartPTY = false;
+	uint16_t uartPort = 0;
+	uint32_t uartBaud = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		// --hart-threads=N runs each hart on its own thread for N instructions at a time
+		if (strncmp(argv[i], "--hart-threads=", 15) == 0)
+			hartQuantum = (uint32_t)strtoul(argv[i] + 15, nullptr, 10);
+		else if (strcmp(argv[i], "--headless") == 0)
+			headless = true;
+		else if (strncmp(argv[i], "--max-cycles=", 13) == 0)
+			headlessOptions.maxCycles = strtoull(argv[i] + 13, nullptr, 10);
+		else if (strncmp(argv[i], "--uart-out=", 11) == 0)
+			headlessOptions.uartFile = argv[i] + 11;
+		// --uart-pty or --uart-tcp=PORT move the UART onto a host link, --uart-baud=N paces it like a real one
+		else if (strcmp(argv[i], "--uart-pty") == 0)
+			uartPTY = true;
+		else if (strncmp(argv[i], "--uart-tcp=", 11) == 0)
+			uartPort = (uint16_t)strtoul(argv[i] + 11, nullptr, 10);
+		else if (strncmp(argv[i], "--uart-baud=", 12) == 0)
+			uartBaud = (uint32_t)strtoul(argv[i] + 12, nullptr, 10);
+		else if (strncmp(argv[i], "--run=", 6) == 0)
+			headlessOptions.command = argv[i] + 6;
+		else if (strncmp(argv[i], "--snapshot=", 11) == 0)
+		{
+			s_snapshotFile = argv[i] + 11;
+			restoreSnapshot = true;
+		}
+		else if (strncmp(argv[i], "--save-snapshot=", 16) == 0)
+			s_snapshotFile = headlessOptions.saveSnapshot = argv[i] + 16;
+		// --profile=FILE samples call stacks every --profile-interval=N cycles, named after the --profile-elf=FILE symbols
+		else if (strncmp(argv[i], "--profile=", 10) == 0)
+			profileFile = argv[i] + 10;
+		else if (strncmp(argv[i], "--profile-interval=", 19) == 0)
+			profileInterval = (uint32_t)strtoul(argv[i] + 19, nullptr, 10);
+		else if (strncmp(argv[i], "--profile-elf=", 14) == 0)
+			profileSymbols.push_back(argv[i] + 14);
+		// --timing=SPEC replaces the flat cache costs, --cache-report=FILE lists where misses happen on exit
+		else if (strncmp(argv[i], "--timing=", 9) == 0)
+		{
+			if (!ParseCacheTiming(argv[i] + 9, cacheTiming))
+				return -1;
+			customTiming = true;
+		}
+		else if (strncmp(argv[i], "--cache-report=", 15) == 0)
+			cacheReportFile = argv[i] + 15;
+		else
+			strncpy(bootRom, argv[i], 255);
+	}
 
-	success = ectx.emulator->Reset(bootRom, resetvector);
+	// A snapshot already holds memory and the sdcard image, no need to load or build either
+	if (restoreSnapshot)
+		success = ectx.emulator->LoadSnapshot(s_snapshotFile);
+	else
+		success = ectx.emulator->Reset(bootRom, resetvector);
 
 	if (!success)
 	{
-		fprintf(stderr, "Failed to load ROM\n");
+		fprintf(stderr, restoreSnapshot ? "Failed to restore snapshot\n" : "Failed to load ROM\n");
 		return -1;
 	}
 
+	if (hartQuantum)
+	{
+		fprintf(stderr, "Running harts on separate threads, quantum: %u instructions\n", hartQuantum);
+		ectx.emulator->SetHartThreads(hartQuantum);
+	}
+
+	CUART* uart = ectx.emulator->m_bus->GetUART();
+	if (uartPTY && !uart->OpenPTY())
+		return -1;
+	if (uartPort && !uart->OpenTCP(uartPort))
+		return -1;
+	if (uartBaud)
+	{
+		fprintf(stderr, "UART paced at %u baud\n", uartBaud);
+		uart->SetBaudRate(uartBaud);
+	}
+
+	if (customTiming || cacheReportFile)
+		ectx.emulator->SetCacheModel(cacheTiming, cacheReportFile != nullptr);
+
+	CProfiler* profiler = nullptr;
+	if (profileFile)
+	{
+		profiler = new CProfiler(profileInterval);
+		for (const char* elfFile : profileSymbols)
+			profiler->LoadSymbols(elfFile);
+		ectx.emulator->SetProfiler(profiler);
+		fprintf(stderr, "Profiling every %u cycles into '%s'\n", profileInterval, profileFile);
+	}
+
+	if (headless)
+	{
+		int exitCode = headlessrun(ectx.emulator, headlessOptions);
+		if (cacheReportFile)
+			ectx.emulator->WriteCacheReport(cacheReportFile);
+		if (profiler)
+		{
+			profiler->Save(profileFile);
+			delete profiler;
+		}
+		delete ectx.emulator;
+		return exitCode;
+	}
+
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0)
 	{
 		fprintf(stderr, "Error initializing SDL2: %s\n", SDL_GetError());
@@ -627,7 +685,8 @@ int SDL_main(int argc, char** argv)
 
 	// ONE_MILLISECOND_IN_TICKS to convert from SDL ticks to device units
 	const uint64_t ONE_MS_IN_TICKS = 10000;
-	uint64_t startTick = SDL_GetTicks64() * ONE_MS_IN_TICKS;
+	// Start from the clock of a restored snapshot so pending timers keep their distance
+	uint64_t startTick = SDL_GetTicks64() * ONE_MS_IN_TICKS - ectx.emulator->GetWallclock();
 	s_wallclock = SDL_GetTicks64() * ONE_MS_IN_TICKS - startTick;
 
 	SDL_Thread* emulatorthreadID = SDL_CreateThread(emulatorthread, "emulator", &ectx);
@@ -644,6 +703,7 @@ int SDL_main(int argc, char** argv)
 	s_textSurface = TTF_RenderText_Blended_Wrapped(s_debugfont, bootString, {255,255,255}, WIDTH);
 
 	fprintf(stderr, "Use the ~ key to reset the emulated CPUs in case of hangs during development\n");
+	fprintf(stderr, "Use F5 to save machine state to '%s' and F9 to restore it\n", s_snapshotFile);
 
 	const uint8_t *keystates = SDL_GetKeyboardState(nullptr);
 	uint8_t *old_keystates = new uint8_t[SDL_NUM_SCANCODES];
@@ -678,6 +738,20 @@ int SDL_main(int argc, char** argv)
 				}
 				else if ((ev.key.keysym.mod & KMOD_CTRL) && ev.key.keysym.sym == 'c')
 					ectx.emulator->QueueByte(3);
+				else if (ev.key.keysym.scancode == SDL_SCANCODE_F5 || ev.key.keysym.scancode == SDL_SCANCODE_F9)
+				{
+					// Park the emulator thread between steps while machine state is saved or replaced
+					ectx.emulator->DebugStop();
+					if (ev.key.keysym.scancode == SDL_SCANCODE_F5)
+						ectx.emulator->SaveSnapshot(s_snapshotFile);
+					else if (ectx.emulator->LoadSnapshot(s_snapshotFile))
+					{
+						// Host time keeps going, move its origin so the emulated clock picks up at the saved time
+						startTick = SDL_GetTicks64() * ONE_MS_IN_TICKS - ectx.emulator->GetWallclock();
+						s_wallclock = SDL_GetTicks64() * ONE_MS_IN_TICKS - startTick;
+					}
+					ectx.emulator->DebugResume();
+				}
 				/*else if (ev.key.keysym.sym != SDLK_LCTRL && ev.key.keysym.sym != SDLK_LSHIFT && ev.key.keysym.sym != SDLK_RSHIFT)
 				{
 					if (ev.key.keysym.mod & KMOD_SHIFT)
@@ -813,6 +887,10 @@ int SDL_main(int argc, char** argv)
 	//SDL_KillThread(gdbStubThread); // We'll hang in accept otherwise
 	SDL_WaitThread(emulatorthreadID, nullptr);
 	SDL_WaitThread(audiothreadID, nullptr);
+	if (profiler)
+		profiler->Save(profileFile);
+	if (cacheReportFile)
+		ectx.emulator->WriteCacheReport(cacheReportFile);
 	SDL_ClearQueuedAudio(ectx.emulator->m_audioDevice);
 	SDL_FreeSurface(ectx.compositesurface);
 	SDL_FreeSurface(ectx.surface);
@@ -3,6 +3,7 @@
 
 #include "gdbstub.h"
 #include "emulator.h"
+#include "headless.h"
 #include "SDL.h"
 #include "SDL_ttf.h"
 
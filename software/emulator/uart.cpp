@@ -1,16 +1,231 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(CAT_WINDOWS)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
 #include "bus.h"
 #include "uart.h"
+#include "snapshot.h"
 
 const uint32_t UARTRECEIVE = DEVICE_UART + 0x00;
 const uint32_t UARTTRANSMIT = DEVICE_UART + 0x04;
 const uint32_t UARTSTATUS = DEVICE_UART + 0x08;
 const uint32_t UARTCONTROL = DEVICE_UART + 0x0C;
 
+// Wall clock runs at 10MHz, a byte on the wire is a start bit, 8 data bits and a stop bit
+const uint64_t UARTWALLCLOCK = 10000000;
+const uint32_t UARTBITSPERBYTE = 10;
+// Output reaches the sink at least once per millisecond of emulated time
+const uint64_t UARTFLUSHINTERVAL = 10000;
+// CPU clock runs 50 cycles for every 3 wall clock ticks
+const uint64_t UARTCPUCYCLESMUL = 50;
+const uint64_t UARTCPUCYCLESDIV = 3;
+// ESP32 resets the CPUs when a lone '~' isn't followed by more data within a second
+const uint64_t UARTRESETDELAY = 10000000;
+
+uint32_t CUARTFileSink::Send(const uint8_t* data, uint32_t len)
+{
+	fwrite(data, 1, len, m_fp);
+	fflush(m_fp);
+	return len;
+}
+
+CUARTPTYSink::~CUARTPTYSink()
+{
+#if !defined(CAT_WINDOWS)
+	if (m_fd >= 0)
+		close(m_fd);
+#endif
+}
+
+bool CUARTPTYSink::Open()
+{
+#if defined(CAT_WINDOWS)
+	fprintf(stderr, "Pseudo terminals are not available on this platform\n");
+	return false;
+#else
+	m_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (m_fd < 0 || grantpt(m_fd) != 0 || unlockpt(m_fd) != 0)
+	{
+		fprintf(stderr, "Could not create a pseudo terminal for the UART\n");
+		return false;
+	}
+	strncpy(m_name, ptsname(m_fd), sizeof(m_name) - 1);
+
+	// Bytes pass through untouched, no echo or line editing
+	struct termios tio;
+	if (tcgetattr(m_fd, &tio) == 0)
+	{
+		cfmakeraw(&tio);
+		tcsetattr(m_fd, TCSANOW, &tio);
+	}
+
+	// Nobody might be listening, the emulator can't wait for them
+	fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL, 0) | O_NONBLOCK);
+	return true;
+#endif
+}
+
+uint32_t CUARTPTYSink::Send(const uint8_t* data, uint32_t len)
+{
+#if defined(CAT_WINDOWS)
+	return 0;
+#else
+	ssize_t written = write(m_fd, data, len);
+	return written > 0 ? (uint32_t)written : 0;
+#endif
+}
+
+uint32_t CUARTPTYSink::Receive(uint8_t* data, uint32_t len)
+{
+#if defined(CAT_WINDOWS)
+	return 0;
+#else
+	// Fails with EAGAIN when there's nothing to read, or EIO while no one has the other end open
+	ssize_t received = read(m_fd, data, len);
+	return received > 0 ? (uint32_t)received : 0;
+#endif
+}
+
+#if defined(CAT_WINDOWS)
+#define INVALID_LINK_SOCKET ((intptr_t)INVALID_SOCKET)
+static bool LinkWouldBlock() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+static void LinkCloseSocket(intptr_t s) { closesocket((SOCKET)s); }
+static void LinkSetNonBlocking(intptr_t s) { u_long mode = 1; ioctlsocket((SOCKET)s, FIONBIO, &mode); }
+#else
+#define INVALID_LINK_SOCKET ((intptr_t)-1)
+static bool LinkWouldBlock() { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+static void LinkCloseSocket(intptr_t s) { close((int)s); }
+static void LinkSetNonBlocking(intptr_t s) { fcntl((int)s, F_SETFL, fcntl((int)s, F_GETFL, 0) | O_NONBLOCK); }
+#endif
+
+CUARTTCPSink::~CUARTTCPSink()
+{
+	Disconnect();
+	if (m_listensocket != INVALID_LINK_SOCKET)
+		LinkCloseSocket(m_listensocket);
+}
+
+bool CUARTTCPSink::Open(uint16_t port)
+{
+#if defined(CAT_WINDOWS)
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+	m_listensocket = (intptr_t)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (m_listensocket == INVALID_LINK_SOCKET)
+	{
+		fprintf(stderr, "Could not create a socket for the UART\n");
+		return false;
+	}
+
+	int reuse = 1;
+	setsockopt(m_listensocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	// Only this machine gets to talk to the UART
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(m_listensocket, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(m_listensocket, 1) < 0)
+	{
+		fprintf(stderr, "Could not listen on port %u for the UART\n", port);
+		return false;
+	}
+	LinkSetNonBlocking(m_listensocket);
+	return true;
+}
+
+bool CUARTTCPSink::Accept()
+{
+	if (m_clientsocket != INVALID_LINK_SOCKET)
+		return true;
+
+	m_clientsocket = (intptr_t)accept(m_listensocket, nullptr, nullptr);
+	if (m_clientsocket == INVALID_LINK_SOCKET)
+		return false;
+
+	// Acks and small packets shouldn't sit around waiting to be merged
+	int nodelay = 1;
+	setsockopt(m_clientsocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+	LinkSetNonBlocking(m_clientsocket);
+	fprintf(stderr, "UART client connected\n");
+	return true;
+}
+
+void CUARTTCPSink::Disconnect()
+{
+	if (m_clientsocket == INVALID_LINK_SOCKET)
+		return;
+	LinkCloseSocket(m_clientsocket);
+	m_clientsocket = INVALID_LINK_SOCKET;
+	fprintf(stderr, "UART client disconnected\n");
+}
+
+uint32_t CUARTTCPSink::Send(const uint8_t* data, uint32_t len)
+{
+	// Like the ESP32, nothing is kept for a client that isn't there yet
+	if (!Accept())
+		return len;
+
+	int sent = send(m_clientsocket, (const char*)data, (int)len, 0);
+	if (sent > 0)
+		return (uint32_t)sent;
+	if (LinkWouldBlock())
+		return 0;
+
+	Disconnect();
+	return len;
+}
+
+uint32_t CUARTTCPSink::Receive(uint8_t* data, uint32_t len)
+{
+	if (!Accept())
+		return 0;
+
+	int received = recv(m_clientsocket, (char*)data, (int)len, 0);
+	if (received > 0)
+		return (uint32_t)received;
+	if (received < 0 && LinkWouldBlock())
+		return 0;
+
+	Disconnect();
+	return 0;
+}
+
+CUART::~CUART()
+{
+	Flush(true);
+	delete m_linksink;
+}
+
 void CUART::Reset()
 {
-	m_byteinqueue = {};
-	m_byteoutqueue = {};
+	// Don't lose what the previous run printed last
+	Flush(true);
+
+	{
+		std::lock_guard<std::mutex> lock(m_rxlock);
+		m_byteinqueue = {};
+	}
+
+	m_txhead = m_txsent = m_txtail = 0;
+	m_txdropped = 0;
+	m_lastflush = m_nexttxtime = m_stalltime = 0;
+	m_resetdeadline = 0;
 
 	m_uartirq = 0;
 	m_controlword = 0b10000; // Interrupts are enabled by default
@@ -18,52 +233,62 @@ void CUART::Reset()
 
 void CUART::Tick(CBus* bus)
 {
-	m_uartirq = m_byteinqueue.size() && (m_controlword&16) ? 1 : 0; // depends on interrupt enable
+	m_wallclock = bus->GetCSR(0)->m_wallclocktime;
 
-	int needflush = 0;
-	while (m_byteoutqueue.size())
+	// Paced bytes leave the FIFO one at a time, unpaced ones never stay in it
+	while (m_txsent != m_txhead && m_wallclock >= m_nexttxtime)
 	{
-		// Output to console
-		printf("%c", m_byteoutqueue.front());
-		m_byteoutqueue.pop_front();
-		++needflush;
+		++m_txsent;
+		m_nexttxtime += m_ticksperbyte;
 	}
 
-	if (needflush)
-		fflush(stdout);
+	// Bulk writes instead of one per byte, and the sink only gets polled for input now and then
+	if (m_wallclock - m_lastflush >= UARTFLUSHINTERVAL || m_wallclock < m_lastflush)
+	{
+		SendToSink(m_txsent - m_txtail);
+		PollSink(m_wallclock < m_lastflush ? UARTFLUSHINTERVAL : m_wallclock - m_lastflush);
+		m_lastflush = m_wallclock;
+	}
+	else if (m_txsent - m_txtail >= UART_TX_RING_SIZE / 2)
+		SendToSink(m_txsent - m_txtail);
+
+	if (m_resetdeadline && m_wallclock >= m_resetdeadline)
+	{
+		m_resetdeadline = 0;
+		bus->GetCSR(0)->RequestReset();
+		bus->GetCSR(1)->RequestReset();
+	}
 }
 
 void CUART::Read(uint32_t address, uint32_t& data)
 {
 	if (address == UARTRECEIVE)
 	{
-		// Note: Same as hardware, this will block until a byte is available
-		// Read status register to check if a byte is available first
-		while (m_byteinqueue.size() == 0) {}
-		data = m_byteinqueue.front();
-		m_byteinqueue.pop_front();
+		// Hardware stalls the bus until a byte arrives, here an empty FIFO reads as zero.
+		// Check UARTSTA_RXFIFO_VALID first, as the ROM does.
+		std::lock_guard<std::mutex> lock(m_rxlock);
+		data = 0;
+		if (m_byteinqueue.size())
+		{
+			data = m_byteinqueue.front();
+			m_byteinqueue.pop_front();
+			UpdateIRQ();
+		}
 	}
 	else if (address == UARTTRANSMIT)
 	{
 		// Can't read from transmit
 		data = 0;
 	}
-	else if (address == UARTSTATUS)
-	{
-		// Report if queue is empty or not
-		if (m_byteinqueue.size())
-			data = 0x01;
-		else
-			data = 0x00;
-	}
-	else if (address == UARTCONTROL)
+	else if (address == UARTSTATUS || address == UARTCONTROL)
 	{
+		std::lock_guard<std::mutex> lock(m_rxlock);
 		data = 0;
 		data |= m_byteinqueue.size() ? 1 : 0; // data available
-		//data |= x ? 2:0; // infifofull
-		//data |= x ? 4:0; // outfifoempty
-		//data |= x ? 8:0; // outfifofull
-		//data |= x ? 16:0; // intenable
+		data |= m_byteinqueue.size() >= UART_FIFO_DEPTH ? 2 : 0; // infifofull
+		data |= m_txsent == m_txhead ? 4 : 0; // outfifoempty
+		data |= m_txhead - m_txsent >= UART_FIFO_DEPTH ? 8 : 0; // outfifofull
+		data |= m_controlword & 16; // intenable
 	}
 	else
 		data = 0;
@@ -73,16 +298,190 @@ void CUART::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 {
 	if (address == UARTCONTROL)
 	{
+		std::lock_guard<std::mutex> lock(m_rxlock);
 		m_controlword = word;
+		UpdateIRQ();
 	}
 	else if (address == UARTTRANSMIT)
 	{
-		// Write to transmit
-		m_byteoutqueue.push_back(word & 0xFF);
+		// Paced with the FIFO full, hold the writer up until the next byte goes out on the wire
+		// as hardware stalls a write into a full FIFO
+		if (m_ticksperbyte && m_txhead - m_txsent >= UART_FIFO_DEPTH)
+		{
+			uint64_t now = m_wallclock > m_stalltime ? m_wallclock : m_stalltime;
+			if (m_nexttxtime > now)
+				CBus::StallWriter((uint32_t)((m_nexttxtime - now) * UARTCPUCYCLESMUL / UARTCPUCYCLESDIV));
+			m_stalltime = m_nexttxtime > now ? m_nexttxtime : now;
+			++m_txsent;
+			m_nexttxtime += m_ticksperbyte;
+		}
+
+		// Make room if the sink fell behind
+		if (m_txhead - m_txtail == UART_TX_RING_SIZE)
+			SendToSink(m_txsent - m_txtail);
+
+		// Only the sink refusing bytes gets here, it isn't going to catch up while we wait
+		if (m_txhead - m_txtail == UART_TX_RING_SIZE)
+		{
+			if (m_txdropped++ == 0)
+				fprintf(stderr, "UART output is not being read, dropping bytes\n");
+			return;
+		}
+
+		// Transmitter was idle, it starts on this byte right away
+		if (m_txsent == m_txhead && m_nexttxtime < m_wallclock)
+			m_nexttxtime = m_wallclock + m_ticksperbyte;
+
+		m_txring[m_txhead % UART_TX_RING_SIZE] = word & 0xFF;
+		++m_txhead;
+		if (m_ticksperbyte == 0)
+			m_txsent = m_txhead;
+	}
+}
+
+void CUART::SetOutput(FILE* fp)
+{
+	Flush(false);
+	delete m_linksink;
+	m_linksink = nullptr;
+	m_filesink.SetFile(fp ? fp : stdout);
+	m_sink = &m_filesink;
+}
+
+void CUART::AttachLink(CUARTSink* link)
+{
+	Flush(false);
+	delete m_linksink;
+	m_linksink = link;
+	m_sink = link;
+}
+
+bool CUART::OpenPTY()
+{
+	CUARTPTYSink* sink = new CUARTPTYSink();
+	if (!sink->Open())
+	{
+		delete sink;
+		return false;
+	}
+
+	AttachLink(sink);
+	fprintf(stderr, "UART is on %s\n", sink->GetName());
+	return true;
+}
+
+bool CUART::OpenTCP(uint16_t port)
+{
+	CUARTTCPSink* sink = new CUARTTCPSink();
+	if (!sink->Open(port))
+	{
+		delete sink;
+		return false;
+	}
+
+	AttachLink(sink);
+	fprintf(stderr, "UART is on tcp:127.0.0.1:%u\n", port);
+	return true;
+}
+
+void CUART::SetBaudRate(uint32_t baud)
+{
+	m_ticksperbyte = baud ? (uint32_t)((UARTWALLCLOCK * UARTBITSPERBYTE + baud / 2) / baud) : 0;
+	if (m_ticksperbyte == 0)
+		m_txsent = m_txhead;
+}
+
+void CUART::Flush(bool drain)
+{
+	if (drain)
+		m_txsent = m_txhead;
+	SendToSink(m_txsent - m_txtail);
+}
+
+void CUART::UpdateIRQ()
+{
+	// Called with m_rxlock held, the line follows the FIFO state like the hardware one does
+	m_uartirq = m_byteinqueue.size() && (m_controlword & 16) ? 1 : 0;
+}
+
+void CUART::SendToSink(uint32_t count)
+{
+	while (count)
+	{
+		// At most two pieces when the bytes wrap around the end of the ring
+		uint32_t offset = m_txtail % UART_TX_RING_SIZE;
+		uint32_t chunk = UART_TX_RING_SIZE - offset < count ? UART_TX_RING_SIZE - offset : count;
+		uint32_t sent = m_sink->Send(&m_txring[offset], chunk);
+		m_txtail += sent;
+		count -= sent;
+		if (sent != chunk)
+			break;
+		m_txdropped = 0;
 	}
 }
 
+void CUART::PollSink(uint64_t elapsed)
+{
+	uint32_t room;
+	{
+		std::lock_guard<std::mutex> lock(m_rxlock);
+		room = m_byteinqueue.size() < UART_FIFO_DEPTH ? UART_FIFO_DEPTH - (uint32_t)m_byteinqueue.size() : 0;
+	}
+
+	// Paced links can't deliver more than the wire carried since the last poll
+	if (m_ticksperbyte && elapsed / m_ticksperbyte < room)
+		room = (uint32_t)(elapsed / m_ticksperbyte);
+
+	// Leave the rest with the sender until the FIFO has room
+	uint8_t incoming[1024];
+	if (room == 0)
+		return;
+	uint32_t received = m_sink->Receive(incoming, room < sizeof(incoming) ? room : sizeof(incoming));
+	if (received == 0)
+		return;
+
+	// Same as the ESP32 bridge: any data cancels a pending reset, and a chunk starting with '~' arms a new one
+	m_resetdeadline = incoming[0] == '~' ? m_wallclock + UARTRESETDELAY : 0;
+
+	std::lock_guard<std::mutex> lock(m_rxlock);
+	m_byteinqueue.insert(m_byteinqueue.end(), incoming, incoming + received);
+	UpdateIRQ();
+}
+
 void CUART::QueueByte(uint8_t byte)
 {
+	std::lock_guard<std::mutex> lock(m_rxlock);
 	m_byteinqueue.push_back(byte);
+	UpdateIRQ();
+}
+
+void CUART::Serialize(CSnapshot& snap)
+{
+	std::lock_guard<std::mutex> lock(m_rxlock);
+	snap.Value(m_uartirq);
+	snap.Value(m_controlword);
+	snap.Deque(m_byteinqueue);
+
+	// Whatever the sink hasn't taken yet goes along, and restores as not yet transmitted
+	std::deque<uint8_t> pending;
+	if (snap.IsSaving())
+	{
+		for (uint32_t i = m_txtail; i != m_txhead; ++i)
+			pending.push_back(m_txring[i % UART_TX_RING_SIZE]);
+	}
+	snap.Deque(pending);
+	snap.Value(m_nexttxtime);
+
+	if (!snap.IsSaving())
+	{
+		m_txtail = m_txsent = m_txhead = 0;
+		for (uint8_t byte : pending)
+		{
+			if (m_txhead == UART_TX_RING_SIZE)
+				break;
+			m_txring[m_txhead++] = byte;
+		}
+		if (m_ticksperbyte == 0)
+			m_txsent = m_txhead;
+	}
 }
@@ -1,14 +1,78 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
 #include <deque>
+#include <mutex>
 #include "memmappeddevice.h"
 
+// Same depth as the hardware FIFOs
+#define UART_FIFO_DEPTH 2048
+// Transmitted bytes wait here for the sink. When paced, at most UART_FIFO_DEPTH of them wait for the
+// wire and writes stall past that, the rest of the ring holds bytes sent while the sink falls behind
+#define UART_TX_RING_SIZE 8192
+
+// Where transmitted bytes end up, and where received ones come from if the other end can talk back
+class CUARTSink
+{
+public:
+	virtual ~CUARTSink() {}
+
+	// Takes as many bytes as it can without blocking, returns how many
+	virtual uint32_t Send(const uint8_t* data, uint32_t len) = 0;
+	// Returns up to len bytes that arrived from the other end
+	virtual uint32_t Receive(uint8_t* data, uint32_t len) { return 0; }
+};
+
+class CUARTFileSink : public CUARTSink
+{
+public:
+	void SetFile(FILE* fp) { m_fp = fp; }
+	uint32_t Send(const uint8_t* data, uint32_t len) override final;
+
+private:
+	FILE* m_fp{ stdout };
+};
+
+// Pseudo terminal that a terminal program or riscvtool can open like a serial port
+class CUARTPTYSink : public CUARTSink
+{
+public:
+	~CUARTPTYSink();
+
+	bool Open();
+	const char* GetName() const { return m_name; }
+	uint32_t Send(const uint8_t* data, uint32_t len) override final;
+	uint32_t Receive(uint8_t* data, uint32_t len) override final;
+
+private:
+	int m_fd{ -1 };
+	char m_name[128]{};
+};
+
+// Loopback TCP port standing in for the ESP32 USB serial link, one client at a time
+class CUARTTCPSink : public CUARTSink
+{
+public:
+	~CUARTTCPSink();
+
+	bool Open(uint16_t port);
+	uint32_t Send(const uint8_t* data, uint32_t len) override final;
+	uint32_t Receive(uint8_t* data, uint32_t len) override final;
+
+private:
+	bool Accept();
+	void Disconnect();
+
+	intptr_t m_listensocket{ -1 };
+	intptr_t m_clientsocket{ -1 };
+};
+
 class CUART : public MemMappedDevice
 {
 public:
 	CUART() {}
-	~CUART() {}
+	~CUART();
 
 	uint32_t m_uartirq{ 0 };
 	uint32_t m_controlword{ 0 };
@@ -18,7 +82,45 @@ public:
 	void Write(uint32_t address, uint32_t word, uint32_t wstrobe) override final;
 	void Tick(CBus* bus);
 
-	std::deque<uint8_t> m_byteinqueue;
-	std::deque<uint8_t> m_byteoutqueue;
+	// Where transmitted bytes go, stdout unless redirected
+	void SetOutput(FILE* fp);
+	// Moves the UART onto a new pseudo terminal, returns false if one can't be created
+	bool OpenPTY();
+	// Moves the UART onto a TCP port on the loopback interface
+	bool OpenTCP(uint16_t port);
+	// Sends bytes at the given rate instead of as fast as they're written, 0 to stop pacing
+	void SetBaudRate(uint32_t baud);
+	// Hands everything transmitted so far to the sink, including what's still waiting in the FIFO if drain is set
+	void Flush(bool drain);
+	void Serialize(CSnapshot& snap);
+
 	void QueueByte(uint8_t byte);
+
+private:
+	void UpdateIRQ();
+	void SendToSink(uint32_t count);
+	void PollSink(uint64_t elapsed);
+	void AttachLink(CUARTSink* link);
+
+	CUARTFileSink m_filesink;
+	CUARTSink* m_linksink{ nullptr };	// PTY or TCP link, owned
+	CUARTSink* m_sink{ &m_filesink };
+
+	// Received bytes, filled from the host side and emptied by the CPU
+	std::mutex m_rxlock;
+	std::deque<uint8_t> m_byteinqueue;
+
+	// Bytes in [m_txtail, m_txsent) are on the wire and wait for the sink, [m_txsent, m_txhead) are still in the FIFO
+	uint8_t m_txring[UART_TX_RING_SIZE]{};
+	uint32_t m_txhead{ 0 };
+	uint32_t m_txsent{ 0 };
+	uint32_t m_txtail{ 0 };
+	uint32_t m_txdropped{ 0 };
+
+	uint64_t m_wallclock{ 0 };
+	uint64_t m_lastflush{ 0 };
+	uint64_t m_nexttxtime{ 0 };
+	uint64_t m_stalltime{ 0 };	// Wall clock the writer has been held up to within this tick
+	uint64_t m_resetdeadline{ 0 };
+	uint32_t m_ticksperbyte{ 0 };
 };
@@ -3,6 +3,15 @@
 #include "vpu.h"
 #include "bus.h"
 #include "bitutil.h"
+#include "snapshot.h"
+
+#if defined(__AVX2__)
+#define VPU_SIMD_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#define VPU_SIMD_SSE2
+#include <emmintrin.h>
+#endif
 
 CVPU::CVPU()
 {
@@ -18,6 +27,149 @@ void CVPU::Reset()
 	m_videoscanoutenable = 0;
 }
 
+// Scanline conversion kernels, widths are always a multiple of 8 pixels
+// AVX2 builds (-march=native, /arch:AVX2) gather palette entries 8 at a time,
+// SSE2 builds at least vectorize 12bpp expansion and pixel doubling
+
+static inline uint32_t Expand12bpp(uint32_t color)
+{
+	uint32_t G = SelectBitRange(color, 3, 0);
+	uint32_t B = SelectBitRange(color, 7, 4);
+	uint32_t R = SelectBitRange(color, 11, 8);
+	return 0xFF000000 | (R << 20) | (B << 12) | (G << 4);
+}
+
+#if defined(VPU_SIMD_AVX2) || defined(VPU_SIMD_SSE2)
+static inline __m128i Expand12bpp4(__m128i color)
+{
+	const __m128i alpha = _mm_set1_epi32(0xFF000000);
+	__m128i R = _mm_slli_epi32(_mm_and_si128(color, _mm_set1_epi32(0xF00)), 12);
+	__m128i B = _mm_slli_epi32(_mm_and_si128(color, _mm_set1_epi32(0x0F0)), 8);
+	__m128i G = _mm_slli_epi32(_mm_and_si128(color, _mm_set1_epi32(0x00F)), 4);
+	return _mm_or_si128(_mm_or_si128(alpha, R), _mm_or_si128(B, G));
+}
+#endif
+
+#if defined(VPU_SIMD_AVX2)
+static inline __m256i Expand12bpp8(__m256i color)
+{
+	const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+	__m256i R = _mm256_slli_epi32(_mm256_and_si256(color, _mm256_set1_epi32(0xF00)), 12);
+	__m256i B = _mm256_slli_epi32(_mm256_and_si256(color, _mm256_set1_epi32(0x0F0)), 8);
+	__m256i G = _mm256_slli_epi32(_mm256_and_si256(color, _mm256_set1_epi32(0x00F)), 4);
+	return _mm256_or_si256(_mm256_or_si256(alpha, R), _mm256_or_si256(B, G));
+}
+
+// Store each of the 8 pixels twice, 16 pixels total
+static inline void StoreDoubled8(uint32_t* target, __m256i pixels)
+{
+	__m256i lo = _mm256_unpacklo_epi32(pixels, pixels);
+	__m256i hi = _mm256_unpackhi_epi32(pixels, pixels);
+	_mm256_storeu_si256((__m256i*)target, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i*)(target + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+#elif defined(VPU_SIMD_SSE2)
+// Store each of the 4 pixels twice, 8 pixels total
+static inline void StoreDoubled4(uint32_t* target, __m128i pixels)
+{
+	_mm_storeu_si128((__m128i*)target, _mm_unpacklo_epi32(pixels, pixels));
+	_mm_storeu_si128((__m128i*)(target + 4), _mm_unpackhi_epi32(pixels, pixels));
+}
+
+static inline __m128i Lookup4(const uint8_t* source, const uint32_t* palette)
+{
+	return _mm_set_epi32(palette[source[3]], palette[source[2]], palette[source[1]], palette[source[0]]);
+}
+#endif
+
+static void ConvertRow8bpp(uint32_t* target, const uint8_t* source, const uint32_t* palette, uint32_t width, bool doubled)
+{
+	uint32_t x = 0;
+#if defined(VPU_SIMD_AVX2)
+	for (; x + 8 <= width; x += 8)
+	{
+		__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&source[x]));
+		__m256i pixels = _mm256_i32gather_epi32((const int*)palette, indices, 4);
+		if (doubled)
+			StoreDoubled8(&target[x << 1], pixels);
+		else
+			_mm256_storeu_si256((__m256i*)&target[x], pixels);
+	}
+#elif defined(VPU_SIMD_SSE2)
+	for (; x + 4 <= width; x += 4)
+	{
+		__m128i pixels = Lookup4(&source[x], palette);
+		if (doubled)
+			StoreDoubled4(&target[x << 1], pixels);
+		else
+			_mm_storeu_si128((__m128i*)&target[x], pixels);
+	}
+#endif
+	for (; x < width; ++x)
+	{
+		uint32_t color = palette[source[x]];
+		if (doubled)
+		{
+			target[(x << 1) + 0] = color;
+			target[(x << 1) + 1] = color;
+		}
+		else
+			target[x] = color;
+	}
+}
+
+static void ConvertRow12bpp(uint32_t* target, const uint16_t* source, uint32_t width, bool doubled)
+{
+	uint32_t x = 0;
+#if defined(VPU_SIMD_AVX2)
+	for (; x + 16 <= width; x += 16)
+	{
+		__m256i colors = _mm256_loadu_si256((const __m256i*)&source[x]);
+		__m256i pixels0 = Expand12bpp8(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(colors)));
+		__m256i pixels1 = Expand12bpp8(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(colors, 1)));
+		if (doubled)
+		{
+			StoreDoubled8(&target[x << 1], pixels0);
+			StoreDoubled8(&target[(x << 1) + 16], pixels1);
+		}
+		else
+		{
+			_mm256_storeu_si256((__m256i*)&target[x], pixels0);
+			_mm256_storeu_si256((__m256i*)&target[x + 8], pixels1);
+		}
+	}
+#elif defined(VPU_SIMD_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	for (; x + 8 <= width; x += 8)
+	{
+		__m128i colors = _mm_loadu_si128((const __m128i*)&source[x]);
+		__m128i pixels0 = Expand12bpp4(_mm_unpacklo_epi16(colors, zero));
+		__m128i pixels1 = Expand12bpp4(_mm_unpackhi_epi16(colors, zero));
+		if (doubled)
+		{
+			StoreDoubled4(&target[x << 1], pixels0);
+			StoreDoubled4(&target[(x << 1) + 8], pixels1);
+		}
+		else
+		{
+			_mm_storeu_si128((__m128i*)&target[x], pixels0);
+			_mm_storeu_si128((__m128i*)&target[x + 4], pixels1);
+		}
+	}
+#endif
+	for (; x < width; ++x)
+	{
+		uint32_t color = Expand12bpp(source[x]);
+		if (doubled)
+		{
+			target[(x << 1) + 0] = color;
+			target[(x << 1) + 1] = color;
+		}
+		else
+			target[x] = color;
+	}
+}
+
 void CVPU::UpdateVideoLink(uint32_t* pixels, int pitch, int scanline, CBus* bus)
 {
 	m_scanline = scanline;
@@ -27,101 +179,37 @@ void CVPU::UpdateVideoLink(uint32_t* pixels, int pitch, int scanline, CBus* bus)
 		uint32_t* devicemem = bus->GetHostAddress(m_scanoutpointer);
 		if (m_videoscanoutenable && devicemem && scanline < 480)
 		{
-			// Copy vram scan out pointer contents to SDL surface
-			if (m_12bppmode)
+			// Start tracking writes to a new scanout buffer or layout, this marks all rows dirty
+			uint32_t rowbytes = m_12bppmode ? m_scanwidth * 2 : m_scanwidth;
+			if (m_watchedpointer != m_scanoutpointer || m_watchedrowbytes != rowbytes || m_watchedrows != m_scanheight)
 			{
-				if (m_scanwidth == 320)
-				{
-					// 16bpp
-					uint16_t* devicememas12bpp = (uint16_t*)devicemem;
-					const int W = pitch / 4;
-					//for (uint32_t y = 0; y < m_scanheight; y++)
-					uint32_t y = scanline / 2;
-					{
-						const int linetop0 = 2 * W * y;
-						const int linetop1 = 2 * W * y + W;
-						uint16_t* sourceRow = &devicememas12bpp[m_scanwidth * y];
-						for (uint32_t x = 0; x < m_scanwidth; ++x)
-						{
-							uint16_t color = sourceRow[x];
-							uint32_t G = SelectBitRange(color, 3, 0);
-							uint32_t B = SelectBitRange(color, 7, 4);
-							uint32_t R = SelectBitRange(color, 11, 8);
-							uint32_t expandedcolor = 0xFF000000 | (R << 20) | (B << 12) | (G << 4);
-							pixels[linetop0 + x*2+0] = expandedcolor;
-							pixels[linetop1 + x*2+0] = expandedcolor;
-							pixels[linetop0 + x*2+1] = expandedcolor;
-							pixels[linetop1 + x*2+1] = expandedcolor;
-						}
-					}
-				}
-				else
-				{
-					// 16bpp
-					uint16_t* devicememas12bpp = (uint16_t*)devicemem;
-					const int W = pitch / 4;
-					//for (uint32_t y = 0; y < m_scanheight; y++)
-					uint32_t y = scanline;
-					{
-						const int linetop = W * y;
-						uint16_t* sourceRow = &devicememas12bpp[m_scanwidth * y];
-						for (uint32_t x = 0; x < m_scanwidth; ++x)
-						{
-							uint16_t color = sourceRow[x];
-							uint32_t G = SelectBitRange(color, 3, 0);
-							uint32_t B = SelectBitRange(color, 7, 4);
-							uint32_t R = SelectBitRange(color, 11, 8);
-							uint32_t expandedcolor = 0xFF000000 | (R << 20) | (B << 12) | (G << 4);
-							pixels[linetop + x] = expandedcolor;
-						}
-					}
-				}
+				m_watchedpointer = m_scanoutpointer;
+				m_watchedrowbytes = rowbytes;
+				m_watchedrows = m_scanheight;
+				bus->m_mem->WatchScanout(m_scanoutpointer, rowbytes, m_scanheight);
 			}
+
+			// 320 wide modes are doubled in both directions, one source row covers two scanlines
+			const bool doubled = m_scanwidth == 320;
+			const uint32_t y = doubled ? scanline / 2 : scanline;
+
+			// Nothing was written to this row since we last converted it
+			if (!bus->m_mem->TakeDirtyRow(y))
+				return;
+
+			const int W = pitch / 4;
+			uint32_t* pixelRow = doubled ? &pixels[2 * W * y] : &pixels[W * y];
+
+			// Copy vram scan out pointer contents to SDL surface
+			if (m_12bppmode)
+				ConvertRow12bpp(pixelRow, &((uint16_t*)devicemem)[m_scanwidth * y], m_scanwidth, doubled);
 			else
-			{
-				if (m_scanwidth == 320)
-				{
-					// 8bpp
-					uint8_t* devicememas8bpp = (uint8_t*)devicemem;
-					const int W = pitch / 4;
-					//for (uint32_t y = 0; y < m_scanheight; y++)
-					uint32_t y = scanline / 2;
-					{
-						uint32_t* pixelRow0 = &pixels[2*W*y];
-						uint32_t* pixelRow1 = pixelRow0 + W;
-						uint8_t* sourceRow = &devicememas8bpp[m_scanwidth * y];
-						for (uint32_t x = 0; x < m_scanwidth; ++x)
-						{
-							uint32_t color = m_vgapalette[sourceRow[x]];
-							uint32_t *pixelPos0 = pixelRow0+(x<<1);
-							uint32_t *pixelPos1 = pixelRow1+(x<<1);
-							pixelPos0[0] = color;
-							pixelPos0[1] = color;
-							pixelPos1[0] = color;
-							pixelPos1[1] = color;
-						}
-					}
-				}
-				else
-				{
-					// 8bpp
-					uint8_t* devicememas8bpp = (uint8_t*)devicemem;
-					const int W = pitch / 4;
-					//for (uint32_t y = 0; y < m_scanheight; y++)
-					uint32_t y = scanline;
-					{
-						uint32_t* pixelRow = &pixels[W*y];
-						uint8_t* sourceRow = &devicememas8bpp[m_scanwidth * y];
-						for (uint32_t x = 0; x < m_scanwidth; ++x)
-						{
-							uint32_t color = m_vgapalette[sourceRow[x]];
-							pixelRow[x] = color;
-						}
-					}
-				}
-			}
+				ConvertRow8bpp(pixelRow, &((uint8_t*)devicemem)[m_scanwidth * y], m_vgapalette, m_scanwidth, doubled);
+
+			if (doubled)
+				memcpy(pixelRow + W, pixelRow, 640 * sizeof(uint32_t));
 		}
-		else
+		else if (scanline == 480)
 		{
 			// This is going to reset the 8 pixel status bar
 			for (uint32_t i = 640 * 480; i < 640 * 488; i++)
@@ -131,11 +219,14 @@ void CVPU::UpdateVideoLink(uint32_t* pixels, int pitch, int scanline, CBus* bus)
 		}
 	}
 
-	if (m_scanoutpointer == 0x0 || m_videoscanoutenable == 0x0)
+	if ((m_scanoutpointer == 0x0 || m_videoscanoutenable == 0x0) && scanline == 0)
 	{
 		// No video signal
 		for (uint32_t i = 0; i < 640 * 488; i++)
 			pixels[i] = 0x0;
+
+		// Convert everything once the signal comes back
+		m_watchedrows = 0;
 	}
 
 	// Vsync triggers on first pixel of scanline 490
@@ -143,6 +234,11 @@ void CVPU::UpdateVideoLink(uint32_t* pixels, int pitch, int scanline, CBus* bus)
 		++m_vsyncCount;
 }
 
+void CVPU::InvalidateScanout(CBus* bus)
+{
+	bus->m_mem->MarkScanoutDirty();
+}
+
 void CVPU::Tick(CBus* bus)
 {
 	// Pull cmd from fifo and process
@@ -257,6 +353,8 @@ void CVPU::Tick(CBus* bus)
 			uint32_t B = SelectBitRange(color, 7, 4) << 4;
 			uint32_t R = SelectBitRange(color, 11, 8) << 4;
 			m_vgapalette[addrs] = 0xFF000000 | (R << 16) | (B << 8) | (G);
+			// Indexed rows need to be converted again with the new color
+			bus->m_mem->MarkScanoutDirty();
 			m_state = 0;
 		}
 		break;
@@ -327,3 +425,28 @@ void CVPU::Write(uint32_t address, uint32_t word, uint32_t wstrobe)
 	// Command FIFO writes dirty the video output
 	m_fifo.push(word);
 }
+
+void CVPU::Serialize(CSnapshot& snap)
+{
+	snap.Value(m_cmd);
+	snap.Value(m_data);
+	snap.Value(m_state);
+	snap.Value(m_videoscanoutenable);
+	snap.Value(m_12bppmode);
+	snap.Value(m_scanoutpointer);
+	snap.Value(m_scanwidth);
+	snap.Value(m_scanheight);
+	snap.Value(m_scanlength);
+	snap.Value(m_vsyncCount);
+	snap.Value(m_scanline);
+	snap.Value(m_vgapalette);
+	snap.Value(m_fakevsync);
+	snap.Value(m_ctlreg);
+	snap.Value(m_regA);
+	snap.Value(m_regB);
+	snap.Value(m_regC);
+	snap.Queue(m_fifo);
+
+	// Start watching the restored scanout buffer on next scanline
+	m_watchedrows = 0;
+}
@@ -20,6 +20,9 @@ public:
 	void Tick(CBus* bus);
 
 	void UpdateVideoLink(uint32_t* pixels, int pitch, int scanline, CBus* bus);
+	// Force all rows to be converted on next scanout, for when the target surface was drawn over
+	void InvalidateScanout(CBus* bus);
+	void Serialize(CSnapshot& snap);
 
 private:
 	uint32_t m_cmd{ 0 };
@@ -36,6 +39,9 @@ private:
 	uint32_t m_vgapalette[256];
 	uint32_t m_fakevsync{ 0 };
 	uint32_t m_ctlreg{ 0 };
+	uint32_t m_watchedpointer{ 0 };
+	uint32_t m_watchedrowbytes{ 0 };
+	uint32_t m_watchedrows{ 0 };
 	int32_t m_regA{ 0 };
 	int32_t m_regB{ 65536 };
 	int32_t m_regC{ 0 };
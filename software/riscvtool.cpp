@@ -1,7 +1,13 @@
 #if defined(CAT_LINUX) || defined(CAT_MACOS)
 #include <termios.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #else
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #endif
 
@@ -16,7 +22,13 @@
 #include <thread>
 #include <filesystem>
 
-#include "lz4.h"
+#include "uploadclient.h"
+
+#if defined(CAT_LINUX) || defined(CAT_MACOS)
+#define INVALID_TCP_SOCKET -1
+#else
+#define INVALID_TCP_SOCKET INVALID_SOCKET
+#endif
 
 #if defined(CAT_LINUX) || defined(CAT_MACOS)
 #include <sys/ioctl.h>
@@ -47,6 +59,10 @@ class CSerialPort{
 
 	bool Open()
 	{
+		// tcp:PORT or tcp:HOST:PORT talks to an emulator started with --uart-tcp=PORT instead of a board
+		if (strncmp(devicename, "tcp:", 4) == 0)
+			return OpenTCP(devicename + 4);
+
 #if defined(CAT_LINUX) || defined(CAT_MACOS)
 		// Open COM port
 		serial_port = open(devicename, O_RDWR);
@@ -82,8 +98,9 @@ class CSerialPort{
 		//tty.c_oflag &= ~OXTABS;
 		//tty.c_oflag &= ~ONOEOT;
 
-		tty.c_cc[VTIME] = 50;
-		tty.c_cc[VMIN] = 10;
+		// Reads return right away with whatever has arrived, same as the COMMTIMEOUTS used on Windows
+		tty.c_cc[VTIME] = 0;
+		tty.c_cc[VMIN] = 0;
 
 		cfsetispeed(&tty, B460800);
 		cfsetospeed(&tty, B460800); // or only cfsetspeed(&tty, B460800);
@@ -136,13 +153,82 @@ class CSerialPort{
 #endif
 	}
 
+	bool OpenTCP(const char *_address)
+	{
+		// Host is optional and defaults to this machine
+		char host[256] = "127.0.0.1";
+		const char *port = strrchr(_address, ':');
+		if (port)
+		{
+			snprintf(host, sizeof(host), "%.*s", (int)(port - _address), _address);
+			++port;
+		}
+		else
+			port = _address;
+
+#if !defined(CAT_LINUX) && !defined(CAT_MACOS)
+		WSADATA wsaData;
+		WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		struct addrinfo *result = nullptr;
+		if (getaddrinfo(host, port, &hints, &result) != 0 || !result)
+		{
+			printf("ERROR: can't resolve %s:%s\n", host, port);
+			return false;
+		}
+
+		tcp_socket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+		bool connected = tcp_socket != INVALID_TCP_SOCKET && connect(tcp_socket, result->ai_addr, (int)result->ai_addrlen) == 0;
+		freeaddrinfo(result);
+		if (!connected)
+		{
+			printf("ERROR: can't connect to %s:%s\n", host, port);
+			return false;
+		}
+
+		// Small packets and acks go out right away, and reads don't wait, same as the serial port
+		int nodelay = 1;
+		setsockopt(tcp_socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+#if defined(CAT_LINUX) || defined(CAT_MACOS)
+		fcntl(tcp_socket, F_SETFL, fcntl(tcp_socket, F_GETFL, 0) | O_NONBLOCK);
+#else
+		u_long nonblocking = 1;
+		ioctlsocket(tcp_socket, FIONBIO, &nonblocking);
+#endif
+
+		printf("%s open\n", devicename);
+		return true;
+	}
+
+	bool TCPWouldBlock()
+	{
+#if defined(CAT_LINUX) || defined(CAT_MACOS)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#else
+		return WSAGetLastError() == WSAEWOULDBLOCK;
+#endif
+	}
+
 	uint32_t Receive(void *_target, unsigned int _rcvlength)
 	{
+		if (tcp_socket != INVALID_TCP_SOCKET)
+		{
+			int n = recv(tcp_socket, (char*)_target, _rcvlength, 0);
+			if (n < 0 && !TCPWouldBlock())
+				printf("ERROR: recv() failed\n");
+			return n > 0 ? (uint32_t)n : 0;
+		}
+
 #if defined(CAT_LINUX) || defined(CAT_MACOS)
 		int n = read(serial_port, _target, _rcvlength);
 		if (n < 0)
 			printf("ERROR: read() failed\n");
-		return n;
+		return n > 0 ? (uint32_t)n : 0;
 #else
 		DWORD bytesread = 0;
 		BOOL success = ReadFile(hComm, _target, _rcvlength, &bytesread, nullptr);
@@ -152,6 +238,27 @@ class CSerialPort{
 
 	uint32_t Send(void *_sendbytes, unsigned int _sendlength)
 	{
+		if (tcp_socket != INVALID_TCP_SOCKET)
+		{
+			// The emulator drains its side in bursts, keep going until it took everything
+			const char *source = (const char*)_sendbytes;
+			uint32_t sent = 0;
+			while (sent < _sendlength)
+			{
+				int n = send(tcp_socket, source + sent, _sendlength - sent, 0);
+				if (n > 0)
+					sent += n;
+				else if (n < 0 && TCPWouldBlock())
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				else
+				{
+					printf("ERROR: send() failed\n");
+					break;
+				}
+			}
+			return sent;
+		}
+
 #if defined(CAT_LINUX) || defined(CAT_MACOS)
 		int n = write(serial_port, _sendbytes, _sendlength);
 		if (n < 0)
@@ -170,15 +277,24 @@ class CSerialPort{
 	void Close()
 	{
 #if defined(CAT_LINUX) || defined(CAT_MACOS)
-		close(serial_port);
+		if (tcp_socket != INVALID_TCP_SOCKET)
+			close(tcp_socket);
+		else
+			close(serial_port);
 #else // CAT_WINDOWS
-		CloseHandle(hComm);
+		if (tcp_socket != INVALID_TCP_SOCKET)
+			closesocket(tcp_socket);
+		else
+			CloseHandle(hComm);
 #endif
+		tcp_socket = INVALID_TCP_SOCKET;
 	}
 
 #if defined(CAT_LINUX) || defined(CAT_MACOS)
 	int serial_port{-1};
+	int tcp_socket{INVALID_TCP_SOCKET};
 #else // CAT_WINDOWS
+	SOCKET tcp_socket{INVALID_TCP_SOCKET};
 	HANDLE hComm{INVALID_HANDLE_VALUE};
 	DCB serialParams{0};
 	COMMTIMEOUTS timeouts{0};
@@ -458,199 +574,19 @@ void sendcmd(int startarg, int argc, char **argv)
 	serial.Close();
 }
 
-// This is meant to be used with the receiver app on the tinysys side
-// It will send the file in chunks after header information
-// The receiver app will respond with an ack(+) or error(!) to each request
+// This is meant to be used with the receiver app on the tinysys side, see SDK/upload.h for the protocol
 void sendfile(char *_filename)
 {
-	char tmpstring[129];
-
-	FILE *fp;
-	fp = fopen(_filename, "rb");
-	if (!fp)
-	{
-		printf("ERROR: can't open ELF file %s\n", _filename);
-		return;
-	}
-
-	char cleanfilename[129];
-	{
-		using namespace std::filesystem;
-		path p = absolute(_filename);
-		strcpy(cleanfilename, p.filename().string().c_str());
-	}
-
-	unsigned int filebytesize = 0;
-	fpos_t pos, endpos;
-	fgetpos(fp, &pos);
-	fseek(fp, 0, SEEK_END);
-	fgetpos(fp, &endpos);
-	fsetpos(fp, &pos);
-	filebytesize = getfilelength(endpos);
-
-	uint8_t *filedata = new uint8_t[filebytesize + 64];
-	fread(filedata, 1, filebytesize, fp);
-	fclose(fp);
-
 	CSerialPort serial;
 	if (serial.Open() == false)
-	{
-		delete [] filedata;
 		return;
-	}
-
-	// Send the file bytes in chunks
-	uint32_t packetSize = 1024;
-	int worstSize = LZ4_compressBound(filebytesize);
-
-	// Pack the data before sending it across
-	char* encoded = new char[worstSize];
-	uint32_t encodedSize = LZ4_compress_default((const char*)filedata, encoded, filebytesize, worstSize);
-	printf("Compression ratio = %.2f%% (%d->%d bytes)\n", 100.f*float(encodedSize)/float(filebytesize), filebytesize, encodedSize);
-
-	// Now we can work out how many packets we need to send
-	uint32_t numPackets = encodedSize / packetSize;
-	uint32_t leftoverBytes = encodedSize % packetSize;
-
-	uint8_t received;
 
 	ConsumeInitialTraffic(serial);
 
-	// Start the receiver app on the other end
-	snprintf(tmpstring, 128, "recv");
-	serial.Send((uint8_t*)tmpstring, 4);
-	std::this_thread::sleep_for(std::chrono::milliseconds(50));
-	snprintf(tmpstring, 128, "\n");
-	serial.Send((uint8_t*)tmpstring, 1);
-	if (!WACK(serial, '+', received))
-	{
-		printf("Transfer initiation error: '%c'\n", received);
-		serial.Close();
-		delete [] filedata;
-		return;
-	}
-
-	// Send encoded length
-	uint32_t encodedLen = encodedSize;
-	serial.Send(&encodedLen, 4);
-	if (!WACK(serial, '+', received))
-	{
-		printf("Encoded buffer length error: '%c'\n", received);
-		serial.Close();
-		delete [] filedata;
-		return;
-	}
-
-	// Send actual length
-	uint32_t decodedLen = filebytesize;
-	serial.Send(&decodedLen, 4);
-	if (!WACK(serial, '+', received))
-	{
-		printf("Decoded buffer length error: '%c'\n", received);
-		serial.Close();
-		delete [] filedata;
-		return;
-	}
-
-	// Send name length
-	uint32_t nameLen = strlen(cleanfilename);
-	serial.Send(&nameLen, 4);
-	if (!WACK(serial, '+', received))
-	{
-		printf("File name length error: '%c'\n", received);
-		serial.Close();
-		delete [] filedata;
-		return;
-	}
-
-	// Send name
-	serial.Send(cleanfilename, nameLen);
-	if (!WACK(serial, '+', received))
-	{
-		printf("File name error: '%c'\n", received);
-		serial.Close();
-		delete [] filedata;
-		return;
-	}
-
-	uint32_t i = 0;
-	uint32_t packetOffset = 0;
-	char progress[65];
-	for (i=0; i<64; ++i)
-		progress[i] = ' ';//176;
-	progress[64] = 0;
-	printf("Uploading '%s' (packet size: %dx%d+%d bytes, packer buffer: %d bytes)\n", cleanfilename, numPackets, packetSize, leftoverBytes, worstSize);
-	for (i=0; i<numPackets; ++i)
-	{
-		const char* source = (const char*)(encoded + packetOffset);
-
-		int idx = (i*64)/numPackets;
-		for (int j=0; j<=idx; ++j) // Progress bar
-			progress[j] = '=';//219;
-		printf("\r [%s] %.2f%%\r", progress, (i*100)/float(numPackets));
-
-		if (!WACK(serial, '+', received)) // Wait for a 'go' signal
-		{
-			printf("Packet size error at %d/%d (%d): '%c'\n", i, numPackets, received, packetSize);
-			serial.Close();
-			delete [] filedata;
-			return;
-		}
-
-		serial.Send(&packetSize, 4);
-
-		if (!WACK(serial, '+', received)) // Wait for a 'go' signal
-		{
-			printf("Packet error at %d/%d (%d): '%c'\n", i, numPackets, received, packetSize);
-			serial.Close();
-			delete [] filedata;
-			return;
-		}
-
-		serial.Send((void*)source, packetSize);
-
-		packetOffset += packetSize;
-	}
-
-	if (leftoverBytes)
-	{
-		const char* source = (const char*)(encoded + packetOffset);
-
-		for (int j=0; j<64; ++j) // Progress bar
-			progress[j] = '=';//219;
-		printf("\r [%s] %.2f%%\r", progress, 100.0f);
-
-		if (!WACK(serial, '+', received)) // Wait for a 'go' signal
-		{
-			printf("Packet size error at %d/%d (%d): '%c'\n", i, numPackets, received, packetSize);
-			serial.Close();
-			delete [] filedata;
-			return;
-		}
-
-		serial.Send(&leftoverBytes, 4);
-
-		if (!WACK(serial, '+', received)) // Wait for a 'go' signal
-		{
-			printf("Packet error at %d/%d (%d): '%c'\n", i, numPackets, received, packetSize);
-			serial.Close();
-			delete [] filedata;
-			return;
-		}
-
-		serial.Send((void*)source, leftoverBytes);
-
-		packetOffset += leftoverBytes;
-	}
-
-	printf("\r\n");
-
-	delete[] encoded;
+	CSerialUploadLink<CSerialPort> link(&serial);
+	UploadFile(&link, _filename, stdout, 50);
 
 	serial.Close();
-	printf("%d bytes uploaded\n", packetOffset);
-
-	delete [] filedata;
 }
 
 void resetCPUs()
@@ -749,6 +685,7 @@ void showusage()
 	printf("riscvtool -makemem binaryfilename groupbytesize outputfilename\n  Generate a memory initialization file for FPGA from an ELF binary. This is used when building a new hardware device with an embedded ROM image\n");
 	printf("riscvtool -makebin binaryfilename groupbytesize outputfilename\n  Generate a loadable binary image from an ELF binary. It is often used to test ROM images by dropping this into the boot folder on the device\n");
 	printf("NOTE: Default device name is %s\n", devicename);
+	printf("NOTE: Use tcp:PORT or tcp:HOST:PORT as the device name to talk to an emulator started with --uart-tcp=PORT\n");
 }
 
 int main(int argc, char **argv)
@@ -44,11 +44,7 @@ int main()
 		APUStartDMA((uint32_t)apubuffer);
 
 		// Wait for the APU to finish playing back current read buffer
-		uint32_t currframe;
-		do
-		{
-			currframe = APUFrame();
-		} while (currframe == prevframe);
+		uint32_t currframe = APUWaitFrame(prevframe);
 
 		// Once we reach this point, the APU has switched to the other buffer we just filled, and playback resumes uninterrupted
 
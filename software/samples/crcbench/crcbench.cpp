@@ -0,0 +1,121 @@
+/** \file
+ * CRC throughput example
+ *
+ * \ingroup examples
+ * This example times the CRC16 variants from the SDK over SD card sized blocks in CPU cycles,
+ * first with the lookup tables in cached system memory, then with the tables in scratchpad memory.
+ * It also compares the table driven CRC7 against a bitwise one for 5 byte SD commands.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "basesystem.h"
+#include "crc.h"
+#include "uart.h"
+
+#define BLOCK_SIZE 512
+#define BLOCK_COUNT 64
+
+typedef uint16_t (*CRC16Func)(const uint8_t *data, uint32_t len);
+
+struct SCRCVariant
+{
+	const char *name;
+	CRC16Func func;
+	int usesTables;
+};
+
+static const SCRCVariant s_variants[] = {
+	{ "bitwise", CRC16Bitwise, 0 },
+	{ "bytewise", CRC16Bytewise, 0 },
+	{ "table", CRC16Table, 1 },
+	{ "slice-by-8", CRC16Slice8, 1 },
+};
+
+// What sdcard.c used for commands before the table version
+static uint8_t BitwiseCRC7(const uint8_t *data, uint32_t len)
+{
+	uint8_t crc = 0;
+	for (uint32_t i = 0; i < len; ++i)
+	{
+		uint8_t d = data[i];
+		for (uint32_t j = 0; j < 8; ++j)
+		{
+			crc <<= 1;
+			if ((d & 0x80) ^ (crc & 0x80))
+				crc ^= 0x09;
+			d <<= 1;
+		}
+	}
+	return (crc << 1) | 1;
+}
+
+static void RunVariants(const uint8_t *blocks, int withTables)
+{
+	int haveReference = 0;
+	uint16_t reference = 0;
+	for (uint32_t v = 0; v < sizeof(s_variants) / sizeof(s_variants[0]); ++v)
+	{
+		if (withTables && !s_variants[v].usesTables)
+			continue;
+
+		// Warm up the caches so only the steady state gets timed
+		uint16_t crc = s_variants[v].func(blocks, BLOCK_SIZE);
+
+		uint64_t startcycles = E32ReadCycles();
+		for (uint32_t b = 0; b < BLOCK_COUNT; ++b)
+			crc ^= s_variants[v].func(blocks + b * BLOCK_SIZE, BLOCK_SIZE);
+		uint64_t cycles = E32ReadCycles() - startcycles;
+
+		// All variants compute the same checksum
+		if (!haveReference)
+		{
+			reference = crc;
+			haveReference = 1;
+		}
+
+		uint32_t perBlock = (uint32_t)(cycles / BLOCK_COUNT);
+		UARTPrintf("%s: %d cycles/block, %d cycles/byte %s\n", s_variants[v].name, perBlock, perBlock / BLOCK_SIZE, crc == reference ? "" : "MISMATCH");
+	}
+}
+
+int main()
+{
+	uint8_t *blocks = (uint8_t*)malloc(BLOCK_SIZE * BLOCK_COUNT);
+	for (uint32_t i = 0; i < BLOCK_SIZE * BLOCK_COUNT; ++i)
+		blocks[i] = rand();
+
+	UARTPrintf("\nCRC16 over %d blocks of %d bytes\n", BLOCK_COUNT, BLOCK_SIZE);
+
+	UARTPrintf("\nTables in system memory\n");
+	CRCInitTables(0);
+	RunVariants(blocks, 0);
+
+	UARTPrintf("\nTables in scratchpad memory\n");
+	CRCInitTables((void*)E32GetScratchpad());
+	RunVariants(blocks, 1);
+
+	// Commands are 5 bytes each, the table version uses the tables in system memory again
+	uint32_t crc7a = 0, crc7b = 0;
+	uint64_t startcycles = E32ReadCycles();
+	for (uint32_t i = 0; i + 5 <= BLOCK_SIZE * BLOCK_COUNT; i += 5)
+		crc7a += BitwiseCRC7(blocks + i, 5);
+	uint64_t bitwisecycles = E32ReadCycles() - startcycles;
+
+	CRCInitTables(0);
+	startcycles = E32ReadCycles();
+	for (uint32_t i = 0; i + 5 <= BLOCK_SIZE * BLOCK_COUNT; i += 5)
+		crc7b += CRC7(blocks + i, 5);
+	uint64_t tablecycles = E32ReadCycles() - startcycles;
+
+	uint32_t commandCount = (BLOCK_SIZE * BLOCK_COUNT) / 5;
+	UARTPrintf("\nCRC7 over %d commands\n", commandCount);
+	UARTPrintf("%s: %d cycles/command\n", "bitwise", (uint32_t)(bitwisecycles / commandCount));
+	UARTPrintf("%s: %d cycles/command %s\n", "table", (uint32_t)(tablecycles / commandCount), crc7a == crc7b ? "" : "MISMATCH");
+
+	free(blocks);
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+/** \file
+ * HART to HART latency example
+ *
+ * \ingroup examples
+ * This example adds an echo task to HART#1 and times round trips from HART#0 to it and back in CPU cycles.
+ * The first test bounces a value through a single atomic slot of the mailbox, the next ones go through a
+ * pair of SPSC and then MPMC message queues in mailbox memory.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "basesystem.h"
+#include "task.h"
+#include "uart.h"
+#include "mailbox.h"
+#include "msgqueue.h"
+
+#define STACK_WORDS 1024
+#define ROUND_TRIPS 1000
+#define QUEUE_CAPACITY 16
+#define QUEUE_STRIDE 256
+
+// Atomic slots used by this sample
+#define SLOT_MODE (ATOMIC_SLOT_USER_FIRST + 0)
+#define SLOT_FLAG (ATOMIC_SLOT_USER_FIRST + 1)
+#define SLOT_PING_TICKETS (ATOMIC_SLOT_USER_FIRST + 2)
+#define SLOT_PONG_TICKETS (ATOMIC_SLOT_USER_FIRST + 4)
+
+#define MODE_IDLE 0
+#define MODE_FLAG 1
+#define MODE_QUEUES 2
+
+#define STOP_MESSAGE 0xFFFFFFFF
+
+// Queues sit at fixed places in mailbox memory so both HARTs can find them without sharing cached variables
+static struct SMessageQueue *QueueAt(uint32_t index)
+{
+	return (struct SMessageQueue *)(MAILBOX_USER_MEMORY + index * QUEUE_STRIDE);
+}
+
+void EchoTask()
+{
+	while(1)
+	{
+		uint32_t mode = AtomicLoad(SLOT_MODE);
+		if (mode == MODE_FLAG)
+		{
+			// Odd values come from HART#0, answer with the next even one
+			uint32_t value = AtomicLoad(SLOT_FLAG);
+			if (value & 1)
+				AtomicStore(SLOT_FLAG, value + 1);
+		}
+		else if (mode == MODE_QUEUES)
+		{
+			uint32_t message = MQPop(QueueAt(0));
+			if (message == STOP_MESSAGE)
+				AtomicStore(SLOT_MODE, MODE_IDLE);
+			else
+				MQPush(QueueAt(1), message);
+		}
+	}
+}
+
+struct SLatency
+{
+	uint32_t minCycles;
+	uint32_t maxCycles;
+	uint64_t totalCycles;
+};
+
+static void AddSample(SLatency &latency, uint32_t cycles)
+{
+	latency.minCycles = cycles < latency.minCycles ? cycles : latency.minCycles;
+	latency.maxCycles = cycles > latency.maxCycles ? cycles : latency.maxCycles;
+	latency.totalCycles += cycles;
+}
+
+static void Report(const char *name, const SLatency &latency)
+{
+	UARTPrintf("%s: min %d avg %d max %d cycles/round trip\n", name, latency.minCycles, (uint32_t)(latency.totalCycles / ROUND_TRIPS), latency.maxCycles);
+}
+
+static void FlagPingPong()
+{
+	SLatency latency = { 0xFFFFFFFF, 0, 0 };
+
+	AtomicStore(SLOT_FLAG, 0);
+	AtomicStore(SLOT_MODE, MODE_FLAG);
+	for (uint32_t i = 0; i < ROUND_TRIPS; ++i)
+	{
+		uint32_t ping = 2*i + 1;
+		uint64_t startcycles = E32ReadCycles();
+		AtomicStore(SLOT_FLAG, ping);
+		while (AtomicLoad(SLOT_FLAG) != ping + 1) { }
+		AddSample(latency, (uint32_t)(E32ReadCycles() - startcycles));
+	}
+	AtomicStore(SLOT_MODE, MODE_IDLE);
+
+	Report("atomic slot", latency);
+}
+
+static void QueuePingPong(const char *name, enum EMessageQueueType type)
+{
+	SLatency latency = { 0xFFFFFFFF, 0, 0 };
+
+	struct SMessageQueue *ping = MQCreate(QueueAt(0), type, QUEUE_CAPACITY, SLOT_PING_TICKETS);
+	struct SMessageQueue *pong = MQCreate(QueueAt(1), type, QUEUE_CAPACITY, SLOT_PONG_TICKETS);
+
+	AtomicStore(SLOT_MODE, MODE_QUEUES);
+	uint32_t errors = 0;
+	for (uint32_t i = 0; i < ROUND_TRIPS; ++i)
+	{
+		uint64_t startcycles = E32ReadCycles();
+		MQPush(ping, i);
+		uint32_t message = MQPop(pong);
+		AddSample(latency, (uint32_t)(E32ReadCycles() - startcycles));
+		errors += message != i ? 1 : 0;
+	}
+
+	// The echo task drops back to idle once it sees this
+	MQPush(ping, STOP_MESSAGE);
+	while (AtomicLoad(SLOT_MODE) != MODE_IDLE) { }
+
+	Report(name, latency);
+	if (errors)
+		UARTPrintf("%s: %d messages came back wrong\n", name, errors);
+}
+
+int main()
+{
+	AtomicStore(SLOT_MODE, MODE_IDLE);
+
+	struct STaskContext *taskctx1 = TaskGetContext(1);
+
+	// Stack grows down from the end of the allocation
+	uint32_t *echoStack = new uint32_t[STACK_WORDS];
+	int echoID = TaskAdd(taskctx1, "echo", EchoTask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, (uint32_t)&echoStack[STACK_WORDS-4]);
+	if (echoID == 0)
+	{
+		printf("Error: No room to add new task on CPU 1\n");
+		return -1;
+	}
+
+	UARTPrintf("\nCPU 0 to CPU 1 and back, %d round trips each\n", ROUND_TRIPS);
+
+	FlagPingPong();
+	QueuePingPong("SPSC queue", MQ_SPSC);
+	QueuePingPong("MPMC queue", MQ_MPMC);
+
+	TaskExitTaskWithID(taskctx1, echoID, 0);
+
+	return 0;
+}
@@ -0,0 +1,136 @@
+// Stands in for the UART, serial input ring buffer and wall clock of the SDK so that
+// recv.cpp can be built for the host and talk to riscvtool through linkrelay.py
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "basesystem.h"
+#include "uart.h"
+#include "serialinringbuffer.h"
+
+// Device side holds the 2K hardware FIFO and the 1K serial input ring buffer,
+// anything arriving while both are full is lost just like on the board
+#define LINK_INPUT_CAPACITY 3072
+
+static int s_socket = -1;
+static std::mutex s_inputLock;
+static std::deque<uint8_t> s_input;
+static uint64_t s_dropped = 0;
+
+uint64_t E32ReadTime()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() / 100;
+}
+
+void E32Sleep(uint64_t ticks)
+{
+	std::this_thread::sleep_for(std::chrono::nanoseconds(ticks * 100));
+}
+
+static void ReceiveThread()
+{
+	uint8_t buffer[64];
+	while (1)
+	{
+		int received = recv(s_socket, buffer, sizeof(buffer), 0);
+		if (received <= 0)
+			return;
+
+		std::lock_guard<std::mutex> lock(s_inputLock);
+		for (int i = 0; i < received; ++i)
+		{
+			if (s_input.size() < LINK_INPUT_CAPACITY)
+				s_input.push_back(buffer[i]);
+			else
+				++s_dropped;
+		}
+	}
+}
+
+// recv.cpp calls this first, connect to the device end of the relay here
+void UARTInterceptSetState(int state)
+{
+	const char* port = getenv("DEVPORT");
+	if (!port)
+	{
+		fprintf(stderr, "Set DEVPORT to the device port of linkrelay.py\n");
+		exit(1);
+	}
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(port));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	while (1)
+	{
+		s_socket = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(s_socket, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+			break;
+		close(s_socket);
+		usleep(10000);
+	}
+
+	int nodelay = 1;
+	setsockopt(s_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	// riscvtool types the command to start us, which the command line would have eaten
+	const char* command = "recv\n";
+	int matched = 0;
+	uint8_t c;
+	while (command[matched] && recv(s_socket, &c, 1, 0) == 1)
+		matched = c == (uint8_t)command[matched] ? matched + 1 : 0;
+
+	std::thread(ReceiveThread).detach();
+}
+
+void UARTSendBlock(uint8_t *data, uint32_t numBytes)
+{
+	send(s_socket, data, numBytes, MSG_NOSIGNAL);
+}
+
+uint32_t SerialInRingBufferCount()
+{
+	std::lock_guard<std::mutex> lock(s_inputLock);
+	return (uint32_t)s_input.size();
+}
+
+uint32_t SerialInRingBufferRead(void* pvDest, const uint32_t cbDest)
+{
+	// Like the SDK ring buffer, reads either get all the bytes asked for or none
+	std::lock_guard<std::mutex> lock(s_inputLock);
+	if (s_input.size() < cbDest)
+		return 0;
+
+	for (uint32_t i = 0; i < cbDest; ++i)
+	{
+		((uint8_t*)pvDest)[i] = s_input.front();
+		s_input.pop_front();
+	}
+	return cbDest;
+}
+
+// Let the last reply drain through the relay before the socket goes away
+static struct SLinkShutdown
+{
+	~SLinkShutdown()
+	{
+		if (s_socket >= 0)
+		{
+			shutdown(s_socket, SHUT_WR);
+			usleep(300000);
+		}
+		if (s_dropped)
+			fprintf(stderr, "Input overflowed, %llu bytes dropped\n", (unsigned long long)s_dropped);
+	}
+} s_linkShutdown;
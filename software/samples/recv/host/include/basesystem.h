@@ -0,0 +1,15 @@
+#pragma once
+
+// Host stand-in for SDK/basesystem.h, the wall clock keeps the device's 10MHz tick rate
+
+#include <stdint.h>
+
+#define ONE_SECOND_IN_TICKS						10000000
+#define HALF_SECOND_IN_TICKS					5000000
+#define TWO_HUNDRED_FIFTY_MILLISECONDS_IN_TICKS	2500000
+#define HUNDRED_MILLISECONDS_IN_TICKS			1000000
+#define TEN_MILLISECONDS_IN_TICKS				100000
+#define ONE_MILLISECOND_IN_TICKS				10000
+
+uint64_t E32ReadTime();
+void E32Sleep(uint64_t ticks);
@@ -0,0 +1,3 @@
+#pragma once
+
+// Nothing from this SDK header is used by recv.cpp on the host
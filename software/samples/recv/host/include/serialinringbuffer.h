@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for SDK/serialinringbuffer.h, see hostlink.cpp
+
+#include <stdint.h>
+
+uint32_t SerialInRingBufferRead(void* pvDest, const uint32_t cbDest);
+uint32_t SerialInRingBufferCount();
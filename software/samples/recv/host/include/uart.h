@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for SDK/uart.h, see hostlink.cpp
+
+#include <stdint.h>
+
+void UARTInterceptSetState(int state);
+void UARTSendBlock(uint8_t *data, uint32_t numBytes);
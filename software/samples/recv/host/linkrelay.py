@@ -0,0 +1,81 @@
+# Sits between riscvtool and the host build of recv, and passes bytes both ways
+# at the 460800 baud of the board's UART with the given latency on top.
+# Bytes going to the device can be damaged on purpose to exercise resends.
+#
+# usage: linkrelay.py <hostport> <deviceport> <latency_ms> [error_rate_per_byte]
+
+import collections
+import random
+import socket
+import sys
+import threading
+import time
+
+BYTES_PER_SECOND = 46080.0
+PIECE_SIZE = 64
+
+hostport, deviceport = int(sys.argv[1]), int(sys.argv[2])
+latency = float(sys.argv[3]) / 1000.0
+errorrate = float(sys.argv[4]) if len(sys.argv) > 4 else 0.0
+
+def listen(port):
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(('127.0.0.1', port))
+    s.listen(1)
+    return s
+
+def forward(src, dst, damage):
+    queue = collections.deque()
+    signal = threading.Condition()
+
+    def reader():
+        while True:
+            data = src.recv(4096)
+            with signal:
+                queue.append((time.monotonic(), data) if data else None)
+                signal.notify()
+            if not data:
+                return
+
+    threading.Thread(target=reader, daemon=True).start()
+
+    # Bytes leave one after the other, never before they arrived plus the latency
+    wirefree = 0.0
+    while True:
+        with signal:
+            while not queue:
+                signal.wait()
+            item = queue.popleft()
+        if item is None:
+            dst.shutdown(socket.SHUT_WR)
+            return
+        arrival, data = item
+        for i in range(0, len(data), PIECE_SIZE):
+            piece = bytearray(data[i:i + PIECE_SIZE])
+            if damage and errorrate:
+                for k in range(len(piece)):
+                    if random.random() < errorrate:
+                        piece[k] ^= 0x5A
+            done = max(arrival + latency, wirefree) + len(piece) / BYTES_PER_SECOND
+            wait = done - time.monotonic()
+            if wait > 0:
+                time.sleep(wait)
+            wirefree = done
+            try:
+                dst.sendall(piece)
+            except OSError:
+                return
+
+hostlisten, devicelisten = listen(hostport), listen(deviceport)
+device, _ = devicelisten.accept()
+host, _ = hostlisten.accept()
+for c in (device, host):
+    c.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+tohost = threading.Thread(target=forward, args=(device, host, False), daemon=True)
+todevice = threading.Thread(target=forward, args=(host, device, True), daemon=True)
+tohost.start()
+todevice.start()
+todevice.join(timeout=600)
+tohost.join(timeout=5)
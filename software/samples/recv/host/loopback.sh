@@ -0,0 +1,36 @@
+#!/bin/bash
+# Sends a file to the host build of recv through linkrelay.py and checks that it arrived intact
+#
+# usage: ./loopback.sh <file> [latency_ms] [error_rate_per_byte]
+# Run 'make' first, the received copy ends up in the received/ directory
+
+set -e
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+FILE="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+LATENCY=${2:-4}
+ERRORRATE=${3:-0}
+HOSTPORT=$((6000 + RANDOM % 1000))
+DEVICEPORT=$((HOSTPORT + 1))
+
+# Whatever an interrupted run left in received/ gets picked up again, delete it to start over
+mkdir -p "$HERE/received"
+
+python3 "$HERE/linkrelay.py" $HOSTPORT $DEVICEPORT $LATENCY $ERRORRATE &
+RELAY=$!
+trap 'kill $RELAY 2>/dev/null || true' EXIT
+sleep 0.3
+
+(cd "$HERE/received" && DEVPORT=$DEVICEPORT "$HERE/recvhost" > recv.log 2>&1) &
+DEVICE=$!
+
+START=$(date +%s%N)
+"$HERE/riscvtool" -sendfile tcp:$HOSTPORT "$FILE"
+wait $DEVICE
+END=$(date +%s%N)
+
+cat "$HERE/received/recv.log"
+MS=$(( (END - START) / 1000000 ))
+BYTES=$(stat -c %s "$FILE")
+echo "Took $MS ms for $BYTES bytes ($(( BYTES * 1000 / (MS > 0 ? MS : 1) )) bytes/s)"
+cmp "$FILE" "$HERE/received/$(basename "$FILE")" && echo "Received file is identical"
@@ -2,6 +2,10 @@
  * File reception utility for TinyOS
  * \ingroup TinyOS
  * This command should be placed in sys/bin and will be initiated remotely to kick off a file transfer.
+ * See upload.h for the protocol. Packets are accepted in any order within the window, and each block is
+ * decompressed and written out as soon as it's complete while the next packets keep arriving.
+ * An upload that stops half way leaves the blocks written so far behind, and sending the same file again
+ * picks up from there.
  */
 
 #include "basesystem.h"
@@ -12,160 +16,394 @@
 #include "encoding.h"
 #include "mini-printf.h"
 #include "serialinringbuffer.h"
+#include "crc.h"
+#include "upload.h"
 #include "lz4.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 
-int main()
-{
-	// Disable OS UART interrupt handling
-	UARTInterceptSetState(1);
+// Sender went away if it's this quiet
+#define IDLE_TIMEOUT (5*ONE_SECOND_IN_TICKS)
+// A packet that started arriving has to be complete by then
+#define PACKET_TIMEOUT TWO_HUNDRED_FIFTY_MILLISECONDS_IN_TICKS
 
-	// NOTE: We have to be absolutely still with the UART chatter as the other side will not tolerate any noise other than ACK/NACK
-	const char* NACK = "!";
-	const char* ACK = "+";
+#define DICTIONARY_SIZE 65536
+#define DECODE_RING_SIZE LZ4_DECODER_RING_BUFFER_SIZE(UPLOAD_BLOCK_SIZE)
+#define MAX_BLOCK_SIZE (4 + LZ4_COMPRESSBOUND(UPLOAD_BLOCK_SIZE))
 
-	// Emulator can still receive files over net/UART proxy
-	/*uint32_t isEmulator = read_csr(0xF12) & 0x80000000 ? 0 : 1; // CSR_MARCHID is 0x80000000 for read hardware, 0x00000000 for emulator
-	if (isEmulator)
-	{
-		UARTPrintf("! Emulator detected, cannot receive files\n");
-		return 0;
-	}*/
+static const char* s_partFileName = "upload.part";
+static const char* s_tempFileName = "downloaded.bin";
 
-	// Wait for UART chatter to finish
-	E32Sleep(HUNDRED_MILLISECONDS_IN_TICKS);
+// Turns the payload back into the file one block at a time
+struct SUploadStream
+{
+	LZ4_streamDecode_t decoder;
+	uint8_t decodeRing[DECODE_RING_SIZE];	// Decoded blocks, keeps the last 64K around for the next block to refer to
+	uint32_t ringPos;
+	uint8_t block[MAX_BLOCK_SIZE];			// Size prefix and compressed data of the block being received
+	uint32_t blockFill;
+	uint32_t skipBytes;						// Bytes before the resume point in the first packet
+	uint32_t encodedPos;					// Payload bytes consumed
+	uint32_t crc;							// CRC32 of the payload bytes consumed
+	uint32_t decodedPos;					// File bytes written
+	uint32_t status;
+	uint32_t finished;						// Trailer arrived
+	FILE* fp;
 
-	// At startup, acknowledge the sender so that it can start sending the file header
-	UARTSendBlock((uint8_t*)ACK, 1);
+	// State as of the end of the last complete block, which is where a resumed upload starts
+	uint32_t blockEncodedPos;
+	uint32_t blockCRC;
+};
 
-	// Grab the encoded size
-	uint32_t encodedLen = 0;
-	for (uint32_t i=0;i<4;)
-	{
-		uint8_t byte;
-		if (SerialInRingBufferRead(&byte, 1))
-		{
-			encodedLen |= (byte << (i*8));
-			++i;
-		}
-	}
-	UARTSendBlock((uint8_t*)ACK, 1);
+// Kept in upload.part when an upload stops half way
+struct SUploadResumePoint
+{
+	struct SUploadHeader header;
+	uint32_t encodedPos;
+	uint32_t crc;
+	uint32_t decodedPos;
+};
+
+static void Reply(const uint8_t _type, const uint32_t _value)
+{
+	uint8_t reply[UPLOAD_REPLY_SIZE] = { _type, (uint8_t)_value, (uint8_t)(_value >> 8), (uint8_t)(_value >> 16), (uint8_t)(_value >> 24) };
+	UARTSendBlock(reply, UPLOAD_REPLY_SIZE);
+}
 
-	// Grab the file size size
-	uint32_t decodedLen = 0;
-	for (uint32_t i=0;i<4;)
+// Reads _count bytes of serial input, gives up once nothing arrived for _timeout ticks
+static bool ReadSerial(void* _target, uint32_t _count, const uint64_t _timeout)
+{
+	uint8_t* target = (uint8_t*)_target;
+	uint64_t lastArrival = E32ReadTime();
+	while (_count)
 	{
-		uint8_t byte;
-		if (SerialInRingBufferRead(&byte, 1))
+		uint32_t available = SerialInRingBufferCount();
+		if (available)
 		{
-			decodedLen |= (byte << (i*8));
-			++i;
+			uint32_t chunk = available < _count ? available : _count;
+			SerialInRingBufferRead(target, chunk);
+			target += chunk;
+			_count -= chunk;
+			lastArrival = E32ReadTime();
 		}
+		else if (E32ReadTime() - lastArrival > _timeout)
+			return false;
 	}
-	UARTSendBlock((uint8_t*)ACK, 1);
+	return true;
+}
 
-	// Grab the file name length
-	uint32_t fileNameLen = 0;
-	for (uint32_t i=0;i<4;)
+// Drops serial input until the sender has been quiet for a while
+static void DrainSerial()
+{
+	uint8_t drain[64];
+	while (ReadSerial(drain, 1, TEN_MILLISECONDS_IN_TICKS))
+		SerialInRingBufferRead(drain, SerialInRingBufferCount() < sizeof(drain) ? SerialInRingBufferCount() : sizeof(drain));
+}
+
+// Waits for an intact header, asking for it again when it's damaged
+static bool ReceiveHeader(struct SUploadHeader& _header)
+{
+	do
 	{
-		uint8_t byte;
-		if (SerialInRingBufferRead(&byte, 1))
-		{
-			fileNameLen |= (byte << (i*8));
-			++i;
-		}
-	}
+		if (!ReadSerial(&_header, 1, IDLE_TIMEOUT))
+			return false;
+		if (ReadSerial(((uint8_t*)&_header) + 1, sizeof(_header) - 1, PACKET_TIMEOUT) &&
+			CRC32(0, (const uint8_t*)&_header, offsetof(struct SUploadHeader, headerCRC)) == _header.headerCRC)
+			return true;
+
+		DrainSerial();
+		Reply(UPLOAD_NAK, UPLOAD_HEADER_INDEX);
+	} while (1);
+}
 
-	if (fileNameLen > 63)
+// Decompresses the block in the stream buffer and writes it out
+static void DecodeBlock(struct SUploadStream& _stream)
+{
+	uint32_t blockLen;
+	memcpy(&blockLen, _stream.block, 4);
+
+	// Blocks go next to each other until the ring can't take a whole one
+	if (DECODE_RING_SIZE - _stream.ringPos < UPLOAD_BLOCK_SIZE)
+		_stream.ringPos = 0;
+
+	char* target = (char*)_stream.decodeRing + _stream.ringPos;
+	int decoded = LZ4_decompress_safe_continue(&_stream.decoder, (const char*)_stream.block + 4, target, blockLen, UPLOAD_BLOCK_SIZE);
+	if (decoded < 0)
 	{
-		// Respond to the sender with an error code as the file name is too long
-		UARTSendBlock((uint8_t*)NACK, 1);
-		return 0;
+		_stream.status = UPLOAD_STATUS_UNPACK;
+		return;
 	}
-	else
-		UARTSendBlock((uint8_t*)ACK, 1);
 
-	// Grab the file name
-	char fileName[96];
-	for (uint32_t i=0;i<fileNameLen;)
+	if (fwrite(target, 1, decoded, _stream.fp) != (size_t)decoded)
 	{
-		if (SerialInRingBufferRead(&fileName[i], 1))
-			++i;
+		_stream.status = UPLOAD_STATUS_WRITE;
+		return;
 	}
-	// Null-terminate the file name
-	fileName[fileNameLen] = 0;
 
-	// Send ready to receive file
-	UARTSendBlock((uint8_t*)ACK, 1);
+	_stream.ringPos += decoded;
+	_stream.decodedPos += decoded;
+	_stream.blockEncodedPos = _stream.encodedPos;
+	_stream.blockCRC = _stream.crc;
+}
 
-	uint8_t* sourceBuffer = new uint8_t[encodedLen+64];
+// Takes the next piece of the payload in order
+static void StreamPayload(struct SUploadStream& _stream, const uint8_t* _data, uint32_t _len)
+{
+	uint32_t skip = _stream.skipBytes < _len ? _stream.skipBytes : _len;
+	_data += skip;
+	_len -= skip;
+	_stream.skipBytes -= skip;
 
-	uint32_t bytesReceived = 0;
-	do
+	// Whatever follows the trailer is padding
+	while (_len && _stream.status == 0 && !_stream.finished)
 	{
-		// Let the sender know we're ready for the packet size
-		UARTSendBlock((uint8_t*)ACK, 1);
-
-		// Receive packet size
-		uint32_t packetLen = 0;
-		for (uint32_t i=0;i<4;)
+		// Size prefix first, then as much of the block as it says, or the payload CRC32 after a zero size
+		uint32_t needed = 4;
+		bool trailer = false;
+		if (_stream.blockFill >= 4)
 		{
-			uint8_t byte;
-			if (SerialInRingBufferRead(&byte, 1))
+			uint32_t blockLen;
+			memcpy(&blockLen, _stream.block, 4);
+			if (blockLen > MAX_BLOCK_SIZE - 4)
 			{
-				packetLen |= (byte << (i*8));
-				++i;
+				_stream.status = UPLOAD_STATUS_UNPACK;
+				return;
 			}
+			trailer = blockLen == 0;
+			needed = trailer ? 8 : 4 + blockLen;
 		}
 
-		// Let the sender know we're ready for the packet data
-		UARTSendBlock((uint8_t*)ACK, 1);
+		uint32_t chunk = needed - _stream.blockFill < _len ? needed - _stream.blockFill : _len;
+		memcpy(_stream.block + _stream.blockFill, _data, chunk);
+		if (!trailer)
+			_stream.crc = CRC32(_stream.crc, _data, chunk);
+		_stream.blockFill += chunk;
+		_stream.encodedPos += chunk;
+		_data += chunk;
+		_len -= chunk;
 
-		// Receive encoded bytes
-		for (uint32_t j=0; j<packetLen;)
+		if (_stream.blockFill == needed && needed > 4)
 		{
-			uint8_t byte;
-			if (SerialInRingBufferRead(&byte, 1))
+			if (trailer)
 			{
-				sourceBuffer[bytesReceived+j] = byte;
-				++j;
+				uint32_t payloadCRC;
+				memcpy(&payloadCRC, _stream.block + 4, 4);
+				if (payloadCRC != _stream.crc)
+					_stream.status = UPLOAD_STATUS_BAD_PAYLOAD;
+				_stream.finished = 1;
 			}
+			else
+				DecodeBlock(_stream);
+			_stream.blockFill = 0;
 		}
+	}
+}
+
+// Picks up where an earlier upload of the same file left off, returns the first packet still needed
+static uint32_t ResumeUpload(const struct SUploadHeader& _header, struct SUploadStream& _stream)
+{
+	struct SUploadResumePoint resume;
+	FILE* part = fopen(s_partFileName, "rb");
+	if (!part)
+		return 0;
+	bool valid = fread(&resume, 1, sizeof(resume), part) == sizeof(resume) &&
+		memcmp(&resume.header, &_header, sizeof(_header)) == 0 && resume.decodedPos <= _header.decodedLen;
+	fclose(part);
+	if (!valid)
+		return 0;
+
+	// The partial file has to be exactly as long as the blocks written before
+	_stream.fp = fopen(s_tempFileName, "r+b");
+	if (!_stream.fp)
+		return 0;
+	fseek(_stream.fp, 0, SEEK_END);
+	if ((uint32_t)ftell(_stream.fp) != resume.decodedPos)
+	{
+		fclose(_stream.fp);
+		_stream.fp = nullptr;
+		return 0;
+	}
+
+	// Bring back the window the next block may refer to
+	uint32_t dictSize = resume.decodedPos < DICTIONARY_SIZE ? resume.decodedPos : DICTIONARY_SIZE;
+	fseek(_stream.fp, resume.decodedPos - dictSize, SEEK_SET);
+	if (fread(_stream.decodeRing, 1, dictSize, _stream.fp) != dictSize)
+	{
+		fclose(_stream.fp);
+		_stream.fp = nullptr;
+		return 0;
+	}
+	fseek(_stream.fp, 0, SEEK_END);
+	LZ4_setStreamDecode(&_stream.decoder, (const char*)_stream.decodeRing, dictSize);
+
+	_stream.ringPos = dictSize;
+	_stream.encodedPos = _stream.blockEncodedPos = resume.encodedPos;
+	_stream.crc = _stream.blockCRC = resume.crc;
+	_stream.decodedPos = resume.decodedPos;
+	_stream.skipBytes = resume.encodedPos % UPLOAD_PACKET_SIZE;
+	return resume.encodedPos / UPLOAD_PACKET_SIZE;
+}
+
+// Keeps what was written up to the last complete block
+static void SaveResumePoint(const struct SUploadHeader& _header, const struct SUploadStream& _stream)
+{
+	if (_stream.blockEncodedPos == 0)
+		return;
+
+	struct SUploadResumePoint resume;
+	resume.header = _header;
+	resume.encodedPos = _stream.blockEncodedPos;
+	resume.crc = _stream.blockCRC;
+	resume.decodedPos = _stream.decodedPos;
+
+	FILE* part = fopen(s_partFileName, "wb");
+	if (!part)
+		return;
+	fwrite(&resume, 1, sizeof(resume), part);
+	fclose(part);
+}
+
+int main()
+{
+	// Disable OS UART interrupt handling
+	UARTInterceptSetState(1);
+
+	// NOTE: We have to be absolutely still with the UART chatter as the other side will not tolerate any noise other than replies
 
-		bytesReceived += packetLen;
+	// Wait for UART chatter to finish
+	E32Sleep(HUNDRED_MILLISECONDS_IN_TICKS);
+
+	// At startup, acknowledge the sender so that it can start sending the file header
+	UARTSendBlock((uint8_t*)"+", 1);
+
+	struct SUploadHeader header;
+	if (!ReceiveHeader(header))
+		return 0;
+
+	if (header.magic != UPLOAD_MAGIC || header.version != UPLOAD_VERSION || header.nameLen >= UPLOAD_MAX_NAME)
+	{
+		Reply(UPLOAD_ERROR, UPLOAD_STATUS_BAD_HEADER);
+		return 0;
+	}
+	header.name[header.nameLen] = 0;
+
+	// Same amount of memory whatever the file size
+	struct SUploadStream* stream = new struct SUploadStream;
+	if (!stream)
+	{
+		Reply(UPLOAD_ERROR, UPLOAD_STATUS_NO_MEMORY);
+		return 0;
 	}
-	while(bytesReceived < encodedLen);
+	memset(stream, 0, sizeof(struct SUploadStream));
+	LZ4_setStreamDecode(&stream->decoder, nullptr, 0);
 
-	uint8_t* targetBuffer = new uint8_t[decodedLen+512];
-	int unpacked = LZ4_decompress_safe((const char*)sourceBuffer, (char*)targetBuffer, bytesReceived, decodedLen+512);
-	if (unpacked > 0)
+	// Tell the sender where to start
+	uint32_t nextPacket = ResumeUpload(header, *stream);
+	if (!stream->fp)
+		stream->fp = fopen(s_tempFileName, "wb");
+	if (!stream->fp)
 	{
-		// Dump the new data to a temp file
-		FILE *fp = fopen("downloaded.bin", "wb");
-		if (fp)
+		Reply(UPLOAD_ERROR, UPLOAD_STATUS_WRITE);
+		printf("! ERROR: can't create file %s\n", s_tempFileName);
+		delete stream;
+		return 0;
+	}
+	Reply(UPLOAD_RESUME, nextPacket);
+
+	// Packets that arrived ahead of a missing one wait here, the sender never goes further than a window ahead
+	uint8_t window[UPLOAD_WINDOW][UPLOAD_PACKET_SIZE];
+	uint8_t windowValid[UPLOAD_WINDOW] = {};
+
+	uint8_t packet[UPLOAD_PACKET_SIZE + 4];
+	while (!stream->finished && stream->status == 0)
+	{
+		uint8_t sync;
+		if (!ReadSerial(&sync, 1, IDLE_TIMEOUT))
+		{
+			// Sender is gone, keep what we have for next time
+			fclose(stream->fp);
+			SaveResumePoint(header, *stream);
+			printf("! ERROR: upload of %s stopped at packet %d (%d/%d bytes written)\n", header.name, (int)nextPacket, (int)stream->decodedPos, (int)header.decodedLen);
+			delete stream;
+			return 0;
+		}
+
+		// Anything else is the remains of a damaged packet, skip to the next one
+		if (sync != UPLOAD_SYNC)
+			continue;
+
+		uint32_t index;
+		if (!ReadSerial(&index, 4, PACKET_TIMEOUT) || index >= nextPacket + UPLOAD_WINDOW)
+			continue;
+
+		uint32_t checksum;
+		if (!ReadSerial(packet, UPLOAD_PACKET_SIZE + 4, PACKET_TIMEOUT))
+		{
+			Reply(UPLOAD_NAK, index);
+			continue;
+		}
+		memcpy(&checksum, packet + UPLOAD_PACKET_SIZE, 4);
+		if (CRC32(CRC32(0, (const uint8_t*)&index, 4), packet, UPLOAD_PACKET_SIZE) != checksum)
+		{
+			Reply(UPLOAD_NAK, index);
+			continue;
+		}
+
+		// Repeats of a packet whose ACK got lost are answered again but not stored twice
+		uint32_t slot = index % UPLOAD_WINDOW;
+		if (index >= nextPacket && !windowValid[slot])
 		{
-			/*uint32_t written =*/ (uint32_t)fwrite(targetBuffer, 1, decodedLen, fp);
-			fclose(fp);
+			memcpy(window[slot], packet, UPLOAD_PACKET_SIZE);
+			windowValid[slot] = 1;
+		}
 
-			// Remove the file if it already exits
-			remove(fileName);
+		// Answer before decoding so the next packets are already on their way while the block is written out
+		Reply(UPLOAD_ACK, index);
 
-			// Rename the temp file to the original file name
-			rename("downloaded.bin", fileName);
+		while (windowValid[nextPacket % UPLOAD_WINDOW])
+		{
+			slot = nextPacket % UPLOAD_WINDOW;
+			StreamPayload(*stream, window[slot], UPLOAD_PACKET_SIZE);
+			windowValid[slot] = 0;
+			++nextPacket;
 		}
-		else
-			printf("! ERROR: can't create file %s\n", fileName);
 	}
-	else
+
+	fclose(stream->fp);
+	remove(s_partFileName);
+
+	uint32_t status = stream->status;
+	if (status == 0 && stream->decodedPos != header.decodedLen)
+		status = UPLOAD_STATUS_UNPACK;
+
+	if (status == 0)
 	{
-		printf("! ERROR: decompression failed (received:%d, unpacked:%d, originalpacked:%d, originalunpacked:%d)\n", (int)bytesReceived, (int)unpacked, (int)encodedLen, (int)decodedLen);
+		// Remove the file if it already exits
+		remove(header.name);
+
+		// Rename the temp file to the original file name
+		rename(s_tempFileName, header.name);
 	}
+	else
+		remove(s_tempFileName);
+
+	// The sender is waiting for this before it lets go of the UART
+	if (status)
+		Reply(UPLOAD_ERROR, status);
+	else
+		Reply(UPLOAD_DONE, 0);
+
+	if (status == UPLOAD_STATUS_BAD_PAYLOAD)
+		printf("! ERROR: payload checksum mismatch for %s\n", header.name);
+	else if (status == UPLOAD_STATUS_UNPACK)
+		printf("! ERROR: decompression failed (received:%d, unpacked:%d, originalunpacked:%d)\n", (int)stream->encodedPos, (int)stream->decodedPos, (int)header.decodedLen);
+	else if (status)
+		printf("! ERROR: can't write file %s\n", s_tempFileName);
 
-	delete [] sourceBuffer;
-	delete [] targetBuffer;
+	delete stream;
 
-    return 0;
+	return 0;
 }
@@ -0,0 +1,96 @@
+/** \file
+ * SD card throughput example
+ *
+ * \ingroup examples
+ * This example compares reading and writing a run of sectors one command per sector
+ * against a single multiple block command for the whole run.
+ * The sectors are written back with the data just read from them, so the card contents don't change.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "basesystem.h"
+#include "sdcard.h"
+#include "uart.h"
+
+// 256 Kbytes from a spot well inside the data area of the card
+#define BENCH_SECTOR 65536
+#define BENCH_SECTOR_COUNT 512
+
+static uint32_t KBytesPerSec(uint32_t deltams)
+{
+	return deltams ? (BENCH_SECTOR_COUNT / 2) * 1000 / deltams : 0;
+}
+
+int main()
+{
+	uint8_t *original = (uint8_t*)malloc(BENCH_SECTOR_COUNT * 512);
+	uint8_t *verify = (uint8_t*)malloc(BENCH_SECTOR_COUNT * 512);
+	uint8_t checksum[2];
+
+	UARTPrintf("\nSD card throughput, %d sectors from sector %d\n", BENCH_SECTOR_COUNT, BENCH_SECTOR);
+
+	// Single block reads
+	uint64_t startclock = E32ReadTime();
+	for (uint32_t i = 0; i < BENCH_SECTOR_COUNT; ++i)
+	{
+		if (SDReadSingleBlock(BENCH_SECTOR + i, original + i * 512, checksum) != SD_START_TOKEN)
+		{
+			UARTPrintf("Single block read failed at sector %d\n", BENCH_SECTOR + i);
+			return -1;
+		}
+	}
+	uint32_t deltams = ClockToMs(E32ReadTime() - startclock);
+	UARTPrintf("CMD17 read:  %d ms, %d Kbytes/sec\n", deltams, KBytesPerSec(deltams));
+
+	// Multiple block read
+	startclock = E32ReadTime();
+	if (SDReadMultipleBlocks(verify, BENCH_SECTOR_COUNT, BENCH_SECTOR) != 0)
+	{
+		UARTPrintf("Multiple block read failed\n");
+		return -1;
+	}
+	deltams = ClockToMs(E32ReadTime() - startclock);
+	UARTPrintf("CMD18 read:  %d ms, %d Kbytes/sec\n", deltams, KBytesPerSec(deltams));
+
+	if (memcmp(original, verify, BENCH_SECTOR_COUNT * 512) != 0)
+	{
+		UARTPrintf("Multiple block read returned different data\n");
+		return -1;
+	}
+
+	// Single block writes
+	startclock = E32ReadTime();
+	for (uint32_t i = 0; i < BENCH_SECTOR_COUNT; ++i)
+	{
+		if (SDWriteSingleBlock(BENCH_SECTOR + i, original + i * 512) != SD_READY)
+		{
+			UARTPrintf("Single block write failed at sector %d\n", BENCH_SECTOR + i);
+			return -1;
+		}
+	}
+	deltams = ClockToMs(E32ReadTime() - startclock);
+	UARTPrintf("CMD24 write: %d ms, %d Kbytes/sec\n", deltams, KBytesPerSec(deltams));
+
+	// Multiple block write
+	startclock = E32ReadTime();
+	if (SDWriteMultipleBlocks(original, BENCH_SECTOR_COUNT, BENCH_SECTOR) != 0)
+	{
+		UARTPrintf("Multiple block write failed\n");
+		return -1;
+	}
+	deltams = ClockToMs(E32ReadTime() - startclock);
+	UARTPrintf("CMD25 write: %d ms, %d Kbytes/sec\n", deltams, KBytesPerSec(deltams));
+
+	// Make sure the multiple block write landed where it should
+	SDReadMultipleBlocks(verify, BENCH_SECTOR_COUNT, BENCH_SECTOR);
+	UARTPrintf("Verify: %s\n", memcmp(original, verify, BENCH_SECTOR_COUNT * 512) == 0 ? "passed" : "failed");
+
+	free(verify);
+	free(original);
+
+	return 0;
+}
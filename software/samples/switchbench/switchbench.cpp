@@ -0,0 +1,102 @@
+/** \file
+ * Task switch timing example
+ *
+ * \ingroup examples
+ * This example adds two tasks to HART#1 that take turns and yield to each other right away,
+ * so HART#1 does nothing but switch tasks. HART#0 times how many switches happen over a
+ * fixed period and reports the average cost of a switch in CPU cycles.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "basesystem.h"
+#include "task.h"
+#include "uart.h"
+
+#define STACK_WORDS 1024
+#define MEASURE_ROUNDS 5
+
+// Lives in scratchpad memory so both HARTs see the same values without cache flushes
+struct SSwitchCounters
+{
+	uint32_t turn;
+	uint32_t pings;
+	uint32_t pongs;
+};
+
+static volatile SSwitchCounters *s_counters;
+
+void PingTask()
+{
+	while(1)
+	{
+		if (s_counters->turn == 0)
+		{
+			s_counters->turn = 1;
+			s_counters->pings = s_counters->pings + 1;
+		}
+		TaskYield();
+	}
+}
+
+void PongTask()
+{
+	while(1)
+	{
+		if (s_counters->turn == 1)
+		{
+			s_counters->turn = 0;
+			s_counters->pongs = s_counters->pongs + 1;
+		}
+		TaskYield();
+	}
+}
+
+int main()
+{
+	s_counters = (volatile SSwitchCounters*)E32GetScratchpad();
+	s_counters->turn = 0;
+	s_counters->pings = 0;
+	s_counters->pongs = 0;
+
+	struct STaskContext *taskctx1 = TaskGetContext(1);
+
+	// Stacks grow down from the end of each allocation
+	uint32_t *pingStack = new uint32_t[STACK_WORDS];
+	uint32_t *pongStack = new uint32_t[STACK_WORDS];
+	int pingID = TaskAdd(taskctx1, "ping", PingTask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, (uint32_t)&pingStack[STACK_WORDS-4]);
+	int pongID = TaskAdd(taskctx1, "pong", PongTask, TS_RUNNING, HUNDRED_MILLISECONDS_IN_TICKS, (uint32_t)&pongStack[STACK_WORDS-4]);
+	if (pingID == 0 || pongID == 0)
+	{
+		printf("Error: No room to add new tasks on CPU 1\n");
+		return -1;
+	}
+
+	UARTPrintf("\nTask switch timing on CPU 1 (%d tasks)\n", taskctx1->numTasks);
+
+	for (uint32_t r = 0; r < MEASURE_ROUNDS; ++r)
+	{
+		uint32_t startTurns = s_counters->pings + s_counters->pongs;
+		uint64_t startcycles = E32ReadCycles();
+
+		E32Sleep(100*ONE_MILLISECOND_IN_TICKS);
+
+		uint32_t turns = s_counters->pings + s_counters->pongs - startTurns;
+		uint64_t cycles = E32ReadCycles() - startcycles;
+
+		// Ping and pong each take one turn per trip through the task list, which also visits the
+		// idle task, so a trip is one switch per task in the list
+		uint32_t switches = turns * taskctx1->numTasks / 2;
+		if (switches == 0)
+			UARTPrintf("round %d: no switches\n", r);
+		else
+			UARTPrintf("round %d: %d switches, %d cycles/switch\n", r, switches, (uint32_t)(cycles / switches));
+	}
+
+	// Remove the last one first so the first one keeps its slot
+	TaskExitTaskWithID(taskctx1, pongID, 0);
+	TaskExitTaskWithID(taskctx1, pingID, 0);
+
+	return 0;
+}
@@ -23,6 +23,8 @@
 #endif
 
 #if defined(CAT_WINDOWS)
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <winuser.h>
 #include <conio.h>
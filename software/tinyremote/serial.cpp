@@ -1,5 +1,21 @@
 #include "serial.h"
 #include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#if defined(CAT_WINDOWS)
+#define INVALID_TCP_SOCKET INVALID_SOCKET
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#define INVALID_TCP_SOCKET -1
+#endif
 
 #if defined(CAT_LINUX)
 #include <errno.h>
@@ -56,8 +72,74 @@ bool CSerialPort::AttemptOpen()
 	return false;
 }
 
+static bool TCPWouldBlock()
+{
+#if defined(CAT_WINDOWS)
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+bool CSerialPort::OpenTCP(const char* _address)
+{
+	// Host is optional and defaults to this machine
+	char host[256] = "127.0.0.1";
+	const char* port = strrchr(_address, ':');
+	if (port)
+	{
+		snprintf(host, sizeof(host), "%.*s", (int)(port - _address), _address);
+		++port;
+	}
+	else
+		port = _address;
+
+#if defined(CAT_WINDOWS)
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* result = nullptr;
+	if (getaddrinfo(host, port, &hints, &result) != 0 || !result)
+	{
+		fprintf(stderr, "ERROR: can't resolve %s:%s\n", host, port);
+		return false;
+	}
+
+	tcp_socket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	bool connected = tcp_socket != INVALID_TCP_SOCKET && connect(tcp_socket, result->ai_addr, (int)result->ai_addrlen) == 0;
+	freeaddrinfo(result);
+	if (!connected)
+	{
+		fprintf(stderr, "ERROR: can't connect to %s:%s\n", host, port);
+		Close();
+		return false;
+	}
+
+	// Small packets and acks go out right away, and reads don't wait, same as the serial port
+	int nodelay = 1;
+	setsockopt(tcp_socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+#if defined(CAT_WINDOWS)
+	u_long nonblocking = 1;
+	ioctlsocket(tcp_socket, FIONBIO, &nonblocking);
+#else
+	fcntl(tcp_socket, F_SETFL, fcntl(tcp_socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+	fprintf(stderr, "%s open\n", commdevicename);
+	return true;
+}
+
 bool CSerialPort::Open()
 {
+	// tcp:PORT or tcp:HOST:PORT talks to an emulator started with --uart-tcp=PORT instead of a board
+	if (strncmp(commdevicename, "tcp:", 4) == 0)
+		return OpenTCP(commdevicename + 4);
+
 #if defined(CAT_LINUX)
 	// Open COM port
 	serial_port = open(commdevicename, O_RDWR);
@@ -93,8 +175,9 @@ bool CSerialPort::Open()
 	//tty.c_oflag &= ~OXTABS;
 	//tty.c_oflag &= ~ONOEOT;
 
-	tty.c_cc[VTIME] = 50;
-	tty.c_cc[VMIN] = 10;
+	// Reads return right away with whatever has arrived, same as the COMMTIMEOUTS used on Windows
+	tty.c_cc[VTIME] = 0;
+	tty.c_cc[VMIN] = 0;
 
 	cfsetispeed(&tty, B460800);
 	cfsetospeed(&tty, B460800); // or only cfsetspeed(&tty, B460800);
@@ -151,11 +234,19 @@ bool CSerialPort::Open()
 
 uint32_t CSerialPort::Receive(void *_target, unsigned int _rcvlength)
 {
+	if (tcp_socket != INVALID_TCP_SOCKET)
+	{
+		int n = recv(tcp_socket, (char*)_target, _rcvlength, 0);
+		if (n < 0 && !TCPWouldBlock())
+			fprintf(stderr, "ERROR: recv() failed\n");
+		return n > 0 ? (uint32_t)n : 0;
+	}
+
 #if defined(CAT_LINUX)
 	int n = read(serial_port, _target, _rcvlength);
 	if (n < 0)
 		fprintf(stderr, "ERROR: read() failed\n");
-	return n;
+	return n > 0 ? (uint32_t)n : 0;
 #elif defined(CAT_DARWIN)
 	// MacOS
 	return 0;
@@ -168,22 +259,43 @@ uint32_t CSerialPort::Receive(void *_target, unsigned int _rcvlength)
 
 uint32_t CSerialPort::Send(void *_sendbytes, unsigned int _sendlength)
 {
+	if (tcp_socket != INVALID_TCP_SOCKET)
+	{
+		// The emulator drains its side in bursts, keep going until it took everything
+		const char* source = (const char*)_sendbytes;
+		uint32_t sent = 0;
+		while (sent < _sendlength)
+		{
+			int n = send(tcp_socket, source + sent, _sendlength - sent, 0);
+			if (n > 0)
+				sent += n;
+			else if (n < 0 && TCPWouldBlock())
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			else
+			{
+				fprintf(stderr, "ERROR: send() failed\n");
+				break;
+			}
+		}
+		return sent;
+	}
+
 #if defined(CAT_LINUX)
 	int n = write(serial_port, _sendbytes, _sendlength);
 	if (n < 0)
 	{
 		fprintf(stderr, "ERROR: write() failed, re-opening port\n");
-		bool opene = Open();
-		if (opene)
+		close(serial_port);
+		if (Open())
 		{
-			success = WriteFile(hComm, _sendbytes, _sendlength, &byteswritten, nullptr);
-			if (!success)
+			n = write(serial_port, _sendbytes, _sendlength);
+			if (n < 0)
 				fprintf(stderr, "ERROR: subsequent write() failed\n");
 		}
 		else
 			fprintf(stderr, "ERROR: can't re-open port\n");
 	}
-	return n;
+	return n > 0 ? (uint32_t)n : 0;
 #elif defined(CAT_DARWIN)
 	// MacOS
 	return 0;
@@ -210,6 +322,17 @@ uint32_t CSerialPort::Send(void *_sendbytes, unsigned int _sendlength)
 
 void CSerialPort::Close()
 {
+	if (tcp_socket != INVALID_TCP_SOCKET)
+	{
+#if defined(CAT_WINDOWS)
+		closesocket(tcp_socket);
+#else
+		close(tcp_socket);
+#endif
+		tcp_socket = INVALID_TCP_SOCKET;
+		return;
+	}
+
 #if defined(CAT_LINUX)
 	close(serial_port);
 #elif defined(CAT_DARWIN)
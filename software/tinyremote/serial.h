@@ -13,6 +13,7 @@ class CSerialPort{
 	~CSerialPort() { }
 
 	bool Open();
+	bool OpenTCP(const char* _address);
 	bool AttemptOpen();
 	uint32_t Receive(void *_target, unsigned int _rcvlength);
 	uint32_t Send(void *_sendbytes, unsigned int _sendlength);
@@ -20,7 +21,9 @@ class CSerialPort{
 
 #if defined(CAT_LINUX) || defined(CAT_DARWIN)
 	int serial_port{-1};
+	int tcp_socket{-1};
 #else // CAT_WINDOWS
+	SOCKET tcp_socket{INVALID_SOCKET};
 	HANDLE hComm{INVALID_HANDLE_VALUE};
 	DCB serialParams{0};
 	COMMTIMEOUTS timeouts{0};
@@ -6,9 +6,9 @@
 #include <errno.h>
 #include <chrono>
 #include <thread>
-#include <filesystem>
 
 #include "tinyremote.h"
+#include "../uploadclient.h"
 
 static AppCtx s_app_ctx;
 static bool s_alive = true;
@@ -122,39 +122,6 @@ uint32_t videoCallback(uint32_t interval, void* param)
 	return interval;
 }
 
-bool WACK(CSerialPort *_serial, const uint8_t waitfor, uint8_t& received)
-{
-	int ack = 0;
-	uint8_t dummy;
-	uint8_t bytes = 0;
-	uint32_t timeout = 0;
-	do
-	{
-		if (_serial->Receive(&dummy, 1))
-		{
-			received = dummy;
-			++bytes;
-			if (dummy == waitfor)
-				ack = 1; // Valid ACK
-		}
-		std::this_thread::sleep_for(std::chrono::milliseconds(5));
-		++timeout;
-	} while (!bytes);
-
-	return (timeout>16384) ? false : (ack ? true : false);
-}
-
-unsigned int getfilelength(const fpos_t &endpos)
-{
-#if defined(CAT_LINUX)
-	return (unsigned int)endpos.__pos;
-#elif defined(CAT_MACOS)
-	return (unsigned int)endpos;
-#else // CAT_WINDOWS
-	return (unsigned int)endpos;
-#endif
-}
-
 void ConsumeInitialTraffic(CSerialPort* _serial)
 {
 	// When we first open the port, ESP32 will respond with a "ESP-ROM:esp32xxxxxx" and tinysys version message
@@ -168,198 +135,31 @@ void ConsumeInitialTraffic(CSerialPort* _serial)
 	}
 }
 
-void SendFile(char *_filename, CSerialPort* _serial)
+// Mirrors the upload progress to the bar drawn over the video
+class CRemoteUploadLink : public CSerialUploadLink<CSerialPort>
 {
-	char tmpstring[129];
+	public:
 
-	FILE *fp;
-	fp = fopen(_filename, "rb");
-	if (!fp)
-	{
-		fprintf(stderr, "ERROR: can't open ELF file %s\n", _filename);
-		return;
-	}
-
-	char cleanfilename[129];
-	{
-		using namespace std::filesystem;
-		path p = absolute(_filename);
-		strcpy(cleanfilename, p.filename().string().c_str());
-	}
+	CRemoteUploadLink(CSerialPort *_serial) : CSerialUploadLink(_serial) { }
 
-	unsigned int filebytesize = 0;
-	fpos_t pos, endpos;
-	fgetpos(fp, &pos);
-	fseek(fp, 0, SEEK_END);
-	fgetpos(fp, &endpos);
-	fsetpos(fp, &pos);
-	filebytesize = getfilelength(endpos);
-
-	uint8_t *filedata = new uint8_t[filebytesize + 64];
-	fread(filedata, 1, filebytesize, fp);
-	fclose(fp);
-
-	// Send the file bytes in chunks
-	uint32_t packetSize = 1024;
-	int worstSize = LZ4_compressBound(filebytesize);
-
-	// Pack the data before sending it across
-	char* encoded = new char[worstSize];
-	uint32_t encodedSize = LZ4_compress_default((const char*)filedata, encoded, filebytesize, worstSize);
-	fprintf(stderr, "Compression ratio = %.2f%% (%d->%d bytes)\n", 100.f*float(encodedSize)/float(filebytesize), filebytesize, encodedSize);
-
-	// Now we can work out how many packets we need to send
-	uint32_t numPackets = encodedSize / packetSize;
-	uint32_t leftoverBytes = encodedSize % packetSize;
-
-	uint8_t received;
+	void Progress(float _percent) override { s_uploadProgress = _percent; }
+};
 
+// This is meant to be used with the receiver app on the tinysys side, see SDK/upload.h for the protocol
+void SendFile(char *_filename, CSerialPort* _serial)
+{
 	ConsumeInitialTraffic(_serial);
 
 	s_uploadProgress = 0.f;
 	s_showProgress = 1;
 
-	// Start the receiver app on the other end
-	snprintf(tmpstring, 128, "recv");
-	_serial->Send((uint8_t*)tmpstring, 4);
-	std::this_thread::sleep_for(std::chrono::milliseconds(200));
-	snprintf(tmpstring, 128, "\n");
-	_serial->Send((uint8_t*)tmpstring, 1);
-	if (!WACK(_serial, '+', received))
-	{
-		fprintf(stderr, "Transfer initiation error: '%c'\n", received);
-		delete [] filedata;
-		s_showProgress = 0;
-		return;
-	}
-
-	// Send encoded length
-	uint32_t encodedLen = encodedSize;
-	_serial->Send(&encodedLen, 4);
-	if (!WACK(_serial, '+', received))
-	{
-		fprintf(stderr, "Encoded buffer length error: '%c'\n", received);
-		delete [] filedata;
-		s_showProgress = 0;
-		return;
-	}
-
-	// Send actual length
-	uint32_t decodedLen = filebytesize;
-	_serial->Send(&decodedLen, 4);
-	if (!WACK(_serial, '+', received))
-	{
-		fprintf(stderr, "Decoded buffer length error: '%c'\n", received);
-		delete [] filedata;
-		s_showProgress = 0;
-		return;
-	}
-
-	// Send name length
-	uint32_t nameLen = strlen(cleanfilename);
-	_serial->Send(&nameLen, 4);
-	if (!WACK(_serial, '+', received))
-	{
-		fprintf(stderr, "File name length error: '%c'\n", received);
-		delete [] filedata;
-		s_showProgress = 0;
-		return;
-	}
-
-	// Send name
-	_serial->Send(cleanfilename, nameLen);
-	if (!WACK(_serial, '+', received))
-	{
-		fprintf(stderr, "File name error: '%c'\n", received);
-		delete [] filedata;
-		s_showProgress = 0;
-		return;
-	}
-
-	uint32_t i = 0;
-	uint32_t packetOffset = 0;
-	char progress[65];
-	for (i=0; i<64; ++i)
-		progress[i] = ' ';//176;
-	progress[64] = 0;
-	fprintf(stderr, "Uploading '%s' (packet size: %dx%d+%d bytes, packer buffer: %d bytes)\n", cleanfilename, numPackets, packetSize, leftoverBytes, worstSize);
-	for (i=0; i<numPackets; ++i)
-	{
-		const char* source = (const char*)(encoded + packetOffset);
-
-		s_uploadProgress = (i*100)/float(numPackets);
-		int idx = (i*64)/numPackets;
-		for (int j=0; j<=idx; ++j) // Progress bar
-			progress[j] = '=';//219;
-		fprintf(stderr, "\r [%s] %.2f%%\r", progress, s_uploadProgress);
-
-		if (!WACK(_serial, '+', received)) // Wait for a 'go' signal
-		{
-			fprintf(stderr, "Packet size error at %d/%d (%d): '%c'\n", i, numPackets, received, packetSize);
-			delete [] filedata;
-			s_showProgress = 0;
-			return;
-		}
-
-		_serial->Send(&packetSize, 4);
-
-		if (!WACK(_serial, '+', received)) // Wait for a 'go' signal
-		{
-			fprintf(stderr, "Packet error at %d/%d (%d): '%c'\n", i, numPackets, received, packetSize);
-			delete [] filedata;
-			s_showProgress = 0;
-			return;
-		}
-
-		_serial->Send((void*)source, packetSize);
-
-		packetOffset += packetSize;
-	}
-
-	if (leftoverBytes)
-	{
-		const char* source = (const char*)(encoded + packetOffset);
-
-		s_uploadProgress = 100.f;
-		for (int j=0; j<64; ++j) // Progress bar
-			progress[j] = '=';//219;
-		fprintf(stderr, "\r [%s] %.2f%%\r", progress, s_uploadProgress);
-
-		if (!WACK(_serial, '+', received)) // Wait for a 'go' signal
-		{
-			fprintf(stderr, "Packet size error at %d/%d (%d): '%c'\n", i, numPackets, received, packetSize);
-			delete [] filedata;
-			s_showProgress = 0;
-			return;
-		}
-
-		_serial->Send(&leftoverBytes, 4);
-
-		if (!WACK(_serial, '+', received)) // Wait for a 'go' signal
-		{
-			fprintf(stderr, "Packet error at %d/%d (%d): '%c'\n", i, numPackets, received, packetSize);
-			delete [] filedata;
-			s_showProgress = 0;
-			return;
-		}
-
-		_serial->Send((void*)source, leftoverBytes);
-
-		packetOffset += leftoverBytes;
-	}
+	CRemoteUploadLink link(_serial);
+	UploadFile(&link, _filename, stderr, 200);
 
 	std::this_thread::sleep_for(std::chrono::milliseconds(200));
-	snprintf(tmpstring, 128, "\n");
-	_serial->Send((uint8_t*)tmpstring, 1);
-
-	fprintf(stderr, "\r\n");
+	_serial->Send((void*)"\n", 1);
 
-	delete[] encoded;
 	s_showProgress = 0;
-
-	fprintf(stderr, "%d bytes uploaded\n", packetOffset);
-
-	delete [] filedata;
 }
 
 float Clamp(float value, float min, float max)
@@ -0,0 +1,416 @@
+#include <string.h>
+#include <stddef.h>
+
+#include <chrono>
+#include <thread>
+#include <filesystem>
+#include <vector>
+#include <deque>
+
+#include "lz4.h"
+#include "SDK/crc.h"
+#include "SDK/upload.h"
+#include "uploadclient.h"
+
+// Packs the file into size prefixed blocks as SDK/upload.h describes, a block at a time as the window needs them
+struct SUploadEncoder
+{
+	FILE *fp{ nullptr };
+	uint32_t fileSize{ 0 };
+	uint32_t readPos{ 0 };
+	LZ4_stream_t *stream{ nullptr };
+	char *ring{ nullptr };					// Blocks may refer to the 64K before them, so they're read into a ring that keeps that much in place
+	uint32_t ringPos{ 0 };
+	std::vector<uint8_t> payload;			// Payload from packet payloadStart on, older packets are acknowledged already
+	uint32_t payloadStart{ 0 };
+	uint32_t payloadEnd{ 0 };
+	uint32_t crc{ 0 };
+	bool finished{ false };					// Trailer is in, payloadEnd is final
+	bool readError{ false };
+};
+
+static const uint32_t s_uploadRingSize = 65536 + UPLOAD_BLOCK_SIZE;
+
+static void AppendPayload(SUploadEncoder &_encoder, const void *_data, uint32_t _len)
+{
+	const uint8_t *data = (const uint8_t*)_data;
+	_encoder.payload.insert(_encoder.payload.end(), data, data + _len);
+	_encoder.payloadEnd += _len;
+}
+
+// Adds the next block, or the trailer and the padding of the last packet once the whole file is in
+static bool EncodeNextBlock(SUploadEncoder &_encoder)
+{
+	if (_encoder.readPos == _encoder.fileSize)
+	{
+		uint32_t endMarker = 0;
+		_encoder.crc = CRC32(_encoder.crc, (const uint8_t*)&endMarker, 4);
+		AppendPayload(_encoder, &endMarker, 4);
+		uint32_t payloadCRC = _encoder.crc;
+		AppendPayload(_encoder, &payloadCRC, 4);
+		uint32_t padding = (UPLOAD_PACKET_SIZE - _encoder.payloadEnd % UPLOAD_PACKET_SIZE) % UPLOAD_PACKET_SIZE;
+		_encoder.payload.resize(_encoder.payload.size() + padding, 0);
+		_encoder.payloadEnd += padding;
+		_encoder.finished = true;
+		return true;
+	}
+
+	uint32_t blockSize = _encoder.fileSize - _encoder.readPos < UPLOAD_BLOCK_SIZE ? _encoder.fileSize - _encoder.readPos : UPLOAD_BLOCK_SIZE;
+	if (_encoder.ringPos + UPLOAD_BLOCK_SIZE > s_uploadRingSize)
+		_encoder.ringPos = 0;
+
+	char *source = _encoder.ring + _encoder.ringPos;
+	if (fread(source, 1, blockSize, _encoder.fp) != blockSize)
+	{
+		_encoder.readError = true;
+		return false;
+	}
+
+	char packed[4 + LZ4_COMPRESSBOUND(UPLOAD_BLOCK_SIZE)];
+	uint32_t packedSize = LZ4_compress_fast_continue(_encoder.stream, source, packed + 4, blockSize, LZ4_COMPRESSBOUND(UPLOAD_BLOCK_SIZE), 1);
+	memcpy(packed, &packedSize, 4);
+	_encoder.crc = CRC32(_encoder.crc, (const uint8_t*)packed, packedSize + 4);
+	AppendPayload(_encoder, packed, packedSize + 4);
+
+	_encoder.ringPos += blockSize;
+	_encoder.readPos += blockSize;
+	return true;
+}
+
+// Packs as much of the file as it takes to fill packet _index, false if the payload ends before it
+static bool EncodeThrough(SUploadEncoder &_encoder, uint32_t _index)
+{
+	while (!_encoder.finished && _encoder.payloadEnd < (_index + 1) * UPLOAD_PACKET_SIZE)
+	{
+		if (!EncodeNextBlock(_encoder))
+			return false;
+	}
+	return _encoder.payloadEnd >= (_index + 1) * UPLOAD_PACKET_SIZE;
+}
+
+// Acknowledged packets are never sent again
+static void DropPayload(SUploadEncoder &_encoder, uint32_t _firstKept)
+{
+	uint32_t drop = (_firstKept - _encoder.payloadStart) * UPLOAD_PACKET_SIZE;
+	_encoder.payload.erase(_encoder.payload.begin(), _encoder.payload.begin() + drop);
+	_encoder.payloadStart = _firstKept;
+}
+
+// Picks complete replies out of whatever recv.elf sent so far
+static bool ReadUploadReply(CUploadLink *_link, std::vector<uint8_t> &pending, uint8_t &type, uint32_t &value)
+{
+	uint8_t incoming[256];
+	uint32_t count = _link->Receive(incoming, sizeof(incoming));
+	pending.insert(pending.end(), incoming, incoming + count);
+
+	// Skip anything that can't start a reply
+	size_t skip = 0;
+	while (skip < pending.size() && memchr("ANRD!", pending[skip], 5) == nullptr)
+		++skip;
+	pending.erase(pending.begin(), pending.begin() + skip);
+
+	if (pending.size() < UPLOAD_REPLY_SIZE)
+		return false;
+
+	type = pending[0];
+	value = pending[1] | (pending[2] << 8) | (pending[3] << 16) | ((uint32_t)pending[4] << 24);
+	pending.erase(pending.begin(), pending.begin() + UPLOAD_REPLY_SIZE);
+	return true;
+}
+
+static bool WaitUploadReply(CUploadLink *_link, std::vector<uint8_t> &pending, uint8_t &type, uint32_t &value, uint32_t timeoutms)
+{
+	auto start = std::chrono::steady_clock::now();
+	while (!ReadUploadReply(_link, pending, type, value))
+	{
+		if (std::chrono::steady_clock::now() - start > std::chrono::milliseconds(timeoutms))
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+// recv.elf answers '+' once it owns the UART, anything else means it didn't start
+static bool WaitUploadStart(CUploadLink *_link, uint8_t &received)
+{
+	auto start = std::chrono::steady_clock::now();
+	while (std::chrono::steady_clock::now() - start < std::chrono::seconds(80))
+	{
+		if (_link->Receive(&received, 1))
+			return received == '+';
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	received = 0;
+	return false;
+}
+
+static void SendUploadPacket(CUploadLink *_link, const SUploadEncoder &_encoder, uint32_t index)
+{
+	uint8_t packet[UPLOAD_PACKET_SIZE + 9];
+	packet[0] = UPLOAD_SYNC;
+	memcpy(packet + 1, &index, 4);
+	memcpy(packet + 5, _encoder.payload.data() + (index - _encoder.payloadStart) * UPLOAD_PACKET_SIZE, UPLOAD_PACKET_SIZE);
+	uint32_t crc = CRC32(0, packet + 1, UPLOAD_PACKET_SIZE + 4);
+	memcpy(packet + 5 + UPLOAD_PACKET_SIZE, &crc, 4);
+	_link->Send(packet, UPLOAD_PACKET_SIZE + 9);
+}
+
+// Up to UPLOAD_WINDOW packets are in flight, and only damaged or unanswered ones are sent again.
+// The file is read and packed as the window moves along, so the first packet goes out right away.
+static bool UploadPayload(CUploadLink *_link, const SUploadHeader &_header, SUploadEncoder &_encoder, FILE *_log, uint32_t _commandDelayMS)
+{
+	// Start the receiver app on the other end
+	uint8_t received;
+	_link->Send((void*)"recv", 4);
+	std::this_thread::sleep_for(std::chrono::milliseconds(_commandDelayMS));
+	_link->Send((void*)"\n", 1);
+	if (!WaitUploadStart(_link, received))
+	{
+		fprintf(_log, "Transfer initiation error: '%c'\n", received);
+		return false;
+	}
+
+	// Send the header until it arrives intact, the answer tells us where to start
+	std::vector<uint8_t> pending;
+	uint8_t replyType = 0;
+	uint32_t replyValue = 0;
+	bool headerAccepted = false;
+	for (int attempt = 0; attempt < 5 && !headerAccepted; ++attempt)
+	{
+		_link->Send((void*)&_header, sizeof(_header));
+		while (WaitUploadReply(_link, pending, replyType, replyValue, 2000))
+		{
+			if (replyType == UPLOAD_RESUME || replyType == UPLOAD_ERROR)
+				headerAccepted = true;
+			if (replyType != UPLOAD_ACK)
+				break;
+		}
+	}
+
+	// A resumed upload packs everything before the resume point again, the compressor needs to see it
+	if (!headerAccepted || replyType == UPLOAD_ERROR || !EncodeThrough(_encoder, replyValue))
+	{
+		if (!_encoder.readError)
+			fprintf(_log, "Header error: '%c' %d\n", replyType, replyValue);
+		return false;
+	}
+
+	struct SPacketState
+	{
+		std::chrono::steady_clock::time_point sentAt;
+		uint32_t sendCount{ 0 };
+		bool acked{ false };
+		bool queued{ false };
+	};
+	std::vector<SPacketState> packets(replyValue);
+	std::deque<uint32_t> resend;
+
+	const uint32_t firstPacket = replyValue;
+	uint32_t base = firstPacket;
+	uint32_t next = base;
+	for (uint32_t i = 0; i < base; ++i)
+		packets[i].acked = true;
+	DropPayload(_encoder, base);
+
+	// Emulated devices run slower than real time, so the resend timeout follows the measured round trip.
+	// When it runs out only the oldest packet goes again and the timeout doubles, until an ACK shows the link is back.
+	double smoothedRTT = 0.0;
+	auto roundTripTimeout = std::chrono::milliseconds(250);
+	auto resendTimeout = roundTripTimeout;
+
+	char progress[65];
+	for (int i=0; i<64; ++i)
+		progress[i] = ' ';//176;
+	progress[64] = 0;
+	if (base)
+		fprintf(_log, "Resuming '%s' at packet %d\n", _header.name, base);
+	fprintf(_log, "Uploading '%s' (%d bytes in packets of %d bytes, window: %d)\n", _header.name, _header.decodedLen, UPLOAD_PACKET_SIZE, UPLOAD_WINDOW);
+
+	auto startTime = std::chrono::steady_clock::now();
+	auto lastReply = startTime;
+	uint32_t resentPackets = 0;
+	bool failed = false;
+	bool done = false;
+	while (!failed && !done)
+	{
+		auto now = std::chrono::steady_clock::now();
+
+		while (ReadUploadReply(_link, pending, replyType, replyValue))
+		{
+			lastReply = now;
+			if (replyType == UPLOAD_ERROR)
+			{
+				fprintf(_log, "\nReceiver error: %d\n", replyValue);
+				failed = true;
+			}
+			else if (replyType == UPLOAD_DONE)
+				done = true; // Small files can be done before we've seen the last ACK
+			else if (replyValue >= next || packets[replyValue].acked)
+				continue;
+			else if (replyType == UPLOAD_ACK)
+			{
+				// Only packets that went out once give an unambiguous round trip
+				if (packets[replyValue].sendCount == 1)
+				{
+					double sample = std::chrono::duration<double, std::milli>(now - packets[replyValue].sentAt).count();
+					smoothedRTT = smoothedRTT == 0.0 ? sample : (smoothedRTT * 7.0 + sample) / 8.0;
+					roundTripTimeout = std::chrono::milliseconds(100 + (int)(3.0 * smoothedRTT));
+				}
+				resendTimeout = roundTripTimeout;
+				packets[replyValue].acked = true;
+			}
+			else if (replyType == UPLOAD_NAK && !packets[replyValue].queued)
+			{
+				packets[replyValue].queued = true;
+				resend.push_back(replyValue);
+			}
+		}
+
+		uint32_t prevBase = base;
+		while (base < next && packets[base].acked)
+			++base;
+		if (base != prevBase)
+		{
+			DropPayload(_encoder, base);
+
+			// File bytes in the acknowledged packets, taking the compression so far as the ratio
+			float percent = _encoder.fileSize ? (100.f * _encoder.readPos / _encoder.fileSize) * (float(base * UPLOAD_PACKET_SIZE) / _encoder.payloadEnd) : 100.f;
+			int idx = int(percent * 64) / 100;
+			for (int j=0; j<idx; ++j) // Progress bar
+				progress[j] = '=';//219;
+			_link->Progress(percent);
+			fprintf(_log, "\r [%s] %.2f%%\r", progress, percent);
+			fflush(_log);
+		}
+
+		// The oldest packet nobody answered is sent again, the ones after it wait their turn
+		if (base < next && !packets[base].queued && now - packets[base].sentAt > resendTimeout)
+		{
+			packets[base].queued = true;
+			resend.push_back(base);
+			if (resendTimeout < std::chrono::seconds(4))
+				resendTimeout *= 2;
+		}
+
+		// Resends go first, new packets only while there's room in the window
+		if (!resend.empty())
+		{
+			uint32_t index = resend.front();
+			resend.pop_front();
+			packets[index].queued = false;
+			if (packets[index].acked)
+				continue;
+			if (packets[index].sendCount > 16)
+			{
+				fprintf(_log, "\nGiving up on packet %d\n", index);
+				failed = true;
+				break;
+			}
+			SendUploadPacket(_link, _encoder, index);
+			packets[index].sentAt = std::chrono::steady_clock::now();
+			++packets[index].sendCount;
+			++resentPackets;
+		}
+		else if (next < base + UPLOAD_WINDOW && EncodeThrough(_encoder, next))
+		{
+			packets.emplace_back();
+			SendUploadPacket(_link, _encoder, next);
+			packets[next].sentAt = std::chrono::steady_clock::now();
+			++packets[next].sendCount;
+			++next;
+		}
+		else if (_encoder.readError)
+			failed = true;
+		else if (now - lastReply > std::chrono::seconds(10))
+		{
+			fprintf(_log, "\nNo reply from the receiver at packet %d\n", base);
+			failed = true;
+		}
+		else
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// Wait for the receiver to check and write the file
+	while (!failed && !done)
+	{
+		if (!WaitUploadReply(_link, pending, replyType, replyValue, 30000))
+		{
+			fprintf(_log, "\nNo completion reply from the receiver\n");
+			failed = true;
+		}
+		else if (replyType == UPLOAD_DONE)
+			done = true;
+		else if (replyType == UPLOAD_ERROR)
+		{
+			fprintf(_log, "\nReceiver error: %d\n", replyValue);
+			failed = true;
+		}
+	}
+
+	fprintf(_log, "\r\n");
+
+	if (done)
+	{
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		uint32_t sentBytes = _encoder.payloadEnd - firstPacket * UPLOAD_PACKET_SIZE;
+		fprintf(_log, "Compression ratio = %.2f%% (%d->%d bytes)\n", _header.decodedLen ? 100.f*float(_encoder.payloadEnd)/float(_header.decodedLen) : 0.f, _header.decodedLen, _encoder.payloadEnd);
+		fprintf(_log, "%d bytes uploaded in %.2fs (%.1f KB/s, %d packets resent)\n", sentBytes, seconds, seconds > 0.0 ? sentBytes / (1024.0 * seconds) : 0.0, resentPackets);
+	}
+
+	return done;
+}
+
+bool UploadFile(CUploadLink *_link, const char *_filename, FILE *_log, uint32_t _commandDelayMS)
+{
+	FILE *fp = fopen(_filename, "rb");
+	if (!fp)
+	{
+		fprintf(_log, "ERROR: can't open ELF file %s\n", _filename);
+		return false;
+	}
+
+	char cleanfilename[129];
+	uint32_t filebytesize = 0;
+	uint32_t filetime = 0;
+	{
+		using namespace std::filesystem;
+		path p = absolute(_filename);
+		snprintf(cleanfilename, sizeof(cleanfilename), "%s", p.filename().string().c_str());
+		std::error_code error;
+		filebytesize = (uint32_t)file_size(p, error);
+		filetime = (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(last_write_time(p, error).time_since_epoch()).count();
+	}
+
+	uint32_t nameLen = strlen(cleanfilename);
+	if (nameLen >= UPLOAD_MAX_NAME)
+	{
+		fprintf(_log, "ERROR: file name %s is longer than %d characters\n", cleanfilename, UPLOAD_MAX_NAME - 1);
+		fclose(fp);
+		return false;
+	}
+
+	SUploadHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = UPLOAD_MAGIC;
+	header.version = UPLOAD_VERSION;
+	header.decodedLen = filebytesize;
+	header.fileTime = filetime;
+	header.nameLen = nameLen;
+	memcpy(header.name, cleanfilename, nameLen);
+	header.headerCRC = CRC32(0, (const uint8_t*)&header, offsetof(SUploadHeader, headerCRC));
+
+	SUploadEncoder encoder;
+	encoder.fp = fp;
+	encoder.fileSize = filebytesize;
+	encoder.stream = LZ4_createStream();
+	encoder.ring = new char[s_uploadRingSize];
+	bool done = UploadPayload(_link, header, encoder, _log, _commandDelayMS);
+
+	LZ4_freeStream(encoder.stream);
+	delete [] encoder.ring;
+	fclose(fp);
+
+	if (encoder.readError)
+		fprintf(_log, "ERROR: can't read file %s\n", _filename);
+	return done;
+}
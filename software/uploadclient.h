@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Host side of the file upload protocol in SDK/upload.h, shared by riscvtool -sendfile and tinyremote drag and drop
+
+// Byte pipe to the device, each tool wraps its own serial port class in one of these
+class CUploadLink
+{
+	public:
+
+	virtual ~CUploadLink() { }
+
+	virtual uint32_t Send(void *_sendbytes, unsigned int _sendlength) = 0;
+	virtual uint32_t Receive(void *_target, unsigned int _rcvlength) = 0;
+
+	// Called whenever more of the file is acknowledged, _percent goes from 0 to 100
+	virtual void Progress(float _percent) { }
+};
+
+template<class SERIALPORT> class CSerialUploadLink : public CUploadLink
+{
+	public:
+
+	CSerialUploadLink(SERIALPORT *_serial) : m_serial(_serial) { }
+
+	uint32_t Send(void *_sendbytes, unsigned int _sendlength) override { return m_serial->Send(_sendbytes, _sendlength); }
+	uint32_t Receive(void *_target, unsigned int _rcvlength) override { return m_serial->Receive(_target, _rcvlength); }
+
+	SERIALPORT *m_serial;
+};
+
+// Starts recv.elf on the device and sends it the file. The port needs to be open with any startup traffic consumed,
+// _commandDelayMS is the pause between typing "recv" and the return key.
+// Messages and the progress bar go to _log, returns true once the receiver has written the file.
+bool UploadFile(CUploadLink *_link, const char *_filename, FILE *_log, uint32_t _commandDelayMS);
@@ -59,6 +59,12 @@ logic [31:0] csrdout;
 
 logic [31:0] csrmemory[0:4095];
 
+// Register shadow window shows one of the banks stored at 0x400-0x7FF
+logic [4:0] regbank;
+function automatic [11:0] bankedaddr(input [11:0] addr, input [4:0] bank);
+	bankedaddr = (addr[11:5] == (`CSR_REGISTERSHADOW >> 5)) ? {2'b01, bank, addr[4:0]} : addr;
+endfunction
+
 initial begin
 	int ri;
 	for (ri=0; ri<4096; ri=ri+1) begin
@@ -177,6 +183,7 @@ always @(posedge aclk) begin
 		timecmpshadow <= 64'hFFFFFFFFFFFFFFFF;
 		cpuresetreq_r <= 1'b0;
 		mieshadow <= 3'b000;
+		regbank <= 5'd0;
 		csrwe <= 1'b0;
 		cpuresetclearcounter <= 11'd0;
 	end else begin
@@ -199,8 +206,11 @@ always @(posedge aclk) begin
 			2'b01: begin
 				if (s_axi.wvalid) begin
 					csrdin <= s_axi.wdata[31:0];
-					cswraddr <= s_axi.awaddr[13:2]; // 4 byte aligned
+					cswraddr <= bankedaddr(s_axi.awaddr[13:2], regbank); // 4 byte aligned
 					csrwe <= 1'b1;
+					// Bank switch takes effect before the write is acknowledged, so the very next access sees it
+					if (s_axi.awaddr[13:2] == `CSR_REGISTERBANK)
+						regbank <= s_axi.wdata[4:0];
 					writestate <= 2'b10;
 					s_axi.wready <= 1'b1;
 				end
@@ -246,7 +256,7 @@ always @(posedge aclk) begin
 			2'b01: begin
 				if (s_axi.arvalid) begin
 					s_axi.arready <= 1'b1;
-					csrraddr <= s_axi.araddr[13:2]; // 4 byte aligned
+					csrraddr <= bankedaddr(s_axi.araddr[13:2], regbank); // 4 byte aligned
 					raddrstate <= 2'b10;
 				end
 			end
@@ -16,6 +16,19 @@ delayreset delayresetinst(
 	.inputresetn(aresetn),
 	.delayedresetn(delayedresetn) );
 
+// --------------------------------------------------
+// Address decode
+// --------------------------------------------------
+
+// Lower half of the address space is memory, upper half is the atomic register block.
+// Addresses are held by the master until the transaction completes.
+wire atomwsel = s_axi.awaddr[15];
+wire atomrsel = s_axi.araddr[15];
+
+logic ramawready, ramwready, rambvalid, ramarready, ramrvalid, ramrlast;
+logic [1:0] rambresp, ramrresp;
+logic [31:0] ramrdata;
+
 // --------------------------------------------------
 // Memory - 16Kbytes
 // --------------------------------------------------
@@ -28,29 +41,142 @@ maildeviceram mailboxinst(
   .s_axi_awlen(s_axi.awlen),
   .s_axi_awsize(s_axi.awsize),
   .s_axi_awburst(s_axi.awburst),
-  .s_axi_awvalid(s_axi.awvalid),
-  .s_axi_awready(s_axi.awready),
+  .s_axi_awvalid(s_axi.awvalid & ~atomwsel),
+  .s_axi_awready(ramawready),
   .s_axi_wdata(s_axi.wdata[31:0]),
   .s_axi_wstrb(s_axi.wstrb[3:0]),
   .s_axi_wlast(s_axi.wlast),
-  .s_axi_wvalid(s_axi.wvalid),
-  .s_axi_wready(s_axi.wready),
+  .s_axi_wvalid(s_axi.wvalid & ~atomwsel),
+  .s_axi_wready(ramwready),
   .s_axi_bid(),
-  .s_axi_bresp(s_axi.bresp),
-  .s_axi_bvalid(s_axi.bvalid),
-  .s_axi_bready(s_axi.bready),
+  .s_axi_bresp(rambresp),
+  .s_axi_bvalid(rambvalid),
+  .s_axi_bready(s_axi.bready & ~atomwsel),
   .s_axi_arid(4'd0),
   .s_axi_araddr(s_axi.araddr),
   .s_axi_arlen(s_axi.arlen),
   .s_axi_arsize(s_axi.arsize),
   .s_axi_arburst(s_axi.arburst),
-  .s_axi_arvalid(s_axi.arvalid),
-  .s_axi_arready(s_axi.arready),
+  .s_axi_arvalid(s_axi.arvalid & ~atomrsel),
+  .s_axi_arready(ramarready),
   .s_axi_rid(),
-  .s_axi_rdata(s_axi.rdata[31:0]),
-  .s_axi_rresp(s_axi.rresp),
-  .s_axi_rlast(s_axi.rlast),
-  .s_axi_rvalid(s_axi.rvalid),
-  .s_axi_rready(s_axi.rready) );
+  .s_axi_rdata(ramrdata),
+  .s_axi_rresp(ramrresp),
+  .s_axi_rlast(ramrlast),
+  .s_axi_rvalid(ramrvalid),
+  .s_axi_rready(s_axi.rready & ~atomrsel) );
+
+// --------------------------------------------------
+// Atomic register block - 64 words
+// --------------------------------------------------
+
+// Address bits [10:8] select the operation, bits [7:2] the slot:
+// 0: load / store
+// 1: test-and-set, reads return the old value and leave 1 behind
+// 2: fetch-increment, reads return the old value and leave value+1 behind
+// 3: fetch-decrement, reads return the old value and leave value-1 behind
+// 4: fetch-add, writes add the written value, reads are plain loads
+// Writes through operations 1-3 are plain stores.
+
+logic [31:0] atomics[0:63];
+
+logic atomawready, atomwready, atombvalid, atomarready, atomrvalid;
+logic [31:0] atomrdata;
+
+logic [1:0] atomwstate;
+logic atomrstate;
+logic [5:0] atomrslot;
+logic [2:0] atomrop;
+
+wire [5:0] atomwslot = s_axi.awaddr[7:2];
+wire [2:0] atomwop = s_axi.awaddr[10:8];
+// Writes land in this clock, reads wait a clock so both sides never modify the block at once
+wire atomwcommit = (atomwstate == 2'b01) && s_axi.wvalid && atomwsel;
+
+always @(posedge aclk) begin
+	if (~delayedresetn) begin
+		for (int i=0; i<64; i=i+1)
+			atomics[i] <= 32'd0;
+		atomwstate <= 2'b00;
+		atomrstate <= 1'b0;
+		atomawready <= 1'b0;
+		atomwready <= 1'b0;
+		atombvalid <= 1'b0;
+		atomarready <= 1'b0;
+		atomrvalid <= 1'b0;
+		atomrdata <= 32'd0;
+		atomrslot <= 6'd0;
+		atomrop <= 3'd0;
+	end else begin
+		atomawready <= 1'b0;
+		atomwready <= 1'b0;
+		atombvalid <= 1'b0;
+		atomarready <= 1'b0;
+		atomrvalid <= 1'b0;
+
+		unique case(atomwstate)
+			2'b00: begin
+				if (s_axi.awvalid && atomwsel) begin
+					atomawready <= 1'b1;
+					atomwstate <= 2'b01;
+				end
+			end
+			2'b01: begin
+				if (atomwcommit) begin
+					atomics[atomwslot] <= (atomwop == 3'd4) ? (atomics[atomwslot] + s_axi.wdata[31:0]) : s_axi.wdata[31:0];
+					atomwready <= 1'b1;
+					atomwstate <= 2'b10;
+				end
+			end
+			2'b10: begin
+				if (s_axi.bready) begin
+					atombvalid <= 1'b1;
+					atomwstate <= 2'b00;
+				end
+			end
+			default: begin
+				atomwstate <= 2'b00;
+			end
+		endcase
+
+		unique case(atomrstate)
+			1'b0: begin
+				if (s_axi.arvalid && atomrsel) begin
+					atomarready <= 1'b1;
+					atomrslot <= s_axi.araddr[7:2];
+					atomrop <= s_axi.araddr[10:8];
+					atomrstate <= 1'b1;
+				end
+			end
+			1'b1: begin
+				if (s_axi.rready && ~atomwcommit) begin
+					atomrdata <= atomics[atomrslot];
+					unique case(atomrop)
+						3'd1: atomics[atomrslot] <= 32'd1;
+						3'd2: atomics[atomrslot] <= atomics[atomrslot] + 32'd1;
+						3'd3: atomics[atomrslot] <= atomics[atomrslot] - 32'd1;
+						default: ;
+					endcase
+					atomrvalid <= 1'b1;
+					atomrstate <= 1'b0;
+				end
+			end
+		endcase
+	end
+end
+
+// --------------------------------------------------
+// Response mux
+// --------------------------------------------------
+
+assign s_axi.awready = atomwsel ? atomawready : ramawready;
+assign s_axi.wready = atomwsel ? atomwready : ramwready;
+assign s_axi.bvalid = atomwsel ? atombvalid : rambvalid;
+assign s_axi.bresp = atomwsel ? 2'b00 : rambresp;
+assign s_axi.arready = atomrsel ? atomarready : ramarready;
+assign s_axi.rvalid = atomrsel ? atomrvalid : ramrvalid;
+assign s_axi.rresp = atomrsel ? 2'b00 : ramrresp;
+assign s_axi.rlast = atomrsel ? 1'b1 : ramrlast;
+assign s_axi.rdata = {96'd0, atomrsel ? atomrdata : ramrdata};
 
 endmodule
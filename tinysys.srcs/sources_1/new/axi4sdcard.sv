@@ -30,8 +30,8 @@ delayreset delayresetinst(
 // Keep attached spi device selected (TODO: Drive via control register)
 assign sdconn.cs_n = 1'b0;
 
-logic [1:0] writestate;
-logic [1:0] raddrstate;
+logic [2:0] writestate;
+logic [2:0] raddrstate;
 
 logic [7:0] writedata;
 logic we;
@@ -201,9 +201,25 @@ always @(posedge aclk) begin
 	end
 end
 
+// Burst transfers, the register map is:
+// 0x0: byte read/write, 0x4: card switch state
+// 0x8: write N to clock out N idle (0xFF) bytes for a burst read
+// 0xC: read drains four received bytes as one word, write sends four bytes
+//      whose incoming bytes get dropped, first byte in the low 8 bits for both
+logic [10:0] burstcount;
+logic [31:0] burstout;
+logic [1:0] burstoutbyte;
+logic [31:0] burstin;
+logic [1:0] burstinbyte;
+// Incoming bytes of word writes that nobody reads, wrapping counters kept by each side
+logic [15:0] dropqueued;
+logic [15:0] dropped;
+
 always @(posedge aclk) begin
 	if (~delayedresetn) begin
-		writestate <= 2'b00;
+		writestate <= 3'b000;
+		burstcount <= 11'd0;
+		dropqueued <= 16'd0;
 	end else begin
 		outfifowe <= 1'b0;
 		s_axi.wready <= 1'b0;
@@ -211,26 +227,63 @@ always @(posedge aclk) begin
 		outfifodin <= 8'h00;
 	
 		unique case (writestate)
-			2'b00: begin
+			3'b000: begin
 				s_axi.bresp = 2'b00;
 				outfifodin <= 8'd0;
 				outfifowe <= 1'b0;
-				writestate <= 2'b01;
+				writestate <= 3'b001;
 			end
-			2'b01: begin
-				if (s_axi.wvalid && (~outfifofull)) begin
-					outfifodin <= s_axi.wdata[7:0];
-					outfifowe <= 1'b1; // (|s_axi.wstrb)
-					s_axi.wready <= 1'b1;
-					writestate <= 2'b10;
+			3'b001: begin
+				if (s_axi.wvalid) begin
+					case (s_axi.awaddr[3:0])
+						4'h8: begin
+							burstcount <= s_axi.wdata[10:0];
+							s_axi.wready <= 1'b1;
+							writestate <= 3'b010;
+						end
+						4'hC: begin
+							burstout <= s_axi.wdata;
+							burstoutbyte <= 2'd0;
+							dropqueued <= dropqueued + 16'd4;
+							s_axi.wready <= 1'b1;
+							writestate <= 3'b011;
+						end
+						default: begin
+							if (~outfifofull) begin
+								outfifodin <= s_axi.wdata[7:0];
+								outfifowe <= 1'b1; // (|s_axi.wstrb)
+								s_axi.wready <= 1'b1;
+								writestate <= 3'b010;
+							end
+						end
+					endcase
+				end else if ((burstcount != 11'd0) && (~outfifofull)) begin
+					// Keep the clock going for a burst read
+					outfifodin <= 8'hFF;
+					outfifowe <= 1'b1;
+					burstcount <= burstcount - 11'd1;
 				end
 			end
-			2'b10: begin
+			3'b010: begin
 				if(s_axi.bready) begin
 					s_axi.bvalid <= 1'b1;
-					writestate <= 2'b01;
+					writestate <= 3'b001;
+				end
+			end
+			3'b011: begin
+				// Word write goes out one byte per clock
+				if (~outfifofull) begin
+					outfifodin <= burstout[7:0];
+					outfifowe <= 1'b1;
+					burstout <= {8'd0, burstout[31:8]};
+					burstoutbyte <= burstoutbyte + 2'd1;
+					if (burstoutbyte == 2'd3)
+						writestate <= 3'b010;
 				end
 			end
+			default: begin
+				writestate <= 3'b001;
+			end
 		endcase
 	end
 end
@@ -238,7 +291,8 @@ end
 always @(posedge aclk) begin
 	if (~delayedresetn) begin
 		keyfifore <= 1'b0;
-		raddrstate <= 2'b00;
+		raddrstate <= 3'b000;
+		dropped <= 16'd0;
 	end else begin
 		infifore <= 1'b0;
 		keyfifore <= 1'b0;
@@ -247,42 +301,78 @@ always @(posedge aclk) begin
 	
 		// read address
 		unique case (raddrstate)
-			2'b00: begin
+			3'b000: begin
 				s_axi.rlast <= 1'b1;
 				s_axi.arready <= 1'b0;
 				s_axi.rvalid <= 1'b0;
 				s_axi.rresp <= 2'b00;
 				s_axi.rdata <= 32'd0;
-				raddrstate <= 2'b01;
+				raddrstate <= 3'b001;
 			end
-			2'b01: begin
-				if (s_axi.arvalid) begin
-					unique case (s_axi.araddr[2])
-						2'b0: raddrstate <= 2'b11;	// SPI i/o at offset 0x0
-						2'b1: raddrstate <= 2'b10;	// Switch state at offset 0x4
+			3'b001: begin
+				if (dropped != dropqueued) begin
+					// Bytes received during word writes go first so reads stay in step
+					if ((~infifoempty) && infifovalid) begin
+						infifore <= 1'b1;
+						dropped <= dropped + 16'd1;
+						raddrstate <= 3'b111;
+					end
+				end else if (s_axi.arvalid) begin
+					unique case (s_axi.araddr[3:2])
+						2'b00: raddrstate <= 3'b011;	// SPI i/o at offset 0x0
+						2'b01: raddrstate <= 3'b010;	// Switch state at offset 0x4
+						2'b10: raddrstate <= 3'b110;	// Burst length at offset 0x8 is write only
+						2'b11: begin					// Burst data at offset 0xC
+							burstinbyte <= 2'd0;
+							raddrstate <= 3'b100;
+						end
 					endcase
 					s_axi.arready <= 1'b1;
 				end
 			end
-			2'b10: begin
+			3'b010: begin
 				if (s_axi.rready && ~keyfifoempty && keyfifovalid) begin
 					s_axi.rdata <= {31'd0, ~keyfifodout};
 					s_axi.rvalid <= 1'b1;
 					// Advance FIFO
 					keyfifore <= 1'b1;
-					raddrstate <= 2'b01;
+					raddrstate <= 3'b001;
 				end
 			end
-			2'b11: begin
+			3'b011: begin
 				// master ready to accept and fifo has incoming data
 				if (s_axi.rready && (~infifoempty) && infifovalid) begin
 					s_axi.rdata <= {infifodout, infifodout, infifodout, infifodout};
 					s_axi.rvalid <= 1'b1;
 					// Advance FIFO
 					infifore <= 1'b1;
-					raddrstate <= 2'b01;
+					raddrstate <= 3'b111;
 				end
 			end
+			3'b100: begin
+				// Gather four bytes, first one ends up in the low 8 bits
+				if ((~infifoempty) && infifovalid) begin
+					burstin <= {infifodout, burstin[31:8]};
+					infifore <= 1'b1;
+					burstinbyte <= burstinbyte + 2'd1;
+					raddrstate <= (burstinbyte == 2'd3) ? 3'b110 : 3'b101;
+				end
+			end
+			3'b101: begin
+				// FIFO output moves on the clock after the read strobe
+				raddrstate <= 3'b100;
+			end
+			3'b110: begin
+				if (s_axi.rready) begin
+					s_axi.rdata <= burstin;
+					s_axi.rvalid <= 1'b1;
+					raddrstate <= 3'b111;
+				end
+			end
+			3'b111: begin
+				// Same here, wait for the FIFO to catch up before looking at it again
+				raddrstate <= 3'b001;
+			end
 		endcase
 	end
 end
@@ -316,6 +316,8 @@
 
 // 32 of these registers are used to store shadow copies of GRPs by ISRs
 `define CSR_REGISTERSHADOW	12'h8A0
+// Selects which of the 32 register banks at 0x400-0x7FF the shadow window above maps to
+`define CSR_REGISTERBANK	12'h8C0
 
 `define CSR_CYCLELO		12'hC00
 `define CSR_TIMELO		12'hC01